@@ -0,0 +1,175 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitcoalesce.h"
+
+/* Below this it's not worth delaying anything */
+#define MIN_BATCH_SIZE  (1024)
+
+/* The largest block we wait for, so messages stay a sensible size */
+#define MAX_BATCH_SIZE  (64 * 1024)
+
+/**
+ * cockpit_coalesce_init:
+ * @self: the coalescing state, usually embedded in a channel
+ * @max_latency: longest time to hold on to data, in milliseconds
+ * @flush: called when held data should be sent
+ * @user_data: passed to @flush
+ *
+ * The @flush callback is expected to send the held data and call
+ * cockpit_coalesce_flushed(). Its return value is ignored.
+ */
+void
+cockpit_coalesce_init (CockpitCoalesce *self,
+                       gint64 max_latency,
+                       GSourceFunc flush,
+                       gpointer user_data)
+{
+  g_return_if_fail (max_latency >= 0 && max_latency < G_MAXUINT);
+
+  self->max_latency = max_latency;
+  self->clock = g_get_monotonic_time;
+  self->rate = 0;
+  self->last_flush = 0;
+  self->timeout = 0;
+  self->flush = flush;
+  self->user_data = user_data;
+}
+
+/**
+ * cockpit_coalesce_set_clock:
+ * @self: the coalescing state
+ * @clock: returns the current time in microseconds
+ *
+ * Measure throughput against another clock than g_get_monotonic_time().
+ * Used by tests.
+ */
+void
+cockpit_coalesce_set_clock (CockpitCoalesce *self,
+                            CockpitCoalesceClock clock)
+{
+  g_return_if_fail (clock != NULL);
+  self->clock = clock;
+}
+
+/**
+ * cockpit_coalesce_get_batch:
+ * @self: the coalescing state
+ *
+ * Returns: the number of bytes worth waiting for, or zero when
+ *          data should be sent as soon as it arrives
+ */
+gsize
+cockpit_coalesce_get_batch (CockpitCoalesce *self)
+{
+  gdouble batch;
+
+  /* The amount of data we expect to see within the latency */
+  batch = self->rate * self->max_latency;
+  if (batch < MIN_BATCH_SIZE)
+    return 0;
+  if (batch > MAX_BATCH_SIZE)
+    return MAX_BATCH_SIZE;
+  return batch;
+}
+
+static gboolean
+on_coalesce_timeout (gpointer user_data)
+{
+  CockpitCoalesce *self = user_data;
+  self->timeout = 0;
+  (self->flush) (self->user_data);
+  return FALSE;
+}
+
+/**
+ * cockpit_coalesce_hold:
+ * @self: the coalescing state
+ * @pending: the amount of data buffered so far
+ *
+ * Decide whether to wait for more data before sending. When this
+ * returns %TRUE the flush callback will be called before the maximum
+ * latency is up, unless data is flushed before then.
+ *
+ * Returns: %TRUE to keep waiting, %FALSE to send now
+ */
+gboolean
+cockpit_coalesce_hold (CockpitCoalesce *self,
+                       gsize pending)
+{
+  if (pending >= cockpit_coalesce_get_batch (self))
+    return FALSE;
+
+  if (!self->timeout)
+    self->timeout = g_timeout_add (self->max_latency, on_coalesce_timeout, self);
+  return TRUE;
+}
+
+/**
+ * cockpit_coalesce_flushed:
+ * @self: the coalescing state
+ * @size: the amount of data that was sent
+ *
+ * Record that data was sent, and update the throughput estimate.
+ */
+void
+cockpit_coalesce_flushed (CockpitCoalesce *self,
+                          gsize size)
+{
+  gint64 now = (self->clock) ();
+  gdouble elapsed, weight;
+
+  if (self->timeout)
+    {
+      g_source_remove (self->timeout);
+      self->timeout = 0;
+    }
+
+  if (self->last_flush > 0)
+    {
+      elapsed = MAX ((now - self->last_flush) / 1000.0, 1.0);
+
+      /*
+       * Bytes per millisecond, averaged over roughly the latency window.
+       * After a long quiet time the old rate counts for nothing.
+       */
+      weight = self->max_latency / (self->max_latency + elapsed);
+      self->rate = (self->rate * weight) + ((size / elapsed) * (1.0 - weight));
+    }
+
+  self->last_flush = now;
+}
+
+/**
+ * cockpit_coalesce_clear:
+ * @self: the coalescing state
+ *
+ * Stop any pending flush timeout.
+ */
+void
+cockpit_coalesce_clear (CockpitCoalesce *self)
+{
+  if (self->timeout)
+    {
+      g_source_remove (self->timeout);
+      self->timeout = 0;
+    }
+}
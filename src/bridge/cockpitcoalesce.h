@@ -0,0 +1,59 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Decides when buffered output should be sent on as a channel message.
+ * The batch size follows the recent throughput: with a steady stream of
+ * output we wait for bigger blocks, with sparse output we send right away.
+ * Data is never held longer than the maximum latency.
+ */
+
+typedef gint64 (* CockpitCoalesceClock) (void);
+
+typedef struct {
+  gint64 max_latency;
+  CockpitCoalesceClock clock;
+  gdouble rate;
+  gint64 last_flush;
+  guint timeout;
+  GSourceFunc flush;
+  gpointer user_data;
+} CockpitCoalesce;
+
+void           cockpit_coalesce_init               (CockpitCoalesce *self,
+                                                    gint64 max_latency,
+                                                    GSourceFunc flush,
+                                                    gpointer user_data);
+
+void           cockpit_coalesce_set_clock          (CockpitCoalesce *self,
+                                                    CockpitCoalesceClock clock);
+
+gboolean       cockpit_coalesce_hold               (CockpitCoalesce *self,
+                                                    gsize pending);
+
+void           cockpit_coalesce_flushed            (CockpitCoalesce *self,
+                                                    gsize size);
+
+gsize          cockpit_coalesce_get_batch          (CockpitCoalesce *self);
+
+void           cockpit_coalesce_clear              (CockpitCoalesce *self);
@@ -29,7 +29,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <grp.h>
+#include <pwd.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitFslist:
@@ -41,12 +44,32 @@
 
 #define COCKPIT_FSLIST(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_FSLIST, CockpitFslist))
 
+/* Number of entries requested from the enumerator at once when not batching */
+#define DEFAULT_ENUMERATE_CHUNK 10
+
+/* Upper limit for the "batch" option */
+#define MAX_BATCH 10000
+
 typedef struct {
   CockpitChannel parent;
   const gchar *path;
   GFileMonitor *monitor;
   guint sig_changed;
   GCancellable *cancellable;
+
+  /* Listing state */
+  GFileEnumerator *enumerator;
+  gboolean requesting;
+  gboolean throttled;
+  gint batch;
+
+  /*
+   * uid/gid to name, only kept for the duration of the listing. Only
+   * touched from the thread that builds a batch, and only one batch is
+   * built at a time while "requesting" is set.
+   */
+  GHashTable *users;
+  GHashTable *groups;
 } CockpitFslist;
 
 typedef struct {
@@ -65,6 +88,8 @@ cockpit_fslist_recv (CockpitChannel *channel,
 static void
 cockpit_fslist_init (CockpitFslist *self)
 {
+  self->users = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  self->groups = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
 }
 
 static const gchar *
@@ -80,6 +105,242 @@ error_to_problem (GError *error)
     return NULL;
 }
 
+/* Give up on growing the getpwuid_r() buffer at this size */
+#define MAX_NSS_BUFFER (1024 * 1024)
+
+static gsize
+nss_buffer_size (int name)
+{
+  long size = sysconf (name);
+  return size > 0 ? size : 1024;
+}
+
+/*
+ * Like GIO did, a uid or gid without a name is shown as the number.
+ * The results are cached, including misses. NSS lookups can block on
+ * the network, so these are called from a worker thread.
+ */
+
+static const gchar *
+lookup_user (CockpitFslist *self,
+             guint32 uid)
+{
+  struct passwd pwd, *result;
+  gchar *buffer;
+  gchar *name;
+  gsize size;
+  int ret;
+
+  name = g_hash_table_lookup (self->users, GUINT_TO_POINTER (uid));
+  if (!name)
+    {
+      size = nss_buffer_size (_SC_GETPW_R_SIZE_MAX);
+      for (;;)
+        {
+          buffer = g_malloc (size);
+          result = NULL;
+          ret = getpwuid_r (uid, &pwd, buffer, size, &result);
+          if (ret != ERANGE || size >= MAX_NSS_BUFFER)
+            break;
+          g_free (buffer);
+          size *= 2;
+        }
+
+      if (ret == 0 && result)
+        name = g_strdup (result->pw_name);
+      else
+        name = g_strdup_printf ("%u", uid);
+      g_free (buffer);
+
+      g_hash_table_insert (self->users, GUINT_TO_POINTER (uid), name);
+    }
+
+  return name;
+}
+
+static const gchar *
+lookup_group (CockpitFslist *self,
+              guint32 gid)
+{
+  struct group grp, *result;
+  gchar *buffer;
+  gchar *name;
+  gsize size;
+  int ret;
+
+  name = g_hash_table_lookup (self->groups, GUINT_TO_POINTER (gid));
+  if (!name)
+    {
+      size = nss_buffer_size (_SC_GETGR_R_SIZE_MAX);
+      for (;;)
+        {
+          buffer = g_malloc (size);
+          result = NULL;
+          ret = getgrgid_r (gid, &grp, buffer, size, &result);
+          if (ret != ERANGE || size >= MAX_NSS_BUFFER)
+            break;
+          g_free (buffer);
+          size *= 2;
+        }
+
+      if (ret == 0 && result)
+        name = g_strdup (result->gr_name);
+      else
+        name = g_strdup_printf ("%u", gid);
+      g_free (buffer);
+
+      g_hash_table_insert (self->groups, GUINT_TO_POINTER (gid), name);
+    }
+
+  return name;
+}
+
+static JsonObject *
+build_present (CockpitFslist *self,
+               GFileInfo *info)
+{
+  const gchar *owner = NULL;
+  const gchar *group = NULL;
+  JsonObject *msg;
+
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_UID))
+    owner = lookup_user (self, g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_UID));
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_GID))
+    group = lookup_group (self, g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_GID));
+
+  msg = json_object_new ();
+  json_object_set_string_member (msg, "event", "present");
+  json_object_set_string_member
+    (msg, "path", g_file_info_get_attribute_byte_string (info, G_FILE_ATTRIBUTE_STANDARD_NAME));
+  json_object_set_string_member
+    (msg, "type", cockpit_file_type_to_string (g_file_info_get_file_type (info)));
+  json_object_set_string_member (msg, "owner", owner);
+  json_object_set_string_member (msg, "group", group);
+  json_object_set_int_member
+    (msg, "size", g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE));
+  json_object_set_int_member
+    (msg, "modified", g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
+  return msg;
+}
+
+static GBytes *
+build_batch (CockpitFslist *self,
+             GList *files)
+{
+  JsonArray *array;
+  JsonNode *node;
+  gchar *data;
+  gsize length;
+
+  array = json_array_new ();
+  for (GList *l = files; l; l = l->next)
+    json_array_add_object_element (array, build_present (self, G_FILE_INFO (l->data)));
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  data = cockpit_json_write (node, &length);
+  json_node_free (node);
+
+  return g_bytes_new_take (data, length);
+}
+
+static void
+free_files (gpointer data)
+{
+  g_list_free_full (data, g_object_unref);
+}
+
+static void
+build_files_thread (GTask *task,
+                    gpointer source_object,
+                    gpointer task_data,
+                    GCancellable *cancellable)
+{
+  CockpitFslist *self = source_object;
+  GPtrArray *messages;
+  JsonObject *msg;
+
+  messages = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+  if (self->batch > 0)
+    {
+      g_ptr_array_add (messages, build_batch (self, task_data));
+    }
+  else
+    {
+      for (GList *l = task_data; l; l = l->next)
+        {
+          msg = build_present (self, G_FILE_INFO (l->data));
+          g_ptr_array_add (messages, cockpit_json_write_bytes (msg));
+          json_object_unref (msg);
+        }
+    }
+
+  if (!g_task_return_error_if_cancelled (task))
+    g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+  else
+    g_ptr_array_unref (messages);
+}
+
+static void
+request_files (CockpitFslist *self);
+
+static void
+on_files_built (GObject *source_object,
+                GAsyncResult *res,
+                gpointer user_data)
+{
+  CockpitFslist *self = COCKPIT_FSLIST (source_object);
+  GPtrArray *messages;
+  guint i;
+
+  self->requesting = FALSE;
+
+  /* Only fails when cancelled, the channel is going away */
+  messages = g_task_propagate_pointer (G_TASK (res), NULL);
+  if (!messages)
+    return;
+
+  for (i = 0; i < messages->len; i++)
+    cockpit_channel_send (COCKPIT_CHANNEL (self), messages->pdata[i], FALSE);
+  g_ptr_array_unref (messages);
+
+  request_files (self);
+}
+
+static void
+on_files_listed (GObject *source_object,
+                 GAsyncResult *res,
+                 gpointer user_data);
+
+static void
+request_files (CockpitFslist *self)
+{
+  /* When the peer is slow, leave the rest of the directory on disk */
+  if (self->requesting || self->throttled || !self->enumerator)
+    return;
+
+  self->requesting = TRUE;
+  g_file_enumerator_next_files_async (self->enumerator,
+                                      self->batch > 0 ? self->batch : DEFAULT_ENUMERATE_CHUNK,
+                                      G_PRIORITY_DEFAULT,
+                                      self->cancellable,
+                                      on_files_listed,
+                                      g_object_ref (self));
+}
+
+static void
+on_channel_pressure (CockpitFlow *flow,
+                     gboolean throttle,
+                     gpointer user_data)
+{
+  CockpitFslist *self = user_data;
+
+  self->throttled = throttle;
+  if (!throttle)
+    request_files (self);
+}
+
 static void
 on_files_listed (GObject *source_object,
                  GAsyncResult *res,
@@ -88,6 +349,7 @@ on_files_listed (GObject *source_object,
   GError *error = NULL;
   JsonObject *options;
   GList *files;
+  GTask *task;
 
   files = g_file_enumerator_next_files_finish (G_FILE_ENUMERATOR (source_object), res, &error);
   if (error)
@@ -108,8 +370,11 @@ on_files_listed (GObject *source_object,
 
   if (files == NULL)
     {
+      self->requesting = FALSE;
       g_clear_object (&self->cancellable);
-      g_object_unref (source_object);
+      g_clear_object (&self->enumerator);
+      g_hash_table_remove_all (self->users);
+      g_hash_table_remove_all (self->groups);
 
       cockpit_channel_ready (COCKPIT_CHANNEL (self), NULL);
 
@@ -121,40 +386,12 @@ on_files_listed (GObject *source_object,
       goto out;
     }
 
-  for (GList *l = files; l; l = l->next)
-    {
-      GFileInfo *info = G_FILE_INFO (l->data);
-      JsonObject *msg;
-      GBytes *msg_bytes;
-
-      msg = json_object_new ();
-      json_object_set_string_member (msg, "event", "present");
-      json_object_set_string_member
-        (msg, "path", g_file_info_get_attribute_byte_string (info, G_FILE_ATTRIBUTE_STANDARD_NAME));
-      json_object_set_string_member
-        (msg, "type", cockpit_file_type_to_string (g_file_info_get_file_type (info)));
-      json_object_set_string_member
-        (msg, "owner", g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_USER));
-      json_object_set_string_member
-        (msg, "group", g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_GROUP));
-      json_object_set_int_member
-        (msg, "size", g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE));
-      json_object_set_int_member
-        (msg, "modified", g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
-      msg_bytes = cockpit_json_write_bytes (msg);
-      json_object_unref (msg);
-      cockpit_channel_send (COCKPIT_CHANNEL(self), msg_bytes, FALSE);
-      g_bytes_unref (msg_bytes);
-    }
-
-  g_list_free_full (files, g_object_unref);
+  /* Still "requesting" until the owners are resolved and the batch is sent */
+  task = g_task_new (self, self->cancellable, on_files_built, NULL);
+  g_task_set_task_data (task, files, free_files);
+  g_task_run_in_thread (task, build_files_thread);
+  g_object_unref (task);
 
-  g_file_enumerator_next_files_async (G_FILE_ENUMERATOR (source_object),
-                                      10,
-                                      G_PRIORITY_DEFAULT,
-                                      self->cancellable,
-                                      on_files_listed,
-                                      g_object_ref (self));
 out:
   g_object_unref (user_data);
 }
@@ -190,12 +427,8 @@ on_enumerator_ready (GObject *source_object,
 
   CockpitFslist *self = COCKPIT_FSLIST (user_data);
 
-  g_file_enumerator_next_files_async (enumerator,
-                                      10,
-                                      G_PRIORITY_DEFAULT,
-                                      self->cancellable,
-                                      on_files_listed,
-                                      g_object_ref (self));
+  self->enumerator = enumerator;
+  request_files (self);
 out:
   g_object_unref (user_data);
 }
@@ -219,6 +452,7 @@ cockpit_fslist_prepare (CockpitChannel *channel)
   GError *error = NULL;
   GFile *file = NULL;
   gboolean watch;
+  gint64 batch;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fslist_parent_class)->prepare (channel);
 
@@ -240,6 +474,16 @@ cockpit_fslist_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (!cockpit_json_get_int (options, "batch", 0, &batch) || batch < 0 || batch > MAX_BATCH)
+    {
+      cockpit_channel_fail (channel, "protocol-error", "invalid \"batch\" option for fslist1 channel");
+      goto out;
+    }
+  self->batch = batch;
+
+  /* Only fires when the channel was opened with "flow-control" */
+  g_signal_connect (self, "pressure", G_CALLBACK (on_channel_pressure), self);
+
   self->cancellable = g_cancellable_new ();
 
   file = g_file_new_for_path (self->path);
@@ -259,7 +503,7 @@ cockpit_fslist_prepare (CockpitChannel *channel)
 
   g_file_enumerate_children_async (file,
                                    G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE ","
-                                   G_FILE_ATTRIBUTE_OWNER_USER "," G_FILE_ATTRIBUTE_OWNER_GROUP ","
+                                   G_FILE_ATTRIBUTE_UNIX_UID "," G_FILE_ATTRIBUTE_UNIX_GID ","
                                    G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED,
                                    G_FILE_QUERY_INFO_NONE,
                                    G_PRIORITY_DEFAULT,
@@ -302,6 +546,9 @@ cockpit_fslist_finalize (GObject *object)
 
   g_clear_object (&self->cancellable);
   g_clear_object (&self->monitor);
+  g_clear_object (&self->enumerator);
+  g_hash_table_unref (self->users);
+  g_hash_table_unref (self->groups);
 
   G_OBJECT_CLASS (cockpit_fslist_parent_class)->finalize (object);
 }
@@ -31,9 +31,16 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 #define DEFAULT_MAX_READ_SIZE (16*1024*1024)
 
+/* Size of each message when reading binary files directly */
+#define BLOCK_READ_SIZE (512 * 1024)
+
+/* How far ahead of the current position the kernel should read */
+#define BLOCK_READ_AHEAD (4 * BLOCK_READ_SIZE)
+
 /**
  * CockpitFsread:
  *
@@ -55,6 +62,12 @@ typedef struct {
   gboolean closing;
   guint sig_read;
   guint sig_close;
+
+  /* Binary files are read directly, without a pipe */
+  GSource *block_source;
+  gboolean block_done;
+  gboolean throttled;
+  gint64 offset;
 } CockpitFsread;
 
 typedef struct {
@@ -106,6 +119,17 @@ cockpit_get_file_tag_from_fd (int fd)
   return file_tag_from_stat (res, errno, &buf);
 }
 
+static void
+stop_block_reading (CockpitFsread *self)
+{
+  if (self->block_source)
+    {
+      g_source_destroy (self->block_source);
+      g_source_unref (self->block_source);
+      self->block_source = NULL;
+    }
+}
+
 static void
 cockpit_fsread_close (CockpitChannel *channel,
                       const gchar *problem)
@@ -113,6 +137,8 @@ cockpit_fsread_close (CockpitChannel *channel,
   CockpitFsread *self = COCKPIT_FSREAD (channel);
 
   self->closing = TRUE;
+  self->block_done = TRUE;
+  stop_block_reading (self);
 
   /*
    * If closed, call base class handler directly. Otherwise ask
@@ -130,18 +156,43 @@ cockpit_fsread_init (CockpitFsread *self)
   self->fd = -1;
 }
 
+static void
+finish_reading (CockpitFsread *self)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  const gchar *problem;
+  JsonObject *options;
+  gchar *tag;
+
+  cockpit_channel_control (channel, "done", NULL);
+
+  problem = NULL;
+  if (self->fd >= 0 && self->start_tag)
+    {
+      tag = cockpit_get_file_tag_from_fd (self->fd);
+      if (g_strcmp0 (tag, self->start_tag) == 0)
+        {
+          options = cockpit_channel_close_options (channel);
+          json_object_set_string_member (options, "tag", tag);
+        }
+      else
+        {
+          problem = "change-conflict";
+        }
+      g_free (tag);
+    }
+
+  cockpit_channel_close (channel, problem);
+}
+
 static void
 on_pipe_read (CockpitPipe *pipe,
               GByteArray *data,
               gboolean end_of_data,
               gpointer user_data)
 {
-  CockpitFsread *self = user_data;
   CockpitChannel *channel = user_data;
-  const gchar *problem;
-  JsonObject *options;
   GBytes *message;
-  gchar *tag;
 
   if (data->len)
     {
@@ -153,27 +204,81 @@ on_pipe_read (CockpitPipe *pipe,
     }
 
   if (end_of_data)
-    {
-      cockpit_channel_control (channel, "done", NULL);
+    finish_reading (user_data);
+}
 
-      problem = NULL;
-      if (self->fd >= 0 && self->start_tag)
-        {
-          tag = cockpit_get_file_tag_from_fd (self->fd);
-          if (g_strcmp0 (tag, self->start_tag) == 0)
-            {
-              options = cockpit_channel_close_options (channel);
-              json_object_set_string_member (options, "tag", tag);
-            }
-          else
-            {
-              problem = "change-conflict";
-            }
-          g_free (tag);
-        }
+static gboolean
+on_block_read (gpointer user_data)
+{
+  CockpitFsread *self = user_data;
+  GBytes *message;
+  guchar *data;
+  gssize ret;
+  int errn;
+
+  data = g_malloc (BLOCK_READ_SIZE);
+  ret = read (self->fd, data, BLOCK_READ_SIZE);
+  errn = errno;
+
+  if (ret < 0)
+    {
+      g_free (data);
+      if (errn == EINTR || errn == EAGAIN)
+        return TRUE;
+
+      self->block_done = TRUE;
+      stop_block_reading (self);
+      cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
+                            "%s: couldn't read: %s", self->path, g_strerror (errn));
+      return FALSE;
+    }
 
-      cockpit_channel_close (channel, problem);
+  if (ret == 0)
+    {
+      g_free (data);
+      self->block_done = TRUE;
+      stop_block_reading (self);
+      finish_reading (self);
+      return FALSE;
     }
+
+  /* Have the kernel read the next blocks while this one is sent */
+  self->offset += ret;
+  posix_fadvise (self->fd, self->offset, BLOCK_READ_AHEAD, POSIX_FADV_WILLNEED);
+
+  /* Only the last block is short */
+  if (ret < BLOCK_READ_SIZE)
+    data = g_realloc (data, ret);
+
+  message = g_bytes_new_take (data, ret);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
+  g_bytes_unref (message);
+
+  return TRUE;
+}
+
+static void
+start_block_reading (CockpitFsread *self)
+{
+  g_assert (self->block_source == NULL);
+  self->block_source = g_idle_source_new ();
+  g_source_set_name (self->block_source, "fsread-block");
+  g_source_set_callback (self->block_source, on_block_read, self, NULL);
+  g_source_attach (self->block_source, NULL);
+}
+
+static void
+on_channel_pressure (CockpitFlow *flow,
+                     gboolean throttle,
+                     gpointer user_data)
+{
+  CockpitFsread *self = user_data;
+
+  self->throttled = throttle;
+  if (throttle)
+    stop_block_reading (self);
+  else if (!self->block_done && !self->block_source)
+    start_block_reading (self);
 }
 
 static void
@@ -266,13 +371,43 @@ cockpit_fsread_prepare (CockpitChannel *channel)
       goto out;
     }
 
-  /* This owns the file descriptor */
-  self->pipe = cockpit_pipe_new (self->path, fd, -1);
+  const gchar *binary;
+  if (!cockpit_json_get_string (options, "binary", "", &binary))
+    binary = "";
+
   self->fd = fd;
   fd = -1;
 
   self->start_tag = cockpit_get_file_tag_from_fd (self->fd);
 
+  /*
+   * Binary data needs no conversion, so read it directly in large
+   * blocks, each one becoming a message without further copies.
+   */
+  if (g_str_equal (binary, "raw"))
+    {
+      posix_fadvise (self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise (self->fd, 0, BLOCK_READ_AHEAD, POSIX_FADV_WILLNEED);
+
+      g_signal_connect (self, "pressure", G_CALLBACK (on_channel_pressure), self);
+      start_block_reading (self);
+
+      if (S_ISREG (statbuf.st_mode))
+        {
+          g_autoptr(JsonObject) message = json_object_new ();
+          json_object_set_int_member (message, "size-hint", statbuf.st_size);
+          cockpit_channel_ready (channel, message);
+        }
+      else
+        {
+          cockpit_channel_ready (channel, NULL);
+        }
+      goto out;
+    }
+
+  /* This owns the file descriptor */
+  self->pipe = cockpit_pipe_new (self->path, self->fd, -1);
+
   /* Let the channel throttle the pipe's input flow*/
   cockpit_flow_throttle (COCKPIT_FLOW (self->pipe), COCKPIT_FLOW (self));
 
@@ -282,15 +417,7 @@ cockpit_fsread_prepare (CockpitChannel *channel)
   self->sig_read = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
   self->sig_close = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
 
-  const gchar *binary;
-  if (S_ISREG(statbuf.st_mode) && cockpit_json_get_string (options, "binary", "", &binary) && g_str_equal (binary, "raw"))
-    {
-      g_autoptr(JsonObject) message = json_object_new ();
-      json_object_set_int_member (message, "size-hint", statbuf.st_size);
-      cockpit_channel_ready (channel, message);
-    } else {
-      cockpit_channel_ready (channel, NULL);
-    }
+  cockpit_channel_ready (channel, NULL);
 
 
 out:
@@ -314,6 +441,8 @@ cockpit_fsread_dispose (GObject *object)
       self->sig_read = self->sig_close = 0;
     }
 
+  stop_block_reading (self);
+
   G_OBJECT_CLASS (cockpit_fsread_parent_class)->dispose (object);
 }
 
@@ -322,6 +451,12 @@ cockpit_fsread_finalize (GObject *object)
 {
   CockpitFsread *self = COCKPIT_FSREAD (object);
 
+  g_assert (self->block_source == NULL);
+
+  /* Without a pipe, the file descriptor is ours */
+  if (!self->pipe && self->fd >= 0)
+    close (self->fd);
+
   g_free (self->start_tag);
   g_clear_object (&self->pipe);
 
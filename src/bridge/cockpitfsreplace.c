@@ -31,15 +31,25 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /**
  * CockpitFsreplace:
  *
  * A #CockpitChannel that writes/replaces the content of a file.
  *
+ * In "delta" mode each message either copies a range of the current
+ * file, or carries literal data. The new file is built from those.
+ *
  * The payload type for this channel is 'fsreplace1'.
  */
 
+/* Longest header line of a delta message */
+#define MAX_DELTA_HEADER 64
+
+/* Buffer size when copy_file_range() isn't usable */
+#define COPY_BUFFER_SIZE (64 * 1024)
+
 #define COCKPIT_FSREPLACE(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_FSREPLACE, CockpitFsreplace))
 
 typedef struct {
@@ -50,6 +60,12 @@ typedef struct {
   gboolean got_content;
   const gchar *expected_tag;
   guint sig_close;
+
+  /* Delta mode: the file being replaced, and its size */
+  gboolean delta;
+  int source_fd;
+  goffset source_size;
+  const gchar *checksum;
 } CockpitFsreplace;
 
 typedef struct {
@@ -77,16 +93,11 @@ close_with_errno (CockpitFsreplace *self,
     }
 }
 
-static void
-cockpit_fsreplace_recv (CockpitChannel *channel,
-                      GBytes *message)
+static gboolean
+write_data (CockpitFsreplace *self,
+            const gchar *data,
+            gsize size)
 {
-  CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
-  gsize size;
-  const char *data = g_bytes_get_data (message, &size);
-
-  self->got_content = TRUE;
-
   while (size > 0)
     {
       ssize_t n = write (self->fd, data, size);
@@ -96,13 +107,185 @@ cockpit_fsreplace_recv (CockpitChannel *channel,
             continue;
 
           close_with_errno (self, "couldn't write", errno);
-          return;
+          return FALSE;
         }
 
-      g_return_if_fail (n > 0);
+      g_return_val_if_fail (n > 0, FALSE);
       size -= n;
       data += n;
     }
+
+  return TRUE;
+}
+
+static gboolean
+copy_range (CockpitFsreplace *self,
+            goffset offset,
+            gsize length)
+{
+  gchar *buffer = NULL;
+  gboolean ret = TRUE;
+  loff_t from = offset;
+  ssize_t n;
+
+  /* Lets the file system share or clone the blocks where it can */
+  while (length > 0)
+    {
+      n = copy_file_range (self->source_fd, &from, self->fd, NULL, length, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      length -= n;
+    }
+
+  while (length > 0)
+    {
+      if (!buffer)
+        buffer = g_malloc (COPY_BUFFER_SIZE);
+
+      n = pread (self->source_fd, buffer, MIN (length, COPY_BUFFER_SIZE), from);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          close_with_errno (self, "couldn't read", errno);
+          ret = FALSE;
+          break;
+        }
+      if (n == 0)
+        {
+          cockpit_channel_close (COCKPIT_CHANNEL (self), "change-conflict");
+          ret = FALSE;
+          break;
+        }
+      if (!write_data (self, buffer, n))
+        {
+          ret = FALSE;
+          break;
+        }
+      from += n;
+      length -= n;
+    }
+
+  g_free (buffer);
+  return ret;
+}
+
+static void
+recv_delta (CockpitFsreplace *self,
+            const gchar *data,
+            gsize size)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  const gchar *line;
+  gchar *header;
+  gchar **parts;
+  guint64 offset, length;
+
+  line = memchr (data, '\n', MIN (size, MAX_DELTA_HEADER));
+  if (!line)
+    {
+      cockpit_channel_fail (channel, "protocol-error", "%s: invalid delta message", self->path);
+      return;
+    }
+
+  header = g_strndup (data, line - data);
+  size -= (line - data) + 1;
+  data = line + 1;
+
+  if (g_str_equal (header, "data"))
+    {
+      write_data (self, data, size);
+      g_free (header);
+      return;
+    }
+
+  parts = g_strsplit (header, " ", -1);
+  if (g_strv_length (parts) != 3 || !g_str_equal (parts[0], "copy") || size != 0 ||
+      !g_ascii_string_to_unsigned (parts[1], 10, 0, G_MAXINT64, &offset, NULL) ||
+      !g_ascii_string_to_unsigned (parts[2], 10, 0, G_MAXINT64, &length, NULL))
+    {
+      cockpit_channel_fail (channel, "protocol-error", "%s: invalid delta message", self->path);
+    }
+  else if (offset > self->source_size || length > self->source_size - offset)
+    {
+      cockpit_channel_fail (channel, "protocol-error", "%s: delta copies past the end of the file", self->path);
+    }
+  else
+    {
+      copy_range (self, offset, length);
+    }
+
+  g_strfreev (parts);
+  g_free (header);
+}
+
+static void
+cockpit_fsreplace_recv (CockpitChannel *channel,
+                      GBytes *message)
+{
+  CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
+  gsize size;
+  const char *data = g_bytes_get_data (message, &size);
+
+  self->got_content = TRUE;
+
+  if (self->delta)
+    recv_delta (self, data, size);
+  else
+    write_data (self, data, size);
+}
+
+static gboolean
+verify_checksum (CockpitFsreplace *self)
+{
+  GChecksum *checksum;
+  gchar *buffer;
+  gchar *actual;
+  gboolean ret;
+  ssize_t n;
+  int fd;
+
+  fd = open (self->tmp_path, O_RDONLY);
+  if (fd < 0)
+    {
+      close_with_errno (self, "couldn't open temp file", errno);
+      return FALSE;
+    }
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  buffer = g_malloc (COPY_BUFFER_SIZE);
+  while ((n = read (fd, buffer, COPY_BUFFER_SIZE)) != 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        break;
+      g_checksum_update (checksum, (guchar *)buffer, n);
+    }
+
+  if (n < 0)
+    {
+      close_with_errno (self, "couldn't read temp file", errno);
+      ret = FALSE;
+    }
+  else
+    {
+      actual = g_strconcat ("sha256:", g_checksum_get_string (checksum), NULL);
+      ret = g_str_equal (actual, self->checksum);
+      if (!ret)
+        {
+          g_message ("%s: delta content doesn't match checksum", self->path);
+          cockpit_channel_close (COCKPIT_CHANNEL (self), "change-conflict");
+        }
+      g_free (actual);
+    }
+
+  g_free (buffer);
+  g_checksum_free (checksum);
+  close (fd);
+  return ret;
 }
 
 static int
@@ -159,6 +342,10 @@ cockpit_fsreplace_control (CockpitChannel *channel,
           cockpit_channel_close (channel, "out-of-date");
           goto out;
         }
+      else if (self->checksum && !verify_checksum (self))
+        {
+          goto out;
+        }
       else
         {
           options = cockpit_channel_close_options (channel);
@@ -206,6 +393,10 @@ cockpit_fsreplace_close (CockpitChannel *channel,
     close (self->fd);
   self->fd = -1;
 
+  if (self->source_fd != -1)
+    close (self->source_fd);
+  self->source_fd = -1;
+
   /* Cleanup in case of problem */
   if (problem)
     {
@@ -221,6 +412,71 @@ static void
 cockpit_fsreplace_init (CockpitFsreplace *self)
 {
   self->fd = -1;
+  self->source_fd = -1;
+}
+
+static gboolean
+valid_checksum (const gchar *checksum)
+{
+  const gchar *digest;
+  gsize i;
+
+  if (!g_str_has_prefix (checksum, "sha256:"))
+    return FALSE;
+
+  digest = checksum + strlen ("sha256:");
+  for (i = 0; digest[i]; i++)
+    {
+      if (!g_ascii_isxdigit (digest[i]) || g_ascii_isupper (digest[i]))
+        return FALSE;
+    }
+
+  return i == (gsize)g_checksum_type_get_length (G_CHECKSUM_SHA256) * 2;
+}
+
+static gboolean
+prepare_delta (CockpitFsreplace *self)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  struct stat buf;
+  gchar *tag;
+
+  if (!self->expected_tag || g_str_equal (self->expected_tag, "-"))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: \"delta\" needs the \"tag\" of an existing file", self->path);
+      return FALSE;
+    }
+
+  self->source_fd = open (self->path, O_RDONLY);
+  if (self->source_fd < 0)
+    {
+      if (errno == ENOENT)
+        cockpit_channel_close (channel, "change-conflict");
+      else
+        close_with_errno (self, "couldn't open", errno);
+      return FALSE;
+    }
+
+  /* The blocks we copy must come from the file the client knows about */
+  tag = cockpit_get_file_tag_from_fd (self->source_fd);
+  if (g_strcmp0 (tag, self->expected_tag) != 0)
+    {
+      cockpit_channel_close (channel, "change-conflict");
+      g_free (tag);
+      return FALSE;
+    }
+  g_free (tag);
+
+  if (fstat (self->source_fd, &buf) < 0)
+    {
+      close_with_errno (self, "couldn't stat", errno);
+      return FALSE;
+    }
+
+  self->source_size = buf.st_size;
+  posix_fadvise (self->source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return TRUE;
 }
 
 static void
@@ -253,6 +509,21 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (!cockpit_json_get_bool (options, "delta", FALSE, &self->delta))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"delta\" option for fsreplace1 channel", self->path);
+      goto out;
+    }
+
+  if (!cockpit_json_get_string (options, "checksum", NULL, &self->checksum) ||
+      (self->checksum && !valid_checksum (self->checksum)))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"checksum\" option for fsreplace1 channel", self->path);
+      goto out;
+    }
+
   actual_tag = cockpit_get_file_tag (self->path);
   if (self->expected_tag && g_strcmp0 (self->expected_tag, actual_tag))
     {
@@ -260,6 +531,9 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (self->delta && !prepare_delta (self))
+    goto out;
+
   // TODO - delay the opening until the first content message.  That
   // way, we don't create a useless temporary file (which might even
   // fail).
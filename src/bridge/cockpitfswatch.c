@@ -24,28 +24,66 @@
 
 #include "common/cockpitjson.h"
 
+#include <glib-unix.h>
+
+#include <sys/inotify.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitFswatch:
  *
  * A #CockpitChannel that watches a file or directory.
  *
+ * Events either come from a GFileMonitor, or straight from inotify.
+ * With the "batch" option they are collected per path, and sent
+ * together as one message.
+ *
  * The payload type for this channel is 'fswatch1'.
  */
 
 #define COCKPIT_FSWATCH(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_FSWATCH, CockpitFswatch))
 
+/* Send a batch early when this many paths have changed */
+#define MAX_PENDING_PATHS 1024
+
+/* Bounds how much inotify input is processed per main loop iteration */
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+#define INOTIFY_MAX_READS 16
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_ATTRIB | \
+                      IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct {
+  gchar *path;
+  gchar *other;
+  GFileMonitorEvent event_type;
+  GList *link;
+} PendingEvent;
+
 typedef struct {
   CockpitChannel parent;
   const gchar *path;
   GFileMonitor *monitor;
   guint sig_changed;
+
+  /* Coalescing of events */
+  gint64 batch;
+  GHashTable *pending;
+  GQueue pending_order;
+  guint batch_timeout;
+
+  /* The inotify backend */
+  int inotify_fd;
+  GSource *inotify_source;
+  gchar *inotify_dir;
+  gchar *inotify_name;
+  gboolean inotify_deleted;
 } CockpitFswatch;
 
 typedef struct {
@@ -62,9 +100,21 @@ cockpit_fswatch_recv (CockpitChannel *channel,
                         "received unexpected message in fswatch channel");
 }
 
+static void
+pending_event_free (gpointer data)
+{
+  PendingEvent *event = data;
+  g_free (event->path);
+  g_free (event->other);
+  g_free (event);
+}
+
 static void
 cockpit_fswatch_init (CockpitFswatch *self)
 {
+  self->pending = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, pending_event_free);
+  g_queue_init (&self->pending_order);
+  self->inotify_fd = -1;
 }
 
 gchar *
@@ -109,14 +159,12 @@ event_type_to_string (GFileMonitorEvent event_type)
   }
 }
 
-void
-cockpit_fswatch_emit_event (CockpitChannel    *channel,
-                            GFile             *file,
-                            GFile             *other_file,
-                            GFileMonitorEvent  event_type)
+static JsonObject *
+build_event (GFile *file,
+             GFile *other_file,
+             GFileMonitorEvent event_type)
 {
   JsonObject *msg;
-  GBytes *msg_bytes;
 
   msg = json_object_new ();
   json_object_set_string_member (msg, "event", event_type_to_string (event_type));
@@ -152,12 +200,120 @@ cockpit_fswatch_emit_event (CockpitChannel    *channel,
       json_object_set_string_member (msg, "other", p);
       g_free (p);
     }
+
+  return msg;
+}
+
+void
+cockpit_fswatch_emit_event (CockpitChannel    *channel,
+                            GFile             *file,
+                            GFile             *other_file,
+                            GFileMonitorEvent  event_type)
+{
+  JsonObject *msg;
+  GBytes *msg_bytes;
+
+  msg = build_event (file, other_file, event_type);
   msg_bytes = cockpit_json_write_bytes (msg);
   json_object_unref (msg);
   cockpit_channel_send (channel, msg_bytes, TRUE);
   g_bytes_unref (msg_bytes);
 }
 
+static void
+flush_events (CockpitFswatch *self)
+{
+  PendingEvent *event;
+  JsonArray *array;
+  JsonNode *node;
+  GBytes *bytes;
+  GFile *file;
+  GFile *other;
+  gchar *data;
+  gsize length;
+
+  if (self->batch_timeout)
+    {
+      g_source_remove (self->batch_timeout);
+      self->batch_timeout = 0;
+    }
+
+  if (!self->pending_order.head)
+    return;
+
+  /* Tags are looked up now, once per path, rather than for each event */
+  array = json_array_new ();
+  while ((event = g_queue_pop_head (&self->pending_order)))
+    {
+      file = g_file_new_for_path (event->path);
+      other = event->other ? g_file_new_for_path (event->other) : NULL;
+      json_array_add_object_element (array, build_event (file, other, event->event_type));
+      g_object_unref (file);
+      if (other)
+        g_object_unref (other);
+      g_hash_table_remove (self->pending, event->path);
+    }
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  data = cockpit_json_write (node, &length);
+  json_node_free (node);
+
+  bytes = g_bytes_new_take (data, length);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static gboolean
+on_batch_timeout (gpointer user_data)
+{
+  CockpitFswatch *self = user_data;
+  self->batch_timeout = 0;
+  flush_events (self);
+  return FALSE;
+}
+
+static void
+queue_event (CockpitFswatch *self,
+             const gchar *path,
+             const gchar *other,
+             GFileMonitorEvent event_type)
+{
+  PendingEvent *event;
+
+  event = g_hash_table_lookup (self->pending, path);
+  if (event)
+    {
+      /* Something that was just created is still just created */
+      if (event->event_type == G_FILE_MONITOR_EVENT_CREATED &&
+          (event_type == G_FILE_MONITOR_EVENT_CHANGED ||
+           event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+           event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED))
+        return;
+
+      /* Otherwise the latest event wins, and moves to the back */
+      g_queue_unlink (&self->pending_order, event->link);
+      g_list_free (event->link);
+      g_free (event->other);
+    }
+  else
+    {
+      event = g_new0 (PendingEvent, 1);
+      event->path = g_strdup (path);
+      g_hash_table_insert (self->pending, event->path, event);
+    }
+
+  event->other = g_strdup (other);
+  event->event_type = event_type;
+  g_queue_push_tail (&self->pending_order, event);
+  event->link = self->pending_order.tail;
+
+  if (self->pending_order.length >= MAX_PENDING_PATHS)
+    flush_events (self);
+  else if (!self->batch_timeout)
+    self->batch_timeout = g_timeout_add (self->batch, on_batch_timeout, self);
+}
+
 static void
 on_changed (GFileMonitor      *monitor,
             GFile             *file,
@@ -166,7 +322,265 @@ on_changed (GFileMonitor      *monitor,
             gpointer           user_data)
 {
   CockpitFswatch *self = COCKPIT_FSWATCH (user_data);
-  cockpit_fswatch_emit_event (COCKPIT_CHANNEL(self), file, other_file, event_type);
+  gchar *path;
+  gchar *other;
+
+  if (self->batch <= 0 || !file)
+    {
+      cockpit_fswatch_emit_event (COCKPIT_CHANNEL(self), file, other_file, event_type);
+      return;
+    }
+
+  path = g_file_get_path (file);
+  other = other_file ? g_file_get_path (other_file) : NULL;
+  queue_event (self, path, other, event_type);
+  g_free (path);
+  g_free (other);
+}
+
+static void
+stop_inotify (CockpitFswatch *self)
+{
+  if (self->inotify_source)
+    {
+      g_source_destroy (self->inotify_source);
+      g_source_unref (self->inotify_source);
+      self->inotify_source = NULL;
+    }
+
+  if (self->inotify_fd >= 0)
+    {
+      close (self->inotify_fd);
+      self->inotify_fd = -1;
+    }
+}
+
+static void
+emit_inotify_event (CockpitFswatch *self,
+                    const gchar *path,
+                    GFileMonitorEvent event_type)
+{
+  GFile *file;
+
+  if (self->batch > 0)
+    {
+      queue_event (self, path, NULL, event_type);
+    }
+  else
+    {
+      file = g_file_new_for_path (path);
+      cockpit_fswatch_emit_event (COCKPIT_CHANNEL (self), file, NULL, event_type);
+      g_object_unref (file);
+    }
+}
+
+static void
+dispatch_inotify_event (CockpitFswatch *self,
+                        const struct inotify_event *event)
+{
+  GFileMonitorEvent event_type;
+  const gchar *name;
+  gchar *path;
+
+  name = event->len ? event->name : NULL;
+
+  /* When watching a file, we watch its directory, and only want the file */
+  if (self->inotify_name && g_strcmp0 (name, self->inotify_name) != 0)
+    return;
+
+  if (event->mask & (IN_CREATE | IN_MOVED_TO))
+    event_type = G_FILE_MONITOR_EVENT_CREATED;
+  else if (event->mask & (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVE_SELF))
+    event_type = G_FILE_MONITOR_EVENT_DELETED;
+  else if (event->mask & IN_MODIFY)
+    event_type = G_FILE_MONITOR_EVENT_CHANGED;
+  else if (event->mask & IN_CLOSE_WRITE)
+    event_type = G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT;
+  else if (event->mask & IN_ATTRIB)
+    event_type = G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED;
+  else if (event->mask & IN_UNMOUNT)
+    event_type = G_FILE_MONITOR_EVENT_UNMOUNTED;
+  else
+    return;
+
+  /* Whether the watched file, or the watched directory itself, is gone */
+  if (self->inotify_name || !name)
+    self->inotify_deleted = (event_type == G_FILE_MONITOR_EVENT_DELETED);
+
+  path = name ? g_build_filename (self->inotify_dir, name, NULL) : g_strdup (self->inotify_dir);
+  emit_inotify_event (self, path, event_type);
+  g_free (path);
+}
+
+static void
+finish_inotify (CockpitFswatch *self)
+{
+  /*
+   * The watch went away with the directory or its mount. Say that the
+   * watched path is gone, as GFileMonitor does, and then close, since
+   * nothing more will be seen about it.
+   */
+  if (!self->inotify_deleted)
+    emit_inotify_event (self, self->path, G_FILE_MONITOR_EVENT_DELETED);
+  self->inotify_deleted = TRUE;
+
+  flush_events (self);
+  stop_inotify (self);
+  cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
+}
+
+static void
+emit_overflow (CockpitFswatch *self)
+{
+  JsonObject *msg;
+  JsonNode *node;
+  JsonArray *array;
+  GBytes *bytes;
+  gchar *data;
+  gsize length;
+
+  flush_events (self);
+
+  msg = json_object_new ();
+  json_object_set_string_member (msg, "event", "overflow");
+  json_object_set_string_member (msg, "path", self->path);
+
+  node = json_node_new (self->batch > 0 ? JSON_NODE_ARRAY : JSON_NODE_OBJECT);
+  if (self->batch > 0)
+    {
+      array = json_array_new ();
+      json_array_add_object_element (array, msg);
+      json_node_take_array (node, array);
+    }
+  else
+    {
+      json_node_take_object (node, msg);
+    }
+
+  data = cockpit_json_write (node, &length);
+  json_node_free (node);
+
+  bytes = g_bytes_new_take (data, length);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static gboolean
+on_inotify_input (gint fd,
+                  GIOCondition cond,
+                  gpointer user_data)
+{
+  CockpitFswatch *self = user_data;
+  const struct inotify_event *event;
+  gchar *buffer;
+  gchar *ptr;
+  gssize len;
+  gint reads;
+  gboolean ret = TRUE;
+
+  buffer = g_malloc (INOTIFY_BUFFER_SIZE);
+  g_object_ref (self);
+
+  for (reads = 0; reads < INOTIFY_MAX_READS && self->inotify_fd >= 0; reads++)
+    {
+      len = read (fd, buffer, INOTIFY_BUFFER_SIZE);
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            break;
+
+          cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
+                                "%s: couldn't read inotify events: %s", self->path, g_strerror (errno));
+          ret = FALSE;
+          break;
+        }
+
+      for (ptr = buffer; ptr < buffer + len; ptr += sizeof (struct inotify_event) + event->len)
+        {
+          event = (const struct inotify_event *)ptr;
+
+          /* The kernel queue filled up and events were lost */
+          if (event->mask & IN_Q_OVERFLOW)
+            {
+              emit_overflow (self);
+              continue;
+            }
+
+          /* The watch went away, with the directory or its mount */
+          if (event->mask & IN_IGNORED)
+            {
+              finish_inotify (self);
+              ret = FALSE;
+              break;
+            }
+
+          dispatch_inotify_event (self, event);
+        }
+
+      if (!ret)
+        break;
+    }
+
+  g_object_unref (self);
+  g_free (buffer);
+  return ret;
+}
+
+static gboolean
+start_inotify (CockpitFswatch *self,
+               const gchar *path)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  struct stat buf;
+  int err;
+
+  if (stat (path, &buf) < 0)
+    {
+      err = errno;
+      if (err != ENOENT)
+        {
+          cockpit_channel_fail (channel, "internal-error", "%s: %s", path, g_strerror (err));
+          return FALSE;
+        }
+
+      /* Watch for the file to show up */
+      buf.st_mode = 0;
+      self->inotify_deleted = TRUE;
+    }
+
+  /* Files are watched through their directory, so that replacing them is seen */
+  if (S_ISDIR (buf.st_mode))
+    {
+      self->inotify_dir = g_strdup (path);
+    }
+  else
+    {
+      self->inotify_dir = g_path_get_dirname (path);
+      self->inotify_name = g_path_get_basename (path);
+    }
+
+  self->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (self->inotify_fd < 0 ||
+      inotify_add_watch (self->inotify_fd, self->inotify_dir, INOTIFY_MASK) < 0)
+    {
+      err = errno;
+      stop_inotify (self);
+      if (err == EACCES || err == EPERM)
+        cockpit_channel_close (channel, "access-denied");
+      else if (err == ENOENT || err == ENOTDIR)
+        cockpit_channel_close (channel, "not-found");
+      else
+        cockpit_channel_fail (channel, "internal-error", "%s: couldn't watch: %s", path, g_strerror (err));
+      return FALSE;
+    }
+
+  self->inotify_source = g_unix_fd_source_new (self->inotify_fd, G_IO_IN);
+  g_source_set_name (self->inotify_source, "fswatch-inotify");
+  g_source_set_callback (self->inotify_source, (GSourceFunc)on_inotify_input, self, NULL);
+  g_source_attach (self->inotify_source, NULL);
+  return TRUE;
 }
 
 static void
@@ -175,6 +589,7 @@ cockpit_fswatch_prepare (CockpitChannel *channel)
   CockpitFswatch *self = COCKPIT_FSWATCH (channel);
   JsonObject *options;
   GError *error = NULL;
+  const gchar *backend;
   const gchar *path;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fswatch_parent_class)->prepare (channel);
@@ -193,6 +608,31 @@ cockpit_fswatch_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  self->path = path;
+
+  if (!cockpit_json_get_int (options, "batch", 0, &self->batch) ||
+      self->batch < 0 || self->batch >= G_MAXUINT)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "invalid \"batch\" option for fswatch channel");
+      goto out;
+    }
+
+  if (!cockpit_json_get_string (options, "backend", "gio", &backend) ||
+      (!g_str_equal (backend, "gio") && !g_str_equal (backend, "inotify")))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "invalid \"backend\" option for fswatch channel");
+      goto out;
+    }
+
+  if (g_str_equal (backend, "inotify"))
+    {
+      if (start_inotify (self, path))
+        cockpit_channel_ready (channel, NULL);
+      goto out;
+    }
+
   GFile *file = g_file_new_for_path (path);
   GFileMonitor *monitor = g_file_monitor (file, 0, NULL, &error);
   g_object_unref (file);
@@ -232,6 +672,12 @@ cockpit_fswatch_dispose (GObject *object)
       self->monitor = NULL;
     }
 
+  stop_inotify (self);
+
+  if (self->batch_timeout)
+    g_source_remove (self->batch_timeout);
+  self->batch_timeout = 0;
+
   G_OBJECT_CLASS (cockpit_fswatch_parent_class)->dispose (object);
 }
 
@@ -242,6 +688,11 @@ cockpit_fswatch_finalize (GObject *object)
 
   g_clear_object (&self->monitor);
 
+  g_queue_clear (&self->pending_order);
+  g_hash_table_destroy (self->pending);
+  g_free (self->inotify_dir);
+  g_free (self->inotify_name);
+
   G_OBJECT_CLASS (cockpit_fswatch_parent_class)->finalize (object);
 }
 
@@ -21,6 +21,7 @@
 
 #include "cockpithttpstream.h"
 
+#include "cockpitcoalesce.h"
 #include "cockpitpackages.h"
 #include "cockpitconnect.h"
 #include "cockpitstream.h"
@@ -41,35 +42,77 @@
  *
  * Information about a certain set of HTTP connections that
  * have been given a connection name, grouping them together as
- * a client. In this mode we cache connections and reuse them
+ * a client. In this mode we pool connections and reuse them
  * as well as share options and address info.
+ *
+ * Idle connections are kept in least recently used order, the
+ * most recently returned connection is at the head of the queue
+ * and is the first to be reused. When there are more than
+ * max_idle connections the oldest ones are evicted. When a limit
+ * of active connections is set, channels wait for a connection
+ * to become available before connecting.
  */
 
+/* The defaults for pooling when a connection name is given */
+#define DEFAULT_MAX_IDLE      4
+#define DEFAULT_IDLE_TIMEOUT  10
+
+typedef struct _CockpitHttpStream CockpitHttpStream;
+
 typedef struct {
   gint refs;
   gchar *name;
   gchar *hostname;
+
+  /* Idle connections, CockpitHttpIdle, most recently used at head */
+  GQueue idle;
+  guint max_idle;
+  guint idle_timeout;
+
+  /* Connections in use by a channel, zero max_active is unlimited */
+  guint active;
+  guint max_active;
+
+  /* Channels waiting for a free active slot, CockpitHttpStream */
+  GQueue waiting;
+  guint handover;
+
+  /* Statistics reported in the close message */
+  guint64 opened;
+  guint64 reused;
+  guint64 evicted;
+  guint64 expired;
+  guint64 discarded;
+} CockpitHttpClient;
+
+typedef struct {
+  CockpitHttpClient *client;
   CockpitStream *stream;
   gulong sig_close;
   guint timeout;
-} CockpitHttpClient;
+} CockpitHttpIdle;
 
 static GHashTable *clients;
 
+static void    cockpit_http_stream_connect      (CockpitHttpStream *self);
+
+static void
+cockpit_http_idle_free (CockpitHttpIdle *idle)
+{
+  if (idle->timeout)
+    g_source_remove (idle->timeout);
+  g_signal_handler_disconnect (idle->stream, idle->sig_close);
+  g_object_unref (idle->stream);
+  g_slice_free (CockpitHttpIdle, idle);
+}
+
 static void
 cockpit_http_client_reset (CockpitHttpClient *client)
 {
-  if (client->timeout)
-    g_source_remove (client->timeout);
-  if (client->stream)
-    {
-      g_signal_handler_disconnect (client->stream, client->sig_close);
-      g_object_unref (client->stream);
-    }
+  CockpitHttpIdle *idle;
 
-  client->sig_close = 0;
-  client->stream = NULL;
-  client->timeout = 0;
+  while ((idle = g_queue_pop_head (&client->idle)))
+    cockpit_http_idle_free (idle);
 }
 
 static void
@@ -79,6 +122,8 @@ cockpit_http_client_unref (gpointer data)
   if (--client->refs == 0)
     {
       cockpit_http_client_reset (client);
+      g_assert (g_queue_is_empty (&client->waiting));
+      g_assert (client->handover == 0);
       g_free (client->hostname);
       g_free (client->name);
       g_slice_free (CockpitHttpClient, client);
@@ -97,20 +142,65 @@ on_client_close (CockpitStream *stream,
                  const gchar *problem,
                  gpointer data)
 {
-  CockpitHttpClient *client = data;
-  g_debug ("%s: connection closed", client->name);
-  cockpit_http_client_reset (client);
+  CockpitHttpIdle *idle = data;
+  CockpitHttpClient *client = idle->client;
+  g_debug ("%s: idle connection closed", client->name);
+  g_queue_remove (&client->idle, idle);
+  cockpit_http_idle_free (idle);
 }
 
 static gboolean
 on_client_timeout (gpointer data)
 {
-  CockpitHttpClient *client = data;
-  g_debug ("%s: connection timed out", client->name);
-  cockpit_http_client_reset (client);
+  CockpitHttpIdle *idle = data;
+  CockpitHttpClient *client = idle->client;
+  g_debug ("%s: idle connection timed out", client->name);
+  idle->timeout = 0;
+  client->expired++;
+  g_queue_remove (&client->idle, idle);
+  cockpit_http_idle_free (idle);
   return FALSE;
 }
 
+static gboolean
+parse_pool_option (CockpitChannel *channel,
+                   JsonObject *options,
+                   const gchar *field,
+                   guint *value)
+{
+  gint64 number;
+
+  if (!cockpit_json_get_int (options, field, *value, &number) || number < 0 || number > G_MAXUINT)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "invalid \"%s\" field in HTTP stream request", field);
+      return FALSE;
+    }
+
+  *value = number;
+  return TRUE;
+}
+
+static gboolean
+cockpit_http_client_configure (CockpitHttpClient *client,
+                               CockpitChannel *channel,
+                               JsonObject *options)
+{
+  if (!parse_pool_option (channel, options, "max-idle", &client->max_idle) ||
+      !parse_pool_option (channel, options, "max-active", &client->max_active) ||
+      !parse_pool_option (channel, options, "idle-timeout", &client->idle_timeout))
+    return FALSE;
+
+  /* Drop any idle connections beyond a lowered limit */
+  while (g_queue_get_length (&client->idle) > client->max_idle)
+    {
+      client->evicted++;
+      cockpit_http_idle_free (g_queue_pop_tail (&client->idle));
+    }
+
+  return TRUE;
+}
+
 static CockpitHttpClient *
 cockpit_http_client_ensure (const gchar *name)
 {
@@ -127,10 +217,15 @@ cockpit_http_client_ensure (const gchar *name)
     {
       client = g_slice_new0 (CockpitHttpClient);
       client->name = g_strdup (name);
+      g_queue_init (&client->idle);
+      g_queue_init (&client->waiting);
+      client->idle_timeout = DEFAULT_IDLE_TIMEOUT;
 
+      /* Unnamed connections are never reused */
       if (clients && name)
         {
           g_debug ("%s: registering client", name);
+          client->max_idle = DEFAULT_MAX_IDLE;
           g_hash_table_replace (clients, client->name, cockpit_http_client_ref (client));
         }
     }
@@ -143,32 +238,134 @@ cockpit_http_client_ensure (const gchar *name)
   return client;
 }
 
+static gboolean
+cockpit_http_client_full (CockpitHttpClient *client)
+{
+  return client->max_active && client->active >= client->max_active;
+}
+
+static gboolean
+on_client_handover (gpointer data)
+{
+  CockpitHttpClient *client = data;
+  CockpitHttpStream *waiter;
+
+  client->handover = 0;
+
+  /* Waiting channels remove themselves from the queue when closed */
+  while (!cockpit_http_client_full (client) &&
+         (waiter = g_queue_pop_head (&client->waiting)))
+    {
+      g_object_ref (waiter);
+      cockpit_http_stream_connect (waiter);
+      g_object_unref (waiter);
+    }
+
+  return FALSE;
+}
+
+/*
+ * Hand free slots over to channels waiting for one. Slots are released
+ * while the releasing channel closes, so waiting channels are connected
+ * later from the main loop rather than reentrantly.
+ */
+static void
+cockpit_http_client_handover (CockpitHttpClient *client)
+{
+  if (!cockpit_http_client_full (client) &&
+      !g_queue_is_empty (&client->waiting) && !client->handover)
+    {
+      client->handover = g_idle_add_full (G_PRIORITY_DEFAULT, on_client_handover,
+                                          cockpit_http_client_ref (client),
+                                          cockpit_http_client_unref);
+    }
+}
+
+static void
+cockpit_http_client_release (CockpitHttpClient *client)
+{
+  g_return_if_fail (client->active > 0);
+  client->active--;
+  cockpit_http_client_handover (client);
+}
+
 static void
 cockpit_http_client_checkin (CockpitHttpClient *client,
                              CockpitStream *stream)
 {
-  cockpit_http_client_reset (client);
-  client->stream = g_object_ref (stream);
-  client->sig_close = g_signal_connect (stream, "close", G_CALLBACK (on_client_close), client);
-  client->timeout = g_timeout_add_seconds (10, on_client_timeout, client);
+  CockpitHttpIdle *idle;
+
+  if (client->max_idle > 0)
+    {
+      idle = g_slice_new0 (CockpitHttpIdle);
+      idle->client = client;
+      idle->stream = g_object_ref (stream);
+      idle->sig_close = g_signal_connect (stream, "close", G_CALLBACK (on_client_close), idle);
+      if (client->idle_timeout)
+        idle->timeout = g_timeout_add_seconds (client->idle_timeout, on_client_timeout, idle);
+      g_queue_push_head (&client->idle, idle);
+
+      /* Evict the least recently used connections */
+      while (g_queue_get_length (&client->idle) > client->max_idle)
+        {
+          g_debug ("%s: evicting idle connection", client->name);
+          client->evicted++;
+          cockpit_http_idle_free (g_queue_pop_tail (&client->idle));
+        }
+    }
+
+  cockpit_http_client_release (client);
 }
 
 static CockpitStream *
 cockpit_http_client_checkout (CockpitHttpClient *client)
 {
   CockpitStream *stream = NULL;
+  CockpitHttpIdle *idle;
 
-  if (client->stream)
+  while (!stream && (idle = g_queue_pop_head (&client->idle)))
     {
-      g_debug ("%s: reusing connection", client->name);
+      /*
+       * A healthy idle connection has no unread data. Anything
+       * that arrived while idle doesn't belong to any request we
+       * send, and would be mistaken for the next response.
+       */
+      if (cockpit_stream_get_buffer (idle->stream)->len == 0)
+        {
+          g_debug ("%s: reusing connection", client->name);
+          stream = g_object_ref (idle->stream);
+          client->reused++;
+        }
+      else
+        {
+          g_debug ("%s: discarding idle connection with unexpected data", client->name);
+          client->discarded++;
+        }
 
-      stream = g_object_ref (client->stream);
-      cockpit_http_client_reset (client);
+      cockpit_http_idle_free (idle);
     }
 
   return stream;
 }
 
+static void
+cockpit_http_client_statistics (CockpitHttpClient *client,
+                                JsonObject *options)
+{
+  JsonObject *object;
+
+  object = json_object_new ();
+  json_object_set_int_member (object, "active", client->active);
+  json_object_set_int_member (object, "idle", g_queue_get_length (&client->idle));
+  json_object_set_int_member (object, "waiting", g_queue_get_length (&client->waiting));
+  json_object_set_int_member (object, "opened", client->opened);
+  json_object_set_int_member (object, "reused", client->reused);
+  json_object_set_int_member (object, "evicted", client->evicted);
+  json_object_set_int_member (object, "expired", client->expired);
+  json_object_set_int_member (object, "discarded", client->discarded);
+  json_object_set_object_member (options, "pool", object);
+}
+
 /**
  * CockpitHttpStream:
  *
@@ -181,7 +378,6 @@ cockpit_http_client_checkout (CockpitHttpClient *client)
  * Some things we should add later without breaking the payload:
  *
  *  - Specifying the HTTP version of the request.
- *  - Chunked messages in the request when request is HTTP/1.1
  *  - Trans coding for non-UTF8 charsets.
  */
 
@@ -194,13 +390,17 @@ enum {
     FINISHED
 };
 
-typedef struct _CockpitHttpStream {
+struct _CockpitHttpStream {
   CockpitChannel parent;
 
   /* The nickname for debugging and logging */
   gchar *name;
   CockpitHttpClient *client;
 
+  /* Whether waiting for, or holding an active slot in the client */
+  gboolean waiting;
+  gboolean active;
+
   /* The connection */
   CockpitStream *stream;
   gulong sig_open;
@@ -213,13 +413,23 @@ typedef struct _CockpitHttpStream {
   gboolean keep_alive;
   gboolean headers_inline;
 
-  /* The request */
+  /* The request, buffered unless streamed */
   GList *request;
+  gboolean request_streamed;
+  gboolean request_chunked;
+  gssize request_length;
+  gsize request_sent;
+  gboolean request_done;
 
   /* From parsing the response */
   gboolean response_chunked;
   gssize response_length;
-} CockpitHttpStream;
+
+  /* Response body held back with "batch": "auto" */
+  gboolean adaptive;
+  CockpitCoalesce coalesce;
+  GByteArray *held;
+};
 
 typedef struct {
   CockpitChannelClass parent_class;
@@ -428,8 +638,8 @@ relay_headers (CockpitHttpStream *self,
 }
 
 static void
-relay_data (CockpitChannel *channel,
-            GBytes *data)
+send_data (CockpitChannel *channel,
+           GBytes *data)
 {
   GBytes *block;
   gsize size;
@@ -453,6 +663,55 @@ relay_data (CockpitChannel *channel,
     }
 }
 
+static void
+flush_held (CockpitHttpStream *self)
+{
+  GBytes *message;
+  gsize size;
+
+  if (!self->held || self->held->len == 0)
+    return;
+
+  /* Held data goes out as one block, that's the point of holding it */
+  size = self->held->len;
+  message = g_byte_array_free_to_bytes (self->held);
+  self->held = NULL;
+
+  cockpit_coalesce_flushed (&self->coalesce, size);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
+  g_bytes_unref (message);
+}
+
+static gboolean
+on_held_timeout (gpointer user_data)
+{
+  flush_held (user_data);
+  return FALSE;
+}
+
+static void
+relay_data (CockpitHttpStream *self,
+            CockpitChannel *channel,
+            GBytes *data)
+{
+  gconstpointer bytes;
+  gsize size;
+
+  if (!self->adaptive)
+    {
+      send_data (channel, data);
+      return;
+    }
+
+  bytes = g_bytes_get_data (data, &size);
+  if (!self->held)
+    self->held = g_byte_array_new ();
+  g_byte_array_append (self->held, bytes, size);
+
+  if (!cockpit_coalesce_hold (&self->coalesce, self->held->len))
+    flush_held (self);
+}
+
 static gboolean
 relay_chunked (CockpitHttpStream *self,
                CockpitChannel *channel,
@@ -511,7 +770,7 @@ relay_chunked (CockpitHttpStream *self,
   else
     {
       message = cockpit_pipe_consume (buffer, beg, size, 2);
-      relay_data (channel, message);
+      relay_data (self, channel, message);
       g_bytes_unref (message);
       return TRUE;
     }
@@ -547,7 +806,7 @@ relay_length (CockpitHttpStream *self,
       self->response_length -= block;
 
       message = cockpit_pipe_consume (buffer, 0, block, 0);
-      relay_data (channel, message);
+      relay_data (self, channel, message);
       g_bytes_unref (message);
     }
 
@@ -568,7 +827,7 @@ relay_all (CockpitHttpStream *self,
     }
 
   message = cockpit_pipe_consume (buffer, 0, buffer->len, 0);
-  relay_data (channel, message);
+  relay_data (self, channel, message);
   g_bytes_unref (message);
 
   return TRUE;
@@ -712,7 +971,7 @@ disallowed_header (const gchar *name,
   return FALSE;
 }
 
-static void
+static gboolean
 send_http_request (CockpitHttpStream *self)
 {
   CockpitChannel *channel = COCKPIT_CHANNEL (self);
@@ -731,6 +990,7 @@ send_http_request (CockpitHttpStream *self)
   GBytes *bytes;
   GList *l;
   gsize total;
+  gboolean ret = FALSE;
 
   options = cockpit_channel_get_options (channel);
 
@@ -851,13 +1111,24 @@ send_http_request (CockpitHttpStream *self)
   request = g_list_reverse (self->request);
   self->request = NULL;
 
-  /* Calculate how much data we have to send */
-  total = 0;
-  for (l = request; l != NULL; l = g_list_next (l))
-    total += g_bytes_get_size (l->data);
+  if (self->request_chunked)
+    {
+      g_string_append (string, "Transfer-Encoding: chunked\r\n");
+    }
+  else if (self->request_length >= 0)
+    {
+      g_string_append_printf (string, "Content-Length: %" G_GSSIZE_FORMAT "\r\n", self->request_length);
+    }
+  else
+    {
+      /* Calculate how much data we have to send */
+      total = 0;
+      for (l = request; l != NULL; l = g_list_next (l))
+        total += g_bytes_get_size (l->data);
 
-  if (request || g_ascii_strcasecmp (method, "POST") == 0)
-    g_string_append_printf (string, "Content-Length: %" G_GSIZE_FORMAT "\r\n", total);
+      if (request || g_ascii_strcasecmp (method, "POST") == 0)
+        g_string_append_printf (string, "Content-Length: %" G_GSIZE_FORMAT "\r\n", total);
+    }
   g_string_append (string, "\r\n");
 
   bytes = g_string_free_to_bytes (string);
@@ -866,15 +1137,88 @@ send_http_request (CockpitHttpStream *self)
   cockpit_stream_write (self->stream, bytes);
   g_bytes_unref (bytes);
 
-  /* Now send all the data */
+  /* Now send all the data, when streamed it's sent as it arrives */
   for (l = request; l != NULL; l = g_list_next (l))
     cockpit_stream_write (self->stream, l->data);
+  if (!self->request_streamed)
+    self->request_done = TRUE;
+
+  ret = TRUE;
 
 out:
   g_list_free (names);
   g_list_free_full (request, (GDestroyNotify)g_bytes_unref);
   if (string)
     g_string_free (string, TRUE);
+  return ret;
+}
+
+static void
+send_request_data (CockpitHttpStream *self,
+                   GBytes *message)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  static const gchar crlf[] = "\r\n";
+  GBytes *bytes;
+  gchar *prefix;
+  gsize size;
+
+  size = g_bytes_get_size (message);
+
+  if (self->request_chunked)
+    {
+      /* An empty chunk would mark the end of the body */
+      if (size == 0)
+        return;
+
+      prefix = g_strdup_printf ("%" G_GSIZE_MODIFIER "x\r\n", size);
+      bytes = g_bytes_new_take (prefix, strlen (prefix));
+      cockpit_stream_write (self->stream, bytes);
+      g_bytes_unref (bytes);
+
+      cockpit_stream_write (self->stream, message);
+
+      bytes = g_bytes_new_static (crlf, 2);
+      cockpit_stream_write (self->stream, bytes);
+      g_bytes_unref (bytes);
+    }
+  else
+    {
+      if (size > (gsize)self->request_length - self->request_sent)
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "%s: received more HTTP request data than the declared length", self->name);
+          return;
+        }
+
+      cockpit_stream_write (self->stream, message);
+    }
+
+  self->request_sent += size;
+}
+
+static void
+finish_request_data (CockpitHttpStream *self)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  static const gchar last[] = "0\r\n\r\n";
+  GBytes *bytes;
+
+  if (self->request_chunked)
+    {
+      bytes = g_bytes_new_static (last, 5);
+      cockpit_stream_write (self->stream, bytes);
+      g_bytes_unref (bytes);
+    }
+  else if (self->request_sent != (gsize)self->request_length)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: received less HTTP request data than the declared length", self->name);
+      return;
+    }
+
+  g_debug ("%s: sent %" G_GSIZE_FORMAT " bytes of streamed request", self->name, self->request_sent);
+  self->request_done = TRUE;
 }
 
 static void
@@ -882,7 +1226,12 @@ cockpit_http_stream_recv (CockpitChannel *channel,
                           GBytes *message)
 {
   CockpitHttpStream *self = (CockpitHttpStream *)channel;
-  self->request = g_list_prepend (self->request, g_bytes_ref (message));
+
+  /* Streamed requests go out as they arrive, and flow control applies */
+  if (!self->request_streamed)
+    self->request = g_list_prepend (self->request, g_bytes_ref (message));
+  else if (self->state != FINISHED)
+    send_request_data (self, message);
 }
 
 static gboolean
@@ -894,25 +1243,82 @@ cockpit_http_stream_control (CockpitChannel *channel,
 
   if (g_str_equal (command, "done"))
     {
-      g_return_val_if_fail (self->state == BUFFER_REQUEST, FALSE);
-      self->state = RELAY_REQUEST;
-      send_http_request (self);
+      if (self->request_streamed)
+        {
+          if (self->state != FINISHED)
+            finish_request_data (self);
+        }
+      else
+        {
+          g_return_val_if_fail (self->state == BUFFER_REQUEST, FALSE);
+          self->state = RELAY_REQUEST;
+          send_http_request (self);
+        }
       return TRUE;
     }
 
   return FALSE;
 }
 
+static void
+cockpit_http_stream_release (CockpitHttpStream *self)
+{
+  if (self->stream)
+    {
+      if (self->sig_open)
+        g_signal_handler_disconnect (self->stream, self->sig_open);
+      g_signal_handler_disconnect (self->stream, self->sig_read);
+      g_signal_handler_disconnect (self->stream, self->sig_close);
+      self->sig_open = self->sig_read = self->sig_close = 0;
+    }
+
+  if (self->waiting)
+    {
+      g_queue_remove (&self->client->waiting, self);
+      self->waiting = FALSE;
+    }
+}
+
+static void
+cockpit_http_stream_deactivate (CockpitHttpStream *self)
+{
+  if (self->active)
+    {
+      self->active = FALSE;
+      cockpit_http_client_release (self->client);
+    }
+}
+
+static void
+cockpit_http_stream_pool_statistics (CockpitHttpStream *self)
+{
+  if (self->client && self->client->name)
+    cockpit_http_client_statistics (self->client, cockpit_channel_close_options (COCKPIT_CHANNEL (self)));
+}
+
 static void
 cockpit_http_stream_close (CockpitChannel *channel,
                            const gchar *problem)
 {
   CockpitHttpStream *self = COCKPIT_HTTP_STREAM (channel);
+  CockpitStream *stream;
+
+  if (self->waiting)
+    cockpit_http_stream_release (self);
+
+  /* Whatever was held back of a complete response still goes out */
+  cockpit_coalesce_clear (&self->coalesce);
+  if (!problem && self->state == RELAY_DATA)
+    flush_held (self);
 
   if (problem)
     {
       self->failed = TRUE;
       self->state = FINISHED;
+
+      /* The connection is closed on dispose, but no longer counts */
+      cockpit_http_stream_deactivate (self);
+      cockpit_http_stream_pool_statistics (self);
       COCKPIT_CHANNEL_CLASS (cockpit_http_stream_parent_class)->close (channel, problem);
     }
   else if (self->state == RELAY_DATA)
@@ -921,20 +1327,27 @@ cockpit_http_stream_close (CockpitChannel *channel,
       self->state = FINISHED;
       cockpit_channel_control (channel, "done", NULL);
 
-      /* Save this for another round? */
-      if (self->keep_alive)
+      /*
+       * Save this for another round? Only when the response was consumed
+       * exactly, any further data would be mistaken for the next response.
+       */
+      if (self->keep_alive && self->request_done &&
+          cockpit_stream_get_buffer (self->stream)->len == 0)
         {
-          if (self->sig_open)
-            g_signal_handler_disconnect (self->stream, self->sig_open);
-          g_signal_handler_disconnect (self->stream, self->sig_read);
-          g_signal_handler_disconnect (self->stream, self->sig_close);
-          cockpit_http_client_checkin (self->client, self->stream);
-          cockpit_flow_throttle (COCKPIT_FLOW (self->stream), NULL);
+          stream = self->stream;
+          cockpit_http_stream_release (self);
+          cockpit_flow_throttle (COCKPIT_FLOW (stream), NULL);
           cockpit_flow_throttle (COCKPIT_FLOW (channel), NULL);
-          g_object_unref (self->stream);
           self->stream = NULL;
+
+          /* A waiting channel picks up the connection from the main loop */
+          self->active = FALSE;
+          cockpit_http_client_checkin (self->client, stream);
+          g_object_unref (stream);
         }
 
+      cockpit_http_stream_deactivate (self);
+      cockpit_http_stream_pool_statistics (self);
       COCKPIT_CHANNEL_CLASS (cockpit_http_stream_parent_class)->close (channel, NULL);
     }
   else if (self->state != FINISHED)
@@ -942,6 +1355,7 @@ cockpit_http_stream_close (CockpitChannel *channel,
       g_warn_if_reached ();
       self->failed = TRUE;
       self->state = FINISHED;
+      cockpit_http_stream_deactivate (self);
       COCKPIT_CHANNEL_CLASS (cockpit_http_stream_parent_class)->close (channel, "internal-error");
     }
 }
@@ -950,50 +1364,26 @@ static void
 cockpit_http_stream_init (CockpitHttpStream *self)
 {
   self->response_length = -1;
+  self->request_length = -1;
   self->keep_alive = FALSE;
   self->state = BUFFER_REQUEST;
+  cockpit_coalesce_init (&self->coalesce, 75, on_held_timeout, self);
 }
 
 static void
-cockpit_http_stream_prepare (CockpitChannel *channel)
+cockpit_http_stream_connect (CockpitHttpStream *self)
 {
-  CockpitHttpStream *self = COCKPIT_HTTP_STREAM (channel);
-  const gchar *payload;
-  const gchar *connection;
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
   JsonObject *options;
   const gchar *path;
 
-  COCKPIT_CHANNEL_CLASS (cockpit_http_stream_parent_class)->prepare (channel);
-
-  if (self->failed)
-    return;
-
   options = cockpit_channel_get_options (channel);
-  if (!cockpit_json_get_string (options, "connection", NULL, &connection))
-    {
-      cockpit_channel_fail (channel, "protocol-error",
-                            "bad \"connection\" field in HTTP stream request");
-      return;
-    }
-
   if (!cockpit_json_get_string (options, "path", "/", &path))
-    {
-      cockpit_channel_fail (channel, "protocol-error",
-                            "bad \"path\" field in HTTP stream request");
-      return;
-    }
-
-  /*
-   * In http-stream1 the headers are sent as first message.
-   * In http-stream2 the headers are in a control message.
-   */
-  if (cockpit_json_get_string (options, "payload", NULL, &payload) &&
-      payload && g_str_equal (payload, "http-stream1"))
-    {
-      self->headers_inline = TRUE;
-    }
+    g_return_if_reached (); /* validated in prepare */
 
-  self->client = cockpit_http_client_ensure (connection);
+  self->waiting = FALSE;
+  self->active = TRUE;
+  self->client->active++;
 
   self->stream = cockpit_http_client_checkout (self->client);
   if (!self->stream)
@@ -1006,6 +1396,7 @@ cockpit_http_stream_prepare (CockpitChannel *channel)
           g_autoptr(GIOStream) packages_stream = cockpit_packages_connect ();
           self->stream = cockpit_stream_new (self->name, packages_stream);
           self->name = g_strdup_printf ("http://internal:packages%s", path);
+          g_free (self->client->hostname);
           self->client->hostname = g_strdup ("packages");
         }
       else
@@ -1017,15 +1408,15 @@ cockpit_http_stream_prepare (CockpitChannel *channel)
           self->name = g_strdup_printf ("%s://%s%s",
                                         connectable->tls ? "https" : "http",
                                         connectable->name, path);
+          g_free (self->client->hostname);
           self->client->hostname = g_strdup (connectable->name);
 
           self->stream = cockpit_stream_connect (self->name, connectable);
           self->sig_open = g_signal_connect (self->stream, "open", G_CALLBACK (on_stream_open), self);
         }
-    }
 
-  /* Parsed elsewhere */
-  self->binary = json_object_has_member (options, "binary");
+      self->client->opened++;
+    }
 
   self->sig_read = g_signal_connect (self->stream, "read", G_CALLBACK (on_stream_read), self);
   self->sig_close = g_signal_connect (self->stream, "close", G_CALLBACK (on_stream_close), self);
@@ -1036,11 +1427,124 @@ cockpit_http_stream_prepare (CockpitChannel *channel)
   /* Let the stream throtlte the channel peer's output flow */
   cockpit_flow_throttle (COCKPIT_FLOW (channel), COCKPIT_FLOW (self->stream));
 
+  /* A streamed request body follows the headers as it is received */
+  if (self->request_streamed)
+    {
+      self->state = RELAY_REQUEST;
+      if (!send_http_request (self))
+        return;
+    }
+
   /* If not waiting for open */
   if (!self->sig_open)
     cockpit_channel_ready (channel, NULL);
 }
 
+static void
+cockpit_http_stream_prepare (CockpitChannel *channel)
+{
+  CockpitHttpStream *self = COCKPIT_HTTP_STREAM (channel);
+  const gchar *payload;
+  const gchar *connection;
+  JsonObject *options;
+  const gchar *path;
+  const gchar *batch;
+  gint64 length;
+  gint64 latency;
+
+  COCKPIT_CHANNEL_CLASS (cockpit_http_stream_parent_class)->prepare (channel);
+
+  if (self->failed)
+    return;
+
+  options = cockpit_channel_get_options (channel);
+  if (!cockpit_json_get_string (options, "connection", NULL, &connection))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "bad \"connection\" field in HTTP stream request");
+      return;
+    }
+
+  if (!cockpit_json_get_string (options, "path", "/", &path))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "bad \"path\" field in HTTP stream request");
+      return;
+    }
+
+  /*
+   * In http-stream1 the headers are sent as first message.
+   * In http-stream2 the headers are in a control message.
+   */
+  if (cockpit_json_get_string (options, "payload", NULL, &payload) &&
+      payload && g_str_equal (payload, "http-stream1"))
+    {
+      self->headers_inline = TRUE;
+    }
+
+  /* Parsed elsewhere */
+  self->binary = json_object_has_member (options, "binary");
+
+  if (!cockpit_json_get_bool (options, "chunked", FALSE, &self->request_chunked))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "bad \"chunked\" field in HTTP stream request");
+      return;
+    }
+
+  if (!cockpit_json_get_int (options, "content-length", -1, &length) || length < -1 || length > G_MAXSSIZE)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "bad \"content-length\" field in HTTP stream request");
+      return;
+    }
+
+  if (self->request_chunked && length >= 0)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "can't specify both \"chunked\" and \"content-length\" in HTTP stream request");
+      return;
+    }
+
+  self->request_length = length;
+  self->request_streamed = self->request_chunked || self->request_length >= 0;
+
+  if (!cockpit_json_get_string (options, "batch", NULL, &batch) ||
+      (batch && !g_str_equal (batch, "auto")))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "bad \"batch\" field in HTTP stream request");
+      return;
+    }
+
+  if (!cockpit_json_get_int (options, "latency", self->coalesce.max_latency, &latency) ||
+      latency < 0 || latency >= G_MAXUINT)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "bad \"latency\" field in HTTP stream request");
+      return;
+    }
+
+  self->adaptive = batch != NULL;
+  self->coalesce.max_latency = latency;
+
+  self->client = cockpit_http_client_ensure (connection);
+  if (connection && !cockpit_http_client_configure (self->client, channel, options))
+    return;
+
+  /* Wait until another channel gives up its connection, and queue behind earlier waiters */
+  if (cockpit_http_client_full (self->client) || !g_queue_is_empty (&self->client->waiting))
+    {
+      g_debug ("%s: waiting for a free connection", connection);
+      self->waiting = TRUE;
+      g_queue_push_tail (&self->client->waiting, self);
+      cockpit_http_client_handover (self->client);
+      return;
+    }
+
+  cockpit_http_stream_connect (self);
+}
+
 static void
 cockpit_http_stream_dispose (GObject *object)
 {
@@ -1054,8 +1558,18 @@ cockpit_http_stream_dispose (GObject *object)
       g_signal_handler_disconnect (self->stream, self->sig_close);
       cockpit_stream_close (self->stream, NULL);
       g_object_unref (self->stream);
+      self->stream = NULL;
     }
 
+  if (self->waiting)
+    cockpit_http_stream_release (self);
+  cockpit_http_stream_deactivate (self);
+
+  cockpit_coalesce_clear (&self->coalesce);
+  if (self->held)
+    g_byte_array_unref (self->held);
+  self->held = NULL;
+
   g_list_free_full (self->request, (GDestroyNotify)g_bytes_unref);
   self->request = NULL;
 
@@ -138,6 +138,189 @@ typedef struct {
   double value;
 } MetricInfo;
 
+/*
+ * Samplers are shared by all channels in the bridge. Each sampler runs at
+ * most once per metronome tick, its samples are recorded and then handed
+ * to every channel that ticks at the same time.
+ *
+ * Recording doesn't allocate per tick: the recorder and the sample arrays
+ * are reused, and instance names are kept in a per sampler set that only
+ * grows when new instances show up.
+ */
+
+typedef struct {
+  const gchar *metric;
+  const gchar *instance;
+  gint64 value;
+} RecordedSample;
+
+typedef struct {
+  SamplerSet sampler;
+  void (* func) (CockpitSamples *samples);
+  gint64 timestamp;
+  GArray *samples;
+  GHashTable *instances;
+} SharedSampler;
+
+static SharedSampler shared_samplers[] = {
+  { CPU_SAMPLER, cockpit_cpu_samples },
+  { MEMORY_SAMPLER, cockpit_memory_samples },
+  { BLOCK_SAMPLER, cockpit_block_samples },
+  { NETWORK_SAMPLER, cockpit_network_samples },
+  { MOUNT_SAMPLER, cockpit_mount_samples },
+  { CGROUP_SAMPLER, cockpit_cgroup_samples },
+  { DISK_SAMPLER, cockpit_disk_samples },
+  { THERMAL_SAMPLER, cockpit_cpu_temperature },
+  { CGROUP_IO_SAMPLER, cockpit_cgroup_disk_usage },
+};
+
+static guint shared_samplers_users = 0;
+
+typedef struct {
+  GObject parent;
+  SharedSampler *shared;
+} SampleRecorder;
+
+typedef struct {
+  GObjectClass parent_class;
+} SampleRecorderClass;
+
+static GType sample_recorder_get_type (void);
+static void sample_recorder_samples_init (CockpitSamplesInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (SampleRecorder, sample_recorder, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES, sample_recorder_samples_init))
+
+static void
+sample_recorder_init (SampleRecorder *self)
+{
+}
+
+static void
+sample_recorder_class_init (SampleRecorderClass *klass)
+{
+}
+
+static void
+sample_recorder_sample (CockpitSamples *samples,
+                        const gchar *metric,
+                        const gchar *instance,
+                        gint64 value)
+{
+  SampleRecorder *self = (SampleRecorder *)samples;
+  SharedSampler *shared = self->shared;
+  RecordedSample sample = { g_intern_string (metric), NULL, value };
+  gchar *key;
+
+  if (instance)
+    {
+      key = g_hash_table_lookup (shared->instances, instance);
+      if (!key)
+        {
+          key = g_strdup (instance);
+          g_hash_table_add (shared->instances, key);
+        }
+      sample.instance = key;
+    }
+
+  g_array_append_val (shared->samples, sample);
+}
+
+static void
+sample_recorder_samples_init (CockpitSamplesInterface *iface)
+{
+  iface->sample = sample_recorder_sample;
+}
+
+static SampleRecorder *shared_recorder = NULL;
+
+static void
+shared_samplers_ref (void)
+{
+  if (shared_samplers_users++ == 0)
+    shared_recorder = g_object_new (sample_recorder_get_type (), NULL);
+}
+
+static void
+shared_samplers_unref (void)
+{
+  g_return_if_fail (shared_samplers_users > 0);
+
+  if (--shared_samplers_users > 0)
+    return;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (shared_samplers); i++)
+    {
+      if (shared_samplers[i].samples)
+        g_array_free (shared_samplers[i].samples, TRUE);
+      shared_samplers[i].samples = NULL;
+      if (shared_samplers[i].instances)
+        g_hash_table_destroy (shared_samplers[i].instances);
+      shared_samplers[i].instances = NULL;
+    }
+
+  g_clear_object (&shared_recorder);
+}
+
+static gboolean
+unrecorded_instance (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+  return !g_hash_table_contains (user_data, key);
+}
+
+static void
+shared_sampler_prune (SharedSampler *shared)
+{
+  GHashTable *recorded;
+  RecordedSample *sample;
+  guint i;
+
+  /* Forget instances that went away, once there are many of them */
+  if (g_hash_table_size (shared->instances) <= 2 * shared->samples->len + 64)
+    return;
+
+  recorded = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < shared->samples->len; i++)
+    {
+      sample = &g_array_index (shared->samples, RecordedSample, i);
+      if (sample->instance)
+        g_hash_table_add (recorded, (gpointer)sample->instance);
+    }
+  g_hash_table_foreach_remove (shared->instances, unrecorded_instance, recorded);
+  g_hash_table_destroy (recorded);
+}
+
+static GArray *
+shared_sampler_run (SharedSampler *shared,
+                    gint64 timestamp)
+{
+  g_return_val_if_fail (shared_recorder != NULL, NULL);
+
+  if (shared->samples && shared->timestamp == timestamp)
+    return shared->samples;
+
+  if (shared->samples)
+    {
+      g_array_set_size (shared->samples, 0);
+    }
+  else
+    {
+      shared->samples = g_array_new (FALSE, FALSE, sizeof (RecordedSample));
+      shared->instances = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+  shared_recorder->shared = shared;
+  shared->func (COCKPIT_SAMPLES (shared_recorder));
+  shared_recorder->shared = NULL;
+
+  shared_sampler_prune (shared);
+
+  shared->timestamp = timestamp;
+  return shared->samples;
+}
+
 typedef struct {
   CockpitMetrics parent;
   const gchar *name;
@@ -147,6 +330,7 @@ typedef struct {
   MetricInfo *metrics;
   const gchar **omit_instances;
   SamplerSet samplers;
+  gboolean sharing;
 
   gboolean need_meta;
 } CockpitInternalMetrics;
@@ -327,26 +511,20 @@ cockpit_internal_metrics_tick (CockpitMetrics *metrics,
         info->value = NAN;
     }
 
-  /* Sample
+  /* Sample, or reuse what was sampled for another channel on this tick
    */
-  if (self->samplers & CPU_SAMPLER)
-    cockpit_cpu_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & MEMORY_SAMPLER)
-    cockpit_memory_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & BLOCK_SAMPLER)
-    cockpit_block_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & NETWORK_SAMPLER)
-    cockpit_network_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & MOUNT_SAMPLER)
-    cockpit_mount_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & CGROUP_SAMPLER)
-    cockpit_cgroup_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & DISK_SAMPLER)
-    cockpit_disk_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & THERMAL_SAMPLER)
-    cockpit_cpu_temperature (COCKPIT_SAMPLES (self));
-  if (self->samplers & CGROUP_IO_SAMPLER)
-    cockpit_cgroup_disk_usage (COCKPIT_SAMPLES (self));
+  for (gsize i = 0; i < G_N_ELEMENTS (shared_samplers); i++)
+    {
+      if (!(self->samplers & shared_samplers[i].sampler))
+        continue;
+
+      GArray *samples = shared_sampler_run (&shared_samplers[i], timestamp);
+      for (guint j = 0; j < samples->len; j++)
+        {
+          RecordedSample *sample = &g_array_index (samples, RecordedSample, j);
+          cockpit_samples_sample (COCKPIT_SAMPLES (self), sample->metric, sample->instance, sample->value);
+        }
+    }
 
   /* Check for disappeared instances
    */
@@ -517,6 +695,9 @@ cockpit_internal_metrics_prepare (CockpitChannel *channel)
 
   self->need_meta = TRUE;
 
+  shared_samplers_ref ();
+  self->sharing = TRUE;
+
   cockpit_metrics_metronome (COCKPIT_METRICS (self), self->interval);
   cockpit_channel_ready (channel, NULL);
 }
@@ -535,6 +716,9 @@ cockpit_internal_metrics_finalize (GObject *object)
 {
   CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (object);
 
+  if (self->sharing)
+    shared_samplers_unref ();
+
   g_free (self->omit_instances);
 
   for (int i = 0; i < self->n_metrics; i++)
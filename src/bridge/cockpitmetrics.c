@@ -176,7 +176,14 @@ on_timeout_tick (gpointer data)
   if (klass->tick)
     (klass->tick) (self, GET_PRIV(self)->next);
 
+  /*
+   * Tick on multiples of the interval, so that channels with the same
+   * interval tick together and can share samples. The first tick happens
+   * right away, so the second one is at least one interval later.
+   */
   GET_PRIV(self)->next += GET_PRIV(self)->interval;
+  GET_PRIV(self)->next += (GET_PRIV(self)->interval - GET_PRIV(self)->next % GET_PRIV(self)->interval) %
+                          GET_PRIV(self)->interval;
   next_interval = GET_PRIV(self)->next - g_get_monotonic_time() / 1000;
   if (next_interval < 0)
     next_interval = 0;
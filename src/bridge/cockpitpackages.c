@@ -1114,6 +1114,13 @@ package_content (CockpitPackages *packages,
                 }
             }
 
+          /* A single file can be sent in byte ranges */
+          if (!globbing && bytes && cockpit_web_response_ranges (response, headers, bytes))
+            {
+              result = TRUE;
+              goto out;
+            }
+
           cockpit_web_response_headers_full (response, 200, "OK", -1, headers);
         }
 
@@ -53,6 +53,12 @@
 /* Several megabytes is when we start to consider queue full enough */
 #define QUEUE_PRESSURE   (128UL * DEF_PACKET_SIZE)
 
+/* Most packets we receive or send in a single system call */
+#define MAX_PACKET_BATCH 32
+
+/* Most memory we hold on to for receiving a batch of packets */
+#define MAX_INPUT_SLAB   (1024UL * 1024UL)
+
 enum {
     CREATED = 0,
     CONNECTING,
@@ -75,6 +81,23 @@ typedef struct {
   gboolean out_done;
   gsize out_queued;
 
+  /*
+   * Receive buffers are reused between reads. The batch starts at a
+   * single packet, grows when the peer keeps filling it up, and shrinks
+   * again when reads come back short, so that quiet channels don't hold
+   * on to lots of memory.
+   */
+  guchar *in_slab;
+  gsize in_slab_size;
+  gint in_batch;
+
+  /* Packets read but not yet sent, while the channel is under pressure */
+  GQueue in_held;
+  gboolean in_eof;
+  gboolean in_throttled;
+  gboolean in_sending;
+  gboolean out_relieving;
+
   /* Pressure which throttles input on this pipe */
   CockpitFlow *pressure;
   gulong pressure_sig;
@@ -152,73 +175,143 @@ close_maybe (CockpitPacketChannel *self)
     }
 }
 
+static void
+prepare_input_slab (CockpitPacketChannel *self)
+{
+  gsize size = self->max_size * self->in_batch;
+
+  if (self->in_slab_size != size)
+    {
+      g_free (self->in_slab);
+      self->in_slab = g_malloc (size);
+      self->in_slab_size = size;
+    }
+}
+
+static void
+relay_input (CockpitPacketChannel *self)
+{
+  GBytes *message;
+
+  /* Once a packet puts the channel under pressure, the rest waits */
+  while (!self->in_throttled && self->state < CLOSED &&
+         (message = g_queue_pop_head (&self->in_held)))
+    {
+      self->in_sending = TRUE;
+      cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
+      self->in_sending = FALSE;
+      g_bytes_unref (message);
+    }
+
+  if (self->in_eof && !self->in_done && self->state < CLOSED &&
+      g_queue_is_empty (&self->in_held))
+    {
+      g_debug ("%s: end of input", self->name);
+      cockpit_channel_control (COCKPIT_CHANNEL (self), "done", NULL);
+      self->in_done = TRUE;
+      if (self->in_source)
+        stop_input (self);
+
+      message = g_bytes_new_static ("", 0);
+      cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
+      g_bytes_unref (message);
+
+      close_maybe (self);
+    }
+}
+
 static gboolean
 dispatch_input (gint fd,
                 GIOCondition cond,
                 gpointer user_data)
 {
   CockpitPacketChannel *self = (CockpitPacketChannel *)user_data;
-  GByteArray *buffer;
+  struct mmsghdr msgs[MAX_PACKET_BATCH];
+  struct iovec iovs[MAX_PACKET_BATCH];
   GBytes *message;
-  gssize ret = 0;
+  gboolean eof = FALSE;
+  gint count = 0;
+  gint i;
   int errn;
 
   g_return_val_if_fail (self->in_source, FALSE);
 
-  buffer = g_byte_array_new ();
-
   /*
    * Enable clean shutdown by not reading when we just get
    * G_IO_HUP. Note that when we get G_IO_ERR we do want to read
    * just so we can get the appropriate detailed error message.
    */
-  if (cond != G_IO_HUP)
+  if (cond == G_IO_HUP)
     {
-      g_byte_array_set_size (buffer, self->max_size);
+      eof = TRUE;
+    }
+  else
+    {
+      prepare_input_slab (self);
+
+      memset (msgs, 0, sizeof (msgs));
+      for (i = 0; i < self->in_batch; i++)
+        {
+          iovs[i].iov_base = self->in_slab + (i * self->max_size);
+          iovs[i].iov_len = self->max_size;
+          msgs[i].msg_hdr.msg_iov = iovs + i;
+          msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
       g_debug ("%s: reading input %x", self->name, cond);
-      ret = recv (self->fd, buffer->data, buffer->len, 0);
+      count = recvmmsg (self->fd, msgs, self->in_batch, MSG_DONTWAIT, NULL);
 
       errn = errno;
-      if (ret < 0)
+      if (count < 0)
         {
           if (errn == EAGAIN || errn == EINTR)
             {
-              g_byte_array_free (buffer, TRUE);
               return TRUE;
             }
           else if (errn == ECONNRESET)
             {
               g_debug ("couldn't read: %s", g_strerror (errn));
-              ret = 0;
+              count = 0;
+              eof = TRUE;
             }
           else
             {
-              g_byte_array_free (buffer, TRUE);
               close_with_errno (self, "couldn't read", errn);
               return FALSE;
             }
         }
+      else if (count == 0)
+        {
+          eof = TRUE;
+        }
 
-      g_byte_array_set_size (buffer, ret);
-    }
+      /* The peer keeps us busy, read more at once next time */
+      if (count == self->in_batch && self->in_batch * 2 * self->max_size <= MAX_INPUT_SLAB)
+        self->in_batch = MIN (self->in_batch * 2, MAX_PACKET_BATCH);
 
-  if (ret == 0)
-    {
-      g_debug ("%s: end of input", self->name);
-      cockpit_channel_control (COCKPIT_CHANNEL (self), "done", NULL);
-      self->in_done = TRUE;
-      stop_input (self);
+      /* And give the memory back once it quiets down */
+      else if (count < self->in_batch / 2)
+        self->in_batch = MAX (self->in_batch / 2, 1);
     }
 
-  g_object_ref (self);
+  /* A zero length packet is the end of a seqpacket stream */
+  for (i = 0; i < count; i++)
+    {
+      if (msgs[i].msg_len == 0)
+        {
+          eof = TRUE;
+          break;
+        }
 
-  message = g_byte_array_free_to_bytes (buffer);
-  cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
-  g_bytes_unref (message);
+      message = g_bytes_new (iovs[i].iov_base, msgs[i].msg_len);
+      g_queue_push_tail (&self->in_held, message);
+    }
 
-  if (self->in_done)
-    close_maybe (self);
+  if (eof)
+    self->in_eof = TRUE;
 
+  g_object_ref (self);
+  relay_input (self);
   g_object_unref (self);
   return TRUE;
 }
@@ -258,9 +351,14 @@ dispatch_output (gint fd,
                  gpointer user_data)
 {
   CockpitPacketChannel *self = (CockpitPacketChannel *)user_data;
+  struct mmsghdr msgs[MAX_PACKET_BATCH];
+  struct iovec iovs[MAX_PACKET_BATCH];
   gconstpointer data;
   gsize before, size;
-  gssize ret;
+  GList *l;
+  gint count;
+  gint ret;
+  gint i;
 
   /* A non-blocking connect is processed here */
   if (self->state == CONNECTING && !dispatch_connect (self))
@@ -272,8 +370,17 @@ dispatch_output (gint fd,
 
   while (self->out_queue->head)
     {
-      data = g_bytes_get_data (self->out_queue->head->data, &size);
-      ret = send (self->fd, data, size, 0);
+      memset (msgs, 0, sizeof (msgs));
+      for (l = self->out_queue->head, count = 0; l && count < MAX_PACKET_BATCH; l = g_list_next (l), count++)
+        {
+          data = g_bytes_get_data (l->data, &size);
+          iovs[count].iov_base = (gpointer)data;
+          iovs[count].iov_len = size;
+          msgs[count].msg_hdr.msg_iov = iovs + count;
+          msgs[count].msg_hdr.msg_iovlen = 1;
+        }
+
+      ret = sendmmsg (self->fd, msgs, count, MSG_DONTWAIT);
 
       if (ret < 0)
         {
@@ -287,12 +394,18 @@ dispatch_output (gint fd,
               return FALSE;
             }
         }
-      else
+
+      /* Each packet is sent whole, or not at all */
+      for (i = 0; i < ret; i++)
         {
+          size = iovs[i].iov_len;
           g_bytes_unref (g_queue_pop_head (self->out_queue));
           g_assert (size <= self->out_queued);
           self->out_queued -= size;
         }
+
+      if (ret < count)
+        break;
     }
 
   /*
@@ -300,7 +413,11 @@ dispatch_output (gint fd,
    * buffer size becomes less than the low mark.
    */
   if (before >= QUEUE_PRESSURE && self->out_queued < QUEUE_PRESSURE)
-    cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+    {
+      self->out_relieving = TRUE;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+      self->out_relieving = FALSE;
+    }
 
   if (self->out_queue->head)
     return TRUE;
@@ -424,6 +541,8 @@ cockpit_packet_channel_init (CockpitPacketChannel *self)
   self->fd = -1;
   self->state = CREATED;
   self->max_size = DEF_PACKET_SIZE;
+  self->in_batch = 1;
+  g_queue_init (&self->in_held);
   self->out_queue = g_queue_new ();
   self->context = g_main_context_ref_thread_default ();
 }
@@ -517,7 +636,7 @@ on_throttle_pressure (GObject *object,
     }
   else
     {
-      if (self->in_source == NULL && !self->in_done)
+      if (self->in_source == NULL && !self->in_done && !self->in_throttled)
         {
           g_debug ("%s: relieving back pressure in pipe", self->name);
           start_input (self);
@@ -546,6 +665,38 @@ cockpit_packet_channel_throttle (CockpitFlow *flow,
     }
 }
 
+/*
+ * The channel's own pressure, when the peer hasn't acknowledged what it
+ * was sent. Our output queue signals on the same object, so only react
+ * to pressure that sending input applied, and to its release.
+ */
+static void
+on_channel_pressure (CockpitFlow *flow,
+                     gboolean throttle,
+                     gpointer user_data)
+{
+  CockpitPacketChannel *self = user_data;
+
+  if (throttle)
+    {
+      if (!self->in_sending)
+        return;
+      g_debug ("%s: channel under pressure, holding input", self->name);
+      self->in_throttled = TRUE;
+      if (self->in_source)
+        stop_input (self);
+    }
+  else if (self->in_throttled && !self->out_relieving)
+    {
+      g_debug ("%s: channel pressure relieved", self->name);
+      self->in_throttled = FALSE;
+      relay_input (self);
+      if (!self->in_throttled && !self->in_source && !self->in_done &&
+          self->state < CLOSED)
+        start_input (self);
+    }
+}
+
 static void
 cockpit_packet_channel_flow_iface (CockpitFlowInterface *iface)
 {
@@ -586,6 +737,7 @@ cockpit_packet_channel_prepare (CockpitChannel *channel)
   else
     {
       self->fd = sock;
+      g_signal_connect (self, "pressure", G_CALLBACK (on_channel_pressure), self);
       start_input (self);
       start_output (self);
     }
@@ -608,6 +760,9 @@ cockpit_packet_channel_dispose (GObject *object)
     g_bytes_unref (g_queue_pop_head (self->out_queue));
   self->out_queued = 0;
 
+  while (self->in_held.head)
+    g_bytes_unref (g_queue_pop_head (&self->in_held));
+
   G_OBJECT_CLASS (cockpit_packet_channel_parent_class)->dispose (object);
 }
 
@@ -620,6 +775,7 @@ cockpit_packet_channel_finalize (GObject *object)
   g_assert (!self->in_source);
   g_assert (!self->out_source);
   g_queue_free (self->out_queue);
+  g_free (self->in_slab);
   g_free (self->name);
 
   if (self->context)
@@ -27,6 +27,7 @@
 
 #include <pcp/pmapi.h>
 #include <math.h>
+#include <sys/stat.h>
 
 /**
  * CockpitPcpMetrics:
@@ -47,9 +48,18 @@ typedef struct {
   pmUnits units_buf;
 } MetricInfo;
 
+typedef enum {
+  AGGREGATE_NONE,
+  AGGREGATE_AVG,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+} Aggregate;
+
 typedef struct {
+  gchar *path;
   int context;
   gint64 start;
+  gint64 end;
 } ArchiveInfo;
 
 typedef struct {
@@ -61,11 +71,30 @@ typedef struct {
   MetricInfo *metrics;
   gint64 interval;
   gint64 limit;
-  guint idler;
+
+  /* Archive samples are fetched by a thread, in batches */
+  GThread *fetcher;
+  GMutex fetch_lock;
+  GCond fetch_cond;
+  GQueue fetched;
+  gboolean fetch_stop;
+  GSource *fetch_source;
+  gboolean throttled;
 
   GList *archives;  /* of ArchiveInfo */
   GList *cur_archive;
 
+  /* Reducing archive samples into buckets of one interval */
+  Aggregate aggregate;
+  gint64 sample_interval;
+  gint64 origin;
+  gint64 bucket;
+  gboolean restarted;
+  double **scratch;
+  guint *counts;
+  int *slots;
+  int n_slots;
+
   /* The previous samples sent */
   pmResult *last;
 } CockpitPcpMetrics;
@@ -74,12 +103,37 @@ typedef struct {
   CockpitMetricsClass parent_class;
 } CockpitPcpMetricsClass;
 
+/* Samples per batch fetched from an archive */
+#define ARCHIVE_BATCH    60
+
+/* Fetched batches waiting to be sent, when full the fetch thread waits */
+#define ARCHIVE_QUEUED   2
+
+typedef struct {
+  pmResult *results[ARCHIVE_BATCH];
+  int n_results;
+  int offset;
+  int rc;
+} FetchBatch;
+
+typedef struct {
+  CockpitPcpMetrics *self;
+  int context;
+  int numpmid;
+  pmID *pmidlist;
+} FetchThread;
+
 G_DEFINE_TYPE (CockpitPcpMetrics, cockpit_pcp_metrics, COCKPIT_TYPE_METRICS);
 
 static void
 cockpit_pcp_metrics_init (CockpitPcpMetrics *self)
 {
   self->direct_context = -1;
+  self->bucket = -1;
+
+  g_mutex_init (&self->fetch_lock);
+  g_cond_init (&self->fetch_cond);
+  g_queue_init (&self->fetched);
 }
 
 static gboolean
@@ -308,13 +362,12 @@ build_sample (CockpitPcpMetrics *self,
 
 static void
 build_samples (CockpitPcpMetrics *self,
+               double **buffer,
                pmResult *result)
 {
-  double **buffer;
   pmValueSet *vs;
   int i, j;
 
-  buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
   for (i = 0; i < result->numpmid; i++)
     {
       vs = result->vset[i];
@@ -364,7 +417,7 @@ cockpit_pcp_metrics_tick (CockpitMetrics *metrics,
     }
 
   /* Send one set of samples */
-  build_samples (self, result);
+  build_samples (self, cockpit_metrics_get_data_buffer (metrics), result);
   cockpit_metrics_send_data (metrics, timestamp_from_timeval (&result->timestamp));
   cockpit_metrics_flush_data (metrics);
 
@@ -373,77 +426,412 @@ cockpit_pcp_metrics_tick (CockpitMetrics *metrics,
   self->last = result;
 }
 
-static void next_archive (CockpitPcpMetrics *self);
-
-static gboolean
-on_idle_batch (gpointer user_data)
+static void
+prepare_scratch (CockpitPcpMetrics *self,
+                 pmResult *result)
 {
-  const int archive_batch = 60;
-  CockpitPcpMetrics *self = user_data;
-  ArchiveInfo *info;
-  JsonObject *meta;
-  pmResult *result;
-  gint i;
-  int rc;
+  pmValueSet *vs;
+  int total = 0;
+  int i, j;
 
-  info = (ArchiveInfo *)(self->cur_archive->data);
+  /* Same layout as the data buffer for the meta built from this result */
+  if (!self->slots)
+    self->slots = g_new0 (int, result->numpmid);
+  for (i = 0; i < result->numpmid; i++)
+    {
+      vs = result->vset[i];
+      if (vs->numval < 0 || self->metrics[i].desc.indom == PM_INDOM_NULL)
+        self->slots[i] = 1;
+      else
+        self->slots[i] = vs->numval;
+      total += self->slots[i];
+    }
 
-  if (pmUseContext (info->context) < 0)
+  if (total != self->n_slots || !self->scratch)
     {
-      self->idler = 0;
-      return FALSE;
+      if (self->scratch)
+        g_free (self->scratch[0]);
+      g_free (self->scratch);
+      g_free (self->counts);
+      self->scratch = g_new0 (double *, MAX (result->numpmid, 1));
+      self->scratch[0] = g_new (double, MAX (total, 1));
+      self->counts = g_new0 (guint, MAX (total, 1));
+      self->n_slots = total;
     }
 
-  for (i = 0; i < archive_batch; i++)
+  for (i = 1; i < result->numpmid; i++)
+    self->scratch[i] = self->scratch[i - 1] + self->slots[i - 1];
+  for (i = 0; i < result->numpmid; i++)
+    {
+      for (j = 0; j < self->slots[i]; j++)
+        self->scratch[i][j] = NAN;
+    }
+}
+
+static void
+reduce_samples (CockpitPcpMetrics *self,
+                pmResult *result,
+                gboolean first)
+{
+  double **buffer;
+  double value;
+  int i, j, k;
+
+  prepare_scratch (self, result);
+  build_samples (self, self->scratch, result);
+
+  buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
+  for (i = 0, k = 0; i < result->numpmid; i++)
     {
-      /* Sent enough samples? */
-      self->limit--;
-      if (self->limit < 0)
+      for (j = 0; j < self->slots[i]; j++, k++)
         {
-          cockpit_metrics_flush_data (COCKPIT_METRICS (self));
-          cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
-          self->idler = 0;
-          return FALSE;
+          value = self->scratch[i][j];
+          if (first || self->counts[k] == 0)
+            {
+              buffer[i][j] = value;
+              self->counts[k] = isnan (value) ? 0 : 1;
+            }
+          else if (!isnan (value))
+            {
+              switch (self->aggregate)
+                {
+                case AGGREGATE_AVG:
+                  buffer[i][j] += value;
+                  break;
+                case AGGREGATE_MIN:
+                  buffer[i][j] = MIN (buffer[i][j], value);
+                  break;
+                case AGGREGATE_MAX:
+                  buffer[i][j] = MAX (buffer[i][j], value);
+                  break;
+                case AGGREGATE_NONE:
+                  g_assert_not_reached ();
+                }
+              self->counts[k]++;
+            }
         }
+    }
+}
 
-      rc = pmFetch (self->numpmid, self->pmidlist, &result);
-      if (rc < 0)
-        {
-          self->idler = 0;
+static void
+flush_bucket (CockpitPcpMetrics *self)
+{
+  double **buffer;
+  int i, j, k;
 
-          if (rc == PM_ERR_EOL)
+  if (self->bucket < 0)
+    return;
+
+  if (self->aggregate == AGGREGATE_AVG)
+    {
+      buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
+      for (i = 0, k = 0; i < self->numpmid; i++)
+        {
+          for (j = 0; j < self->slots[i]; j++, k++)
             {
-              cockpit_metrics_flush_data (COCKPIT_METRICS (self));
-              next_archive (self);
+              if (self->counts[k] > 1)
+                buffer[i][j] /= self->counts[k];
             }
+        }
+    }
+
+  cockpit_metrics_send_data (COCKPIT_METRICS (self), self->bucket);
+  self->bucket = -1;
+  self->limit--;
+}
+
+static gint64
+bucket_for_timestamp (CockpitPcpMetrics *self,
+                      gint64 timestamp)
+{
+  gint64 offset = (timestamp - self->origin) % self->interval;
+  if (offset < 0)
+    offset += self->interval;
+  return timestamp - offset;
+}
+
+static void next_archive (CockpitPcpMetrics *self);
+
+static void
+fetch_batch_free (gpointer data)
+{
+  FetchBatch *batch = data;
+  int i;
+
+  for (i = batch->offset; i < batch->n_results; i++)
+    pmFreeResult (batch->results[i]);
+  g_free (batch);
+}
+
+static gpointer
+fetch_thread (gpointer data)
+{
+  FetchThread *ft = data;
+  CockpitPcpMetrics *self = ft->self;
+  FetchBatch *batch;
+  gboolean done = FALSE;
+  int rc;
+
+  /* The current context is per thread */
+  rc = pmUseContext (ft->context);
+
+  while (!done)
+    {
+      batch = g_new0 (FetchBatch, 1);
+      if (rc < 0)
+        batch->rc = rc;
+
+      while (batch->rc == 0 && batch->n_results < ARCHIVE_BATCH)
+        {
+          rc = pmFetch (ft->numpmid, ft->pmidlist, &batch->results[batch->n_results]);
+          if (rc < 0)
+            batch->rc = rc;
           else
-            {
-              cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
-                                    "%s: couldn't read from archive: %s", self->name, pmErrStr (rc));
-            }
+            batch->n_results++;
+        }
 
-          return FALSE;
+      done = batch->rc < 0;
+
+      /* Wait until the main loop has caught up */
+      g_mutex_lock (&self->fetch_lock);
+      while (!self->fetch_stop && self->fetched.length >= ARCHIVE_QUEUED)
+        g_cond_wait (&self->fetch_cond, &self->fetch_lock);
+      if (self->fetch_stop)
+        {
+          done = TRUE;
+          fetch_batch_free (batch);
+        }
+      else
+        {
+          g_queue_push_tail (&self->fetched, batch);
+          g_source_set_ready_time (self->fetch_source, 0);
         }
+      g_mutex_unlock (&self->fetch_lock);
+    }
+
+  g_free (ft->pmidlist);
+  g_free (ft);
+  return NULL;
+}
+
+static gboolean
+on_fetch_dispatch (GSource *source,
+                   GSourceFunc callback,
+                   gpointer user_data)
+{
+  g_source_set_ready_time (source, -1);
+  return callback (user_data);
+}
+
+static GSourceFuncs fetch_source_funcs = {
+  NULL, NULL, on_fetch_dispatch, NULL,
+};
+
+static void
+stop_fetching (CockpitPcpMetrics *self)
+{
+  if (self->fetcher)
+    {
+      g_mutex_lock (&self->fetch_lock);
+      self->fetch_stop = TRUE;
+      g_cond_signal (&self->fetch_cond);
+      g_mutex_unlock (&self->fetch_lock);
+
+      g_thread_join (self->fetcher);
+      self->fetcher = NULL;
+    }
+
+  while (!g_queue_is_empty (&self->fetched))
+    fetch_batch_free (g_queue_pop_head (&self->fetched));
+  self->fetch_stop = FALSE;
+
+  if (self->fetch_source)
+    {
+      g_source_destroy (self->fetch_source);
+      g_source_unref (self->fetch_source);
+      self->fetch_source = NULL;
+    }
+}
+
+static void
+send_archive_result (CockpitPcpMetrics *self,
+                     pmResult *result)
+{
+  JsonObject *meta;
+  gint64 bucket;
+
+  bucket = bucket_for_timestamp (self, timestamp_from_timeval (&result->timestamp));
 
-      meta = build_meta_if_necessary (self, result);
-      if (meta)
+  /*
+   * A bucket that spans the boundary between two archives is continued
+   * when the next archive carries on with the same instances. Otherwise
+   * send what we have, and a new meta message for the next archive.
+   */
+  if (self->restarted)
+    {
+      self->restarted = FALSE;
+      if (self->bucket != bucket || !self->last || !result_meta_equal (self, self->last, result))
         {
-          cockpit_metrics_send_meta (COCKPIT_METRICS (self), meta, self->last == NULL);
-          json_object_unref (meta);
+          flush_bucket (self);
+          if (self->last)
+            pmFreeResult (self->last);
+          self->last = NULL;
         }
+    }
+
+  meta = build_meta_if_necessary (self, result);
+  if (meta)
+    {
+      /* The partial bucket so far still has the previous layout */
+      flush_bucket (self);
+      if (self->aggregate != AGGREGATE_NONE)
+        json_object_set_int_member (meta, "timestamp", bucket);
+      cockpit_metrics_send_meta (COCKPIT_METRICS (self), meta, self->last == NULL);
+      json_object_unref (meta);
+    }
 
-      build_samples (self, result);
+  if (self->aggregate == AGGREGATE_NONE)
+    {
+      build_samples (self, cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self)), result);
       cockpit_metrics_send_data (COCKPIT_METRICS (self), timestamp_from_timeval (&result->timestamp));
+    }
+  else
+    {
+      if (self->bucket != bucket)
+        flush_bucket (self);
+      reduce_samples (self, result, self->bucket < 0);
+      self->bucket = bucket;
+    }
 
-      if (self->last)
-        pmFreeResult (self->last);
-      self->last = result;
+  if (self->last)
+    pmFreeResult (self->last);
+  self->last = result;
+}
+
+static gboolean
+enough_samples (CockpitPcpMetrics *self)
+{
+  /* When aggregating, buckets count as they are sent */
+  if (self->aggregate == AGGREGATE_NONE)
+    self->limit--;
+  if (self->limit < 0 || (self->aggregate != AGGREGATE_NONE && self->limit == 0))
+    {
+      stop_fetching (self);
+      cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+      cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+on_fetched_batch (gpointer user_data)
+{
+  CockpitPcpMetrics *self = user_data;
+  ArchiveInfo *info;
+  FetchBatch *batch;
+  gboolean more;
+
+  /* Resumed once the peer acknowledges enough of what we sent */
+  if (self->throttled)
+    return TRUE;
+
+  g_mutex_lock (&self->fetch_lock);
+  batch = g_queue_pop_head (&self->fetched);
+  more = !g_queue_is_empty (&self->fetched);
+  g_cond_signal (&self->fetch_cond);
+  g_mutex_unlock (&self->fetch_lock);
+
+  if (!batch)
+    return TRUE;
+
+  /* One batch per main loop iteration, so other channels get a turn */
+  if (more)
+    g_source_set_ready_time (self->fetch_source, 0);
+
+  info = (ArchiveInfo *)(self->cur_archive->data);
+  if (pmUseContext (info->context) < 0)
+    {
+      fetch_batch_free (batch);
+      stop_fetching (self);
+      return TRUE;
+    }
+
+  while (batch->offset < batch->n_results)
+    {
+      if (enough_samples (self))
+        {
+          fetch_batch_free (batch);
+          return TRUE;
+        }
+      send_archive_result (self, batch->results[batch->offset++]);
     }
 
-  cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+  if (batch->rc < 0)
+    {
+      if (enough_samples (self))
+        {
+          fetch_batch_free (batch);
+          return TRUE;
+        }
+
+      /* The open bucket is carried over, and sent once all archives are done */
+      if (batch->rc == PM_ERR_EOL)
+        {
+          next_archive (self);
+        }
+      else
+        {
+          stop_fetching (self);
+          cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
+                                "%s: couldn't read from archive: %s", self->name, pmErrStr (batch->rc));
+        }
+    }
+  else
+    {
+      cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+    }
+
+  fetch_batch_free (batch);
   return TRUE;
 }
 
+static void
+start_fetching (CockpitPcpMetrics *self,
+                int context)
+{
+  FetchThread *ft;
+
+  g_assert (self->fetcher == NULL);
+
+  self->fetch_source = g_source_new (&fetch_source_funcs, sizeof (GSource));
+  g_source_set_name (self->fetch_source, "pcp-archive-fetch");
+  g_source_set_callback (self->fetch_source, on_fetched_batch, self, NULL);
+  g_source_attach (self->fetch_source, NULL);
+
+  ft = g_new0 (FetchThread, 1);
+  ft->self = self;
+  ft->context = context;
+  ft->numpmid = self->numpmid;
+  ft->pmidlist = g_memdup (self->pmidlist, sizeof (pmID) * self->numpmid);
+
+  self->fetcher = g_thread_new ("pcp-archive-fetch", fetch_thread, ft);
+}
+
+static void
+on_channel_pressure (CockpitChannel *channel,
+                     gboolean pressure,
+                     gpointer user_data)
+{
+  CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (channel);
+
+  g_debug ("%s: %s archive replay", self->name, pressure ? "pausing" : "resuming");
+  self->throttled = pressure;
+  if (!pressure && self->fetch_source)
+    g_source_set_ready_time (self->fetch_source, 0);
+}
+
 static gboolean
 units_equal (pmUnits *a,
              pmUnits *b)
@@ -661,42 +1049,262 @@ prepare_current_context (CockpitPcpMetrics *self,
 static void start_archive (CockpitPcpMetrics *self, gint64 timestamp);
 
 static void
-add_archive (CockpitPcpMetrics *self,
-             const gchar *name)
+archive_info_free (gpointer data)
 {
-  ArchiveInfo *info;
-  pmLogLabel label;
-  int rc;
+  ArchiveInfo *info = data;
+  if (info->context >= 0)
+    pmDestroyContext (info->context);
+  g_free (info->path);
+  g_free (info);
+}
 
-  info = g_new0 (ArchiveInfo, 1);
-  info->context = pmNewContext (PM_CONTEXT_ARCHIVE, name);
+static gboolean
+open_archive (CockpitPcpMetrics *self,
+              ArchiveInfo *info)
+{
+  if (info->context >= 0)
+    return TRUE;
+
+  info->context = pmNewContext (PM_CONTEXT_ARCHIVE, info->path);
   if (info->context < 0)
     {
       if (info->context == -ENOENT)
         {
-          g_debug ("%s: couldn't find pcp archive for %s", self->name, name);
+          g_debug ("%s: couldn't find pcp archive for %s", self->name, info->path);
         }
       else if (info->context != PM_ERR_NODATA)
         {
           g_warning ("%s: couldn't create pcp archive context for %s: %s (%d)",
-                     self->name, name, pmErrStr (info->context), info->context);
+                     self->name, info->path, pmErrStr (info->context), info->context);
         }
-      g_free (info);
-      return;
+      info->context = -1;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+close_archive (ArchiveInfo *info)
+{
+  if (info->context >= 0)
+    pmDestroyContext (info->context);
+  info->context = -1;
+}
+
+static ArchiveInfo *
+read_archive (CockpitPcpMetrics *self,
+              const gchar *name)
+{
+  ArchiveInfo *info;
+  pmLogLabel label;
+  struct timeval end;
+  int rc;
+
+  info = g_new0 (ArchiveInfo, 1);
+  info->path = g_strdup (name);
+  info->context = -1;
+
+  if (!open_archive (self, info))
+    {
+      archive_info_free (info);
+      return NULL;
     }
 
   rc = pmGetArchiveLabel (&label);
   if (rc < 0)
     {
       g_warning ("%s: couldn't read archive label of %s: %s", self->name, name, pmErrStr (rc));
-      pmDestroyContext (info->context);
-      g_free (info);
-      return;
+      archive_info_free (info);
+      return NULL;
+    }
+
+  info->start = timestamp_from_timeval (&label.ll_start);
+
+  /* An archive that is still being written may not have an end yet */
+  rc = pmGetArchiveEnd (&end);
+  if (rc < 0)
+    info->end = G_MAXINT64;
+  else
+    info->end = timestamp_from_timeval (&end);
+
+  return info;
+}
+
+static void
+add_archive (CockpitPcpMetrics *self,
+             const gchar *name)
+{
+  ArchiveInfo *info;
+
+  info = read_archive (self, name);
+  if (info)
+    self->archives = g_list_prepend (self->archives, info);
+}
+
+/*
+ * Learning the time range of an archive means opening it, which is slow
+ * for directories with many archives. So we keep an index of the start
+ * and end of each archive in a directory, and only look again at those
+ * whose .index file changed since.
+ */
+
+static gchar *
+archive_index_path (const gchar *directory)
+{
+  gchar *checksum;
+  gchar *filename;
+  gchar *path;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, directory, -1);
+  filename = g_strdup_printf ("%s.archives", checksum);
+  path = g_build_filename (g_get_user_cache_dir (), "cockpit", "pcp", filename, NULL);
+  g_free (filename);
+  g_free (checksum);
+
+  return path;
+}
+
+static void
+save_archive_index (CockpitPcpMetrics *self,
+                    const gchar *path,
+                    GKeyFile *index)
+{
+  GError *error = NULL;
+  gchar *directory;
+  gchar *data;
+  gsize length;
+
+  directory = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (directory, 0700) < 0)
+    {
+      g_debug ("%s: couldn't create directory for archive index: %s: %s",
+               self->name, directory, g_strerror (errno));
+    }
+  else
+    {
+      data = g_key_file_to_data (index, &length, NULL);
+      if (!g_file_set_contents (path, data, length, &error))
+        {
+          g_debug ("%s: couldn't write archive index: %s", self->name, error->message);
+          g_clear_error (&error);
+        }
+      g_free (data);
     }
 
-  info->start = (gint64) label.ll_start.tv_sec * 1000 + label.ll_start.tv_usec / 1000;
-  self->archives = g_list_prepend (self->archives, info);
-  return;
+  g_free (directory);
+}
+
+static gboolean
+lookup_archive_index (GKeyFile *index,
+                      const gchar *group,
+                      gint64 mtime,
+                      gint64 size,
+                      ArchiveInfo *info)
+{
+  GError *error = NULL;
+
+  if (!g_key_file_has_group (index, group) ||
+      g_key_file_get_int64 (index, group, "mtime", NULL) != mtime ||
+      g_key_file_get_int64 (index, group, "size", NULL) != size)
+    return FALSE;
+
+  info->start = g_key_file_get_int64 (index, group, "start", &error);
+  if (!error)
+    info->end = g_key_file_get_int64 (index, group, "end", &error);
+  if (error)
+    {
+      g_error_free (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+scan_archives (CockpitPcpMetrics *self,
+               const gchar *name,
+               GDir *dir)
+{
+  GKeyFile *index;
+  GKeyFile *fresh;
+  gboolean changed;
+  ArchiveInfo *info;
+  const gchar *entry;
+  gchar *index_path;
+  gchar *base;
+  gchar *path;
+  struct stat sb;
+  gint64 mtime;
+  gsize count;
+  gsize before;
+
+  index_path = archive_index_path (name);
+  index = g_key_file_new ();
+  if (!g_key_file_load_from_file (index, index_path, G_KEY_FILE_NONE, NULL))
+    g_debug ("%s: no archive index for %s", self->name, name);
+
+  fresh = g_key_file_new ();
+  changed = FALSE;
+  count = 0;
+
+  while ((entry = g_dir_read_name (dir)))
+    {
+      if (!g_str_has_suffix (entry, ".index"))
+        continue;
+
+      path = g_build_filename (name, entry, NULL);
+      if (stat (path, &sb) < 0)
+        {
+          g_debug ("%s: couldn't stat archive index: %s: %m", self->name, path);
+          g_free (path);
+          continue;
+        }
+
+      mtime = (gint64) sb.st_mtim.tv_sec * G_USEC_PER_SEC + sb.st_mtim.tv_nsec / 1000;
+      path[strlen(path)-strlen(".index")] = '\0';
+      base = g_path_get_basename (path);
+
+      info = g_new0 (ArchiveInfo, 1);
+      info->context = -1;
+      if (lookup_archive_index (index, base, mtime, (gint64) sb.st_size, info))
+        {
+          info->path = path;
+          path = NULL;
+        }
+      else
+        {
+          g_free (info);
+
+          /* Archives we can't read aren't indexed, and are tried again next time */
+          info = read_archive (self, path);
+          changed = TRUE;
+          if (info)
+            close_archive (info);
+        }
+
+      if (info)
+        {
+          g_key_file_set_int64 (fresh, base, "mtime", mtime);
+          g_key_file_set_int64 (fresh, base, "size", sb.st_size);
+          g_key_file_set_int64 (fresh, base, "start", info->start);
+          g_key_file_set_int64 (fresh, base, "end", info->end);
+          self->archives = g_list_prepend (self->archives, info);
+          count++;
+        }
+
+      g_free (base);
+      g_free (path);
+    }
+
+  /* Also rewrite the index when archives have been removed */
+  g_strfreev (g_key_file_get_groups (index, &before));
+  if (changed || before != count)
+    save_archive_index (self, index_path, fresh);
+
+  g_key_file_free (fresh);
+  g_key_file_free (index);
+  g_free (index_path);
 }
 
 static gint
@@ -720,25 +1328,13 @@ prepare_archives (CockpitPcpMetrics *self,
                   gint64 timestamp)
 {
   GDir *dir;
-  int count;
   GError *error = NULL;
+  ArchiveInfo *last;
 
   dir = g_dir_open (name, 0, &error);
   if (dir)
     {
-      const gchar *entry;
-      count = 0;
-      while ((entry = g_dir_read_name (dir)) && count < 200)
-        {
-          if (g_str_has_suffix (entry, ".index"))
-            {
-              gchar *path = g_build_filename (name, entry, NULL);
-              path[strlen(path)-strlen(".index")] = '\0';
-              add_archive (self, path);
-              g_free (path);
-              count += 1;
-            }
-        }
+      scan_archives (self, name, dir);
       g_dir_close (dir);
     }
   else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
@@ -762,6 +1358,10 @@ prepare_archives (CockpitPcpMetrics *self,
 
   self->archives = g_list_sort (self->archives, cmp_archive_start);
 
+  /* The newest archive may still be growing, whatever the index says */
+  last = g_list_last (self->archives)->data;
+  last->end = G_MAXINT64;
+
   self->cur_archive = self->archives;
   start_archive (self, timestamp);
   return TRUE;
@@ -777,19 +1377,30 @@ start_archive (CockpitPcpMetrics *self,
   gboolean not_found;
   int rc;
 
+  /* Skip archives that end before the requested time, without opening them */
   while (self->cur_archive && self->cur_archive->next
-         && ((ArchiveInfo *)(self->cur_archive->next->data))->start < timestamp)
+         && (((ArchiveInfo *)(self->cur_archive->next->data))->start < timestamp
+             || ((ArchiveInfo *)(self->cur_archive->data))->end < timestamp))
     self->cur_archive = self->cur_archive->next;
 
  again:
   if (self->cur_archive == NULL)
     {
+      flush_bucket (self);
+      cockpit_metrics_flush_data (COCKPIT_METRICS (self));
       cockpit_channel_close (channel, NULL);
       return;
     }
 
   info = self->cur_archive->data;
 
+  /* Archives are only opened once replay reaches them */
+  if (!open_archive (self, info))
+    {
+      self->cur_archive = self->cur_archive->next;
+      goto again;
+    }
+
   if (timestamp < info->start)
     timestamp = info->start;
 
@@ -804,7 +1415,7 @@ start_archive (CockpitPcpMetrics *self,
       return;
     }
 
-  rc = pmSetMode (PM_MODE_INTERP | PM_XTB_SET(PM_TIME_MSEC), &stamp, self->interval);
+  rc = pmSetMode (PM_MODE_INTERP | PM_XTB_SET(PM_TIME_MSEC), &stamp, self->sample_interval);
   if (rc < 0)
     {
       cockpit_channel_fail (channel, "internal-error",
@@ -817,25 +1428,34 @@ start_archive (CockpitPcpMetrics *self,
     {
       if (not_found)
         {
+          close_archive (info);
           self->cur_archive = self->cur_archive->next;
           goto again;
         }
       return;
     }
 
-  /* Make sure we send a meta message.
+  /* Make sure we send a meta message, unless continuing an open bucket.
    */
-  if (self->last)
-    pmFreeResult (self->last);
-  self->last = NULL;
+  if (self->bucket >= 0)
+    {
+      self->restarted = TRUE;
+    }
+  else
+    {
+      if (self->last)
+        pmFreeResult (self->last);
+      self->last = NULL;
+    }
 
-  g_assert (self->idler == 0);
-  self->idler = g_idle_add (on_idle_batch, self);
+  start_fetching (self, info->context);
 }
 
 static void
 next_archive (CockpitPcpMetrics *self)
 {
+  stop_fetching (self);
+  close_archive (self->cur_archive->data);
   self->cur_archive = self->cur_archive->next;
   start_archive (self, 0);
 }
@@ -883,6 +1503,7 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
   CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (channel);
   JsonObject *options;
   const gchar *source;
+  const gchar *aggregate;
   int type;
   char *name = NULL;
   gint64 timestamp;
@@ -993,8 +1614,59 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  /* "aggregate" option */
+  if (!cockpit_json_get_string (options, "aggregate", NULL, &aggregate))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"aggregate\" option", self->name);
+      goto out;
+    }
+  else if (!aggregate)
+    self->aggregate = AGGREGATE_NONE;
+  else if (g_str_equal (aggregate, "avg"))
+    self->aggregate = AGGREGATE_AVG;
+  else if (g_str_equal (aggregate, "min"))
+    self->aggregate = AGGREGATE_MIN;
+  else if (g_str_equal (aggregate, "max"))
+    self->aggregate = AGGREGATE_MAX;
+  else
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"aggregate\" value: %s", self->name, aggregate);
+      goto out;
+    }
+
+  /* "sample-interval" option */
+  if (!cockpit_json_get_int (options, "sample-interval",
+                             self->aggregate == AGGREGATE_NONE ? self->interval : MIN (self->interval, 60000),
+                             &self->sample_interval))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"sample-interval\" option", self->name);
+      goto out;
+    }
+  else if (self->sample_interval <= 0 || self->sample_interval > self->interval ||
+           (self->aggregate == AGGREGATE_NONE && self->sample_interval != self->interval))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"sample-interval\" value: %" G_GINT64_FORMAT, self->name, self->sample_interval);
+      goto out;
+    }
+
+  /* Live sources are sampled once per interval, there is nothing to aggregate */
+  if (type != PM_CONTEXT_ARCHIVE &&
+      (json_object_has_member (options, "aggregate") || json_object_has_member (options, "sample-interval")))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: \"aggregate\" and \"sample-interval\" are only supported for archives", self->name);
+      goto out;
+    }
+
+  self->origin = timestamp;
+
   if (type == PM_CONTEXT_ARCHIVE)
     {
+      g_signal_connect (self, "pressure", G_CALLBACK (on_channel_pressure), NULL);
       if (!prepare_archives (self, name, timestamp))
         goto out;
     }
@@ -1029,16 +1701,21 @@ out:
   g_free (name);
 }
 
+static void
+cockpit_pcp_metrics_close (CockpitChannel *channel,
+                           const gchar *problem)
+{
+  stop_fetching (COCKPIT_PCP_METRICS (channel));
+
+  COCKPIT_CHANNEL_CLASS (cockpit_pcp_metrics_parent_class)->close (channel, problem);
+}
+
 static void
 cockpit_pcp_metrics_dispose (GObject *object)
 {
   CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (object);
 
-  if (self->idler)
-    {
-      g_source_remove (self->idler);
-      self->idler = 0;
-    }
+  stop_fetching (self);
 
   if (self->last)
     {
@@ -1046,14 +1723,7 @@ cockpit_pcp_metrics_dispose (GObject *object)
       self->last = NULL;
     }
 
-  for (GList *a = self->archives; a; a = a->next)
-    {
-      ArchiveInfo *info = a->data;
-      if (info->context >= 0)
-        pmDestroyContext (info->context);
-      g_free (info);
-    }
-  g_list_free (self->archives);
+  g_list_free_full (self->archives, archive_info_free);
   self->archives = NULL;
 
   if (self->direct_context >= 0)
@@ -1073,6 +1743,15 @@ cockpit_pcp_metrics_finalize (GObject *object)
   g_free (self->metrics);
   g_free (self->pmidlist);
 
+  if (self->scratch)
+    g_free (self->scratch[0]);
+  g_free (self->scratch);
+  g_free (self->counts);
+  g_free (self->slots);
+
+  g_mutex_clear (&self->fetch_lock);
+  g_cond_clear (&self->fetch_cond);
+
   G_OBJECT_CLASS (cockpit_pcp_metrics_parent_class)->finalize (object);
 }
 
@@ -1087,5 +1766,6 @@ cockpit_pcp_metrics_class_init (CockpitPcpMetricsClass *klass)
   gobject_class->finalize = cockpit_pcp_metrics_finalize;
 
   channel_class->prepare = cockpit_pcp_metrics_prepare;
+  channel_class->close = cockpit_pcp_metrics_close;
   metrics_class->tick = cockpit_pcp_metrics_tick;
 }
@@ -21,6 +21,7 @@
 
 #include "cockpitpipechannel.h"
 
+#include "cockpitcoalesce.h"
 #include "cockpitconnect.h"
 
 #include "common/cockpitflow.h"
@@ -63,6 +64,8 @@ typedef struct {
   gint64 batch;
   gint64 latency;
   guint timeout;
+  gboolean adaptive;
+  CockpitCoalesce coalesce;
   gboolean pty;
 } CockpitPipeChannel;
 
@@ -123,8 +126,13 @@ process_pipe_buffer (CockpitPipeChannel *self,
       self->timeout = 0;
     }
 
+  cockpit_coalesce_clear (&self->coalesce);
+
   if (data->len)
     {
+      if (self->adaptive)
+        cockpit_coalesce_flushed (&self->coalesce, data->len);
+
       /* When array is reffed, this just clears byte array */
       g_byte_array_ref (data);
       message = g_byte_array_free_to_bytes (data);
@@ -171,16 +179,33 @@ cockpit_pipe_channel_control (CockpitChannel *channel,
 {
   CockpitPipeChannel *self = COCKPIT_PIPE_CHANNEL (channel);
   gboolean ret = TRUE;
+  JsonNode *node;
 
   /* New set of options for channel */
   if (g_str_equal (command, "options"))
     {
-      if (!cockpit_json_get_int (message, "batch", self->batch, &self->batch))
+      node = json_object_get_member (message, "batch");
+      if (node && JSON_NODE_HOLDS_VALUE (node) && json_node_get_value_type (node) == G_TYPE_STRING)
+        {
+          if (!g_str_equal (json_node_get_string (node), "auto"))
+            {
+              cockpit_channel_fail (channel, "protocol-error",
+                                    "invalid \"batch\" option for stream channel");
+              goto out;
+            }
+          self->adaptive = TRUE;
+          self->batch = 0;
+        }
+      else if (!cockpit_json_get_int (message, "batch", self->batch, &self->batch))
         {
           cockpit_channel_fail (channel, "protocol-error",
                                 "invalid \"batch\" option for stream channel");
           goto out;
         }
+      else if (node)
+        {
+          self->adaptive = FALSE;
+        }
 
       if (!cockpit_json_get_int (message, "latency", self->latency, &self->latency) ||
           self->latency < 0 || self->latency >= G_MAXUINT)
@@ -190,6 +215,8 @@ cockpit_pipe_channel_control (CockpitChannel *channel,
           goto out;
         }
 
+      self->coalesce.max_latency = self->latency;
+
       /* ignore size options if this channel is not a pty or we are in prepare() */
       if (self->pty && self->pipe)
         {
@@ -284,6 +311,10 @@ on_pipe_read (CockpitPipe *pipe,
       if (!self->timeout)
         self->timeout = g_timeout_add (self->latency, on_batch_timeout, self);
     }
+  else if (!end_of_data && self->adaptive && cockpit_coalesce_hold (&self->coalesce, data->len))
+    {
+      /* Wait for more data, we'll be called back */
+    }
   else
     {
       process_pipe_buffer (self, data);
@@ -365,6 +396,7 @@ cockpit_pipe_channel_init (CockpitPipeChannel *self)
 {
   /* Has no effect until batch is set */
   self->latency = 75;
+  cockpit_coalesce_init (&self->coalesce, self->latency, on_batch_timeout, self);
 }
 
 static gchar **
@@ -529,6 +561,8 @@ cockpit_pipe_channel_dispose (GObject *object)
       self->sig_read = self->sig_close = 0;
     }
 
+  cockpit_coalesce_clear (&self->coalesce);
+
   G_OBJECT_CLASS (cockpit_pipe_channel_parent_class)->dispose (object);
 }
 
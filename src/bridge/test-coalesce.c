@@ -0,0 +1,160 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitcoalesce.h"
+
+#include "testlib/cockpittest.h"
+
+typedef struct {
+  CockpitCoalesce coalesce;
+  guint flushes;
+} TestCase;
+
+static gint64 fake_now;
+
+static gint64
+fake_clock (void)
+{
+  return fake_now;
+}
+
+static void
+advance (gint64 msecs)
+{
+  fake_now += msecs * 1000;
+}
+
+static gboolean
+on_flush (gpointer user_data)
+{
+  TestCase *tc = user_data;
+  tc->flushes++;
+  cockpit_coalesce_flushed (&tc->coalesce, 100);
+  return FALSE;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  fake_now = G_USEC_PER_SEC;
+  cockpit_coalesce_init (&tc->coalesce, 10, on_flush, tc);
+  cockpit_coalesce_set_clock (&tc->coalesce, fake_clock);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  cockpit_coalesce_clear (&tc->coalesce);
+}
+
+static void
+test_sparse (TestCase *tc,
+             gconstpointer data)
+{
+  /* Nothing known yet, so send right away */
+  g_assert_cmpuint (cockpit_coalesce_get_batch (&tc->coalesce), ==, 0);
+  g_assert (!cockpit_coalesce_hold (&tc->coalesce, 10));
+  cockpit_coalesce_flushed (&tc->coalesce, 10);
+
+  advance (20);
+
+  /* A trickle of data is never held back */
+  g_assert (!cockpit_coalesce_hold (&tc->coalesce, 10));
+  cockpit_coalesce_flushed (&tc->coalesce, 10);
+  g_assert_cmpuint (cockpit_coalesce_get_batch (&tc->coalesce), ==, 0);
+  g_assert_cmpuint (tc->flushes, ==, 0);
+}
+
+static void
+test_grow_shrink (TestCase *tc,
+                  gconstpointer data)
+{
+  gint i;
+
+  /* Lots of data back to back, 4 KiB every millisecond */
+  for (i = 0; i < 5; i++)
+    {
+      g_assert (!cockpit_coalesce_hold (&tc->coalesce, 4096));
+      cockpit_coalesce_flushed (&tc->coalesce, 4096);
+      advance (1);
+    }
+
+  /* The estimate is still catching up with the rate */
+  g_assert_cmpuint (cockpit_coalesce_get_batch (&tc->coalesce), >, 4096);
+  g_assert_cmpuint (cockpit_coalesce_get_batch (&tc->coalesce), <, 40960);
+
+  /* Never waits for more than the largest batch, 80 KiB are expected here */
+  for (i = 0; i < 100; i++)
+    {
+      cockpit_coalesce_flushed (&tc->coalesce, 8192);
+      advance (1);
+    }
+
+  g_assert_cmpuint (cockpit_coalesce_get_batch (&tc->coalesce), ==, 64 * 1024);
+
+  /* Now small amounts are held, until the latency is up */
+  g_assert (cockpit_coalesce_hold (&tc->coalesce, 100));
+  g_assert (cockpit_coalesce_hold (&tc->coalesce, 200));
+  while (tc->flushes == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (tc->flushes, ==, 1);
+
+  /* After things quiet down, data is sent right away again */
+  advance (1000);
+  cockpit_coalesce_flushed (&tc->coalesce, 10);
+  g_assert_cmpuint (cockpit_coalesce_get_batch (&tc->coalesce), ==, 0);
+  g_assert (!cockpit_coalesce_hold (&tc->coalesce, 10));
+  g_assert_cmpuint (tc->flushes, ==, 1);
+}
+
+static void
+test_full_batch (TestCase *tc,
+                 gconstpointer data)
+{
+  gint i;
+
+  for (i = 0; i < 50; i++)
+    cockpit_coalesce_flushed (&tc->coalesce, 4096);
+
+  /* A full batch goes out right away, and stops the timeout */
+  g_assert (cockpit_coalesce_hold (&tc->coalesce, 10));
+  g_assert (!cockpit_coalesce_hold (&tc->coalesce, 64 * 1024));
+  cockpit_coalesce_flushed (&tc->coalesce, 64 * 1024);
+  g_assert_cmpuint (tc->coalesce.timeout, ==, 0);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/coalesce/sparse", TestCase, NULL,
+              setup, test_sparse, teardown);
+  g_test_add ("/coalesce/grow-shrink", TestCase, NULL,
+              setup, test_grow_shrink, teardown);
+  g_test_add ("/coalesce/full-batch", TestCase, NULL,
+              setup, test_full_batch, teardown);
+
+  return g_test_run ();
+}
@@ -31,6 +31,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #define TIMEOUT 30
@@ -109,6 +112,36 @@ setup_fsreplace_channel (TestCase *tc,
   cockpit_channel_prepare (tc->channel);
 }
 
+static void
+setup_fsreplace_full (TestCase *tc,
+                      const gchar *path,
+                      const gchar *tag,
+                      gboolean delta,
+                      const gchar *checksum)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  if (tag)
+    json_object_set_string_member (options, "tag", tag);
+  json_object_set_boolean_member (options, "delta", delta);
+  if (checksum)
+    json_object_set_string_member (options, "checksum", checksum);
+  json_object_set_string_member (options, "payload", "fsreplace1");
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSREPLACE,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
 static void
 setup_fswatch_channel (TestCase *tc,
                        const gchar *path)
@@ -119,6 +152,34 @@ setup_fswatch_channel (TestCase *tc,
   cockpit_channel_prepare (tc->channel);
 }
 
+static void
+setup_fswatch_channel_full (TestCase *tc,
+                            const gchar *path,
+                            const gchar *backend,
+                            gint64 batch)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fswatch1");
+  if (backend)
+    json_object_set_string_member (options, "backend", backend);
+  if (batch)
+    json_object_set_int_member (options, "batch", batch);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSWATCH,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
 static void
 setup_fslist_channel (TestCase *tc,
                      const gchar *path,
@@ -129,6 +190,33 @@ setup_fslist_channel (TestCase *tc,
   g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
 }
 
+static void
+setup_fslist_batch_channel (TestCase *tc,
+                            const gchar *path,
+                            gint64 batch,
+                            gboolean flow_control)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fslist1");
+  json_object_set_boolean_member (options, "watch", FALSE);
+  json_object_set_int_member (options, "batch", batch);
+  if (flow_control)
+    json_object_set_boolean_member (options, "flow-control", TRUE);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSLIST,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+}
+
 static void
 send_string (TestCase *tc,
              const gchar *str)
@@ -319,6 +407,49 @@ test_read_binary_size_hint (TestCase *tc,
   g_assert_cmpint (json_object_get_int_member (control, "size-hint"), ==, statbuf.st_size);
 }
 
+static void
+test_read_binary_large (TestCase *tc,
+                        gconstpointer unused)
+{
+  JsonObject *control;
+  GBytes *data;
+  gchar *contents;
+  gsize length;
+  guint count;
+  gchar *tag;
+  gsize i;
+
+  /* A few blocks worth, and a partial one at the end */
+  length = 3 * 512 * 1024 + 7;
+  contents = g_malloc (length);
+  for (i = 0; i < length; i++)
+    contents[i] = i % 251;
+  g_assert (g_file_set_contents (tc->test_path, contents, length, NULL));
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  setup_fsread_channel (tc, tc->test_path, TRUE);
+  wait_channel_closed (tc);
+
+  data = combine_output (tc, &count);
+  cockpit_assert_bytes_eq (data, contents, length);
+  g_assert_cmpuint (count, ==, 4);
+  g_bytes_unref (data);
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  g_assert_cmpint (json_object_get_int_member (control, "size-hint"), ==, length);
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "done");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+  g_assert_cmpstr (json_object_get_string_member (control, "tag"), ==, tag);
+
+  g_free (contents);
+  g_free (tag);
+}
+
 static void
 test_read_non_existent (TestCase *tc,
                         gconstpointer unused)
@@ -536,6 +667,120 @@ test_write_multiple (TestCase *tc,
   g_free (tag);
 }
 
+static void
+test_write_delta (TestCase *tc,
+                  gconstpointer unused)
+{
+  const gchar *expected = "Hello there world! Goodbye!";
+  gchar *checksum;
+  gchar *digest;
+  gchar *tag;
+  JsonObject *control;
+
+  set_contents (tc->test_path, "Hello world! Goodbye!");
+  tag = cockpit_get_file_tag (tc->test_path);
+  digest = g_compute_checksum_for_string (G_CHECKSUM_SHA256, expected, -1);
+  checksum = g_strconcat ("sha256:", digest, NULL);
+  g_free (digest);
+
+  setup_fsreplace_full (tc, tc->test_path, tag, TRUE, checksum);
+  send_string (tc, "copy 0 6\n");
+  send_string (tc, "data\nthere ");
+  send_string (tc, "copy 6 15\n");
+  send_done (tc);
+  g_free (checksum);
+  g_free (tag);
+
+  wait_channel_closed (tc);
+
+  assert_contents (tc->test_path, expected);
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  control = mock_transport_pop_control (tc->transport);
+  tag = cockpit_get_file_tag (tc->test_path);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+  g_assert_cmpstr (json_object_get_string_member (control, "tag"), ==, tag);
+  g_free (tag);
+}
+
+static void
+test_write_delta_checksum_fail (TestCase *tc,
+                                gconstpointer unused)
+{
+  gchar *tag;
+  JsonObject *control;
+
+  cockpit_expect_message ("*delta content doesn't match checksum");
+
+  set_contents (tc->test_path, "Hello world!");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  setup_fsreplace_full (tc, tc->test_path, tag, TRUE,
+                        "sha256:0000000000000000000000000000000000000000000000000000000000000000");
+  send_string (tc, "copy 0 5\n");
+  send_done (tc);
+  g_free (tag);
+
+  wait_channel_closed (tc);
+
+  assert_contents (tc->test_path, "Hello world!");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "problem"), ==, "change-conflict");
+}
+
+static void
+test_write_checksum_invalid (TestCase *tc,
+                             gconstpointer data)
+{
+  JsonObject *control;
+
+  cockpit_expect_log ("cockpit-protocol", G_LOG_LEVEL_MESSAGE, "1234: *: invalid \"checksum\" option*");
+
+  set_contents (tc->test_path, "Hello world!");
+
+  setup_fsreplace_full (tc, tc->test_path, NULL, FALSE, data);
+  wait_channel_closed (tc);
+
+  assert_contents (tc->test_path, "Hello world!");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "close");
+  g_assert_cmpstr (json_object_get_string_member (control, "problem"), ==, "protocol-error");
+}
+
+static void
+test_write_delta_out_of_range (TestCase *tc,
+                               gconstpointer unused)
+{
+  gchar *tag;
+  JsonObject *control;
+
+  cockpit_expect_log ("cockpit-protocol", G_LOG_LEVEL_MESSAGE, "1234: *: delta copies past the end of the file");
+
+  set_contents (tc->test_path, "Hello world!");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  setup_fsreplace_full (tc, tc->test_path, tag, TRUE, NULL);
+  send_string (tc, "copy 6 7\n");
+  g_free (tag);
+
+  wait_channel_closed (tc);
+
+  assert_contents (tc->test_path, "Hello world!");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "problem"), ==, "protocol-error");
+}
+
 static void
 test_write_remove (TestCase *tc,
                    gconstpointer unused)
@@ -837,6 +1082,164 @@ test_watch_directory (TestCase *tc,
   g_assert (saw_created && saw_deleted);
 }
 
+static JsonArray *
+recv_json_array (TestCase *tc)
+{
+  GBytes *msg = recv_bytes (tc);
+  JsonArray *array;
+  JsonNode *node;
+
+  node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+  g_assert (node != NULL);
+  g_assert_cmpint (json_node_get_node_type (node), ==, JSON_NODE_ARRAY);
+  array = json_node_dup_array (node);
+  json_node_free (node);
+  return array;
+}
+
+static void
+test_watch_batch (TestCase *tc,
+                  gconstpointer data)
+{
+  const gchar *backend = data;
+  JsonObject *event;
+  JsonArray *array;
+  gboolean saw_created = FALSE;
+  gchar *tag;
+  guint i;
+
+  setup_fswatch_channel_full (tc, tc->test_dir, backend, 200);
+
+  /* Several changes to the same file */
+  set_contents (tc->test_path, "One");
+  set_contents (tc->test_path, "Two");
+  set_contents (tc->test_path, "Three");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  array = recv_json_array (tc);
+
+  /* Each path shows up only once, with the current tag */
+  for (i = 0; i < json_array_get_length (array); i++)
+    {
+      event = json_array_get_object_element (array, i);
+      if (g_strcmp0 (json_object_get_string_member (event, "path"), tc->test_path) != 0)
+        continue;
+
+      g_assert (!saw_created);
+      g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "created");
+      g_assert_cmpstr (json_object_get_string_member (event, "tag"), ==, tag);
+      saw_created = TRUE;
+    }
+
+  g_assert (saw_created);
+  json_array_unref (array);
+  g_free (tag);
+}
+
+static void
+test_watch_inotify (TestCase *tc,
+                    gconstpointer unused)
+{
+  JsonObject *event;
+
+  /* The file doesn't exist yet */
+  setup_fswatch_channel_full (tc, tc->test_path, "inotify", 0);
+
+  set_contents (tc->test_path, "Hello!");
+  g_assert (unlink (tc->test_path) >= 0);
+
+  /* g_file_set_contents() writes a temp file and renames it in place */
+  event = recv_json (tc);
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "created");
+  g_assert_cmpstr (json_object_get_string_member (event, "path"), ==, tc->test_path);
+  json_object_unref (event);
+
+  event = recv_json (tc);
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "deleted");
+  g_assert_cmpstr (json_object_get_string_member (event, "path"), ==, tc->test_path);
+  g_assert_cmpstr (json_object_get_string_member (event, "tag"), ==, "-");
+  json_object_unref (event);
+}
+
+static void
+test_watch_inotify_gone (TestCase *tc,
+                         gconstpointer data)
+{
+  const gchar *batch = data;
+  JsonObject *control;
+  JsonObject *event;
+  JsonArray *array;
+  gchar *path;
+
+  g_assert (mkdir (tc->test_subdir, 0700) >= 0);
+  path = g_build_filename (tc->test_subdir, "file", NULL);
+  set_contents (path, "Hello!");
+
+  setup_fswatch_channel_full (tc, path, "inotify", batch ? 10 : 0);
+
+  /* The whole directory goes away, not only the file */
+  g_assert (unlink (path) >= 0);
+  g_assert (rmdir (tc->test_subdir) >= 0);
+
+  /* The file is reported gone exactly once */
+  if (batch)
+    {
+      array = recv_json_array (tc);
+      g_assert_cmpuint (json_array_get_length (array), ==, 1);
+      event = json_object_ref (json_array_get_object_element (array, 0));
+      json_array_unref (array);
+    }
+  else
+    {
+      event = recv_json (tc);
+    }
+
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "deleted");
+  g_assert_cmpstr (json_object_get_string_member (event, "path"), ==, path);
+  json_object_unref (event);
+
+  /* Then the channel closes, since the watch is gone */
+  wait_channel_closed (tc);
+  g_assert (mock_transport_pop_channel (tc->transport, "1234") == NULL);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "close");
+  g_assert (json_object_get_member (control, "problem") == NULL);
+
+  g_free (path);
+}
+
+static void
+test_watch_inotify_directory_gone (TestCase *tc,
+                              gconstpointer unused)
+{
+  JsonObject *control;
+  JsonObject *event;
+
+  g_assert (mkdir (tc->test_subdir, 0700) >= 0);
+
+  setup_fswatch_channel_full (tc, tc->test_subdir, "inotify", 0);
+
+  /* Only the directory itself is left, the mount going away looks the same */
+  g_assert (rmdir (tc->test_subdir) >= 0);
+
+  event = recv_json (tc);
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "deleted");
+  g_assert_cmpstr (json_object_get_string_member (event, "path"), ==, tc->test_subdir);
+  json_object_unref (event);
+
+  wait_channel_closed (tc);
+  g_assert (mock_transport_pop_channel (tc->transport, "1234") == NULL);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "close");
+  g_assert (json_object_get_member (control, "problem") == NULL);
+}
+
 static void
 test_dir_simple (TestCase *tc,
                  gconstpointer unused)
@@ -903,6 +1306,40 @@ test_dir_simple_no_watch (TestCase *tc,
   g_assert (json_object_get_member (control, "problem") == NULL);
 }
 
+static void
+test_dir_unknown_owner (TestCase *tc,
+                        gconstpointer unused)
+{
+  JsonObject *event;
+  const guint32 id = 54321;
+
+  if (geteuid () != 0)
+    {
+      g_test_skip ("not running as root");
+      return;
+    }
+
+  if (getpwuid (id) || getgrgid (id))
+    {
+      g_test_skip ("test uid or gid exists");
+      return;
+    }
+
+  set_contents (tc->test_path, "Hello!");
+  g_assert (chown (tc->test_path, id, id) >= 0);
+
+  setup_fslist_channel (tc, tc->test_dir, FALSE);
+
+  /* Ids without a name are sent as numbers */
+  event = recv_json (tc);
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "present");
+  g_assert_cmpstr (json_object_get_string_member (event, "owner"), ==, "54321");
+  g_assert_cmpstr (json_object_get_string_member (event, "group"), ==, "54321");
+  json_object_unref (event);
+
+  wait_channel_closed (tc);
+}
+
 static void
 test_dir_early_close (TestCase *tc,
                       gconstpointer unused)
@@ -994,6 +1431,132 @@ test_dir_watch (TestCase *tc,
   g_assert (json_object_get_member (control, "problem") == NULL);
 }
 
+static void
+test_dir_batch (TestCase *tc,
+                gconstpointer unused)
+{
+  JsonObject *event, *control;
+  JsonArray *array;
+  gchar *path;
+  guint seen = 0;
+  guint i;
+
+  g_assert (mkdir (tc->test_subdir, 0700) >= 0);
+  for (i = 0; i < 25; i++)
+    {
+      path = g_strdup_printf ("%s/file%u", tc->test_subdir, i);
+      set_contents (path, "Hello!");
+      g_free (path);
+    }
+
+  setup_fslist_batch_channel (tc, tc->test_subdir, 10, FALSE);
+
+  /* Entries arrive in arrays of at most "batch" entries */
+  while (seen < 25)
+    {
+      array = recv_json_array (tc);
+      g_assert_cmpuint (json_array_get_length (array), >, 0);
+      g_assert_cmpuint (json_array_get_length (array), <=, 10);
+      for (i = 0; i < json_array_get_length (array); i++)
+        {
+          event = json_array_get_object_element (array, i);
+          g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "present");
+          g_assert (g_str_has_prefix (json_object_get_string_member (event, "path"), "file"));
+          g_assert_cmpstr (json_object_get_string_member (event, "type"), ==, "file");
+          g_assert_cmpstr (json_object_get_string_member (event, "owner"), ==, g_get_user_name());
+          g_assert_cmpstr (json_object_get_string_member (event, "group"), !=, NULL);
+          g_assert_cmpint (json_object_get_int_member (event, "size"), ==, 6);
+          seen++;
+        }
+      json_array_unref (array);
+    }
+  g_assert_cmpuint (seen, ==, 25);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  wait_channel_closed (tc);
+
+  for (i = 0; i < 25; i++)
+    {
+      path = g_strdup_printf ("%s/file%u", tc->test_subdir, i);
+      g_assert (unlink (path) >= 0);
+      g_free (path);
+    }
+}
+
+/* Long names, so that the listing is larger than the flow control window */
+#define FLOW_FILES 8000
+#define FLOW_NAME "file%04u-xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" \
+                  "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" \
+                  "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+
+static void
+test_dir_flow_control (TestCase *tc,
+                       gconstpointer unused)
+{
+  JsonObject *control;
+  const gchar *command;
+  gboolean ready = FALSE;
+  GBytes *payload;
+  gsize received = 0;
+  guint pings = 0;
+  gint64 sequence;
+  gchar *path;
+  gchar *pong;
+  guint i;
+
+  g_assert (mkdir (tc->test_subdir, 0700) >= 0);
+  for (i = 0; i < FLOW_FILES; i++)
+    {
+      path = g_strdup_printf ("%s/" FLOW_NAME, tc->test_subdir, i);
+      set_contents (path, "");
+      g_free (path);
+    }
+
+  setup_fslist_batch_channel (tc, tc->test_subdir, 100, TRUE);
+
+  /* Answer pings like cockpit-ws does, the listing must not stall */
+  while (!tc->channel_closed)
+    {
+      g_main_context_iteration (NULL, TRUE);
+
+      while ((control = mock_transport_pop_control (tc->transport)))
+        {
+          command = json_object_get_string_member (control, "command");
+          if (g_str_equal (command, "ready"))
+            {
+              ready = TRUE;
+            }
+          else if (g_str_equal (command, "ping"))
+            {
+              g_assert (!ready);
+              pings++;
+              sequence = json_object_get_int_member (control, "sequence");
+              pong = g_strdup_printf ("{ \"command\": \"pong\", \"channel\": \"1234\", \"sequence\": %"
+                                      G_GINT64_FORMAT " }", sequence);
+              payload = g_bytes_new_take (pong, strlen (pong));
+              cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), NULL, payload);
+              g_bytes_unref (payload);
+            }
+        }
+
+      while ((payload = mock_transport_pop_channel (tc->transport, "1234")))
+        received += g_bytes_get_size (payload);
+    }
+
+  g_assert (ready);
+  g_assert_cmpuint (pings, >, 0);
+  g_assert_cmpuint (received, >, 2 * 1024 * 1024);
+
+  for (i = 0; i < FLOW_FILES; i++)
+    {
+      path = g_strdup_printf ("%s/" FLOW_NAME, tc->test_subdir, i);
+      g_assert (unlink (path) >= 0);
+      g_free (path);
+    }
+}
+
 static void
 test_dir_list_fail (TestCase *tc,
                       gconstpointer unused)
@@ -1019,6 +1582,8 @@ main (int argc,
               setup, test_read_simple, teardown);
   g_test_add ("/fsread/binary", TestCase, NULL,
               setup, test_read_binary_size_hint, teardown);
+  g_test_add ("/fsread/binary-large", TestCase, NULL,
+              setup, test_read_binary_large, teardown);
   g_test_add ("/fsread/non-existent", TestCase, NULL,
               setup, test_read_non_existent, teardown);
   g_test_add ("/fsread/denied", TestCase, NULL,
@@ -1036,6 +1601,19 @@ main (int argc,
               setup, test_write_simple, teardown);
   g_test_add ("/fsreplace/multiple", TestCase, NULL,
               setup, test_write_multiple, teardown);
+  g_test_add ("/fsreplace/delta", TestCase, NULL,
+              setup, test_write_delta, teardown);
+  g_test_add ("/fsreplace/delta-checksum-fail", TestCase, NULL,
+              setup, test_write_delta_checksum_fail, teardown);
+  g_test_add ("/fsreplace/checksum-no-prefix", TestCase,
+              "0000000000000000000000000000000000000000000000000000000000000000",
+              setup, test_write_checksum_invalid, teardown);
+  g_test_add ("/fsreplace/checksum-md5", TestCase, "md5:00000000000000000000000000000000",
+              setup, test_write_checksum_invalid, teardown);
+  g_test_add ("/fsreplace/checksum-truncated", TestCase, "sha256:0000",
+              setup, test_write_checksum_invalid, teardown);
+  g_test_add ("/fsreplace/delta-out-of-range", TestCase, NULL,
+              setup, test_write_delta_out_of_range, teardown);
   g_test_add ("/fsreplace/remove", TestCase, NULL,
               setup, test_write_remove, teardown);
   g_test_add ("/fsreplace/remove-nonexistent", TestCase, NULL,
@@ -1059,15 +1637,33 @@ main (int argc,
               setup, test_watch_remove, teardown);
   g_test_add ("/fswatch/directory", TestCase, NULL,
               setup, test_watch_directory, teardown);
+  g_test_add ("/fswatch/batch", TestCase, "gio",
+              setup, test_watch_batch, teardown);
+  g_test_add ("/fswatch/batch-inotify", TestCase, "inotify",
+              setup, test_watch_batch, teardown);
+  g_test_add ("/fswatch/inotify", TestCase, NULL,
+              setup, test_watch_inotify, teardown);
+  g_test_add ("/fswatch/inotify-gone", TestCase, NULL,
+              setup, test_watch_inotify_gone, teardown);
+  g_test_add ("/fswatch/inotify-gone-batch", TestCase, "batch",
+              setup, test_watch_inotify_gone, teardown);
+  g_test_add ("/fswatch/inotify-directory-gone", TestCase, NULL,
+              setup, test_watch_inotify_directory_gone, teardown);
 
   g_test_add ("/fslist/simple", TestCase, NULL,
               setup, test_dir_simple, teardown);
   g_test_add ("/fslist/simple_no_watch", TestCase, NULL,
               setup, test_dir_simple_no_watch, teardown);
+  g_test_add ("/fslist/unknown-owner", TestCase, NULL,
+              setup, test_dir_unknown_owner, teardown);
   g_test_add ("/fslist/early-close", TestCase, NULL,
               setup, test_dir_early_close, teardown);
   g_test_add ("/fslist/watch", TestCase, NULL,
               setup, test_dir_watch, teardown);
+  g_test_add ("/fslist/flow-control", TestCase, NULL,
+              setup, test_dir_flow_control, teardown);
+  g_test_add ("/fslist/batch", TestCase, NULL,
+              setup, test_dir_batch, teardown);
   g_test_add ("/fslist/list_fail", TestCase, NULL,
               setup, test_dir_list_fail, teardown);
 
@@ -253,6 +253,98 @@ test_http_stream2 (TestGeneral *tt,
   g_bytes_unref (data);
 }
 
+static void
+test_batch_auto (TestGeneral *tt,
+                 gconstpointer unused)
+{
+  CockpitChannel *channel;
+  GBytes *bytes;
+  JsonObject *options;
+  const gchar *control;
+  JsonObject *object;
+  gboolean closed;
+  GBytes *data;
+  guint count;
+
+  g_signal_connect (tt->web_server, "handle-resource::/", G_CALLBACK (handle_default), tt);
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", tt->port);
+  json_object_set_string_member (options, "payload", "http-stream2");
+  json_object_set_string_member (options, "method", "GET");
+  json_object_set_string_member (options, "path", "/");
+  json_object_set_string_member (options, "batch", "auto");
+  json_object_set_int_member (options, "latency", 10000);
+
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", tt->transport,
+                          "id", "444",
+                          "options", options,
+                          NULL);
+
+  json_object_unref (options);
+
+  control = "{\"command\": \"done\", \"channel\": \"444\"}";
+  bytes = g_bytes_new_static (control, strlen (control));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tt->transport), NULL, bytes);
+  g_bytes_unref (bytes);
+
+  /* Nothing is held back at the end of the response, even with a long latency */
+  closed = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_set_flag), &closed);
+  while (!closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  object = mock_transport_pop_control (tt->transport);
+  cockpit_assert_json_eq (object, "{\"command\":\"ready\",\"channel\":\"444\"}");
+  object = mock_transport_pop_control (tt->transport);
+  cockpit_assert_json_eq (object, "{\"command\":\"response\",\"channel\":\"444\",\"status\":200,\"reason\":\"OK\",\"headers\":{" STATIC_HEADERS "}}");
+
+  data = mock_transport_combine_output (tt->transport, "444", &count);
+  cockpit_assert_bytes_eq (data, "Da Da Da", -1);
+  g_assert_cmpuint (count, ==, 1);
+  g_bytes_unref (data);
+
+  g_object_unref (channel);
+}
+
+static void
+test_batch_invalid (TestGeneral *tt,
+                    gconstpointer unused)
+{
+  CockpitChannel *channel;
+  JsonObject *options;
+  JsonObject *object;
+  gboolean closed;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", tt->port);
+  json_object_set_string_member (options, "payload", "http-stream2");
+  json_object_set_string_member (options, "method", "GET");
+  json_object_set_string_member (options, "path", "/");
+  json_object_set_string_member (options, "batch", "always");
+
+  cockpit_expect_message ("*bad \"batch\" field*");
+
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", tt->transport,
+                          "id", "444",
+                          "options", options,
+                          NULL);
+
+  json_object_unref (options);
+
+  closed = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_set_flag), &closed);
+  while (!closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  object = mock_transport_pop_control (tt->transport);
+  cockpit_assert_json_eq (object, "{\"command\":\"close\",\"channel\":\"444\",\"problem\":\"protocol-error\",\"message\":\"bad \\\"batch\\\" field in HTTP stream request\"}");
+
+  g_object_unref (channel);
+}
+
 static void
 test_cannot_connect (TestGeneral *tt,
                      gconstpointer unused)
@@ -296,6 +388,257 @@ test_cannot_connect (TestGeneral *tt,
   cockpit_assert_json_eq (object, "{\"command\":\"close\",\"channel\":\"444\",\"problem\":\"not-found\"}");
 }
 
+static CockpitChannel *
+open_pooled_channel (TestGeneral *tt,
+                     const gchar *id,
+                     gint port,
+                     gboolean *closed)
+{
+  CockpitChannel *channel;
+  JsonObject *options;
+  gchar *control;
+  GBytes *bytes;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", port);
+  json_object_set_string_member (options, "payload", "http-stream2");
+  json_object_set_string_member (options, "method", "GET");
+  json_object_set_string_member (options, "path", "/");
+  json_object_set_string_member (options, "connection", "test-pool");
+  json_object_set_int_member (options, "max-active", 1);
+  json_object_set_int_member (options, "max-idle", 2);
+
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", tt->transport,
+                          "id", id,
+                          "options", options,
+                          NULL);
+
+  json_object_unref (options);
+
+  /* Tell HTTP we have no more data to send */
+  control = g_strdup_printf ("{\"command\": \"done\", \"channel\": \"%s\"}", id);
+  bytes = g_bytes_new_take (control, strlen (control));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tt->transport), NULL, bytes);
+  g_bytes_unref (bytes);
+
+  *closed = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_set_flag), closed);
+  return channel;
+}
+
+static void
+test_connection_pool (TestGeneral *tt,
+                      gconstpointer unused)
+{
+  CockpitChannel *one;
+  CockpitChannel *two;
+  gboolean closed_one;
+  gboolean closed_two;
+  JsonObject *object;
+  JsonObject *pool;
+  const gchar *command;
+  const gchar *id;
+  gint64 value;
+  GBytes *data;
+
+  g_signal_connect (tt->web_server, "handle-resource::/", G_CALLBACK (handle_default), tt);
+
+  /* The second channel has to wait for the first one's connection */
+  one = open_pooled_channel (tt, "one", tt->port, &closed_one);
+  two = open_pooled_channel (tt, "two", tt->port, &closed_two);
+
+  while (!closed_one || !closed_two)
+    g_main_context_iteration (NULL, TRUE);
+
+  pool = NULL;
+  while ((object = mock_transport_pop_control (tt->transport)))
+    {
+      g_assert (cockpit_json_get_string (object, "command", NULL, &command));
+      g_assert (cockpit_json_get_string (object, "channel", NULL, &id));
+      if (g_str_equal (command, "close"))
+        {
+          g_assert (!json_object_has_member (object, "problem"));
+          g_assert (cockpit_json_get_object (object, "pool", NULL, &pool));
+          g_assert (pool != NULL);
+          if (g_str_equal (id, "two"))
+            break;
+        }
+    }
+
+  /* Only one connection was ever made, and reused */
+  g_assert (pool != NULL);
+  g_assert (cockpit_json_get_int (pool, "opened", -1, &value));
+  g_assert_cmpint (value, ==, 1);
+  g_assert (cockpit_json_get_int (pool, "reused", -1, &value));
+  g_assert_cmpint (value, ==, 1);
+  g_assert (cockpit_json_get_int (pool, "active", -1, &value));
+  g_assert_cmpint (value, ==, 0);
+  g_assert (cockpit_json_get_int (pool, "idle", -1, &value));
+  g_assert_cmpint (value, ==, 1);
+
+  data = mock_transport_combine_output (tt->transport, "one", NULL);
+  cockpit_assert_bytes_eq (data, "Da Da Da", -1);
+  g_bytes_unref (data);
+  data = mock_transport_combine_output (tt->transport, "two", NULL);
+  cockpit_assert_bytes_eq (data, "Da Da Da", -1);
+  g_bytes_unref (data);
+
+  g_object_unref (one);
+  g_object_unref (two);
+}
+
+static void
+test_connection_pool_failed (TestGeneral *tt,
+                             gconstpointer unused)
+{
+  CockpitChannel *bad;
+  CockpitChannel *good;
+  gboolean closed_bad;
+  gboolean closed_good;
+  JsonObject *object;
+  GBytes *data;
+
+  cockpit_expect_log ("cockpit-bridge", G_LOG_LEVEL_MESSAGE, "*couldn't connect*");
+
+  g_signal_connect (tt->web_server, "handle-resource::/", G_CALLBACK (handle_default), tt);
+
+  /* The second channel waits for the slot of one that fails to connect */
+  bad = open_pooled_channel (tt, "bad", 5555, &closed_bad);
+  good = open_pooled_channel (tt, "good", tt->port, &closed_good);
+
+  /* The failed channel is still around, but no longer holds its slot */
+  while (!closed_good)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (closed_bad);
+
+  object = mock_transport_pop_control (tt->transport);
+  g_assert (object != NULL);
+  g_assert (json_object_has_member (object, "problem"));
+
+  data = mock_transport_combine_output (tt->transport, "good", NULL);
+  cockpit_assert_bytes_eq (data, "Da Da Da", -1);
+  g_bytes_unref (data);
+
+  g_object_unref (bad);
+  g_object_unref (good);
+}
+
+static gpointer
+chunked_request_server_thread (gpointer data)
+{
+  GSocket *listen_sock = data;
+  const gchar *response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+  GError *error = NULL;
+  GString *received;
+  gchar buffer[1024];
+  GSocket *sock;
+  gssize ret;
+
+  sock = g_socket_accept (listen_sock, NULL, &error);
+  g_assert_no_error (error);
+
+  received = g_string_new ("");
+  while (!g_str_has_suffix (received->str, "\r\n0\r\n\r\n"))
+    {
+      ret = g_socket_receive (sock, buffer, sizeof (buffer), NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (ret, >, 0);
+      g_string_append_len (received, buffer, ret);
+    }
+
+  ret = g_socket_send (sock, response, strlen (response), NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (ret, ==, strlen (response));
+
+  g_object_unref (sock);
+  return g_string_free (received, FALSE);
+}
+
+static void
+test_request_chunked (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  GSocketAddress *address;
+  GInetAddress *inet;
+  GSocket *listen_sock;
+  JsonObject *options;
+  GError *error = NULL;
+  const gchar *control;
+  gchar *received;
+  gboolean closed;
+  GThread *thread;
+  GBytes *bytes;
+
+  inet = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (inet, 0);
+  g_object_unref (inet);
+
+  listen_sock = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, &error);
+  g_assert_no_error (error);
+  g_socket_bind (listen_sock, address, TRUE, &error);
+  g_assert_no_error (error);
+  g_object_unref (address);
+  g_socket_listen (listen_sock, &error);
+  g_assert_no_error (error);
+
+  address = g_socket_get_local_address (listen_sock, &error);
+  g_assert_no_error (error);
+
+  thread = g_thread_new ("chunked-request", chunked_request_server_thread, listen_sock);
+
+  transport = mock_transport_new ();
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address)));
+  json_object_set_string_member (options, "payload", "http-stream2");
+  json_object_set_string_member (options, "method", "PUT");
+  json_object_set_string_member (options, "path", "/upload");
+  json_object_set_boolean_member (options, "chunked", TRUE);
+
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", transport,
+                          "id", "444",
+                          "options", options,
+                          NULL);
+
+  json_object_unref (options);
+  g_object_unref (address);
+
+  /* Each message is sent as a chunk, the empty one is skipped */
+  bytes = g_bytes_new_static ("Hello ", 6);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "444", bytes);
+  g_bytes_unref (bytes);
+  bytes = g_bytes_new_static ("", 0);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "444", bytes);
+  g_bytes_unref (bytes);
+  bytes = g_bytes_new_static ("World", 5);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "444", bytes);
+  g_bytes_unref (bytes);
+
+  control = "{\"command\": \"done\", \"channel\": \"444\"}";
+  bytes = g_bytes_new_static (control, strlen (control));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, bytes);
+  g_bytes_unref (bytes);
+
+  closed = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_set_flag), &closed);
+  while (!closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  received = g_thread_join (thread);
+  g_assert (g_str_has_prefix (received, "PUT /upload HTTP/1.1\r\n"));
+  g_assert (strstr (received, "\r\nTransfer-Encoding: chunked\r\n") != NULL);
+  g_assert (strstr (received, "Content-Length") == NULL);
+  g_assert (g_str_has_suffix (received, "\r\n\r\n6\r\nHello \r\n5\r\nWorld\r\n0\r\n\r\n"));
+  g_free (received);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+  g_object_unref (listen_sock);
+}
+
 /* -----------------------------------------------------------------------------
  * Test
  */
@@ -879,7 +1222,16 @@ main (int argc,
               setup_general, test_http_stream2, teardown_general);
   g_test_add ("/http-stream/cannot-connect", TestGeneral, NULL,
               setup_general, test_cannot_connect, teardown_general);
-
+  g_test_add ("/http-stream/batch-auto", TestGeneral, NULL,
+              setup_general, test_batch_auto, teardown_general);
+  g_test_add ("/http-stream/batch-invalid", TestGeneral, NULL,
+              setup_general, test_batch_invalid, teardown_general);
+
+  g_test_add ("/http-stream/connection-pool", TestGeneral, NULL,
+              setup_general, test_connection_pool, teardown_general);
+  g_test_add ("/http-stream/connection-pool-failed", TestGeneral, NULL,
+              setup_general, test_connection_pool_failed, teardown_general);
+  g_test_add_func  ("/http-stream/request-chunked", test_request_chunked);
   g_test_add_func  ("/http-stream/parse_keepalive", test_parse_keep_alive);
   g_test_add_func  ("/http-stream/http_chunked", test_http_chunked);
 
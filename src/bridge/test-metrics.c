@@ -75,6 +75,49 @@ mock_metrics_class_init (MockMetricsClass *self)
   /* nothing */
 }
 
+typedef struct {
+  CockpitMetrics parent;
+  GArray *ticks;
+} TickMetrics;
+
+typedef struct _CockpitMetricsClass TickMetricsClass;
+
+GType tick_metrics_get_type (void);
+
+G_DEFINE_TYPE (TickMetrics, tick_metrics, COCKPIT_TYPE_METRICS);
+
+static void
+tick_metrics_tick (CockpitMetrics *metrics,
+                   gint64 timestamp)
+{
+  TickMetrics *self = (TickMetrics *)metrics;
+  g_array_append_val (self->ticks, timestamp);
+}
+
+static void
+tick_metrics_init (TickMetrics *self)
+{
+  self->ticks = g_array_new (FALSE, FALSE, sizeof (gint64));
+}
+
+static void
+tick_metrics_finalize (GObject *object)
+{
+  TickMetrics *self = (TickMetrics *)object;
+  g_array_free (self->ticks, TRUE);
+  G_OBJECT_CLASS (tick_metrics_parent_class)->finalize (object);
+}
+
+static void
+tick_metrics_class_init (TickMetricsClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  CockpitMetricsClass *metrics_class = COCKPIT_METRICS_CLASS (klass);
+
+  gobject_class->finalize = tick_metrics_finalize;
+  metrics_class->tick = tick_metrics_tick;
+}
+
 static void
 setup (TestCase *tc,
        gconstpointer data)
@@ -599,6 +642,35 @@ test_omit_instances (void)
   g_object_unref (transport);
 }
 
+static void
+test_metronome_aligned (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  TickMetrics *channel;
+  gint64 *ticks;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  channel = g_object_new (tick_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          NULL);
+
+  cockpit_metrics_metronome (COCKPIT_METRICS (channel), 30);
+
+  while (channel->ticks->len < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* First tick happens right away, the following ones on interval boundaries */
+  ticks = (gint64 *)channel->ticks->data;
+  g_assert_cmpint (ticks[1] % 30, ==, 0);
+  g_assert_cmpint (ticks[1] - ticks[0], >=, 30);
+  g_assert_cmpint (ticks[1] - ticks[0], <, 60);
+  g_assert_cmpint (ticks[2] - ticks[1], ==, 30);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
 static void
 on_close_get_problem (CockpitChannel *channel,
                       const gchar *problem,
@@ -982,6 +1054,7 @@ main (int argc,
               setup, test_instances, teardown);
   g_test_add ("/metrics/dynamic-instances", TestCase, NULL,
               setup, test_dynamic_instances, teardown);
+  g_test_add_func ("/metrics/metronome-aligned", test_metronome_aligned);
   g_test_add_func ("/metrics/omit-instances", test_omit_instances);
 
   g_test_add_func ("/metrics/not-supported", test_not_supported);
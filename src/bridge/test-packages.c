@@ -236,6 +236,75 @@ test_simple (TestCase *tc,
   g_bytes_unref (data);
 }
 
+static const Fixture fixture_range = {
+  .path = "/test/sub/file.ext",
+  .headers = { "Range", "bytes=10-17" },
+};
+
+static void
+test_range (TestCase *tc,
+            gconstpointer fixture)
+{
+  GBytes *data;
+  JsonObject *object;
+  GError *error = NULL;
+  guint count;
+
+  g_assert (fixture == &fixture_range);
+
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  data = mock_transport_pop_channel (tc->transport, "444");
+  object = cockpit_json_parse_bytes (data, &error);
+  g_assert_no_error (error);
+  cockpit_assert_json_eq (object, "{\"status\":206,\"reason\":\"Partial Content\",\"headers\":{" STATIC_HEADERS_CACHECONTROL ",\"Content-Range\":\"bytes 10-17/50\"}}");
+  json_object_unref (object);
+
+  data = mock_transport_combine_output (tc->transport, "444", &count);
+  g_assert_cmpint (count, ==, 1);
+  cockpit_assert_bytes_eq (data, "the cont", -1);
+  g_bytes_unref (data);
+}
+
+/*
+ * package_content responses have no ETag, so an If-Range never matches
+ * here. This is why cockpit-ws checks If-Range itself and doesn't pass
+ * it along with the Range.
+ */
+static const Fixture fixture_if_range = {
+  .path = "/test/sub/file.ext",
+  .headers = { "Range", "bytes=10-17", "If-Range", "\"$abcdef\"" },
+};
+
+static void
+test_if_range (TestCase *tc,
+               gconstpointer fixture)
+{
+  GBytes *data;
+  JsonObject *object;
+  GError *error = NULL;
+  guint count;
+
+  g_assert (fixture == &fixture_if_range);
+
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  data = mock_transport_pop_channel (tc->transport, "444");
+  object = cockpit_json_parse_bytes (data, &error);
+  g_assert_no_error (error);
+  cockpit_assert_json_eq (object, "{\"status\":200,\"reason\":\"OK\",\"headers\":{" STATIC_HEADERS_CACHECONTROL "}}");
+  json_object_unref (object);
+
+  data = mock_transport_combine_output (tc->transport, "444", &count);
+  g_assert_cmpint (count, ==, 1);
+  cockpit_assert_bytes_eq (data, "These are the contents of file.ext\nOh marmalaaade\n", -1);
+  g_bytes_unref (data);
+}
+
 static const Fixture fixture_forwarded = {
   .path = "/another/test.html",
   .headers = { "X-Forwarded-Proto", "https", "X-Forwarded-Host", "blah:9090" },
@@ -1278,6 +1347,10 @@ main (int argc,
 
   g_test_add ("/packages/simple", TestCase, &fixture_simple,
               setup, test_simple, teardown);
+  g_test_add ("/packages/range", TestCase, &fixture_range,
+              setup, test_range, teardown);
+  g_test_add ("/packages/if-range", TestCase, &fixture_if_range,
+              setup, test_if_range, teardown);
   g_test_add ("/packages/forwarded", TestCase, &fixture_forwarded,
               setup, test_forwarded, teardown);
   g_test_add ("/packages/localized-translated", TestCase, &fixture_pig,
@@ -314,6 +314,63 @@ test_large (TestCase *tc,
   g_bytes_unref (options);
 }
 
+static void
+test_many (TestCase *tc,
+           gconstpointer unused)
+{
+  GError *error = NULL;
+  GBytes *payload;
+  GBytes *sent;
+  gchar *data;
+  gint i;
+
+  /* Wait until the socket has opened */
+  while (tc->conn_sock == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Lots of packets queued at once, each one should stay separate */
+  for (i = 0; i < 40; i++)
+    {
+      data = g_strdup_printf ("Packet %d", i);
+      g_assert_cmpint (g_socket_send (tc->conn_sock, data, strlen (data), NULL, &error), ==, strlen (data));
+      g_assert_no_error (error);
+      g_free (data);
+    }
+
+  while (mock_transport_count_sent (tc->transport) < 41)
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < 40; i++)
+    {
+      data = g_strdup_printf ("Packet %d", i);
+      sent = mock_transport_pop_channel (tc->transport, "548");
+      g_assert (sent != NULL);
+      cockpit_assert_bytes_eq (sent, data, strlen (data));
+      g_free (data);
+    }
+
+  /* And the same in the other direction, through the echo */
+  for (i = 0; i < 40; i++)
+    {
+      data = g_strdup_printf ("Echo %d", i);
+      payload = g_bytes_new_take (data, strlen (data));
+      cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "548", payload);
+      g_bytes_unref (payload);
+    }
+
+  while (mock_transport_count_sent (tc->transport) < 81)
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < 40; i++)
+    {
+      data = g_strdup_printf ("Echo %d", i);
+      sent = mock_transport_pop_channel (tc->transport, "548");
+      g_assert (sent != NULL);
+      cockpit_assert_bytes_eq (sent, data, strlen (data));
+      g_free (data);
+    }
+}
+
 static const Fixture fixture_connect_in_progress = { .delay_listen = TRUE };
 
 static gboolean
@@ -541,6 +598,122 @@ test_recv_valid_batched (TestCase *tc,
   g_bytes_unref (received);
 }
 
+#define FLOW_PACKET_SIZE   (64 * 1024)
+#define FLOW_PACKETS       48
+
+typedef struct {
+  GSocket *sock;
+  gint sent;
+} FlowSender;
+
+static gboolean
+on_flow_send (gpointer user_data)
+{
+  FlowSender *sender = user_data;
+  gchar buffer[FLOW_PACKET_SIZE];
+  GError *error = NULL;
+
+  memset (buffer, 'x', sizeof (buffer));
+  while (sender->sent < FLOW_PACKETS)
+    {
+      if (g_socket_send (sender->sock, buffer, sizeof (buffer), NULL, &error) < 0)
+        {
+          g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+          g_clear_error (&error);
+          return TRUE;
+        }
+      sender->sent++;
+    }
+
+  return FALSE;
+}
+
+static gsize
+count_received (TestCase *tc)
+{
+  GBytes *block;
+  gsize size = 0;
+
+  while ((block = mock_transport_pop_channel (tc->transport, "548")))
+    size += g_bytes_get_size (block);
+  return size;
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_recv_flow_control (TestCase *tc,
+                        gconstpointer unused)
+{
+  FlowSender sender = { NULL, 0 };
+  const gsize window = 2 * 1024 * 1024;
+  gboolean waited = FALSE;
+  JsonObject *options;
+  GBytes *payload;
+  gchar *pong;
+  gsize received = 0;
+  guint source;
+
+  setup (tc, NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "unix", tc->unix_path);
+  json_object_set_string_member (options, "payload", "packet");
+  json_object_set_boolean_member (options, "flow-control", TRUE);
+  tc->channel = g_object_new (COCKPIT_TYPE_PACKET_CHANNEL,
+                              "transport", tc->transport,
+                              "id", "548",
+                              "options", options,
+                              NULL);
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_closed_get_problem), &tc->channel_problem);
+  json_object_unref (options);
+
+  while (tc->conn_sock == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* More than the flow control window, as fast as the socket takes it */
+  g_socket_set_blocking (tc->conn_sock, FALSE);
+  sender.sock = tc->conn_sock;
+  source = g_timeout_add (1, on_flow_send, &sender);
+
+  while (received <= window)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      received += count_received (tc);
+    }
+
+  /* Nothing is forwarded past the packet that went over the window */
+  g_timeout_add (200, on_timeout_set_flag, &waited);
+  while (!waited)
+    g_main_context_iteration (NULL, TRUE);
+  received += count_received (tc);
+  g_assert_cmpuint (received, <=, window + FLOW_PACKET_SIZE);
+  g_assert_cmpint (sender.sent, <, FLOW_PACKETS);
+
+  /* Acknowledging everything lets the rest through */
+  pong = g_strdup_printf ("{ \"command\": \"pong\", \"channel\": \"548\", \"sequence\": %" G_GSIZE_FORMAT " }",
+                          received);
+  payload = g_bytes_new_take (pong, strlen (pong));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), NULL, payload);
+  g_bytes_unref (payload);
+
+  while (received < FLOW_PACKETS * FLOW_PACKET_SIZE)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      received += count_received (tc);
+    }
+
+  g_assert_cmpuint (received, ==, FLOW_PACKETS * FLOW_PACKET_SIZE);
+  if (sender.sent < FLOW_PACKETS)
+    g_source_remove (source);
+}
+
 static void
 test_fail_not_found (void)
 {
@@ -622,6 +795,8 @@ main (int argc,
               setup_channel, test_echo, teardown);
   g_test_add ("/packet-channel/large", TestCase, NULL,
               setup_channel, test_large, teardown);
+  g_test_add ("/packet-channel/many", TestCase, NULL,
+              setup_channel, test_many, teardown);
   g_test_add ("/packet-channel/connect-in-progress",
               TestCase, &fixture_connect_in_progress,
               setup_channel, test_connect_in_progress, teardown);
@@ -637,6 +812,8 @@ main (int argc,
               setup_channel, test_recv_invalid, teardown);
   g_test_add ("/packet-channel/valid-recv-batched", TestCase, NULL,
               setup_channel, test_recv_valid_batched, teardown);
+  g_test_add ("/packet-channel/valid-recv-flow-control", TestCase, NULL,
+              NULL, test_recv_flow_control, teardown);
 
   g_test_add_func ("/packet-channel/fail/not-found", test_fail_not_found);
   g_test_add_func ("/packet-channel/fail/access-denied", test_fail_access_denied);
@@ -39,7 +39,7 @@
 static void
 init_mock_archives (void)
 {
-  g_assert (system ("rm -rf mock-archives && mkdir mock-archives") == 0);
+  g_assert (system ("rm -rf mock-archives mock-cache && mkdir mock-archives") == 0);
 
   g_assert (pmiStart ("mock-archives/0", 0) >= 0);
   g_assert (pmiAddMetric ("mock.value", PM_ID_NULL,
@@ -279,6 +279,71 @@ test_metrics_archive_limit (TestCase *tc,
   json_object_unref (options);
 }
 
+static void
+test_metrics_archive_aggregate (TestCase *tc,
+                                gconstpointer data)
+{
+  const gchar *aggregate = ((const gchar **)data)[0];
+  const gchar *expected = ((const gchar **)data)[1];
+  JsonObject *options = json_obj("{ \"source\": \"" BUILDDIR "/mock-archives/0\","
+                                 "  \"metrics\": [ { \"name\": \"mock.value\" } ],"
+                                 "  \"interval\": 2000,"
+                                 "  \"sample-interval\": 1000"
+                                 "}");
+
+  json_object_set_string_member (options, "aggregate", aggregate);
+  setup_metrics_channel_json (tc, options);
+
+  JsonObject *meta = recv_json_object (tc);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), ==, 0);
+  g_assert_cmpint (json_object_get_int_member (meta, "interval"), ==, 2000);
+
+  /* Samples at 0s and 1s make up the first bucket, 2s the second */
+  assert_sample (tc, expected);
+
+  json_object_unref (options);
+}
+
+static void
+test_metrics_archive_aggregate_invalid (TestCase *tc,
+                                        gconstpointer unused)
+{
+  cockpit_expect_log ("cockpit-protocol", G_LOG_LEVEL_MESSAGE,
+                      "1234: *: invalid \"aggregate\" value: median");
+
+  JsonObject *options = json_obj("{ \"source\": \"" BUILDDIR "/mock-archives/0\","
+                                 "  \"metrics\": [ { \"name\": \"mock.value\" } ],"
+                                 "  \"aggregate\": \"median\""
+                                 "}");
+
+  setup_metrics_channel_json (tc, options);
+  while (!tc->channel_closed)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, "protocol-error");
+
+  json_object_unref (options);
+}
+
+static void
+test_metrics_archive_close_early (TestCase *tc,
+                                  gconstpointer unused)
+{
+  JsonObject *options = json_obj("{ \"source\": \"" BUILDDIR "/mock-archives/0\","
+                                 "  \"metrics\": [ { \"name\": \"mock.value\" } ],"
+                                 "  \"interval\": 1"
+                                 "}");
+
+  setup_metrics_channel_json (tc, options);
+  recv_json_object (tc);
+
+  /* Samples are fetched in a thread, which must go away with the channel */
+  cockpit_channel_close (tc->channel, NULL);
+  g_assert (tc->channel_closed);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  json_object_unref (options);
+}
+
 static void
 test_metrics_archive_timestamp (TestCase *tc,
                                 gconstpointer unused)
@@ -363,6 +428,35 @@ test_metrics_archive_directory (TestCase *tc,
   json_object_unref (options);
 }
 
+static void
+test_metrics_archive_directory_aggregate (TestCase *tc,
+                                          gconstpointer unused)
+{
+  expect_broken_archive_warning();
+
+  JsonObject *meta;
+  JsonObject *options = json_obj("{ \"source\": \"" BUILDDIR "/mock-archives\","
+                                 "  \"metrics\": [ { \"name\": \"mock.value\" } ],"
+                                 "  \"interval\": 4000,"
+                                 "  \"sample-interval\": 1000,"
+                                 "  \"aggregate\": \"max\""
+                                 "}");
+
+  setup_metrics_channel_json (tc, options);
+
+  meta = recv_json_object (tc);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), ==, 0);
+
+  /* The first bucket spans both archives, and is only sent once */
+  assert_sample (tc, "[[13],[15]]");
+
+  while (!tc->channel_closed)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  json_object_unref (options);
+}
+
 static void
 test_metrics_archive_directory_timestamp (TestCase *tc,
                                           gconstpointer unused)
@@ -409,10 +503,57 @@ test_metrics_archive_directory_late_metric (TestCase *tc,
   json_object_unref (options);
 }
 
+static void
+test_metrics_archive_index (TestCase *tc,
+                            gconstpointer unused)
+{
+  expect_broken_archive_warning();
+
+  GError *error = NULL;
+  GKeyFile *index;
+  gchar *checksum;
+  gchar *path;
+
+  JsonObject *options = json_obj("{ \"source\": \"" BUILDDIR "/mock-archives\","
+                                 "  \"metrics\": [ { \"name\": \"mock.value\" } ],"
+                                 "  \"interval\": 1000,"
+                                 "  \"timestamp\": 4000"
+                                 "}");
+
+  setup_metrics_channel_json (tc, options);
+  recv_json_object (tc);
+  assert_sample (tc, "[[14],[15]]");
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, BUILDDIR "/mock-archives", -1);
+  path = g_strdup_printf (BUILDDIR "/mock-cache/cockpit/pcp/%s.archives", checksum);
+
+  /* Readable archives are indexed with their time range, broken ones are not */
+  index = g_key_file_new ();
+  g_key_file_load_from_file (index, path, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_key_file_get_int64 (index, "0", "start", NULL), ==, 0);
+  g_assert_cmpint (g_key_file_get_int64 (index, "0", "end", NULL), ==, 2000);
+  g_assert_cmpint (g_key_file_get_int64 (index, "1", "start", NULL), ==, 3000);
+  g_assert_cmpint (g_key_file_get_int64 (index, "1", "end", NULL), ==, 5000);
+  g_assert (!g_key_file_has_group (index, "2"));
+
+  g_key_file_free (index);
+  g_free (checksum);
+  g_free (path);
+  json_object_unref (options);
+}
+
+static const gchar *aggregate_avg[] = { "avg", "[[10.5],[12]]" };
+static const gchar *aggregate_min[] = { "min", "[[10],[12]]" };
+static const gchar *aggregate_max[] = { "max", "[[11],[12]]" };
+
 int
 main (int argc,
       char *argv[])
 {
+  /* Keep the archive index out of the real cache directory */
+  g_setenv ("XDG_CACHE_HOME", BUILDDIR "/mock-cache", TRUE);
+
   cockpit_test_init (&argc, &argv);
 
   if (chdir (BUILDDIR) < 0)
@@ -424,16 +565,30 @@ main (int argc,
               setup, test_metrics_single_archive, teardown);
   g_test_add ("/metrics/archive-limit", TestCase, NULL,
               setup, test_metrics_archive_limit, teardown);
+  g_test_add ("/metrics/archive-aggregate-avg", TestCase, aggregate_avg,
+              setup, test_metrics_archive_aggregate, teardown);
+  g_test_add ("/metrics/archive-aggregate-min", TestCase, aggregate_min,
+              setup, test_metrics_archive_aggregate, teardown);
+  g_test_add ("/metrics/archive-aggregate-max", TestCase, aggregate_max,
+              setup, test_metrics_archive_aggregate, teardown);
+  g_test_add ("/metrics/archive-aggregate-invalid", TestCase, NULL,
+              setup, test_metrics_archive_aggregate_invalid, teardown);
+  g_test_add ("/metrics/archive-close-early", TestCase, NULL,
+              setup, test_metrics_archive_close_early, teardown);
   g_test_add ("/metrics/archive-timestamp", TestCase, NULL,
               setup, test_metrics_archive_timestamp, teardown);
   g_test_add ("/metrics/archive-timestamp-now", TestCase, NULL,
               setup, test_metrics_archive_timestamp_now, teardown);
   g_test_add ("/metrics/archive-directory", TestCase, NULL,
               setup, test_metrics_archive_directory, teardown);
+  g_test_add ("/metrics/archive-directory-aggregate", TestCase, NULL,
+              setup, test_metrics_archive_directory_aggregate, teardown);
   g_test_add ("/metrics/archive-directory-timestamp", TestCase, NULL,
               setup, test_metrics_archive_directory_timestamp, teardown);
   g_test_add ("/metrics/archive-directory-late-metric", TestCase, NULL,
               setup, test_metrics_archive_directory_late_metric, teardown);
+  g_test_add ("/metrics/archive-index", TestCase, NULL,
+              setup, test_metrics_archive_index, teardown);
 
   return g_test_run ();
 }
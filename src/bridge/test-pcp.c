@@ -316,6 +316,26 @@ test_metrics_units_noconv (TestCase *tc,
   json_object_unref (options);
 }
 
+static void
+test_metrics_aggregate_live (TestCase *tc,
+                             gconstpointer unused)
+{
+  cockpit_expect_log ("cockpit-protocol", G_LOG_LEVEL_MESSAGE,
+                      "1234: direct: \"aggregate\" and \"sample-interval\" are only supported for archives");
+
+  JsonObject *options = json_obj("{ \"source\": \"direct\","
+                                 "  \"metrics\": [ { \"name\": \"mock.value\" } ],"
+                                 "  \"interval\": 1000,"
+                                 "  \"aggregate\": \"avg\""
+                                 "}");
+  setup_metrics_channel_json (tc, options);
+
+  wait_channel_closed (tc);
+  g_assert_cmpstr (tc->problem, ==, "protocol-error");
+
+  json_object_unref (options);
+}
+
 static void
 test_metrics_units_funny_conv (TestCase *tc,
                                gconstpointer unused)
@@ -613,6 +633,9 @@ main (int argc,
   g_test_add ("/metrics/units-funny-conv", TestCase, NULL,
               setup, test_metrics_units_funny_conv, teardown);
 
+  g_test_add ("/metrics/aggregate-live", TestCase, NULL,
+              setup, test_metrics_aggregate_live, teardown);
+
   g_test_add ("/metrics/strings", TestCase, NULL,
               setup, test_metrics_strings, teardown);
 
@@ -82,6 +82,9 @@ typedef struct {
     JsonObject *open_options;
     gchar **capabilities;
 
+    /* The main context our idle and timeout sources run in */
+    GMainContext *context;
+
     /* Queued messages before channel is ready */
     gboolean prepared;
     guint prepare_tag;
@@ -155,6 +158,38 @@ cockpit_channel_init (CockpitChannel *self)
 
   priv->out_sequence = 0;
   priv->out_window = CHANNEL_FLOW_WINDOW;
+  priv->context = g_main_context_ref_thread_default ();
+}
+
+/*
+ * Channels can run in a thread other than the main one, so their
+ * sources go into the context they were created in, rather than
+ * the global default one that g_idle_add() and friends use.
+ */
+static guint
+attach_source (CockpitChannel *self,
+               GSource *source,
+               GSourceFunc func)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  guint tag;
+
+  g_source_set_callback (source, func, self, NULL);
+  tag = g_source_attach (source, priv->context);
+  g_source_unref (source);
+  return tag;
+}
+
+static void
+remove_source (CockpitChannel *self,
+               guint tag)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  GSource *source;
+
+  source = g_main_context_find_source_by_id (priv->context, tag);
+  if (source)
+    g_source_destroy (source);
 }
 
 static void
@@ -400,7 +435,7 @@ flush_buffer (gpointer user_data)
       g_bytes_unref (priv->out_buffer);
       priv->out_buffer = NULL;
       if (priv->buffer_timeout)
-          g_source_remove(priv->buffer_timeout);
+          remove_source (self, priv->buffer_timeout);
       priv->buffer_timeout = 0;
 
       cockpit_channel_actual_send (self, payload, FALSE);
@@ -415,6 +450,7 @@ cockpit_channel_constructed (GObject *object)
 {
   CockpitChannel *self = COCKPIT_CHANNEL (object);
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  GSource *source;
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->constructed (object);
 
@@ -431,7 +467,9 @@ cockpit_channel_constructed (GObject *object)
 
   /* Freeze this channel's messages until ready */
   cockpit_transport_freeze (priv->transport, priv->id);
-  priv->prepare_tag = g_idle_add_full (G_PRIORITY_HIGH, on_idle_prepare, self, NULL);
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_HIGH);
+  priv->prepare_tag = attach_source (self, source, on_idle_prepare);
 }
 
 static gboolean
@@ -599,7 +637,7 @@ cockpit_channel_dispose (GObject *object)
    */
   if (priv->prepare_tag)
     {
-      g_source_remove (priv->prepare_tag);
+      remove_source (self, priv->prepare_tag);
       priv->prepare_tag = 0;
     }
 
@@ -619,7 +657,7 @@ cockpit_channel_dispose (GObject *object)
     cockpit_channel_close (self, "terminated");
 
   if (priv->buffer_timeout)
-    g_source_remove(priv->buffer_timeout);
+    remove_source (self, priv->buffer_timeout);
   priv->buffer_timeout = 0;
 
   if (priv->out_buffer)
@@ -649,6 +687,7 @@ cockpit_channel_finalize (GObject *object)
 
   g_strfreev (priv->capabilities);
   g_free (priv->id);
+  g_main_context_unref (priv->context);
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->finalize (object);
 }
@@ -900,7 +939,7 @@ cockpit_channel_send (CockpitChannel *self,
   GByteArray *combined;
 
   if (priv->buffer_timeout)
-    g_source_remove(priv->buffer_timeout);
+    remove_source (self, priv->buffer_timeout);
   priv->buffer_timeout = 0;
 
   if (priv->out_buffer)
@@ -920,7 +959,7 @@ cockpit_channel_send (CockpitChannel *self,
       if (cockpit_unicode_has_incomplete_ending (send_data))
         {
           priv->out_buffer = g_bytes_ref (send_data);
-          priv->buffer_timeout = g_timeout_add (500, flush_buffer, self);
+          priv->buffer_timeout = attach_source (self, g_timeout_source_new (500), flush_buffer);
         }
     }
 
@@ -1024,7 +1063,7 @@ cockpit_channel_prepare (CockpitChannel *self)
 
   if (priv->prepare_tag)
     {
-      g_source_remove (priv->prepare_tag);
+      remove_source (self, priv->prepare_tag);
       priv->prepare_tag = 0;
     }
 
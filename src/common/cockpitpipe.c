@@ -33,6 +33,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <pty.h>
 #include <stdio.h>
@@ -63,6 +64,71 @@
  */
 
 #define DEF_PACKET_SIZE  (64UL * 1024UL)
+#define MAX_PACKET_SIZE  (1024UL * 1024UL)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * The output queue is a ring of GBytes, which grows as needed
+ * but never shrinks. This avoids allocating a list node for each
+ * block, and is walked in order to fill a writev().
+ */
+typedef struct {
+  GBytes **blocks;
+  guint size;
+  guint head;
+  guint length;
+} OutputRing;
+
+static void
+output_ring_push (OutputRing *ring,
+                  GBytes *block)
+{
+  guint size;
+  guint i;
+
+  if (ring->length == ring->size)
+    {
+      size = MAX (ring->size * 2, 16);
+      ring->blocks = g_renew (GBytes *, ring->blocks, size);
+
+      /* Move the wrapped part of the ring up into the new space */
+      for (i = 0; i < ring->head; i++)
+        ring->blocks[ring->size + i] = ring->blocks[i];
+
+      ring->size = size;
+    }
+
+  ring->blocks[(ring->head + ring->length) % ring->size] = block;
+  ring->length++;
+}
+
+static inline GBytes *
+output_ring_peek (OutputRing *ring,
+                  guint index)
+{
+  g_assert (index < ring->length);
+  return ring->blocks[(ring->head + index) % ring->size];
+}
+
+static GBytes *
+output_ring_pop (OutputRing *ring)
+{
+  GBytes *block;
+
+  if (ring->length == 0)
+    return NULL;
+
+  block = ring->blocks[ring->head];
+  ring->head = (ring->head + 1) % ring->size;
+  ring->length--;
+  if (ring->length == 0)
+    ring->head = 0;
+
+  return block;
+}
 
 enum {
   PROP_0,
@@ -93,7 +159,7 @@ typedef struct {
   int out_fd;
   gboolean out_done;
   GSource *out_source;
-  GQueue *out_queue;
+  OutputRing out_queue;
   gsize out_queued;
   gsize out_partial;
 
@@ -154,7 +220,6 @@ cockpit_pipe_init (CockpitPipe *self)
 
   priv->in_buffer = g_byte_array_new ();
   priv->in_fd = -1;
-  priv->out_queue = g_queue_new ();
   priv->out_fd = -1;
   priv->err_fd = -1;
   priv->status = -1;
@@ -316,12 +381,16 @@ dispatch_input (gint fd,
   CockpitPipe *self = (CockpitPipe *)user_data;
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
   gssize ret = 0;
+  gsize size;
   gsize len;
   int errn;
 
   g_return_val_if_fail (priv->in_source, FALSE);
   len = priv->in_buffer->len;
 
+  /* Read in larger blocks while a large message is incomplete */
+  size = CLAMP (len, DEF_PACKET_SIZE, MAX_PACKET_SIZE);
+
   /*
    * Enable clean shutdown by not reading when we just get
    * G_IO_HUP. Note that when we get G_IO_ERR we do want to read
@@ -329,9 +398,9 @@ dispatch_input (gint fd,
    */
   if (cond != G_IO_HUP)
     {
-      g_byte_array_set_size (priv->in_buffer, len + DEF_PACKET_SIZE);
+      g_byte_array_set_size (priv->in_buffer, len + size);
       g_debug ("%s: reading input %x", priv->name, cond);
-      ret = read (priv->in_fd, priv->in_buffer->data + len, DEF_PACKET_SIZE);
+      ret = read (priv->in_fd, priv->in_buffer->data + len, size);
 
       errn = errno;
       if (ret < 0)
@@ -578,12 +647,11 @@ dispatch_output (gint fd,
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
-  struct iovec iov[4];
-  gsize partial, size, before;
+  struct iovec iov[IOV_MAX];
+  gsize size, before;
   GBytes *popped;
   gssize ret;
   gint i, count;
-  GList *l;
 
   /* A non-blocking connect is processed here */
   if (priv->connecting && !dispatch_connect (self))
@@ -594,22 +662,16 @@ dispatch_output (gint fd,
   before = priv->out_queued;
 
   /* Note we fall through when nothing to write */
-  partial = priv->out_partial;
-  for (l = priv->out_queue->head, i = 0;
-      i < G_N_ELEMENTS (iov) && l != NULL;
-      i++, l = g_list_next (l))
-    {
-      iov[i].iov_base = (gpointer)g_bytes_get_data (l->data, &iov[i].iov_len);
+  count = MIN (priv->out_queue.length, G_N_ELEMENTS (iov));
+  for (i = 0; i < count; i++)
+    iov[i].iov_base = (gpointer)g_bytes_get_data (output_ring_peek (&priv->out_queue, i), &iov[i].iov_len);
 
-      if (partial)
-        {
-          g_assert (partial < iov[i].iov_len);
-          iov[i].iov_len -= partial;
-          iov[i].iov_base = ((gchar *)iov[i].iov_base) + partial;
-          partial = 0;
-        }
+  if (count > 0 && priv->out_partial)
+    {
+      g_assert (priv->out_partial < iov[0].iov_len);
+      iov[0].iov_len -= priv->out_partial;
+      iov[0].iov_base = ((gchar *)iov[0].iov_base) + priv->out_partial;
     }
-  count = i;
 
   if (count == 0)
     ret = 0;
@@ -633,13 +695,14 @@ dispatch_output (gint fd,
       return FALSE;
     }
 
+  g_debug ("%s: wrote %d bytes from %d blocks", priv->name, (int)ret, count);
+
   /* Figure out what was written */
   for (i = 0; ret > 0 && i < count; i++)
     {
       if (ret >= iov[i].iov_len)
         {
-          g_debug ("%s: wrote %d bytes", priv->name, (int)iov[i].iov_len);
-          popped = g_queue_pop_head (priv->out_queue);
+          popped = output_ring_pop (&priv->out_queue);
           size = g_bytes_get_size (popped);
           g_assert (size <= priv->out_queued);
           priv->out_queued -= size;
@@ -666,7 +729,7 @@ dispatch_output (gint fd,
       cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
     }
 
-  if (priv->out_queue->head)
+  if (priv->out_queue.length)
     return TRUE;
 
   g_debug ("%s: output queue empty", priv->name);
@@ -706,6 +769,35 @@ start_input (CockpitPipe *self)
   g_source_attach (priv->in_source, priv->context);
 }
 
+static void
+start_error (CockpitPipe *self)
+{
+  CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
+
+  g_assert (priv->err_source == NULL);
+  priv->err_source = g_unix_fd_source_new (priv->err_fd, G_IO_IN);
+  g_source_set_name (priv->err_source, "pipe-error");
+  g_source_set_callback (priv->err_source, (GSourceFunc)dispatch_error, self, NULL);
+  g_source_attach (priv->err_source, priv->context);
+}
+
+static void
+start_child_watch (CockpitPipe *self)
+{
+  CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
+
+  g_assert (priv->child == NULL);
+
+  /* We may need this watch to outlast this process ... */
+  priv->watch_arg = g_new0 (CockpitPipe *, 1);
+  *(priv->watch_arg) = self;
+
+  priv->child = g_child_watch_source_new (priv->pid);
+  g_source_set_callback (priv->child, (GSourceFunc)on_child_reap,
+                         priv->watch_arg, g_free);
+  g_source_attach (priv->child, priv->context);
+}
+
 static void
 cockpit_pipe_constructed (GObject *object)
 {
@@ -759,10 +851,7 @@ cockpit_pipe_constructed (GObject *object)
         }
 
       priv->err_buffer = g_byte_array_new ();
-      priv->err_source = g_unix_fd_source_new (priv->err_fd, G_IO_IN);
-      g_source_set_name (priv->err_source, "pipe-error");
-      g_source_set_callback (priv->err_source, (GSourceFunc)dispatch_error, self, NULL);
-      g_source_attach (priv->err_source, priv->context);
+      start_error (self);
     }
   else
     {
@@ -772,15 +861,7 @@ cockpit_pipe_constructed (GObject *object)
   if (priv->pid)
     {
       priv->is_process = TRUE;
-
-      /* We may need this watch to outlast this process ... */
-      priv->watch_arg = g_new0 (CockpitPipe *, 1);
-      *(priv->watch_arg) = self;
-
-      priv->child = g_child_watch_source_new (priv->pid);
-      g_source_set_callback (priv->child, (GSourceFunc)on_child_reap,
-                             priv->watch_arg, g_free);
-      g_source_attach (priv->child, priv->context);
+      start_child_watch (self);
     }
 }
 
@@ -874,8 +955,8 @@ cockpit_pipe_dispose (GObject *object)
   cockpit_pipe_throttle (COCKPIT_FLOW (self), NULL);
   g_assert (priv->pressure == NULL);
 
-  while (priv->out_queue->head)
-    g_bytes_unref (g_queue_pop_head (priv->out_queue));
+  while (priv->out_queue.length)
+    g_bytes_unref (output_ring_pop (&priv->out_queue));
   priv->out_queued = 0;
 
   G_OBJECT_CLASS (cockpit_pipe_parent_class)->dispose (object);
@@ -905,7 +986,7 @@ cockpit_pipe_finalize (GObject *object)
   g_byte_array_unref (priv->in_buffer);
   if (priv->err_buffer)
     g_byte_array_unref (priv->err_buffer);
-  g_queue_free (priv->out_queue);
+  g_free (priv->out_queue.blocks);
   g_free (priv->problem);
   g_free (priv->name);
 
@@ -1084,7 +1165,7 @@ _cockpit_pipe_write (CockpitPipe *self,
   before = priv->out_queued;
   g_return_if_fail (G_MAXSIZE - size > priv->out_queued);
   priv->out_queued += size;
-  g_queue_push_tail (priv->out_queue, g_bytes_ref (data));
+  output_ring_push (&priv->out_queue, g_bytes_ref (data));
 
   /*
    * If we have too much data queued, and are controlling another flow
@@ -1132,7 +1213,7 @@ cockpit_pipe_close (CockpitPipe *self,
 
   if (problem)
       close_immediately (self, problem);
-  else if (g_queue_is_empty (priv->out_queue))
+  else if (priv->out_queue.length == 0)
     close_output (self);
   else
     g_debug ("%s: pipe closing when output queue empty", priv->name);
@@ -1148,10 +1229,11 @@ on_later_close (gpointer user_data)
 static void
 cockpit_close_later (CockpitPipe *self)
 {
+  CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
   GSource *source = g_idle_source_new ();
   g_source_set_priority (source, G_PRIORITY_HIGH);
   g_source_set_callback (source, on_later_close, g_object_ref (self), g_object_unref);
-  g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_attach (source, priv->context);
   g_source_unref (source);
 }
 
@@ -1492,6 +1574,60 @@ cockpit_pipe_is_closed (CockpitPipe *self)
   return priv->closed;
 }
 
+/**
+ * cockpit_pipe_set_context:
+ * @self: a pipe
+ * @context: the main context to move to
+ *
+ * Move all the sources of this pipe to another main context,
+ * including the watch on the child process. From then on the
+ * pipe must only be used from the thread that runs @context.
+ *
+ * This must be called from the thread that currently runs the
+ * pipe, and never from within one of its signal handlers.
+ */
+void
+cockpit_pipe_set_context (CockpitPipe *self,
+                          GMainContext *context)
+{
+  CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
+
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+  g_return_if_fail (context != NULL);
+
+  if (context == priv->context)
+    return;
+
+  g_main_context_unref (priv->context);
+  priv->context = g_main_context_ref (context);
+
+  if (priv->in_source)
+    {
+      stop_input (self);
+      start_input (self);
+    }
+  if (priv->out_source)
+    {
+      stop_output (self);
+      start_output (self);
+    }
+  if (priv->err_source)
+    {
+      stop_error (self);
+      start_error (self);
+    }
+
+  /* Destroying the old watch frees its watch_arg */
+  if (priv->child)
+    {
+      g_source_destroy (priv->child);
+      g_source_unref (priv->child);
+      priv->child = NULL;
+      priv->watch_arg = NULL;
+      start_child_watch (self);
+    }
+}
+
 /**
  * cockpit_pipe_get_name:
  * @self: a pipe
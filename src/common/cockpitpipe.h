@@ -81,6 +81,9 @@ void               cockpit_pipe_close        (CockpitPipe *self,
 
 gint               cockpit_pipe_exit_status  (CockpitPipe *self);
 
+void               cockpit_pipe_set_context  (CockpitPipe *self,
+                                              GMainContext *context);
+
 const gchar *      cockpit_pipe_get_name     (CockpitPipe *self);
 
 GByteArray *       cockpit_pipe_get_buffer   (CockpitPipe *self);
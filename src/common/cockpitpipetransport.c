@@ -50,8 +50,22 @@ struct _CockpitPipeTransport {
   gboolean closed;
   gulong read_sig;
   gulong close_sig;
+
+  /* Frame prefixes are formatted into this block and sliced off */
+  GBytes *prefixes;
+  guint8 *prefixes_data;
+  gsize prefixes_used;
 };
 
+/* Size of a block of frame prefixes, shared by many messages */
+#define PREFIX_BLOCK_SIZE  (16UL * 1024UL)
+
+/*
+ * Frames smaller than this are copied out of the input block, so
+ * that a small message held on to doesn't keep the whole block alive.
+ */
+#define MIN_SLICE_SIZE  (16UL * 1024UL)
+
 enum {
     PROP_0,
     PROP_NAME,
@@ -212,10 +226,50 @@ cockpit_pipe_transport_finalize (GObject *object)
 
   g_free (self->name);
   g_clear_object (&self->pipe);
+  if (self->prefixes)
+    g_bytes_unref (self->prefixes);
 
   G_OBJECT_CLASS (cockpit_pipe_transport_parent_class)->finalize (object);
 }
 
+static GBytes *
+build_frame_prefix (CockpitPipeTransport *self,
+                    const gchar *channel_id,
+                    gsize channel_len,
+                    gsize length)
+{
+  gsize needed;
+  gint ret;
+
+  /* Length, channel and two newlines. Large prefixes get their own block */
+  needed = 20 + 2 + channel_len + 1;
+  if (needed > PREFIX_BLOCK_SIZE / 4)
+    {
+      gchar *prefix = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n", length, channel_id ? channel_id : "");
+      return g_bytes_new_take (prefix, strlen (prefix));
+    }
+
+  /*
+   * The unused tail of the block has never been handed out, so it's
+   * fine to write into it while earlier slices are still referenced.
+   */
+  if (!self->prefixes || PREFIX_BLOCK_SIZE - self->prefixes_used < needed)
+    {
+      if (self->prefixes)
+        g_bytes_unref (self->prefixes);
+      self->prefixes_data = g_malloc (PREFIX_BLOCK_SIZE);
+      self->prefixes = g_bytes_new_take (self->prefixes_data, PREFIX_BLOCK_SIZE);
+      self->prefixes_used = 0;
+    }
+
+  ret = g_snprintf ((gchar *)self->prefixes_data + self->prefixes_used, needed,
+                    "%" G_GSIZE_FORMAT "\n%s\n", length, channel_id ? channel_id : "");
+  g_assert (ret > 0 && (gsize)ret < needed);
+
+  self->prefixes_used += ret;
+  return g_bytes_new_from_bytes (self->prefixes, self->prefixes_used - ret, ret);
+}
+
 static void
 cockpit_pipe_transport_send (CockpitTransport *transport,
                              const gchar *channel_id,
@@ -223,7 +277,6 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
   GBytes *prefix;
-  gchar *prefix_str;
   gsize payload_len;
   gsize channel_len;
 
@@ -236,10 +289,7 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
   channel_len = channel_id ? strlen (channel_id) : 0;
   payload_len = g_bytes_get_size (payload);
 
-  prefix_str = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
-                                channel_len + 1 + payload_len,
-                                channel_id ? channel_id : "");
-  prefix = g_bytes_new_take (prefix_str, strlen (prefix_str));
+  prefix = build_frame_prefix (self, channel_id, channel_len, channel_len + 1 + payload_len);
 
   cockpit_pipe_write (self->pipe, prefix);
   cockpit_pipe_write (self->pipe, payload);
@@ -327,12 +377,48 @@ cockpit_pipe_transport_get_pipe (CockpitPipeTransport *self)
   return self->pipe;
 }
 
+/*
+ * Take @length bytes of complete frames from the front of @input
+ * as a single block. Whichever part of the buffer is smaller is
+ * copied: either the frames, or the partial frame that remains.
+ */
+static GBytes *
+take_input_block (GByteArray *input,
+                  gsize length)
+{
+  GBytes *block;
+  guint8 *buf;
+  gsize total;
+
+  total = input->len;
+  if (length >= total - length)
+    {
+      /* When array is reffed, this just clears byte array */
+      g_byte_array_ref (input);
+      buf = g_byte_array_free (input, FALSE);
+      g_byte_array_append (input, buf + length, total - length);
+      block = g_bytes_new_take (buf, length);
+    }
+  else
+    {
+      block = g_bytes_new (input->data, length);
+      g_byte_array_remove_range (input, 0, length);
+    }
+
+  return block;
+}
+
 /**
  * cockpit_transport_read_from_pipe:
  *
  * Meant to be used in a "read" handler for a #CockpitPipe
  * Closed is pointer to a boolean value that may be updated
  * during the read and parse loop.
+ *
+ * All the complete frames are taken from @input at once, and large
+ * messages reference a slice of that block. Consuming the frames
+ * one at a time would shift the rest of the buffer for each of them,
+ * which is quadratic when many small frames arrive in one read.
  */
 static void
 cockpit_transport_read_from_pipe (CockpitTransport *self,
@@ -342,14 +428,23 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
                                   GByteArray *input,
                                   gboolean end_of_data)
 {
+  g_autoptr(GBytes) block = NULL;
+  gboolean invalid = FALSE;
+  guint8 *data;
+  gsize length;
+  gsize offset;
+  gssize size;
+  gsize i;
+
   /* This may be updated during the loop. */
   g_assert (closed != NULL);
   g_object_ref (self);
 
-  while (!*closed)
+  /* Find the extent of the complete frames */
+  length = 0;
+  for (;;)
     {
-      gsize i;
-      gssize size = cockpit_frame_parse (input->data, input->len, &i);
+      size = cockpit_frame_parse (input->data + length, input->len - length, &i);
 
       if (size == 0)
         {
@@ -359,17 +454,35 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
         }
       else if (size < 0)
         {
-          g_warning ("%s: incorrect protocol: received invalid length prefix", logname);
-          cockpit_pipe_close (pipe, "protocol-error");
+          invalid = TRUE;
           break;
         }
-      else if (input->len < i + size)
+      else if (input->len - length < i + size)
         {
           g_debug ("%s: want more data 2", logname);
           break;
         }
 
-      g_autoptr(GBytes) message = cockpit_pipe_consume (input, i, size, 0);
+      length += i + size;
+    }
+
+  if (length > 0)
+    block = take_input_block (input, length);
+
+  offset = 0;
+  while (offset < length && !*closed)
+    {
+      data = (guint8 *)g_bytes_get_data (block, NULL) + offset;
+      size = cockpit_frame_parse (data, length - offset, &i);
+      g_assert (size > 0);
+
+      g_autoptr(GBytes) message = NULL;
+      if ((gsize)size < MIN_SLICE_SIZE)
+        message = g_bytes_new (data + i, size);
+      else
+        message = g_bytes_new_from_bytes (block, offset + i, size);
+      offset += i + size;
+
       g_autofree gchar *channel = NULL;
       g_autoptr(GBytes) payload = cockpit_transport_parse_frame (message, &channel);
       if (payload)
@@ -379,7 +492,12 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
         }
     }
 
-  if (end_of_data)
+  if (invalid && !*closed)
+    {
+      g_warning ("%s: incorrect protocol: received invalid length prefix", logname);
+      cockpit_pipe_close (pipe, "protocol-error");
+    }
+  else if (end_of_data)
     {
       /* Received a partial message */
       if (input->len > 0)
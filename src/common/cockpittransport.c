@@ -77,6 +77,7 @@ cockpit_transport_get_property (GObject *object,
 
 static gboolean
 maybe_freeze_message (CockpitTransport *self,
+                      const gchar *command,
                       const gchar *channel,
                       JsonObject *control,
                       GBytes *data)
@@ -84,6 +85,14 @@ maybe_freeze_message (CockpitTransport *self,
   CockpitTransportPrivate *priv = cockpit_transport_get_instance_private (self);
   FrozenMessage *frozen = NULL;
 
+  /*
+   * A "pong" only ever answers a "ping" the channel itself sent. A channel
+   * that sends data before it is ready would otherwise never be relieved
+   * of flow control pressure.
+   */
+  if (g_strcmp0 (command, "pong") == 0)
+    return FALSE;
+
   if (priv->freeze && channel)
     {
       /* Note that we dig out the real value for the channel */
@@ -247,7 +256,7 @@ cockpit_transport_emit_recv (CockpitTransport *transport,
 
   g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
 
-  if (maybe_freeze_message (transport, channel, NULL, data))
+  if (maybe_freeze_message (transport, NULL, channel, NULL, data))
     return;
 
   g_signal_emit (transport, signals[RECV], 0, channel, data, &result);
@@ -267,7 +276,7 @@ cockpit_transport_emit_control (CockpitTransport *transport,
 
   g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
 
-  if (maybe_freeze_message (transport, channel, options, data))
+  if (maybe_freeze_message (transport, command, channel, options, data))
     return;
 
   g_signal_emit (transport, signals[CONTROL], 0, command, channel, options, data, &result);
@@ -13,6 +13,14 @@ struct _CockpitWebRequest {
   GSource *timeout;
   gboolean check_tls_redirect;
 
+  /* Incremental parsing state, kept across reads */
+  gsize parse_offset;
+  gsize scan_offset;
+  gchar *parse_method;
+  gchar *parse_path;
+  GHashTable *parse_headers;
+  gboolean parse_complete;
+
   GHashTable *headers;
   const gchar *original_path;
   const gchar *path;
@@ -34,6 +34,8 @@
 #include "common/cockpitlocale.h"
 #include "common/cockpittemplate.h"
 
+#include <sys/stat.h>
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -59,6 +61,9 @@ struct _CockpitWebResponse {
   gchar *url_root;
   gchar *method;
   gchar *origin;
+  gchar *if_none_match;
+  gchar *range;
+  gchar *if_range;
 
   gchar *protocol;
   CockpitCacheType cache_type;
@@ -160,6 +165,9 @@ cockpit_web_response_finalize (GObject *object)
   g_free (self->url_root);
   g_free (self->method);
   g_free (self->origin);
+  g_free (self->if_none_match);
+  g_free (self->range);
+  g_free (self->if_range);
   g_assert (self->io == NULL);
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
@@ -257,6 +265,9 @@ cockpit_web_response_new (GIOStream *io,
       if (connection)
         self->keep_alive = g_str_equal (connection, "keep-alive");
       host = g_hash_table_lookup (in_headers, "Host");
+      self->if_none_match = g_strdup (g_hash_table_lookup (in_headers, "If-None-Match"));
+      self->range = g_strdup (g_hash_table_lookup (in_headers, "Range"));
+      self->if_range = g_strdup (g_hash_table_lookup (in_headers, "If-Range"));
     }
 
   self->protocol = g_strdup (protocol ?: "http");
@@ -466,7 +477,7 @@ queue_bytes (CockpitWebResponse *self,
     {
       self->source = g_pollable_output_stream_create_source (self->out, NULL);
       g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
-      g_source_attach (self->source, NULL);
+      g_source_attach (self->source, g_main_context_get_thread_default ());
     }
 
   if (before < QUEUE_PRESSURE && self->out_queued >= QUEUE_PRESSURE)
@@ -1046,6 +1057,243 @@ cockpit_web_response_content (CockpitWebResponse *self,
   va_end (va2);
 }
 
+/* More ranges than this in one request and we send everything */
+#define MAX_RANGES 16
+
+typedef struct {
+  guint64 first;
+  guint64 last;
+} ByteRange;
+
+static gboolean
+parse_range_number (const gchar *string,
+                    guint64 *number)
+{
+  /* Only plain digits, no signs or white space */
+  if (!g_ascii_isdigit (string[0]))
+    return FALSE;
+  return g_ascii_string_to_unsigned (string, 10, 0, G_MAXUINT64, number, NULL);
+}
+
+/*
+ * Returns the number of satisfiable ranges placed in @ranges, or -1 if
+ * the header is invalid and should be ignored.
+ */
+static gint
+parse_ranges (const gchar *value,
+              guint64 size,
+              ByteRange *ranges)
+{
+  gint n_specs = 0;
+  gint n_ranges = 0;
+
+  if (g_ascii_strncasecmp (value, "bytes=", 6) != 0)
+    return -1;
+
+  g_auto(GStrv) specs = g_strsplit (value + 6, ",", -1);
+  for (gint i = 0; specs[i] != NULL; i++)
+    {
+      gchar *spec = g_strstrip (specs[i]);
+      guint64 first, last;
+
+      if (spec[0] == '\0')
+        continue;
+      if (n_specs++ >= MAX_RANGES)
+        return -1;
+
+      gchar *dash = strchr (spec, '-');
+      if (dash == NULL)
+        return -1;
+      *dash = '\0';
+
+      if (dash == spec)
+        {
+          /* A suffix range: the last N bytes */
+          if (!parse_range_number (dash + 1, &last))
+            return -1;
+          if (last == 0 || size == 0)
+            continue;
+          first = size > last ? size - last : 0;
+          last = size - 1;
+        }
+      else
+        {
+          if (!parse_range_number (spec, &first))
+            return -1;
+          if (dash[1] == '\0')
+            last = G_MAXUINT64;
+          else if (!parse_range_number (dash + 1, &last) || last < first)
+            return -1;
+          if (first >= size)
+            continue;
+          last = MIN (last, size - 1);
+        }
+
+      ranges[n_ranges].first = first;
+      ranges[n_ranges].last = last;
+      n_ranges++;
+    }
+
+  if (n_specs == 0)
+    return -1;
+  return n_ranges;
+}
+
+static GBytes *
+range_slice (GBytes *body,
+             ByteRange *range)
+{
+  return g_bytes_new_from_bytes (body, range->first, range->last - range->first + 1);
+}
+
+/**
+ * cockpit_web_response_ranges:
+ * @self: the response
+ * @headers: headers to include or NULL
+ * @body: the complete body of the resource
+ *
+ * If the request has a Range header that can be applied to @body, send
+ * a 206 Partial Content response for the requested byte ranges, or 416
+ * if none of them can be satisfied. Multiple ranges are sent as
+ * multipart/byteranges. The ranges are slices of @body, not copies.
+ *
+ * An If-Range request header is compared against the "ETag" in
+ * @headers, and the Range is ignored if they don't match.
+ *
+ * Returns: %TRUE if a response was sent, or %FALSE if the caller
+ *          should send the full @body as usual
+ */
+gboolean
+cockpit_web_response_ranges (CockpitWebResponse *self,
+                             GHashTable *headers,
+                             GBytes *body)
+{
+  ByteRange ranges[MAX_RANGES];
+  GHashTableIter iter;
+  gpointer key, value;
+  GString *string;
+  GBytes *block;
+  guint seen = 0;
+  gint n_ranges;
+
+  g_return_val_if_fail (COCKPIT_IS_WEB_RESPONSE (self), FALSE);
+  g_return_val_if_fail (body != NULL, FALSE);
+
+  if (!self->range || !g_str_equal (self->method, "GET") || self->filters)
+    return FALSE;
+
+  if (self->if_range)
+    {
+      const gchar *etag = headers ? g_hash_table_lookup (headers, "ETag") : NULL;
+      if (!etag || !g_str_equal (etag, self->if_range))
+        return FALSE;
+    }
+
+  guint64 size = g_bytes_get_size (body);
+  n_ranges = parse_ranges (self->range, size, ranges);
+  if (n_ranges < 0)
+    {
+      g_debug ("%s: ignoring invalid range: %s", self->logname, self->range);
+      return FALSE;
+    }
+
+  if (n_ranges == 0)
+    {
+      g_autofree gchar *content_range = g_strdup_printf ("bytes */%" G_GUINT64_FORMAT, size);
+      cockpit_web_response_headers (self, 416, "Range Not Satisfiable", 0,
+                                    "Content-Range", content_range, NULL);
+      cockpit_web_response_complete (self);
+      return TRUE;
+    }
+
+  string = begin_headers (self, 206, "Partial Content");
+
+  if (n_ranges == 1)
+    {
+      g_autofree gchar *content_range = NULL;
+      g_autoptr(GBytes) slice = range_slice (body, &ranges[0]);
+
+      content_range = g_strdup_printf ("bytes %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT,
+                                       ranges[0].first, ranges[0].last, size);
+      seen = append_table (string, headers);
+      seen |= append_header (string, "Content-Range", content_range);
+
+      block = finish_headers (self, string, g_bytes_get_size (slice), 206, seen);
+      queue_bytes (self, block);
+      g_bytes_unref (block);
+
+      if (cockpit_web_response_queue (self, slice))
+        cockpit_web_response_complete (self);
+      return TRUE;
+    }
+
+  const gchar *type = headers ? g_hash_table_lookup (headers, "Content-Type") : NULL;
+  if (!type && self->full_path)
+    type = cockpit_web_response_content_type (self->full_path);
+
+  g_autofree gchar *boundary = g_strdup_printf ("%08x%08x", g_random_int (), g_random_int ());
+  GQueue parts = G_QUEUE_INIT;
+  gsize length = 0;
+
+  for (gint i = 0; i < n_ranges; i++)
+    {
+      GString *part = g_string_new (NULL);
+      g_string_append_printf (part, "%s--%s\r\n", i == 0 ? "" : "\r\n", boundary);
+      if (type)
+        g_string_append_printf (part, "Content-Type: %s\r\n", type);
+      g_string_append_printf (part, "Content-Range: bytes %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "\r\n\r\n",
+                              ranges[i].first, ranges[i].last, size);
+
+      block = g_string_free_to_bytes (part);
+      length += g_bytes_get_size (block);
+      g_queue_push_tail (&parts, block);
+
+      block = range_slice (body, &ranges[i]);
+      length += g_bytes_get_size (block);
+      g_queue_push_tail (&parts, block);
+    }
+
+  gchar *trailer = g_strdup_printf ("\r\n--%s--\r\n", boundary);
+  block = g_bytes_new_take (trailer, strlen (trailer));
+  length += g_bytes_get_size (block);
+  g_queue_push_tail (&parts, block);
+
+  if (headers)
+    {
+      g_hash_table_iter_init (&iter, headers);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          if (g_ascii_strcasecmp (key, "Content-Type") != 0)
+            seen |= append_header (string, key, value);
+        }
+    }
+
+  g_autofree gchar *content_type = g_strdup_printf ("multipart/byteranges; boundary=%s", boundary);
+  seen |= append_header (string, "Content-Type", content_type);
+
+  block = finish_headers (self, string, length, 206, seen);
+  queue_bytes (self, block);
+  g_bytes_unref (block);
+
+  while ((block = g_queue_pop_head (&parts)) != NULL)
+    {
+      if (!cockpit_web_response_queue (self, block))
+        {
+          g_bytes_unref (block);
+          break;
+        }
+      g_bytes_unref (block);
+    }
+
+  if (block == NULL)
+    cockpit_web_response_complete (self);
+
+  while ((block = g_queue_pop_head (&parts)) != NULL)
+    g_bytes_unref (block);
+
+  return TRUE;
+}
+
 static GBytes *
 substitute_message (const gchar *variable,
                     gpointer user_data)
@@ -1252,14 +1500,455 @@ cockpit_web_response_resolve_roots (const gchar **input)
   return (gchar **)g_ptr_array_free (roots, FALSE);
 }
 
+/*
+ * Static files are cached by their path below the root, together with
+ * their decompressed variant and an ETag. Files that don't exist in a
+ * root are remembered too. An entry is only stat'd again once
+ * FILE_CACHE_CHECK_INTERVAL has passed since the last check, so cache
+ * hits and conditional requests don't touch the file system.
+ */
+#define FILE_CACHE_CHECK_INTERVAL (1 * G_USEC_PER_SEC)
+#define FILE_CACHE_MAX_ENTRIES 256
+#define FILE_CACHE_MAX_INFLATED (32 * 1024 * 1024)
+
+typedef struct {
+  gint refs;
+  gchar *path;
+  GBytes *body;
+  gboolean is_gzip;
+  GBytes *inflated;
+  gchar *etag;
+  dev_t dev;
+  ino_t ino;
+  goffset size;
+  gint64 mtime;
+  gint64 checked;
+  gboolean cached;
+} FileCacheEntry;
+
+static GHashTable *file_cache;
+static gsize file_cache_inflated;
+
+static FileCacheEntry *
+file_cache_entry_ref (FileCacheEntry *entry)
+{
+  g_atomic_int_inc (&entry->refs);
+  return entry;
+}
+
+/* May be called from any thread */
+static void
+file_cache_entry_unref (gpointer data)
+{
+  FileCacheEntry *entry = data;
+
+  if (!g_atomic_int_dec_and_test (&entry->refs))
+    return;
+
+  g_free (entry->path);
+  if (entry->body)
+    g_bytes_unref (entry->body);
+  if (entry->inflated)
+    g_bytes_unref (entry->inflated);
+  g_free (entry->etag);
+  g_free (entry);
+}
+
+static void
+file_cache_evict (gpointer data)
+{
+  FileCacheEntry *entry = data;
+
+  entry->cached = FALSE;
+  if (entry->inflated)
+    file_cache_inflated -= g_bytes_get_size (entry->inflated);
+  file_cache_entry_unref (entry);
+}
+
+static gboolean
+file_missing (const gchar *path)
+{
+  struct stat st;
+  return stat (path, &st) < 0 && errno == ENOENT;
+}
+
+static gboolean
+file_cache_entry_valid (FileCacheEntry *entry)
+{
+  struct stat st;
+
+  /* A missing file, and also its .gz variant when is_gzip is set */
+  if (entry->body == NULL)
+    {
+      g_autofree gchar *gz_path = NULL;
+      if (!file_missing (entry->path))
+        return FALSE;
+      if (entry->is_gzip)
+        {
+          gz_path = g_strconcat (entry->path, ".gz", NULL);
+          return file_missing (gz_path);
+        }
+      return TRUE;
+    }
+
+  return stat (entry->path, &st) == 0 &&
+         entry->dev == st.st_dev &&
+         entry->ino == st.st_ino &&
+         entry->size == st.st_size &&
+         entry->mtime == (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_mtim.tv_nsec;
+}
+
+static FileCacheEntry *
+file_cache_lookup (const gchar *path,
+                   gboolean search_gzip)
+{
+  FileCacheEntry *entry;
+  gint64 now;
+
+  if (!file_cache)
+    return NULL;
+
+  entry = g_hash_table_lookup (file_cache, path);
+  if (!entry)
+    return NULL;
+
+  /* Found as a .gz fallback, but the caller doesn't want that */
+  if (entry->body && entry->is_gzip && !search_gzip)
+    return NULL;
+
+  /* Only known to be missing, but the .gz variant wasn't checked */
+  if (!entry->body && !entry->is_gzip && search_gzip)
+    return NULL;
+
+  now = g_get_monotonic_time ();
+  if (now - entry->checked >= FILE_CACHE_CHECK_INTERVAL)
+    {
+      if (!file_cache_entry_valid (entry))
+        {
+          g_debug ("%s: file changed, dropping from cache", entry->path);
+          g_hash_table_remove (file_cache, path);
+          return NULL;
+        }
+      entry->checked = now;
+    }
+
+  return file_cache_entry_ref (entry);
+}
+
+static void
+file_cache_insert (const gchar *path,
+                   FileCacheEntry *entry)
+{
+  if (!file_cache)
+    {
+      file_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, file_cache_evict);
+    }
+
+  if (g_hash_table_size (file_cache) >= FILE_CACHE_MAX_ENTRIES)
+    {
+      g_debug ("static file cache is full, clearing");
+      g_hash_table_remove_all (file_cache);
+    }
+
+  entry->checked = g_get_monotonic_time ();
+  entry->cached = TRUE;
+  g_hash_table_replace (file_cache, g_strdup (path), file_cache_entry_ref (entry));
+}
+
+static void
+file_cache_add_missing (const gchar *path,
+                        gboolean search_gzip)
+{
+  FileCacheEntry *entry = g_new0 (FileCacheEntry, 1);
+  entry->refs = 1;
+  entry->path = g_strdup (path);
+  entry->is_gzip = search_gzip;
+  file_cache_insert (path, entry);
+  file_cache_entry_unref (entry);
+}
+
+static FileCacheEntry *
+file_cache_add (const gchar *path,
+                const gchar *mapped_path,
+                struct stat *st,
+                GMappedFile *file,
+                gboolean is_gzip)
+{
+  FileCacheEntry *entry = g_new0 (FileCacheEntry, 1);
+  entry->refs = 1;
+  entry->path = g_strdup (mapped_path);
+  entry->body = g_mapped_file_get_bytes (file);
+  entry->is_gzip = is_gzip;
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = (gint64)st->st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st->st_mtim.tv_nsec;
+  entry->etag = g_strdup_printf ("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x",
+                                 (gint64)entry->ino, (gint64)entry->size, entry->mtime);
+
+  file_cache_insert (path, entry);
+  return entry;
+}
+
+static void
+file_cache_set_inflated (FileCacheEntry *entry,
+                         GBytes *inflated)
+{
+  gsize size = g_bytes_get_size (inflated);
+
+  if (!entry->cached || entry->inflated ||
+      file_cache_inflated + size > FILE_CACHE_MAX_INFLATED)
+    return;
+
+  entry->inflated = g_bytes_ref (inflated);
+  file_cache_inflated += size;
+}
+
+static GMappedFile *
+map_file (const gchar *path,
+          struct stat *st,
+          GError **error)
+{
+  /* Stat before mapping, so a concurrent change invalidates the entry */
+  if (stat (path, st) < 0)
+    {
+      int errn = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+                   "%s: %s", path, g_strerror (errn));
+      return NULL;
+    }
+
+  return g_mapped_file_new (path, FALSE, error);
+}
+
+/* Bodies at least this large are decompressed or expanded in a thread */
+#define FILE_BODY_THREAD_SIZE (16 * 1024)
+
+typedef struct {
+  gchar *unescaped;
+  FileCacheEntry *entry;
+  GBytes *body;
+  gboolean gunzip;
+  GHashTable *values;
+  GBytes *inflated;
+} FileBody;
+
+static void
+file_body_free (gpointer data)
+{
+  FileBody *fb = data;
+  g_free (fb->unescaped);
+  file_cache_entry_unref (fb->entry);
+  g_bytes_unref (fb->body);
+  if (fb->values)
+    g_hash_table_unref (fb->values);
+  if (fb->inflated)
+    g_bytes_unref (fb->inflated);
+  g_free (fb);
+}
+
+/* Only touches the FileBody, so may be called from any thread */
+static GList *
+expand_file_body (FileBody *fb,
+                  GError **error)
+{
+  g_autoptr(GBytes) body = NULL;
+
+  if (fb->gunzip)
+    {
+      body = cockpit_web_response_gunzip (fb->body, error);
+      if (body == NULL)
+        return NULL;
+      fb->inflated = g_bytes_ref (body);
+    }
+  else
+    {
+      body = g_bytes_ref (fb->body);
+    }
+
+  if (fb->values)
+    return cockpit_template_expand (body, "${", "}", substitute_hash_value, fb->values);
+  else
+    return g_list_prepend (NULL, g_bytes_ref (body));
+}
+
+static gint
+output_length (GList *output)
+{
+  gsize length = 0;
+  for (GList *l = output; l != NULL; l = g_list_next (l))
+    length += g_bytes_get_size (l->data);
+  return length;
+}
+
+static gchar *
+file_etag (FileCacheEntry *entry,
+           gboolean is_gzip,
+           GHashTable *values)
+{
+  /* Expanded templates depend on more than the file */
+  if (values)
+    return NULL;
+  return g_strdup_printf ("\"%s%s\"", entry->etag, is_gzip ? "-gzip" : "");
+}
+
+/*
+ * An If-None-Match header is "*" or a comma separated list of entity
+ * tags, compared weakly as in RFC 7232: a W/ prefix is ignored.
+ */
+static gboolean
+etag_none_match (const gchar *if_none_match,
+                 const gchar *etag)
+{
+  const gchar *p = if_none_match;
+  const gchar *end;
+  gsize len = strlen (etag);
+
+  while (p && *p)
+    {
+      while (*p == ' ' || *p == '\t' || *p == ',')
+        p++;
+      if (*p == '\0')
+        break;
+
+      if (*p == '*')
+        return TRUE;
+      if (g_str_has_prefix (p, "W/"))
+        p += 2;
+
+      /* A list that doesn't parse matches nothing */
+      if (*p != '"')
+        return FALSE;
+      end = strchr (p + 1, '"');
+      if (!end)
+        return FALSE;
+
+      end++;
+      if ((gsize)(end - p) == len && strncmp (p, etag, len) == 0)
+        return TRUE;
+      p = end;
+    }
+
+  return FALSE;
+}
+
+static void
+send_file_body (CockpitWebResponse *response,
+                const gchar *unescaped,
+                gboolean is_gzip,
+                const gchar *etag,
+                GList *output,
+                gint content_length)
+{
+  g_autoptr(GHashTable) headers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+  if (response->origin)
+    g_hash_table_insert (headers, "Access-Control-Allow-Origin", g_strdup (response->origin));
+
+  /*
+   * The default Content-Security-Policy for .html files allows
+   * the site to have inline <script> and <style> tags. This code
+   * is only used for static resources that do not use the session.
+   */
+  if (g_str_has_suffix (unescaped, ".html"))
+    {
+      const gchar *default_policy = "default-src 'self' 'unsafe-inline';";
+      g_hash_table_insert (headers, "Content-Security-Policy",
+                           cockpit_web_response_security_policy (default_policy, response->origin));
+    }
+
+  if (is_gzip)
+    g_hash_table_insert (headers, "Content-Encoding", g_strdup ("gzip"));
+
+  /* Only the plain file contents have an ETag, and can be sent in ranges */
+  if (etag)
+    {
+      g_hash_table_insert (headers, "ETag", g_strdup (etag));
+      g_hash_table_insert (headers, "Accept-Ranges", g_strdup ("bytes"));
+
+      if (output && !output->next && cockpit_web_response_ranges (response, headers, output->data))
+        {
+          g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
+          return;
+        }
+    }
+
+  cockpit_web_response_headers_full (response, 200, "OK", content_length, headers);
+
+  GList *l;
+  for (l = output; l != NULL; l = g_list_next (l))
+    {
+      if (!cockpit_web_response_queue (response, l->data))
+        break;
+    }
+  if (l == NULL)
+    cockpit_web_response_complete (response);
+
+  g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
+}
+
+static void
+file_body_failed (CockpitWebResponse *response,
+                  GError *error)
+{
+  g_warning ("%s", error->message);
+  cockpit_web_response_error (response, 500, NULL, "Internal server error");
+}
+
+static void
+file_body_thread (GTask *task,
+                  gpointer source_object,
+                  gpointer task_data,
+                  GCancellable *cancellable)
+{
+  GError *error = NULL;
+  GList *output = expand_file_body (task_data, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, output, NULL);
+}
+
+static void
+on_file_body_ready (GObject *object,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+  CockpitWebResponse *response = COCKPIT_WEB_RESPONSE (object);
+  FileBody *fb = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GError) error = NULL;
+
+  GList *output = g_task_propagate_pointer (G_TASK (result), &error);
+  if (error)
+    {
+      file_body_failed (response, error);
+      return;
+    }
+
+  if (fb->inflated)
+    file_cache_set_inflated (fb->entry, fb->inflated);
+
+  if (response->failed)
+    {
+      g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
+    }
+  else
+    {
+      g_autofree gchar *etag = file_etag (fb->entry, FALSE, fb->values);
+      send_file_body (response, fb->unescaped, FALSE, etag, output,
+                      fb->values ? -1 : output_length (output));
+    }
+}
+
 static void
 web_response_file (CockpitWebResponse *response,
                    const gchar *escaped,
                    const gchar **roots,
                    gboolean search_gzip,
                    gboolean accept_gzip,
-                   CockpitTemplateFunc template_func,
-                   gpointer user_data)
+                   GHashTable *values)
 {
   g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (response));
 
@@ -1277,13 +1966,22 @@ web_response_file (CockpitWebResponse *response,
       return;
     }
 
-  gboolean is_gzip = FALSE;
-  g_autoptr(GMappedFile) file = NULL;
+  FileCacheEntry *entry = NULL;
   for (gint i = 0; roots[i]; i++)
     {
       const gchar *root = roots[i];
       g_autofree gchar *path = g_build_filename (root, unescaped, NULL);
 
+      entry = file_cache_lookup (path, search_gzip);
+      if (entry != NULL && entry->body != NULL)
+        break;
+      if (entry != NULL)
+        {
+          g_debug ("%s: file not found in root: %s (cached)", escaped, root);
+          g_clear_pointer (&entry, file_cache_entry_unref);
+          continue;
+        }
+
       if (g_file_test (path, G_FILE_TEST_IS_DIR))
         {
           cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
@@ -1294,24 +1992,33 @@ web_response_file (CockpitWebResponse *response,
       g_assert (path_has_prefix (path, root));
 
       g_autoptr(GError) error = NULL;
-      file = g_mapped_file_new (path, FALSE, &error);
+      g_autoptr(GMappedFile) file = NULL;
+      g_autofree gchar *gz_path = NULL;
+      struct stat st;
+
+      file = map_file (path, &st, &error);
 
       if (file == NULL && search_gzip &&
           g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
         {
           g_debug ("%s: file not found in root: %s, looking for .gz", escaped, root);
           g_clear_error (&error);
-          g_autofree gchar *old_path = g_steal_pointer (&path);
-          path = g_strconcat (old_path, ".gz", NULL);
-          file = g_mapped_file_new (path, FALSE, &error);
-          is_gzip = file != NULL;
+          gz_path = g_strconcat (path, ".gz", NULL);
+          file = map_file (gz_path, &st, &error);
         }
 
       if (file != NULL)
-        break;
+        {
+          entry = file_cache_add (path, gz_path ? gz_path : path, &st, file, gz_path != NULL);
+          break;
+        }
 
-      if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
-          g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
+      if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_debug ("%s: file not found in root: %s", escaped, root);
+          file_cache_add_missing (path, search_gzip);
+        }
+      else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
         {
           g_debug ("%s: file not found in root: %s", escaped, root);
         }
@@ -1324,83 +2031,88 @@ web_response_file (CockpitWebResponse *response,
         }
       else
         {
-          g_warning ("%s: %s", path, error->message);
+          g_warning ("%s", error->message);
           cockpit_web_response_error (response, 500, NULL, "Internal server error");
           return;
         }
     }
 
-  if (file == NULL)
+  if (entry == NULL)
     {
       cockpit_web_response_error (response, 404, NULL, "Not Found");
       return;
     }
 
-  g_autoptr(GBytes) body = g_mapped_file_get_bytes (file);
-
-  if (is_gzip && (!accept_gzip || template_func))
-    {
-      /* We have gzipped content, but the client won't accept it, or
-       * template expansion was requested.  Decompress.
-       */
-      g_autoptr(GError) error = NULL;
-      g_autoptr(GBytes) body_gz = g_steal_pointer (&body);
-      body = cockpit_web_response_gunzip (body_gz, &error);
-      if (body == NULL)
-        {
-          g_warning ("%s", error->message);
-          cockpit_web_response_error (response, 500, NULL, "Internal server error");
-          return;
-        }
-      is_gzip = FALSE;
+  /* We have gzipped content, but the client won't accept it, or
+   * template expansion was requested.  Decompress.
+   */
+  gboolean is_gzip = entry->is_gzip;
+  gboolean gunzip = is_gzip && (!accept_gzip || values);
+  if (gunzip)
+    is_gzip = FALSE;
+
+  g_autofree gchar *etag = file_etag (entry, is_gzip, values);
+  if (etag && etag_none_match (response->if_none_match, etag))
+    {
+      g_debug ("%s: not modified", escaped);
+      cockpit_web_response_headers (response, 304, "Not Modified", -1, "ETag", etag, NULL);
+      cockpit_web_response_complete (response);
+      file_cache_entry_unref (entry);
+      return;
     }
 
-  GList *output;
-  gint content_length = -1;
-  if (template_func)
+  GBytes *body = entry->body;
+  if (gunzip && entry->inflated)
     {
-      output = cockpit_template_expand (body, "${", "}", template_func, user_data);
-    }
-  else
-    {
-      output = g_list_prepend (NULL, g_bytes_ref (body));
-      content_length = g_bytes_get_size (body);
+      body = entry->inflated;
+      gunzip = FALSE;
     }
 
-  GString *string = begin_headers (response, 200, "OK");
-  guint seen = 0;
-
-  if (response->origin)
-    seen |= append_header (string, "Access-Control-Allow-Origin", response->origin);
-
-  /*
-   * The default Content-Security-Policy for .html files allows
-   * the site to have inline <script> and <style> tags. This code
-   * is only used for static resources that do not use the session.
-   */
-  if (g_str_has_suffix (unescaped, ".html"))
+  if (!gunzip && !values)
     {
-      const gchar *default_policy = "default-src 'self' 'unsafe-inline';";
-      g_autofree gchar *policy = cockpit_web_response_security_policy (default_policy, response->origin);
-      seen |= append_header (string, "Content-Security-Policy", policy);
+      send_file_body (response, unescaped, is_gzip, etag,
+                      g_list_prepend (NULL, g_bytes_ref (body)),
+                      g_bytes_get_size (body));
+      file_cache_entry_unref (entry);
+      return;
     }
 
-  if (is_gzip)
-    seen |= append_header (string, "Content-Encoding", "gzip");
-
-  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, 200, seen);
-  queue_bytes (response, headers_block);
+  FileBody *fb = g_new0 (FileBody, 1);
+  fb->unescaped = g_steal_pointer (&unescaped);
+  fb->entry = entry;
+  fb->body = g_bytes_ref (body);
+  fb->gunzip = gunzip;
+  fb->values = values ? g_hash_table_ref (values) : NULL;
 
-  GList *l;
-  for (l = output; l != NULL; l = g_list_next (l))
+  if (g_bytes_get_size (fb->body) < FILE_BODY_THREAD_SIZE)
     {
-      if (!cockpit_web_response_queue (response, l->data))
-        break;
+      g_autoptr(GError) error = NULL;
+      GList *output = expand_file_body (fb, &error);
+      if (error)
+        {
+          file_body_failed (response, error);
+        }
+      else
+        {
+          if (fb->inflated)
+            file_cache_set_inflated (entry, fb->inflated);
+          send_file_body (response, fb->unescaped, FALSE, etag, output,
+                          fb->values ? -1 : output_length (output));
+        }
+      file_body_free (fb);
+      return;
     }
-  if (l == NULL)
-    cockpit_web_response_complete (response);
 
-  g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
+  /*
+   * Decompressing or expanding large files is CPU heavy, and would
+   * stall every other request and websocket sharing this main loop.
+   * Do it on a worker thread, and send the result back here.
+   */
+  g_debug ("%s: processing file body in a thread", fb->unescaped);
+  GTask *task = g_task_new (response, NULL, on_file_body_ready, NULL);
+  g_task_set_task_data (task, fb, file_body_free);
+  g_task_run_in_thread (task, file_body_thread);
+  g_object_unref (task);
 }
 
 /**
@@ -1416,7 +2128,7 @@ cockpit_web_response_file (CockpitWebResponse *response,
                            const gchar *escaped,
                            const gchar **roots)
 {
-  web_response_file (response, escaped, roots, FALSE, FALSE, NULL, NULL);
+  web_response_file (response, escaped, roots, FALSE, FALSE, NULL);
 }
 
 void
@@ -1425,7 +2137,7 @@ cockpit_web_response_template (CockpitWebResponse *response,
                                    const gchar **roots,
                                    GHashTable *values)
 {
-  web_response_file (response, escaped, roots, FALSE, FALSE, substitute_hash_value, values);
+  web_response_file (response, escaped, roots, FALSE, FALSE, values);
 }
 
 void
@@ -1434,7 +2146,7 @@ cockpit_web_response_file_or_gz (CockpitWebResponse *response,
                                  const gchar *escaped,
                                  const gchar **roots)
 {
-  web_response_file (response, escaped, roots, TRUE, accepts_gzip, NULL, NULL);
+  web_response_file (response, escaped, roots, TRUE, accepts_gzip, NULL);
 }
 
 static gboolean
@@ -95,6 +95,10 @@ void                  cockpit_web_response_content       (CockpitWebResponse *se
                                                           GBytes *block,
                                                           ...) G_GNUC_NULL_TERMINATED;
 
+gboolean              cockpit_web_response_ranges        (CockpitWebResponse *self,
+                                                          GHashTable *headers,
+                                                          GBytes *body);
+
 void                  cockpit_web_response_error         (CockpitWebResponse *self,
                                                           guint status,
                                                           GHashTable *headers,
@@ -43,8 +43,11 @@
 /* Used during testing */
 gboolean cockpit_webserver_want_certificate = FALSE;
 
+/* Largest amount of request data read in one go */
+#define REQUEST_MAXIMUM 8192
+
 guint cockpit_webserver_request_timeout = 30;
-const gsize cockpit_webserver_request_maximum = 8192;
+const gsize cockpit_webserver_request_maximum = REQUEST_MAXIMUM;
 
 struct _CockpitWebServer {
   GObject parent_instance;
@@ -250,19 +253,53 @@ close_io_stream (GIOStream *io)
   g_io_stream_close_async (io, G_PRIORITY_DEFAULT, NULL, on_io_closed, NULL);
 }
 
+typedef struct {
+  CockpitWebServer *server;
+  GIOStream *io;
+  gboolean reusable;
+} ResponseDone;
+
+static void
+response_done_free (gpointer data)
+{
+  ResponseDone *done = data;
+  g_object_unref (done->server);
+  g_object_unref (done->io);
+  g_free (done);
+}
+
+static gboolean
+on_response_done_invoke (gpointer data)
+{
+  ResponseDone *done = data;
+
+  if (done->reusable)
+    cockpit_web_request_start (done->server, done->io, FALSE);
+  else
+    close_io_stream (done->io);
+
+  return FALSE;
+}
+
 static void
 on_web_response_done (CockpitWebResponse *response,
                       gboolean reusable,
                       gpointer user_data)
 {
   CockpitWebServer *self = user_data;
-  GIOStream *io;
+  ResponseDone *done;
 
-  io = cockpit_web_response_get_stream (response);
-  if (reusable)
-    cockpit_web_request_start (self, io, FALSE);
-  else
-    close_io_stream (io);
+  /*
+   * Responses may be completed from a session thread, but the
+   * connection goes back to the server in its own main context.
+   */
+  done = g_new0 (ResponseDone, 1);
+  done->server = g_object_ref (self);
+  done->io = g_object_ref (cockpit_web_response_get_stream (response));
+  done->reusable = reusable;
+
+  g_main_context_invoke_full (self->main_context, G_PRIORITY_DEFAULT,
+                              on_response_done_invoke, done, response_done_free);
 }
 
 static gboolean
@@ -728,6 +765,10 @@ cockpit_web_request_free (gpointer data)
    */
   g_byte_array_unref (self->buffer);
   g_object_unref (self->io);
+  g_free (self->parse_method);
+  g_free (self->parse_path);
+  if (self->parse_headers)
+    g_hash_table_unref (self->parse_headers);
   g_free (self);
 }
 
@@ -852,17 +893,74 @@ cockpit_web_request_process (CockpitWebRequest *self,
     g_critical ("no handler responded to request: %s", self->path);
 }
 
+/*
+ * Parses the request line and headers as they arrive. Each line is only
+ * parsed once, and the buffer is only searched for a line ending from
+ * where the last search stopped, so a client trickling in its request
+ * doesn't cause the whole request to be parsed again on each read.
+ *
+ * Returns zero if more data is needed, negative if the request is
+ * invalid, or the length of the request line and headers.
+ */
+static gssize
+cockpit_web_request_parse_head (CockpitWebRequest *self)
+{
+  const gchar *data = (const gchar *)self->buffer->data;
+  gsize length = self->buffer->len;
+  gssize ret;
+
+  while (!self->parse_complete)
+    {
+      if (!memchr (data + self->scan_offset, '\n', length - self->scan_offset))
+        {
+          self->scan_offset = length;
+          return 0;
+        }
+
+      if (!self->parse_headers)
+        {
+          ret = web_socket_util_parse_req_line (data, length, &self->parse_method, &self->parse_path);
+          if (ret < 0)
+            {
+              g_message ("received invalid HTTP request line");
+              return -1;
+            }
+          if (!self->parse_path || self->parse_path[0] != '/')
+            {
+              g_message ("received invalid HTTP path");
+              return -1;
+            }
+
+          self->parse_headers = web_socket_util_new_headers ();
+        }
+      else
+        {
+          ret = web_socket_util_parse_header_line (data + self->parse_offset, length - self->parse_offset,
+                                                   self->parse_headers, &self->parse_complete);
+          if (ret < 0)
+            {
+              g_message ("received invalid HTTP request headers");
+              return -1;
+            }
+        }
+
+      /* We found a line ending above */
+      g_assert (ret > 0);
+      self->parse_offset += ret;
+      self->scan_offset = self->parse_offset;
+    }
+
+  return self->parse_offset;
+}
+
 static gboolean
 cockpit_web_request_parse_and_process (CockpitWebRequest *self)
 {
   gboolean again = FALSE;
-  GHashTable *headers = NULL;
-  gchar *method = NULL;
-  gchar *path = NULL;
+  GHashTable *headers;
   const gchar *str;
   gchar *end = NULL;
-  gssize off1;
-  gssize off2;
+  gssize off;
   guint64 length;
 
   /* The hard input limit, we just terminate the connection */
@@ -872,42 +970,19 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
       goto out;
     }
 
-  off1 = web_socket_util_parse_req_line ((const gchar *)self->buffer->data,
-                                         self->buffer->len,
-                                         &method,
-                                         &path);
-  if (off1 == 0)
+  off = cockpit_web_request_parse_head (self);
+  if (off == 0)
     {
       again = TRUE;
       goto out;
     }
-  if (off1 < 0)
+  if (off < 0)
     {
-      g_message ("received invalid HTTP request line");
-      self->delayed_reply = 400;
-      goto out;
-    }
-  if (!path || path[0] != '/')
-    {
-      g_message ("received invalid HTTP path");
       self->delayed_reply = 400;
       goto out;
     }
 
-  off2 = web_socket_util_parse_headers ((const gchar *)self->buffer->data + off1,
-                                        self->buffer->len - off1,
-                                        &headers);
-  if (off2 == 0)
-    {
-      again = TRUE;
-      goto out;
-    }
-  if (off2 < 0)
-    {
-      g_message ("received invalid HTTP request headers");
-      self->delayed_reply = 400;
-      goto out;
-    }
+  headers = self->parse_headers;
 
   /* If we get a Content-Length then verify it is zero */
   length = 0;
@@ -932,13 +1007,13 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
     }
 
   /* Not enough data yet */
-  if (self->buffer->len < off1 + off2 + length)
+  if (self->buffer->len < off + length)
     {
       again = TRUE;
       goto out;
     }
 
-  if (!g_str_equal (method, "GET") && !g_str_equal (method, "HEAD"))
+  if (!g_str_equal (self->parse_method, "GET") && !g_str_equal (self->parse_method, "HEAD"))
     {
       g_message ("received unsupported HTTP method");
       self->delayed_reply = 405;
@@ -951,14 +1026,10 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
       self->delayed_reply = 400;
     }
 
-  g_byte_array_remove_range (self->buffer, 0, off1 + off2);
-  cockpit_web_request_process (self, method, path, str, headers);
+  g_byte_array_remove_range (self->buffer, 0, off);
+  cockpit_web_request_process (self, self->parse_method, self->parse_path, str, headers);
 
 out:
-  if (headers)
-    g_hash_table_unref (headers);
-  g_free (method);
-  g_free (path);
   if (!again)
     cockpit_web_request_finish (self);
   return again;
@@ -1008,6 +1079,7 @@ cockpit_web_request_on_input (GObject *pollable_input,
 {
   GPollableInputStream *input = (GPollableInputStream *)pollable_input;
   CockpitWebRequest *self = user_data;
+  guint8 data[REQUEST_MAXIMUM + 1];
   GError *error = NULL;
   gsize length;
   gssize count;
@@ -1023,15 +1095,13 @@ cockpit_web_request_on_input (GObject *pollable_input,
    *
    * FIXME: This may still hang for several large requests that are pipelined;
    * for these this needs to be changed into a loop.
+   *
+   * Read onto the stack, so the request buffer only grows by what was
+   * actually received.
    */
-  g_byte_array_set_size (self->buffer, length + cockpit_webserver_request_maximum + 1);
-
-  count = g_pollable_input_stream_read_nonblocking (input, self->buffer->data + length,
-                                                    cockpit_webserver_request_maximum + 1, NULL, &error);
+  count = g_pollable_input_stream_read_nonblocking (input, data, sizeof (data), NULL, &error);
   if (count < 0)
     {
-      g_byte_array_set_size (self->buffer, length);
-
       /* Just wait and try again */
       if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
         {
@@ -1047,7 +1117,7 @@ cockpit_web_request_on_input (GObject *pollable_input,
       return FALSE;
     }
 
-  g_byte_array_set_size (self->buffer, length + count);
+  g_byte_array_append (self->buffer, data, count);
 
   if (count == 0)
     {
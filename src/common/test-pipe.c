@@ -21,6 +21,7 @@
 
 #include "cockpitpipe.h"
 
+#include "cockpitpipetransport.h"
 #include "cockpitsystem.h"
 
 #include "testlib/cockpittest.h"
@@ -30,9 +31,11 @@
 #include <glib/gstdio.h>
 #include <gio/gunixsocketaddress.h>
 
+#include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <unistd.h>
 
 /* ----------------------------------------------------------------------------
  * Mock
@@ -834,6 +837,60 @@ test_spawn_and_write (void)
   g_object_unref (pipe);
 }
 
+typedef struct {
+  GMainContext *context;
+  gboolean closed;
+} ThreadClosure;
+
+static gpointer
+iterate_until_closed (gpointer user_data)
+{
+  ThreadClosure *closure = user_data;
+
+  g_main_context_push_thread_default (closure->context);
+  while (!closure->closed)
+    g_main_context_iteration (closure->context, TRUE);
+  g_main_context_pop_thread_default (closure->context);
+
+  return NULL;
+}
+
+static void
+test_spawn_set_context (void)
+{
+  ThreadClosure closure = { NULL, FALSE };
+  CockpitPipe *pipe;
+  GByteArray *buffer;
+  GThread *thread;
+  GBytes *sent;
+
+  const gchar *argv[] = { "/bin/cat", NULL };
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closure.closed);
+
+  /* Queued here, but written, read back and reaped in the other thread */
+  sent = g_bytes_new_static ("jola", 5);
+  cockpit_pipe_write (pipe, sent);
+  g_bytes_unref (sent);
+  cockpit_pipe_close (pipe, NULL);
+
+  closure.context = g_main_context_new ();
+  cockpit_pipe_set_context (pipe, closure.context);
+
+  thread = g_thread_new ("test-pipe", iterate_until_closed, &closure);
+  g_thread_join (thread);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_assert_cmpuint (buffer->len, ==, 5);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "jola");
+  g_assert_cmpint (cockpit_pipe_exit_status (pipe), ==, 0);
+
+  g_object_unref (pipe);
+  g_main_context_unref (closure.context);
+}
+
 static void
 test_spawn_and_fail (void)
 {
@@ -1279,6 +1336,187 @@ test_get_environ_null (void)
   g_strfreev (environ);
 }
 
+typedef struct {
+  gint fd;
+  GBytes *data;
+} BurstWriter;
+
+static gpointer
+burst_writer_thread (gpointer user_data)
+{
+  BurstWriter *writer = user_data;
+  const guint8 *data;
+  gsize length;
+  gssize ret;
+
+  data = g_bytes_get_data (writer->data, &length);
+  while (length > 0)
+    {
+      ret = write (writer->fd, data, length);
+      g_assert_cmpint (ret, >, 0);
+      data += ret;
+      length -= ret;
+    }
+
+  close (writer->fd);
+  return NULL;
+}
+
+typedef struct {
+  guint count;
+  gboolean closed;
+} BurstReader;
+
+static gboolean
+on_burst_recv (CockpitTransport *transport,
+               const gchar *channel,
+               GBytes *payload,
+               gpointer user_data)
+{
+  BurstReader *reader = user_data;
+  gchar expected[16];
+
+  g_assert_cmpstr (channel, ==, "a");
+  g_snprintf (expected, sizeof (expected), "%08x", reader->count);
+  cockpit_assert_bytes_eq (payload, expected, 8);
+  reader->count++;
+  return TRUE;
+}
+
+static void
+on_burst_closed (CockpitTransport *transport,
+                 const gchar *problem,
+                 gpointer user_data)
+{
+  BurstReader *reader = user_data;
+  g_assert_cmpstr (problem, ==, NULL);
+  reader->closed = TRUE;
+}
+
+static void
+test_transport_burst (gconstpointer data)
+{
+  guint messages = GPOINTER_TO_UINT (data);
+  BurstReader reader = { 0, };
+  BurstWriter writer;
+  CockpitTransport *transport;
+  GString *burst;
+  GThread *thread;
+  gdouble elapsed;
+  int fds[2];
+  guint i;
+
+  /* Lots of tiny frames, which arrive many to a read */
+  burst = g_string_new ("");
+  for (i = 0; i < messages; i++)
+    g_string_append_printf (burst, "10\na\n%08x", i);
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+  transport = cockpit_pipe_transport_new_fds ("burst", fds[0], dup (fds[0]));
+  g_signal_connect (transport, "recv", G_CALLBACK (on_burst_recv), &reader);
+  g_signal_connect (transport, "closed", G_CALLBACK (on_burst_closed), &reader);
+
+  writer.fd = fds[1];
+  writer.data = g_string_free_to_bytes (burst);
+
+  g_test_timer_start ();
+  thread = g_thread_new ("burst-writer", burst_writer_thread, &writer);
+
+  while (!reader.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  elapsed = g_test_timer_elapsed ();
+  g_thread_join (thread);
+
+  g_assert_cmpuint (reader.count, ==, messages);
+  g_test_minimized_result (elapsed, "received %u messages in %.3f seconds, %.0f messages/s",
+                           messages, elapsed, messages / elapsed);
+
+  g_bytes_unref (writer.data);
+  g_object_unref (transport);
+}
+
+typedef struct {
+  gint fd;
+  gsize expected;
+  GByteArray *received;
+  gint done;
+} OutputReader;
+
+static gpointer
+output_reader_thread (gpointer user_data)
+{
+  OutputReader *reader = user_data;
+  guint8 buffer[64 * 1024];
+  gssize ret;
+
+  while (reader->received->len < reader->expected)
+    {
+      ret = read (reader->fd, buffer, sizeof (buffer));
+      g_assert_cmpint (ret, >, 0);
+      g_byte_array_append (reader->received, buffer, ret);
+    }
+
+  g_atomic_int_set (&reader->done, 1);
+  g_main_context_wakeup (NULL);
+  return NULL;
+}
+
+static void
+test_transport_output (gconstpointer data)
+{
+  guint messages = GPOINTER_TO_UINT (data);
+  CockpitTransport *transport;
+  OutputReader reader;
+  GString *expected;
+  GThread *thread;
+  gdouble elapsed;
+  GBytes *payload;
+  gchar buffer[16];
+  int fds[2];
+  guint i;
+
+  expected = g_string_new ("");
+  for (i = 0; i < messages; i++)
+    g_string_append_printf (expected, "10\na\n%08x", i);
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+  transport = cockpit_pipe_transport_new_fds ("output", dup (fds[0]), fds[0]);
+
+  reader.fd = fds[1];
+  reader.expected = expected->len;
+  reader.received = g_byte_array_new ();
+  reader.done = 0;
+  thread = g_thread_new ("output-reader", output_reader_thread, &reader);
+
+  g_test_timer_start ();
+
+  /* Many small messages, as chatty channels send them */
+  for (i = 0; i < messages; i++)
+    {
+      g_snprintf (buffer, sizeof (buffer), "%08x", i);
+      payload = g_bytes_new (buffer, 8);
+      cockpit_transport_send (transport, "a", payload);
+      g_bytes_unref (payload);
+    }
+
+  while (!g_atomic_int_get (&reader.done))
+    g_main_context_iteration (NULL, TRUE);
+
+  elapsed = g_test_timer_elapsed ();
+  g_thread_join (thread);
+
+  g_assert_cmpuint (reader.received->len, ==, expected->len);
+  g_assert (memcmp (reader.received->data, expected->str, expected->len) == 0);
+  g_test_minimized_result (elapsed, "sent %u messages in %.3f seconds, %.0f messages/s",
+                           messages, elapsed, messages / elapsed);
+
+  g_byte_array_free (reader.received, TRUE);
+  g_string_free (expected, TRUE);
+  g_object_unref (transport);
+  close (fds[1]);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1332,6 +1570,7 @@ main (int argc,
 
   g_test_add_func ("/pipe/spawn/and-read", test_spawn_and_read);
   g_test_add_func ("/pipe/spawn/and-write", test_spawn_and_write);
+  g_test_add_func ("/pipe/spawn/set-context", test_spawn_set_context);
   g_test_add_func ("/pipe/spawn/and-fail", test_spawn_and_fail);
   g_test_add_func ("/pipe/spawn/buffer-stderr", test_spawn_and_buffer_stderr);
 
@@ -1349,6 +1588,13 @@ main (int argc,
 
   g_test_add_func ("/pipe/problem-later", test_problem_later);
 
+  g_test_add_data_func ("/pipe/transport/burst", GUINT_TO_POINTER (10000), test_transport_burst);
+  if (g_test_perf ())
+    g_test_add_data_func ("/pipe/transport/burst-benchmark", GUINT_TO_POINTER (2000000), test_transport_burst);
+  g_test_add_data_func ("/pipe/transport/output", GUINT_TO_POINTER (10000), test_transport_output);
+  if (g_test_perf ())
+    g_test_add_data_func ("/pipe/transport/output-benchmark", GUINT_TO_POINTER (2000000), test_transport_output);
+
   g_test_add_func ("/pipe/connect/not-found", test_fail_not_found);
   g_test_add_func ("/pipe/connect/access-denied", test_fail_access_denied);
 
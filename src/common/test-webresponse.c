@@ -399,6 +399,275 @@ test_template (TestCase *tc,
   g_hash_table_unref (data);
 }
 
+static const TestFixture gunzip_fixture = {
+  .path = "/large.min.js"
+};
+
+static void
+test_file_gunzip (TestCase *tc,
+                  gconstpointer user_data)
+{
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  GHashTable *headers = NULL;
+  const gchar *resp;
+  gchar *checksum;
+  gsize length;
+  guint status;
+  gssize off;
+
+  /* Large enough that decompression happens in a thread */
+  cockpit_web_response_file_or_gz (tc->response, FALSE, NULL, roots);
+
+  resp = output_as_string (tc);
+  length = strlen (resp);
+
+  off = web_socket_util_parse_status_line (resp, length, NULL, &status, NULL);
+  g_assert_cmpuint (off, >, 0);
+  g_assert_cmpint (status, ==, 200);
+  resp += off;
+  length -= off;
+
+  off = web_socket_util_parse_headers (resp, length, &headers);
+  g_assert_cmpuint (off, >, 0);
+  g_assert (g_hash_table_lookup (headers, "Content-Encoding") == NULL);
+  g_assert_cmpuint (atoi (g_hash_table_lookup (headers, "Content-Length")), ==, length - off);
+  g_hash_table_unref (headers);
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, resp + off, length - off);
+  g_assert_cmpstr (checksum, ==, "5ca7582261c421482436dfdf3af9bffe");
+  g_free (checksum);
+}
+
+static gchar *
+request_file (const gchar *escaped,
+              const gchar **roots,
+              const gchar *if_none_match)
+{
+  GHashTable *headers = cockpit_web_server_new_table ();
+  GInputStream *input = g_memory_input_stream_new ();
+  GOutputStream *output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  GIOStream *io = g_simple_io_stream_new (input, output);
+  CockpitWebResponse *response;
+  gboolean done = FALSE;
+  gchar *resp;
+
+  if (if_none_match)
+    g_hash_table_insert (headers, g_strdup ("If-None-Match"), g_strdup (if_none_match));
+
+  response = cockpit_web_response_new (io, escaped, escaped, headers, "GET", "http");
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+  cockpit_web_response_file (response, escaped, roots);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  resp = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                    g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+
+  g_object_unref (response);
+  g_object_unref (io);
+  g_object_unref (output);
+  g_object_unref (input);
+  g_hash_table_unref (headers);
+  return resp;
+}
+
+static gchar *
+response_etag (const gchar *resp)
+{
+  GHashTable *headers = NULL;
+  gchar *etag;
+  gssize off;
+
+  off = web_socket_util_parse_status_line (resp, strlen (resp), NULL, NULL, NULL);
+  g_assert_cmpint (off, >, 0);
+  g_assert_cmpint (web_socket_util_parse_headers (resp + off, strlen (resp + off), &headers), >, 0);
+  etag = g_strdup (g_hash_table_lookup (headers, "ETag"));
+  g_hash_table_unref (headers);
+  return etag;
+}
+
+static void
+test_file_etag (void)
+{
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  gchar *resp;
+  gchar *etag;
+
+  resp = request_file ("/test-file.txt", roots, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*\r\n\r\nA small test file\n");
+  etag = response_etag (resp);
+  g_assert (etag != NULL);
+  g_free (resp);
+
+  resp = request_file ("/test-file.txt", roots, etag);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 304 Not Modified\r\n*\r\n\r\n");
+  g_assert (strstr (resp, "Content-Length") == NULL);
+  g_free (resp);
+
+  resp = request_file ("/test-file.txt", roots, "\"other\"");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*");
+  g_free (resp);
+
+  g_free (etag);
+}
+
+static void
+test_file_etag_list (void)
+{
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  gchar *header;
+  gchar *resp;
+  gchar *etag;
+
+  resp = request_file ("/test-file.txt", roots, NULL);
+  etag = response_etag (resp);
+  g_assert (etag != NULL);
+  g_free (resp);
+
+  header = g_strdup_printf ("\"other\", \"a,b\",%s", etag);
+  resp = request_file ("/test-file.txt", roots, header);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 304 Not Modified\r\n*");
+  g_free (resp);
+  g_free (header);
+
+  /* Weak comparison */
+  header = g_strdup_printf ("W/%s", etag);
+  resp = request_file ("/test-file.txt", roots, header);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 304 Not Modified\r\n*");
+  g_free (resp);
+  g_free (header);
+
+  resp = request_file ("/test-file.txt", roots, "*");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 304 Not Modified\r\n*");
+  g_free (resp);
+
+  resp = request_file ("/test-file.txt", roots, "\"other\", W/\"another\"");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*");
+  g_free (resp);
+
+  /* Not quoted, so not an entity tag */
+  header = g_strndup (etag + 1, strlen (etag) - 2);
+  resp = request_file ("/test-file.txt", roots, header);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*");
+  g_free (resp);
+  g_free (header);
+
+  g_free (etag);
+}
+
+static void
+test_file_changed (void)
+{
+  gchar *dir = g_dir_make_tmp ("test-webresponse.XXXXXX", NULL);
+  const gchar *roots[] = { dir, NULL };
+  gchar *path = g_build_filename (dir, "changing.txt", NULL);
+  gchar *resp;
+  gchar *etag;
+
+  /* Remembered as missing, until the next check */
+  resp = request_file ("/changing.txt", roots, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 404*");
+  g_free (resp);
+
+  g_assert (g_file_set_contents (path, "first", -1, NULL));
+  g_usleep (G_USEC_PER_SEC + G_USEC_PER_SEC / 10);
+
+  resp = request_file ("/changing.txt", roots, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*\r\n\r\nfirst");
+  etag = response_etag (resp);
+  g_free (resp);
+
+  g_assert (g_file_set_contents (path, "the second", -1, NULL));
+  g_usleep (G_USEC_PER_SEC + G_USEC_PER_SEC / 10);
+
+  resp = request_file ("/changing.txt", roots, etag);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*\r\n\r\nthe second");
+  g_free (resp);
+
+  g_free (etag);
+  g_unlink (path);
+  g_rmdir (dir);
+  g_free (path);
+  g_free (dir);
+}
+
+static const TestFixture range_fixture = {
+  .path = "/test-file.txt",
+  .header = "Range",
+  .value = "bytes=2-6"
+};
+
+static const TestFixture range_suffix_fixture = {
+  .path = "/test-file.txt",
+  .header = "Range",
+  .value = "bytes=-5"
+};
+
+static const TestFixture range_multiple_fixture = {
+  .path = "/test-file.txt",
+  .header = "Range",
+  .value = "bytes=0-0, 8-"
+};
+
+static const TestFixture range_unsatisfiable_fixture = {
+  .path = "/test-file.txt",
+  .header = "Range",
+  .value = "bytes=100-"
+};
+
+static const TestFixture range_invalid_fixture = {
+  .path = "/test-file.txt",
+  .header = "Range",
+  .value = "bytes=6-2"
+};
+
+static void
+test_file_range (TestCase *tc,
+                 gconstpointer user_data)
+{
+  const TestFixture *fixture = user_data;
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  const gchar *resp;
+
+  cockpit_web_response_file (tc->response, NULL, roots);
+  resp = output_as_string (tc);
+
+  if (fixture == &range_fixture)
+    {
+      cockpit_assert_strmatch (resp, "HTTP/1.1 206 Partial Content\r\n*"
+                               "Content-Range: bytes 2-6/18\r\n*"
+                               "Content-Length: 5\r\n*\r\n\r\nsmall");
+    }
+  else if (fixture == &range_suffix_fixture)
+    {
+      cockpit_assert_strmatch (resp, "HTTP/1.1 206 Partial Content\r\n*"
+                               "Content-Range: bytes 13-17/18\r\n*\r\n\r\nfile\n");
+    }
+  else if (fixture == &range_multiple_fixture)
+    {
+      cockpit_assert_strmatch (resp, "HTTP/1.1 206 Partial Content\r\n*"
+                               "Content-Type: multipart/byteranges; boundary=*\r\n\r\n"
+                               "--*\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-0/18\r\n\r\nA"
+                               "\r\n--*\r\nContent-Type: text/plain\r\nContent-Range: bytes 8-17/18\r\n\r\ntest file\n"
+                               "\r\n--*--\r\n");
+    }
+  else if (fixture == &range_unsatisfiable_fixture)
+    {
+      cockpit_assert_strmatch (resp, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                               "Content-Range: bytes */18\r\n*");
+    }
+  else if (fixture == &range_invalid_fixture)
+    {
+      cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*Accept-Ranges: bytes\r\n*"
+                               "\r\n\r\nA small test file\n");
+    }
+  else
+    {
+      g_assert_not_reached ();
+    }
+}
+
 static const TestFixture cache_none_fixture = {
   .path = "/pkg/shell/index.html",
   .cache = COCKPIT_WEB_RESPONSE_NO_CACHE
@@ -1478,6 +1747,21 @@ main (int argc,
               setup, test_file_breakout_non_existant, teardown);
   g_test_add ("/web-reponse/file/template", TestCase, &template_fixture,
               setup, test_template, teardown);
+  g_test_add ("/web-response/file/gunzip", TestCase, &gunzip_fixture,
+              setup, test_file_gunzip, teardown);
+  g_test_add_func ("/web-response/file/etag", test_file_etag);
+  g_test_add_func ("/web-response/file/etag-list", test_file_etag_list);
+  g_test_add_func ("/web-response/file/changed", test_file_changed);
+  g_test_add ("/web-response/file/range", TestCase, &range_fixture,
+              setup, test_file_range, teardown);
+  g_test_add ("/web-response/file/range-suffix", TestCase, &range_suffix_fixture,
+              setup, test_file_range, teardown);
+  g_test_add ("/web-response/file/range-multiple", TestCase, &range_multiple_fixture,
+              setup, test_file_range, teardown);
+  g_test_add ("/web-response/file/range-unsatisfiable", TestCase, &range_unsatisfiable_fixture,
+              setup, test_file_range, teardown);
+  g_test_add ("/web-response/file/range-invalid", TestCase, &range_invalid_fixture,
+              setup, test_file_range, teardown);
   g_test_add ("/web-response/content-type/html", TestCase, &content_type_fixture_html,
               setup, test_content_type, teardown);
   g_test_add ("/web-response/content-type/png", TestCase, &content_type_fixture_png,
@@ -370,6 +370,37 @@ on_ready_get_result (GObject *source,
   *retval = g_object_ref (result);
 }
 
+static GString *
+read_reply (GInputStream *input)
+{
+  GAsyncResult *result;
+  GError *error = NULL;
+  GString *reply;
+  gsize len;
+  gssize ret;
+
+  reply = g_string_new ("");
+  for (;;)
+    {
+      result = NULL;
+      len = reply->len;
+      g_string_set_size (reply, len + 1024);
+      g_input_stream_read_async (input, reply->str + len, 1024, G_PRIORITY_DEFAULT,
+                                 NULL, on_ready_get_result, &result);
+      while (result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      ret = g_input_stream_read_finish (input, result, &error);
+      g_object_unref (result);
+      g_assert_no_error (error);
+      g_assert (ret >= 0);
+      g_string_set_size (reply, len + ret);
+      if (ret == 0)
+        break;
+    }
+
+  return reply;
+}
+
 static gchar *
 perform_request (const gchar *hostport,
                  const gchar *request,
@@ -385,8 +416,6 @@ perform_request (const gchar *hostport,
   GOutputStream *output;
   GError *error = NULL;
   GString *reply;
-  gsize len;
-  gssize ret;
 
   connectable = g_network_address_parse (hostport, 0, &error);
   g_assert_no_error (error);
@@ -432,24 +461,7 @@ perform_request (const gchar *hostport,
   g_socket_shutdown (g_socket_connection_get_socket (conn), FALSE, TRUE, &error);
   g_assert_no_error (error);
 
-  reply = g_string_new ("");
-  for (;;)
-    {
-      result = NULL;
-      len = reply->len;
-      g_string_set_size (reply, len + 1024);
-      g_input_stream_read_async (input, reply->str + len, 1024, G_PRIORITY_DEFAULT,
-                                 NULL, on_ready_get_result, &result);
-      while (result == NULL)
-        g_main_context_iteration (NULL, TRUE);
-      ret = g_input_stream_read_finish (input, result, &error);
-      g_object_unref (result);
-      g_assert_no_error (error);
-      g_assert (ret >= 0);
-      g_string_set_size (reply, len + ret);
-      if (ret == 0)
-        break;
-    }
+  reply = read_reply (input);
 
   if (tls)
     g_object_unref (tls_conn);
@@ -1043,6 +1055,140 @@ test_webserver_with_headers (Fixture *fixture,
   cockpit_assert_strmatch (resp, "HTTP/* 200 *\r\n*");
 }
 
+/*
+ * Sends the request in random chunks of up to @max_chunk bytes, letting
+ * the server process each chunk before sending the next.
+ */
+static gchar *
+perform_trickled_request (const gchar *hostport,
+                          const gchar *request,
+                          gsize length,
+                          gint max_chunk)
+{
+  GSocketClient *client;
+  GSocketConnection *conn;
+  GOutputStream *output;
+  GError *error = NULL;
+  GString *reply;
+  gsize offset;
+  gsize chunk;
+
+  client = g_socket_client_new ();
+  conn = g_socket_client_connect_to_host (client, hostport, 0, NULL, &error);
+  g_assert_no_error (error);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (conn));
+  for (offset = 0; offset < length; offset += chunk)
+    {
+      chunk = MIN (g_test_rand_int_range (1, max_chunk + 1), length - offset);
+      g_output_stream_write_all (output, request + offset, chunk, NULL, NULL, &error);
+      g_assert_no_error (error);
+      while (g_main_context_iteration (NULL, FALSE));
+    }
+
+  g_socket_shutdown (g_socket_connection_get_socket (conn), FALSE, TRUE, &error);
+  g_assert_no_error (error);
+
+  reply = read_reply (g_io_stream_get_input_stream (G_IO_STREAM (conn)));
+
+  g_object_unref (conn);
+  g_object_unref (client);
+  return g_string_free (reply, FALSE);
+}
+
+static gboolean
+on_echo_header (CockpitWebServer *server,
+                CockpitWebRequest *request,
+                const gchar *path,
+                GHashTable *headers,
+                CockpitWebResponse *response,
+                gpointer user_data)
+{
+  const gchar *value = g_hash_table_lookup (headers, "X-Echo");
+  g_autoptr(GBytes) content = g_bytes_new (value, value ? strlen (value) : 0);
+  cockpit_web_response_content (response, NULL, content, NULL);
+  return TRUE;
+}
+
+static gchar *
+build_trickle_request (const gchar *echo,
+                       gint n_headers)
+{
+  GString *request = g_string_new ("GET /echo HTTP/1.0\r\nHost: test\r\n");
+
+  for (gint i = 0; i < n_headers; i++)
+    g_string_append_printf (request, "X-Filler-%d: %0*d\r\n", i, 40, i);
+  g_string_append_printf (request, "X-Echo: %s\r\n\r\n", echo);
+
+  return g_string_free (request, FALSE);
+}
+
+static void
+test_trickle (Fixture *fixture,
+              const TestCase *test_case)
+{
+  g_signal_connect (fixture->web_server, "handle-resource", G_CALLBACK (on_echo_header), NULL);
+
+  for (gint i = 0; i < 50; i++)
+    {
+      g_autofree gchar *echo = g_strdup_printf ("value-%d", g_test_rand_int ());
+      g_autofree gchar *request = build_trickle_request (echo, 10);
+      g_autofree gchar *resp = perform_trickled_request (fixture->localport, request, strlen (request),
+                                                         g_test_rand_int_range (1, 64));
+      g_autofree gchar *expected = g_strdup_printf ("HTTP/1.1 200 OK\r\n*\r\n\r\n%s", echo);
+      cockpit_assert_strmatch (resp, expected);
+    }
+}
+
+static void
+test_trickle_fuzz (Fixture *fixture,
+                   const TestCase *test_case)
+{
+  static const gchar replacements[] = { '\n', '\r', ':', ' ', '\0', '\xff', '\x01', 'a' };
+
+  g_signal_connect (fixture->web_server, "handle-resource", G_CALLBACK (on_echo_header), NULL);
+
+  for (gint i = 0; i < 200; i++)
+    {
+      g_autofree gchar *request = build_trickle_request ("fuzz", 4);
+      gsize length = strlen (request);
+
+      /* Leave the first byte alone, it selects between TLS and HTTP */
+      gint n_mutations = g_test_rand_int_range (1, 4);
+      for (gint j = 0; j < n_mutations; j++)
+        request[g_test_rand_int_range (1, length)] = replacements[g_test_rand_int_range (0, G_N_ELEMENTS (replacements))];
+
+      /* The request may be rejected, with a message, but must not confuse the server */
+      cockpit_expect_possible_log ("cockpit-protocol", G_LOG_LEVEL_MESSAGE, "received *");
+      cockpit_expect_possible_log ("cockpit-protocol", G_LOG_LEVEL_MESSAGE, "received *");
+
+      g_autofree gchar *resp = perform_trickled_request (fixture->localport, request, length,
+                                                         g_test_rand_int_range (1, 16));
+      g_assert (resp[0] == '\0' || g_str_has_prefix (resp, "HTTP/1.1 "));
+    }
+}
+
+static void
+test_trickle_benchmark (Fixture *fixture,
+                        const TestCase *test_case)
+{
+  g_autofree gchar *request = build_trickle_request ("benchmark", 100);
+  gsize length = strlen (request);
+
+  g_signal_connect (fixture->web_server, "handle-resource", G_CALLBACK (on_echo_header), NULL);
+
+  g_test_timer_start ();
+
+  for (gint i = 0; i < 20; i++)
+    {
+      g_autofree gchar *resp = perform_trickled_request (fixture->localport, request, length, 8);
+      cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*\r\n\r\nbenchmark");
+    }
+
+  g_test_minimized_result (g_test_timer_elapsed (),
+                           "20 requests of %" G_GSIZE_FORMAT " bytes in chunks of up to 8 bytes", length);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1090,6 +1236,11 @@ main (int argc,
 
   cockpit_test_add ("/web-server/handle-resource", test_handle_resource);
 
+  cockpit_test_add ("/web-server/trickle", test_trickle);
+  cockpit_test_add ("/web-server/trickle-fuzz", test_trickle_fuzz);
+  if (g_test_perf ())
+    cockpit_test_add ("/web-server/trickle-benchmark", test_trickle_benchmark);
+
   cockpit_test_add ("/web-server/url-root", test_url_root);
   cockpit_test_add ("/web-server/url-root-handlers", test_handle_resource_url_root);
 
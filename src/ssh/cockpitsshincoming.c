@@ -0,0 +1,143 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsshincoming.h"
+
+#include <string.h>
+
+#define MAX_POOLED_SLABS   4
+
+/*
+ * Below this a flush is copied into a block of its own, and the slab
+ * stays to gather more. A small message never pins a whole slab.
+ */
+#define MIN_HANDOVER_SIZE  (16 * 1024)
+
+static GQueue slab_pool = G_QUEUE_INIT;
+
+static guint8 *
+slab_get (void)
+{
+  guint8 *slab = g_queue_pop_head (&slab_pool);
+  return slab ? slab : g_malloc (COCKPIT_SSH_INCOMING_SLAB_SIZE);
+}
+
+static void
+slab_release (gpointer slab)
+{
+  if (slab_pool.length < MAX_POOLED_SLABS)
+    g_queue_push_head (&slab_pool, slab);
+  else
+    g_free (slab);
+}
+
+/**
+ * cockpit_ssh_incoming_fits:
+ * @self: the gathered data
+ * @length: the size of a block to append
+ *
+ * Returns: %TRUE if the block can be appended without a flush
+ */
+gboolean
+cockpit_ssh_incoming_fits (CockpitSshIncoming *self,
+                           gsize length)
+{
+  return length <= COCKPIT_SSH_INCOMING_SLAB_SIZE - self->length;
+}
+
+/**
+ * cockpit_ssh_incoming_append:
+ * @self: the gathered data
+ * @data: the block to append
+ * @length: its size, which must fit
+ */
+void
+cockpit_ssh_incoming_append (CockpitSshIncoming *self,
+                             const guint8 *data,
+                             gsize length)
+{
+  g_return_if_fail (cockpit_ssh_incoming_fits (self, length));
+
+  if (!self->slab)
+    self->slab = slab_get ();
+  memcpy (self->slab + self->length, data, length);
+  self->length += length;
+}
+
+/**
+ * cockpit_ssh_incoming_flush:
+ * @self: the gathered data
+ *
+ * Large amounts of data are handed over with the slab itself, which
+ * returns to the pool when the bytes are freed. Small amounts are
+ * copied, and the slab is kept.
+ *
+ * Returns: (transfer full): the gathered data, or %NULL if empty
+ */
+GBytes *
+cockpit_ssh_incoming_flush (CockpitSshIncoming *self)
+{
+  GBytes *bytes;
+
+  if (self->length == 0)
+    return NULL;
+
+  if (self->length < MIN_HANDOVER_SIZE)
+    {
+      bytes = g_bytes_new (self->slab, self->length);
+    }
+  else
+    {
+      bytes = g_bytes_new_with_free_func (self->slab, self->length, slab_release, self->slab);
+      self->slab = NULL;
+    }
+
+  self->length = 0;
+  return bytes;
+}
+
+/**
+ * cockpit_ssh_incoming_clear:
+ * @self: the gathered data
+ *
+ * Drop any gathered data, and return the slab to the pool.
+ */
+void
+cockpit_ssh_incoming_clear (CockpitSshIncoming *self)
+{
+  if (self->slab)
+    slab_release (self->slab);
+  self->slab = NULL;
+  self->length = 0;
+}
+
+/**
+ * cockpit_ssh_incoming_pooled:
+ *
+ * Used by tests.
+ *
+ * Returns: the number of slabs waiting in the pool
+ */
+guint
+cockpit_ssh_incoming_pooled (void)
+{
+  return slab_pool.length;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_SSH_INCOMING_H__
+#define __COCKPIT_SSH_INCOMING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Gathers channel data into large slabs, which go on as one block per
+ * dispatch. Slabs handed out come back to a small pool once written.
+ */
+
+#define COCKPIT_SSH_INCOMING_SLAB_SIZE  (256 * 1024)
+
+typedef struct {
+  guint8 *slab;
+  gsize length;
+} CockpitSshIncoming;
+
+gboolean       cockpit_ssh_incoming_fits          (CockpitSshIncoming *self,
+                                                   gsize length);
+
+void           cockpit_ssh_incoming_append        (CockpitSshIncoming *self,
+                                                   const guint8 *data,
+                                                   gsize length);
+
+GBytes *       cockpit_ssh_incoming_flush         (CockpitSshIncoming *self);
+
+void           cockpit_ssh_incoming_clear         (CockpitSshIncoming *self);
+
+guint          cockpit_ssh_incoming_pooled        (void);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsshknownhosts.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+#define INDEX_GROUP "known-hosts"
+
+static gchar *
+known_hosts_index_path (const gchar *file)
+{
+  gchar *checksum;
+  gchar *filename;
+  gchar *path;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, file, -1);
+  filename = g_strdup_printf ("%s.known-hosts", checksum);
+  path = g_build_filename (g_get_user_cache_dir (), "cockpit", "ssh", filename, NULL);
+  g_free (filename);
+  g_free (checksum);
+
+  return path;
+}
+
+static void
+save_known_hosts_index (const gchar *path,
+                        GKeyFile *index)
+{
+  GError *error = NULL;
+  gchar *directory;
+  gchar *data;
+  gsize length;
+
+  directory = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (directory, 0700) < 0)
+    {
+      g_debug ("couldn't create directory for known hosts index: %s: %s",
+               directory, g_strerror (errno));
+    }
+  else
+    {
+      data = g_key_file_to_data (index, &length, NULL);
+      if (!g_file_set_contents (path, data, length, &error))
+        {
+          g_debug ("couldn't write known hosts index: %s", error->message);
+          g_clear_error (&error);
+        }
+      g_free (data);
+    }
+
+  g_free (directory);
+}
+
+static gboolean
+known_hosts_index_current (GKeyFile *index,
+                           const gchar *file,
+                           gint64 mtime,
+                           gint64 size)
+{
+  gchar *path;
+  gboolean ret;
+
+  path = g_key_file_get_string (index, INDEX_GROUP, "path", NULL);
+  ret = g_strcmp0 (path, file) == 0 &&
+        g_key_file_get_int64 (index, INDEX_GROUP, "mtime", NULL) == mtime &&
+        g_key_file_get_int64 (index, INDEX_GROUP, "size", NULL) == size;
+  g_free (path);
+
+  return ret;
+}
+
+static void
+parse_known_hosts_line (gchar *line,
+                        GPtrArray *hosts,
+                        GPtrArray *hashed,
+                        gboolean *patterns)
+{
+  gchar **fields;
+  gchar **names;
+  guint i;
+
+  line = g_strstrip (line);
+  if (line[0] == '\0' || line[0] == '#')
+    return;
+
+  /* Markers like @cert-authority and @revoked are for libssh to decide */
+  if (line[0] == '@')
+    {
+      *patterns = TRUE;
+      return;
+    }
+
+  /* The host names, then the key type and the key */
+  fields = g_strsplit_set (line, " \t", 2);
+  if (fields[0] && fields[1] && strpbrk (g_strstrip (fields[1]), " \t"))
+    {
+      names = g_strsplit (fields[0], ",", -1);
+      for (i = 0; names[i] != NULL; i++)
+        {
+          if (g_str_has_prefix (names[i], "|1|"))
+            g_ptr_array_add (hashed, g_strdup (names[i]));
+          else if (strpbrk (names[i], "*?!"))
+            *patterns = TRUE;
+          else if (names[i][0] != '\0')
+            g_ptr_array_add (hosts, g_ascii_strdown (names[i], -1));
+        }
+      g_strfreev (names);
+    }
+
+  g_strfreev (fields);
+}
+
+static GKeyFile *
+parse_known_hosts (const gchar *file,
+                   gint64 mtime,
+                   gint64 size)
+{
+  GError *error = NULL;
+  GPtrArray *hosts;
+  GPtrArray *hashed;
+  gboolean patterns = FALSE;
+  GKeyFile *index;
+  gchar *contents;
+  gchar **lines;
+  guint i;
+
+  if (!g_file_get_contents (file, &contents, NULL, &error))
+    {
+      g_debug ("couldn't read known hosts file: %s", error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  hosts = g_ptr_array_new_with_free_func (g_free);
+  hashed = g_ptr_array_new_with_free_func (g_free);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    parse_known_hosts_line (lines[i], hosts, hashed, &patterns);
+  g_strfreev (lines);
+  g_free (contents);
+
+  index = g_key_file_new ();
+  g_key_file_set_string (index, INDEX_GROUP, "path", file);
+  g_key_file_set_int64 (index, INDEX_GROUP, "mtime", mtime);
+  g_key_file_set_int64 (index, INDEX_GROUP, "size", size);
+  g_key_file_set_boolean (index, INDEX_GROUP, "patterns", patterns);
+  g_key_file_set_string_list (index, INDEX_GROUP, "hosts",
+                              (const gchar * const *)hosts->pdata, hosts->len);
+  g_key_file_set_string_list (index, INDEX_GROUP, "hashed",
+                              (const gchar * const *)hashed->pdata, hashed->len);
+
+  g_ptr_array_free (hosts, TRUE);
+  g_ptr_array_free (hashed, TRUE);
+
+  return index;
+}
+
+/*
+ * A hashed entry looks like |1|salt|hash where the hash is the
+ * HMAC-SHA1 of the host name keyed with the salt, both in base64.
+ */
+static gboolean
+match_hashed_host (const gchar *entry,
+                   const gchar *name)
+{
+  gboolean ret = FALSE;
+  gchar **parts;
+  guchar *salt;
+  gsize salt_len;
+  guint8 digest[20];
+  gsize digest_len = sizeof (digest);
+  gchar *encoded;
+  GHmac *hmac;
+
+  parts = g_strsplit (entry + 3, "|", 2);
+  if (parts[0] && parts[1])
+    {
+      salt = g_base64_decode (parts[0], &salt_len);
+      hmac = g_hmac_new (G_CHECKSUM_SHA1, salt, salt_len);
+      g_hmac_update (hmac, (const guchar *)name, -1);
+      g_hmac_get_digest (hmac, digest, &digest_len);
+      encoded = g_base64_encode (digest, digest_len);
+      ret = g_str_equal (encoded, parts[1]);
+      g_free (encoded);
+      g_hmac_unref (hmac);
+      g_free (salt);
+    }
+
+  g_strfreev (parts);
+  return ret;
+}
+
+static CockpitSshKnownHost
+lookup_known_hosts_index (GKeyFile *index,
+                          const gchar *host,
+                          guint port)
+{
+  CockpitSshKnownHost ret = COCKPIT_SSH_KNOWN_HOST_UNKNOWN;
+  gchar **hosts;
+  gchar **hashed;
+  gchar *lower;
+  gchar *name;
+  guint i;
+
+  if (g_key_file_get_boolean (index, INDEX_GROUP, "patterns", NULL))
+    return COCKPIT_SSH_KNOWN_HOST_UNDECIDED;
+
+  /* Same as libssh looks for the host */
+  lower = g_ascii_strdown (host, -1);
+  if (port == 0 || port == 22)
+    name = g_strdup (lower);
+  else
+    name = g_strdup_printf ("[%s]:%u", lower, port);
+
+  hosts = g_key_file_get_string_list (index, INDEX_GROUP, "hosts", NULL, NULL);
+  for (i = 0; hosts && hosts[i] != NULL; i++)
+    {
+      if (g_str_equal (hosts[i], name))
+        ret = COCKPIT_SSH_KNOWN_HOST_KNOWN;
+    }
+
+  hashed = g_key_file_get_string_list (index, INDEX_GROUP, "hashed", NULL, NULL);
+  for (i = 0; ret != COCKPIT_SSH_KNOWN_HOST_KNOWN && hashed && hashed[i] != NULL; i++)
+    {
+      if (match_hashed_host (hashed[i], name))
+        ret = COCKPIT_SSH_KNOWN_HOST_KNOWN;
+    }
+
+  g_strfreev (hosts);
+  g_strfreev (hashed);
+  g_free (lower);
+  g_free (name);
+
+  return ret;
+}
+
+/**
+ * cockpit_ssh_known_hosts_lookup:
+ * @file: path of a known_hosts file
+ * @host: the host name to look for
+ * @port: the ssh port of the host
+ *
+ * Look for an entry for @host in @file, using the index of the file
+ * when it's still current.
+ *
+ * Returns: %COCKPIT_SSH_KNOWN_HOST_UNDECIDED when the index can't
+ * tell, and libssh needs to look at the file itself.
+ */
+CockpitSshKnownHost
+cockpit_ssh_known_hosts_lookup (const gchar *file,
+                                const gchar *host,
+                                guint port)
+{
+  CockpitSshKnownHost ret = COCKPIT_SSH_KNOWN_HOST_UNDECIDED;
+  GKeyFile *index = NULL;
+  struct stat sb;
+  gchar *path;
+  gint64 mtime;
+
+  g_return_val_if_fail (file != NULL, COCKPIT_SSH_KNOWN_HOST_UNDECIDED);
+  g_return_val_if_fail (host != NULL, COCKPIT_SSH_KNOWN_HOST_UNDECIDED);
+
+  if (stat (file, &sb) < 0)
+    {
+      if (errno == ENOENT)
+        return COCKPIT_SSH_KNOWN_HOST_UNKNOWN;
+      return COCKPIT_SSH_KNOWN_HOST_UNDECIDED;
+    }
+
+  mtime = (gint64) sb.st_mtim.tv_sec * G_USEC_PER_SEC + sb.st_mtim.tv_nsec / 1000;
+  path = known_hosts_index_path (file);
+
+  index = g_key_file_new ();
+  if (!g_key_file_load_from_file (index, path, G_KEY_FILE_NONE, NULL) ||
+      !known_hosts_index_current (index, file, mtime, (gint64) sb.st_size))
+    {
+      g_key_file_free (index);
+      index = parse_known_hosts (file, mtime, (gint64) sb.st_size);
+      if (index)
+        save_known_hosts_index (path, index);
+    }
+
+  if (index)
+    {
+      ret = lookup_known_hosts_index (index, host, port);
+      g_key_file_free (index);
+    }
+
+  g_free (path);
+  return ret;
+}
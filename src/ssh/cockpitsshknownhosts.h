@@ -0,0 +1,46 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_SSH_KNOWN_HOSTS_H__
+#define __COCKPIT_SSH_KNOWN_HOSTS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * An index of the host names in a known_hosts file, kept in the user's
+ * cache directory. It's parsed again only when the file changes. Files
+ * with wildcards or markers can't be answered from the index, those are
+ * left to libssh.
+ */
+
+typedef enum {
+  COCKPIT_SSH_KNOWN_HOST_UNDECIDED,
+  COCKPIT_SSH_KNOWN_HOST_UNKNOWN,
+  COCKPIT_SSH_KNOWN_HOST_KNOWN,
+} CockpitSshKnownHost;
+
+CockpitSshKnownHost  cockpit_ssh_known_hosts_lookup   (const gchar *file,
+                                                       const gchar *host,
+                                                       guint port);
+
+G_END_DECLS
+
+#endif
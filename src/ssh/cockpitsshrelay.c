@@ -30,6 +30,8 @@
 
 #include "cockpitsshrelay.h"
 #include "cockpitsshoptions.h"
+#include "cockpitsshincoming.h"
+#include "cockpitsshknownhosts.h"
 
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
@@ -41,7 +43,10 @@
 
 #include <glib/gstdio.h>
 
+#include <sys/socket.h>
 #include <errno.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -70,6 +75,12 @@ typedef struct {
   gchar *user_known_hosts;
 
   gchar *problem_error;
+
+  /* Resolving and connecting while we wait for credentials */
+  GThread *preconnect;
+  GCancellable *preconnect_cancel;
+  gchar *preconnect_host;
+  guint preconnect_port;
 } CockpitSshData;
 
 static gchar *tmp_knownhost_file;
@@ -245,9 +256,42 @@ send_authorize_challenge (const gchar *challenge)
   json_object_unref (object);
 }
 
+/*
+ * A warm process was started by cockpit-ws before anyone logged in, so
+ * it's told about the remote peer and such with the login reply, instead
+ * of in its environment.
+ */
+static void
+update_login_environment (CockpitSshData *data,
+                          JsonObject *reply)
+{
+  const gchar *remote_peer = NULL;
+  const gchar *unknown_hosts = NULL;
+
+  if (!cockpit_json_get_string (reply, "remote-peer", NULL, &remote_peer) ||
+      !cockpit_json_get_string (reply, "connect-to-unknown-hosts", NULL, &unknown_hosts))
+    {
+      g_message ("%s: received invalid login options", data->logname);
+      return;
+    }
+
+  if (remote_peer)
+    data->env = g_environ_setenv (data->env, "COCKPIT_REMOTE_PEER", remote_peer, TRUE);
+  if (unknown_hosts)
+    data->env = g_environ_setenv (data->env, "COCKPIT_SSH_CONNECT_TO_UNKNOWN_HOSTS", unknown_hosts, TRUE);
+
+  /* The options point into the environment */
+  if (remote_peer || unknown_hosts)
+    {
+      g_free (data->ssh_options);
+      data->ssh_options = cockpit_ssh_options_from_env (data->env);
+    }
+}
+
 static gchar *
 challenge_for_auth_data (const gchar *challenge,
-                         gchar **ret_type)
+                         gchar **ret_type,
+                         CockpitSshData *login)
 {
   const gchar *response = NULL;
   const gchar *command;
@@ -269,6 +313,10 @@ challenge_for_auth_data (const gchar *challenge,
     {
       g_message ("received unexpected \"authorize\" control message: %s", response);
     }
+  else if (login)
+    {
+      update_login_environment (login, reply);
+    }
 
   if (response)
     cockpit_authorize_type (response, &type);
@@ -294,7 +342,7 @@ challenge_for_knownhosts_data (CockpitSshData *data)
   gchar *ret = NULL;
   gchar *response = NULL;
 
-  response = challenge_for_auth_data ("x-host-key", NULL);
+  response = challenge_for_auth_data ("x-host-key", NULL, NULL);
   if (response)
     {
       value = cockpit_authorize_type (response, NULL);
@@ -472,8 +520,18 @@ session_has_known_host_in_file (const gchar *file,
   */
 
   ssh_session tmp_session;
+  CockpitSshKnownHost known;
   gboolean result;
   g_warn_if_fail (ssh_options_set (data->session, SSH_OPTIONS_KNOWNHOSTS, file) == 0);
+
+  /* Most files can be answered from their index, without parsing them again */
+  if (file && g_strcmp0 (file, tmp_knownhost_file) != 0)
+    {
+      known = cockpit_ssh_known_hosts_lookup (file, host, port);
+      if (known != COCKPIT_SSH_KNOWN_HOST_UNDECIDED)
+        return known == COCKPIT_SSH_KNOWN_HOST_KNOWN;
+    }
+
   ssh_options_copy (data->session, &tmp_session);
   result = ssh_session_has_known_hosts_entry (tmp_session) == SSH_KNOWN_HOSTS_OK;
   ssh_free (tmp_session);
@@ -512,8 +570,9 @@ set_knownhosts_file (CockpitSshData *data,
   /* first check the libssh defaults including local and global file */
   host_known = session_has_known_host_in_file (NULL, data, host, port);
 
-  /* check file set by COCKPIT_SSH_KNOWN_HOSTS_FILE */
-  if (!host_known)
+  /* check file set by COCKPIT_SSH_KNOWN_HOSTS_FILE, parsing it only when it's there */
+  if (!host_known && data->ssh_options->knownhosts_file &&
+      g_file_test (data->ssh_options->knownhosts_file, G_FILE_TEST_EXISTS))
     host_known = session_has_known_host_in_file (data->ssh_options->knownhosts_file, data, host, port);
 
   if (!host_known)
@@ -1050,7 +1109,7 @@ has_password (CockpitSshData *data)
   if (data->auth_type == NULL &&
       data->initial_auth_data == NULL)
     {
-      data->initial_auth_data = challenge_for_auth_data ("basic", &data->auth_type);
+      data->initial_auth_data = challenge_for_auth_data ("basic", &data->auth_type, NULL);
     }
 
   return (data->initial_auth_data != NULL &&
@@ -1323,6 +1382,224 @@ username_from_basic (const gchar *basic_data)
   return user;
 }
 
+/* The libssh connect timeout, when none is configured */
+#define PRECONNECT_TIMEOUT 10
+
+typedef struct {
+  gchar *host;
+  guint port;
+  GCancellable *cancellable;
+} Preconnect;
+
+static gboolean
+preconnect_address (int fd,
+                    struct addrinfo *ai,
+                    gint64 deadline,
+                    GCancellable *cancellable)
+{
+  struct pollfd pfd[2] = { { .fd = fd, .events = POLLOUT }, { .fd = -1, .events = POLLIN } };
+  socklen_t len = sizeof (int);
+  gboolean cancel_fd;
+  GPollFD poll_fd;
+  gint64 remaining;
+  int error = 0;
+  int ret;
+
+  if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+    return TRUE;
+  if (errno != EINPROGRESS)
+    return FALSE;
+
+  /* Cancelling wakes the poll up */
+  cancel_fd = g_cancellable_make_pollfd (cancellable, &poll_fd);
+  if (cancel_fd)
+    pfd[1].fd = poll_fd.fd;
+
+  do
+    {
+      remaining = (deadline - g_get_monotonic_time ()) / 1000;
+      ret = remaining > 0 ? poll (pfd, 2, remaining) : 0;
+    }
+  while (ret < 0 && errno == EINTR);
+
+  if (cancel_fd)
+    g_cancellable_release_fd (cancellable);
+
+  if (ret <= 0 || !(pfd[0].revents & (POLLOUT | POLLERR | POLLHUP)))
+    return FALSE;
+  if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+    return FALSE;
+  return error == 0;
+}
+
+static gpointer
+preconnect_thread (gpointer user_data)
+{
+  Preconnect *pc = user_data;
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_ADDRCONFIG };
+  struct addrinfo *res = NULL;
+  struct addrinfo *ai;
+  gchar service[16];
+  gint64 deadline;
+  int fd = -1;
+
+  g_snprintf (service, sizeof (service), "%u", pc->port);
+  if (getaddrinfo (pc->host, service, &hints, &res) == 0)
+    {
+      /* Never wait for longer than libssh would, nor past teardown */
+      deadline = g_get_monotonic_time () + PRECONNECT_TIMEOUT * G_USEC_PER_SEC;
+      for (ai = res; ai != NULL; ai = ai->ai_next)
+        {
+          if (g_cancellable_is_cancelled (pc->cancellable))
+            break;
+          fd = socket (ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+          if (fd < 0)
+            continue;
+          if (preconnect_address (fd, ai, deadline, pc->cancellable))
+            break;
+          close (fd);
+          fd = -1;
+        }
+      freeaddrinfo (res);
+    }
+
+  g_object_unref (pc->cancellable);
+  g_free (pc->host);
+  g_free (pc);
+
+  /* Zero means failure */
+  return GINT_TO_POINTER (fd + 1);
+}
+
+/*
+ * Resolve the host and connect to it in a thread, while the
+ * main thread waits for credentials. Only the host and port
+ * can be known this early, so ssh config that tunnels the
+ * connection can't be used with this.
+ */
+static void
+start_preconnect (CockpitSshData *data,
+                  const gchar *host_arg)
+{
+  g_autofree gchar *host = NULL;
+  g_autofree gchar *username = NULL;
+  gchar *new_host = NULL;
+  gchar *proxy = NULL;
+  ssh_session tmp_session;
+  Preconnect *pc;
+  guint port = 0;
+
+  if (!cockpit_conf_bool (COCKPIT_CONF_SSH_SECTION, "preconnect", FALSE))
+    return;
+  if (!parse_host (host_arg, &host, &username, &port))
+    return;
+
+  /* Same as cockpit_ssh_connect() will do, on a throw away session */
+  tmp_session = ssh_new ();
+  g_warn_if_fail (ssh_options_set (tmp_session, SSH_OPTIONS_HOST, host) == 0);
+  g_warn_if_fail (ssh_options_parse_config (tmp_session, NULL) == 0);
+  if (port != 0)
+    g_warn_if_fail (ssh_options_set (tmp_session, SSH_OPTIONS_PORT, &port) == 0);
+
+  if (ssh_options_get (tmp_session, SSH_OPTIONS_PROXYCOMMAND, &proxy) == SSH_OK)
+    {
+      g_debug ("%s: not connecting early through proxy command", data->logname);
+      ssh_string_free_char (proxy);
+    }
+  else if (ssh_options_get (tmp_session, SSH_OPTIONS_HOST, &new_host) == SSH_OK &&
+           ssh_options_get_port (tmp_session, &port) == SSH_OK)
+    {
+      pc = g_new0 (Preconnect, 1);
+      pc->host = g_strdup (new_host);
+      pc->port = port;
+      data->preconnect_cancel = g_cancellable_new ();
+      pc->cancellable = g_object_ref (data->preconnect_cancel);
+      data->preconnect_host = g_strdup (new_host);
+      data->preconnect_port = port;
+      data->preconnect = g_thread_new ("preconnect", preconnect_thread, pc);
+    }
+
+  if (new_host)
+    ssh_string_free_char (new_host);
+  ssh_free (tmp_session);
+}
+
+static int
+join_preconnect (CockpitSshData *data)
+{
+  int fd;
+
+  fd = GPOINTER_TO_INT (g_thread_join (data->preconnect)) - 1;
+  data->preconnect = NULL;
+  return fd;
+}
+
+static void
+finish_preconnect (CockpitSshData *data,
+                   const gchar *host,
+                   guint port)
+{
+  int fd;
+
+  if (!data->preconnect)
+    return;
+
+  /* When that didn't work, libssh tries again and reports the problem */
+  fd = join_preconnect (data);
+  if (fd < 0)
+    return;
+
+  if (g_strcmp0 (host, data->preconnect_host) != 0 || port != data->preconnect_port)
+    {
+      close (fd);
+      return;
+    }
+
+  /* libssh owns the socket from here on, it's already non-blocking */
+  g_debug ("%s: using early connection to %s:%u", data->logname, host, port);
+  g_warn_if_fail (ssh_options_set (data->session, SSH_OPTIONS_FD, &fd) == 0);
+}
+
+static void
+set_transport_option (CockpitSshData *data,
+                      enum ssh_options_e option,
+                      const gchar *field)
+{
+  const gchar *value = cockpit_conf_string (COCKPIT_CONF_SSH_SECTION, field);
+
+  /* An invalid list leaves the libssh default in place */
+  if (value && ssh_options_set (data->session, option, value) != 0)
+    g_message ("%s: invalid %s option: %s: %s", data->logname, field, value, ssh_get_error (data->session));
+}
+
+static void
+set_transport_options (CockpitSshData *data)
+{
+  gboolean compression;
+  int level;
+
+  if (cockpit_conf_string (COCKPIT_CONF_SSH_SECTION, "compression"))
+    {
+      /* The peer may still decline, "none" stays acceptable */
+      compression = cockpit_conf_bool (COCKPIT_CONF_SSH_SECTION, "compression", FALSE);
+      if (ssh_options_set (data->session, SSH_OPTIONS_COMPRESSION,
+                           compression ? "zlib@openssh.com,zlib,none" : "none") != 0)
+        g_message ("%s: couldn't set compression: %s", data->logname, ssh_get_error (data->session));
+
+      if (compression)
+        {
+          level = cockpit_conf_uint (COCKPIT_CONF_SSH_SECTION, "compressionLevel", 6, 9, 1);
+          g_warn_if_fail (ssh_options_set (data->session, SSH_OPTIONS_COMPRESSION_LEVEL, &level) == 0);
+        }
+    }
+
+  set_transport_option (data, SSH_OPTIONS_CIPHERS_C_S, "ciphers");
+  set_transport_option (data, SSH_OPTIONS_CIPHERS_S_C, "ciphers");
+  set_transport_option (data, SSH_OPTIONS_KEY_EXCHANGE, "kex");
+  set_transport_option (data, SSH_OPTIONS_HMAC_C_S, "macs");
+  set_transport_option (data, SSH_OPTIONS_HMAC_S_C, "macs");
+}
+
 static const gchar*
 cockpit_ssh_connect (CockpitSshData *data,
                      const gchar *host_arg,
@@ -1375,6 +1652,8 @@ cockpit_ssh_connect (CockpitSshData *data,
   if (port != 0)
     g_warn_if_fail (ssh_options_set (data->session, SSH_OPTIONS_PORT, &port) == 0);
 
+  set_transport_options (data);
+
   /* Parsing the config might have changed the host or port */
   gchar *new_host;
   if (ssh_options_get (data->session, SSH_OPTIONS_HOST, &new_host) == 0)
@@ -1384,6 +1663,8 @@ cockpit_ssh_connect (CockpitSshData *data,
     }
   g_warn_if_fail (ssh_options_get_port (data->session, &port) == 0);
 
+  finish_preconnect (data, host, port);
+
   /* This is a single host, for which we have been told to ignore the host key */
   ignore_hostkey = cockpit_conf_string (COCKPIT_CONF_SSH_SECTION, "host");
   if (!ignore_hostkey)
@@ -1456,6 +1737,18 @@ out:
 static void
 cockpit_ssh_data_free (CockpitSshData *data)
 {
+  int fd;
+
+  if (data->preconnect)
+    {
+      g_cancellable_cancel (data->preconnect_cancel);
+      fd = join_preconnect (data);
+      if (fd >= 0)
+        close (fd);
+    }
+  g_clear_object (&data->preconnect_cancel);
+  g_free (data->preconnect_host);
+
   if (data->initial_auth_data)
     {
       memset (data->initial_auth_data, 0, strlen (data->initial_auth_data));
@@ -1505,6 +1798,9 @@ struct  _CockpitSshRelay {
   GQueue *queue;
   gsize partial;
 
+  /* Data from the channel not yet handed to the pipe */
+  CockpitSshIncoming incoming;
+
   gchar *logname;
   gchar *connection_string;
 
@@ -1530,6 +1826,53 @@ enum {
 
 G_DEFINE_TYPE (CockpitSshRelay, cockpit_ssh_relay, G_TYPE_OBJECT);
 
+/* Queued blocks smaller than this are merged before writing to the channel */
+#define COALESCE_WRITE_SIZE  (128 * 1024)
+
+static void
+write_incoming (CockpitSshRelay *self,
+                GBytes *bytes)
+{
+  if (!self->pipe_closed)
+    cockpit_pipe_write (self->pipe, bytes);
+  else
+    g_debug ("%s: dropping %d incoming bytes, pipe is closed", self->logname, (int)g_bytes_get_size (bytes));
+}
+
+static void
+flush_incoming (CockpitSshRelay *self)
+{
+  GBytes *bytes;
+
+  bytes = cockpit_ssh_incoming_flush (&self->incoming);
+  if (bytes)
+    {
+      write_incoming (self, bytes);
+      g_bytes_unref (bytes);
+    }
+}
+
+static void
+queue_incoming (CockpitSshRelay *self,
+                const guint8 *data,
+                gsize len)
+{
+  GBytes *bytes;
+
+  if (!cockpit_ssh_incoming_fits (&self->incoming, len))
+    flush_incoming (self);
+
+  if (!cockpit_ssh_incoming_fits (&self->incoming, len))
+    {
+      bytes = g_bytes_new (data, len);
+      write_incoming (self, bytes);
+      g_bytes_unref (bytes);
+      return;
+    }
+
+  cockpit_ssh_incoming_append (&self->incoming, data, len);
+}
+
 static void
 cockpit_ssh_relay_dispose (GObject *object)
 {
@@ -1561,6 +1904,8 @@ cockpit_ssh_relay_finalize (GObject *object)
 
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
 
+  cockpit_ssh_incoming_clear (&self->incoming);
+
   if (self->event)
     ssh_event_free (self->event);
 
@@ -1605,6 +1950,8 @@ cockpit_relay_disconnect (CockpitSshRelay *self,
       self->ssh_data = NULL;
     }
 
+  flush_incoming (self);
+
   /* libssh channels like to hang around even after they're freed */
   if (self->channel)
       memset (&self->channel_cbs, 0, sizeof (self->channel_cbs));
@@ -1672,17 +2019,8 @@ on_channel_data (ssh_session session,
     }
   else if (self->received_frame)
     {
-      if (!self->pipe_closed)
-        {
-          g_autoptr(GBytes) bytes = g_bytes_new (bdata, len);
-          cockpit_pipe_write (self->pipe, bytes);
-          ret = len;
-        }
-      else
-        {
-          g_debug ("%s: dropping %d incoming bytes, pipe is closed", self->logname, len);
-          ret = len;
-        }
+      queue_incoming (self, bdata, len);
+      ret = len;
     }
 out:
   return ret;
@@ -1789,6 +2127,28 @@ on_channel_exit_status (ssh_session session,
   cockpit_relay_disconnect (self, NULL);
 }
 
+static GBytes *
+coalesce_queue (CockpitSshRelay *self)
+{
+  GByteArray *merged;
+  GBytes *block;
+  gsize length;
+
+  merged = g_byte_array_sized_new (COALESCE_WRITE_SIZE);
+  while ((block = g_queue_peek_head (self->queue)))
+    {
+      length = g_bytes_get_size (block);
+      if (merged->len > 0 && merged->len + length > COALESCE_WRITE_SIZE)
+        break;
+      g_byte_array_append (merged, g_bytes_get_data (block, NULL), length);
+      g_bytes_unref (g_queue_pop_head (self->queue));
+    }
+
+  block = g_byte_array_free_to_bytes (merged);
+  g_queue_push_head (self->queue, block);
+  return block;
+}
+
 static gboolean
 dispatch_queue (CockpitSshRelay *self)
 {
@@ -1810,6 +2170,10 @@ dispatch_queue (CockpitSshRelay *self)
       if (!block)
         return FALSE;
 
+      if (self->partial == 0 && g_bytes_get_size (block) < COALESCE_WRITE_SIZE &&
+          self->queue->length > 1)
+        block = coalesce_queue (self);
+
       data = g_bytes_get_data (block, &length);
       g_assert (self->partial <= length);
 
@@ -1991,7 +2355,16 @@ cockpit_ssh_source_prepare (GSource *source,
   CockpitSshRelay *self = cs->relay;
   gint status;
 
-  *timeout = 1;
+  /* Hand anything the channel gave us to the pipe before sleeping */
+  flush_incoming (self);
+
+  /*
+   * Everything that can make progress shows up as readiness of the
+   * ssh socket: input from the peer (including window adjustments),
+   * or room to write once we have something to send. Data arriving
+   * on our pipe runs its own callback, after which we're prepared again.
+   */
+  *timeout = -1;
 
   status = ssh_get_status (self->session);
 
@@ -2002,9 +2375,13 @@ cockpit_ssh_source_prepare (GSource *source,
   if (status & SSH_WRITE_PENDING)
     cs->pfd.events |= G_IO_OUT;
 
-  /* We have something in our queue: want to write */
+  /* We have something in our queue: want to write, once the peer has room for it */
   else if (!g_queue_is_empty (self->queue))
-    cs->pfd.events |= G_IO_OUT;
+    {
+      if (!self->sent_eof && !self->received_close &&
+          ssh_channel_window_size (self->channel) > 0)
+        cs->pfd.events |= G_IO_OUT;
+    }
 
   /* We are closing and need to send eof: want to write */
   else if (self->pipe_closed && !self->sent_eof)
@@ -2046,7 +2423,8 @@ cockpit_ssh_source_dispatch (GSource *source,
 
   /*
    * HACK: Yes this is another poll() call. The async support in
-   * libssh is quite hacky right now.
+   * libssh is quite hacky right now. It only runs when the socket is
+   * ready though, and returns immediately.
    *
    * https://red.libssh.org/issues/155
    */
@@ -2089,6 +2467,8 @@ cockpit_ssh_source_dispatch (GSource *source,
       ret = FALSE;
     }
 
+  flush_incoming (self);
+
   if (!ret)
     goto out;
 
@@ -2153,7 +2533,9 @@ cockpit_ssh_relay_start (CockpitSshRelay *self)
     .channel_exit_status_function = on_channel_exit_status,
   };
 
-  self->ssh_data->initial_auth_data = challenge_for_auth_data ("*", &self->ssh_data->auth_type);
+  start_preconnect (self->ssh_data, self->connection_string);
+  self->ssh_data->initial_auth_data = challenge_for_auth_data ("*", &self->ssh_data->auth_type,
+                                                                 self->ssh_data);
 
   problem = cockpit_ssh_connect (self->ssh_data, self->connection_string, &self->channel);
   if (problem)
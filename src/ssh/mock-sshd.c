@@ -87,6 +87,9 @@ bool multi_step = false;
 char authorizedkeys[DEF_STR_SIZE] = {0};
 char username[128] = "myuser";
 char password[128] = "mypassword";
+char ciphers[128] = {0};
+char macs[128] = {0};
+char compression[128] = {0};
 #ifdef HAVE_ARGP_H
 const char *argp_program_version = "libssh server example "
 SSH_STRINGIFY(LIBSSH_VERSION);
@@ -186,6 +189,30 @@ static struct argp_option options[] = {
         .doc   = "Multi Step Auth",
         .group = 0
     },
+    {
+        .name  = "ciphers",
+        .key   = 'c',
+        .arg   = "LIST",
+        .flags = 0,
+        .doc   = "Only offer these ciphers.",
+        .group = 0
+    },
+    {
+        .name  = "macs",
+        .key   = 'M',
+        .arg   = "LIST",
+        .flags = 0,
+        .doc   = "Only offer these MACs.",
+        .group = 0
+    },
+    {
+        .name  = "compression",
+        .key   = 'z',
+        .arg   = "LIST",
+        .flags = 0,
+        .doc   = "Only offer these compression methods.",
+        .group = 0
+    },
     {
         .name  = "verbose",
         .key   = 'v',
@@ -237,6 +264,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         case 'm':
             multi_step = true;
             break;
+        case 'c':
+            strncpy(ciphers, arg, sizeof(ciphers) - 1);
+            break;
+        case 'M':
+            strncpy(macs, arg, sizeof(macs) - 1);
+            break;
+        case 'z':
+            strncpy(compression, arg, sizeof(compression) - 1);
+            break;
         case 'v':
             ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LOG_VERBOSITY_STR,
                                  "3");
@@ -263,7 +299,7 @@ static int parse_opt(int argc, char **argv, ssh_bind sshbind) {
     int ecdsa_already_set = 0;
     int key;
 
-    while((key = getopt(argc, argv, "a:d:e:k:np:P:r:u:v")) != -1) {
+    while((key = getopt(argc, argv, "a:c:d:e:k:M:np:P:r:u:vz:")) != -1) {
         if (key == 'n') {
             no_default_keys = 1;
         } else if (key == 'p') {
@@ -289,6 +325,12 @@ static int parse_opt(int argc, char **argv, ssh_bind sshbind) {
             strncpy(username, optarg, sizeof(username) - 1);
         } else if (key == 'P') {
             strncpy(password, optarg, sizeof(password) - 1);
+        } else if (key == 'c') {
+            strncpy(ciphers, optarg, sizeof(ciphers) - 1);
+        } else if (key == 'M') {
+            strncpy(macs, optarg, sizeof(macs) - 1);
+        } else if (key == 'z') {
+            strncpy(compression, optarg, sizeof(compression) - 1);
         } else if (key == 'v') {
             ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LOG_VERBOSITY_STR,
                                  "3");
@@ -302,16 +344,19 @@ static int parse_opt(int argc, char **argv, ssh_bind sshbind) {
                "libssh %s -- a Secure Shell protocol implementation\n"
                "\n"
                "  -a, --authorizedkeys=FILE  Set the authorized keys file.\n"
+               "  -c, --ciphers=LIST         Only offer these ciphers.\n"
                "  -d, --dsakey=FILE          Set the dsa key.\n"
                "  -e, --ecdsakey=FILE        Set the ecdsa key.\n"
                "  -k, --hostkey=FILE         Set a host key.  Can be used multiple times.\n"
                "                             Implies no default keys.\n"
+               "  -M, --macs=LIST            Only offer these MACs.\n"
                "  -n, --no-default-keys      Do not set default key locations.\n"
                "  -p, --port=PORT            Set the port to bind.\n"
                "  -P, --pass=PASSWORD        Set expected password.\n"
                "  -r, --rsakey=FILE          Set the rsa key.\n"
                "  -u, --user=USERNAME        Set expected username.\n"
                "  -v, --verbose              Get verbose output.\n"
+               "  -z, --compression=LIST     Only offer these compression methods.\n"
                "  -?, --help                 Give this help list\n"
                "\n"
                "Mandatory or optional arguments to long options are also mandatory or optional\n"
@@ -830,6 +875,27 @@ static void handle_session(ssh_event event, ssh_session session) {
     ssh_set_server_callbacks(session, &server_cb);
     ssh_set_message_callback (session, auth_message_callback, &sdata);
 
+    /* Restrict what the server offers, so that a client only gets
+     * through when it negotiates one of these */
+    if (ciphers[0] &&
+        (ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, ciphers) < 0 ||
+         ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, ciphers) < 0)) {
+        fprintf(stderr, "%s\n", ssh_get_error(session));
+        return;
+    }
+    if (macs[0] &&
+        (ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, macs) < 0 ||
+         ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, macs) < 0)) {
+        fprintf(stderr, "%s\n", ssh_get_error(session));
+        return;
+    }
+    if (compression[0] &&
+        (ssh_options_set(session, SSH_OPTIONS_COMPRESSION_C_S, compression) < 0 ||
+         ssh_options_set(session, SSH_OPTIONS_COMPRESSION_S_C, compression) < 0)) {
+        fprintf(stderr, "%s\n", ssh_get_error(session));
+        return;
+    }
+
     if (ssh_handle_key_exchange(session) != SSH_OK) {
         fprintf(stderr, "%s\n", ssh_get_error(session));
         return;
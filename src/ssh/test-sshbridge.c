@@ -26,6 +26,8 @@
 #include "common/cockpitpipetransport.h"
 #include "common/cockpitjson.h"
 
+#include <glib-unix.h>
+
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -48,6 +50,7 @@
 
 typedef struct {
   CockpitTransport *transport;
+  GPid bridge_pid;
   gboolean closed;
 
   /* setup_mock_sshd */
@@ -57,6 +60,10 @@ typedef struct {
   gchar *home_ssh_dir;
   gchar *home_knownhosts_file;
   gchar *home_ssh_config_file;
+
+  /* expect_log */
+  GString *bridge_log;
+  guint bridge_log_watch;
 } TestCase;
 
 typedef struct {
@@ -71,6 +78,7 @@ typedef struct {
     const char *host_key_authorize; /* authorize x-host-key response for test_problem() */
     const char *config;
     const char *problem;
+    const char *expect_log; /* pattern for the cockpit-ssh stderr */
     const char *ssh_config_identity_file;
     gboolean allow_unknown;
     gboolean test_home_ssh_config;
@@ -233,7 +241,9 @@ setup_env (const TestFixture *fix)
 
 static CockpitTransport *
 start_bridge (gchar **env,
-              gchar **argv)
+              gchar **argv,
+              GPid *pid,
+              gint *err_fd)
 {
   GError *error = NULL;
   int fds[2];
@@ -242,13 +252,39 @@ start_bridge (gchar **env,
   g_spawn_async_with_pipes (BUILDDIR, argv, env,
                             G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
                             spawn_setup, GINT_TO_POINTER (fds[0]),
-                            NULL, NULL, NULL, NULL, &error);
+                            pid, NULL, NULL, err_fd, &error);
   g_assert_no_error (error);
   close (fds[0]);
 
   return cockpit_pipe_transport_new_fds ("test-ssh", fds[1], fds[1]);
 }
 
+/* The bridge logs to stderr, keep it while passing it through */
+static gboolean
+on_bridge_log (gint fd,
+               GIOCondition cond,
+               gpointer user_data)
+{
+  TestCase *tc = user_data;
+  gchar buffer[1024];
+  gssize ret;
+
+  ret = read (fd, buffer, sizeof (buffer));
+  if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+    return TRUE;
+
+  if (ret <= 0)
+    {
+      close (fd);
+      tc->bridge_log_watch = 0;
+      return FALSE;
+    }
+
+  g_string_append_len (tc->bridge_log, buffer, ret);
+  g_printerr ("%.*s", (int)ret, buffer);
+  return TRUE;
+}
+
 static void
 on_closed_set_flag (CockpitTransport *transport,
                     const gchar *problem,
@@ -270,12 +306,15 @@ setup (TestCase *tc,
   gchar **env = NULL;
   gchar *host = NULL;
   gchar *path = NULL;
+  gint err_fd;
 
   alarm (TIMEOUT);
 
   g_assert (fixture != NULL);
 
   env = setup_env (fixture);
+  if (fixture->expect_log)
+    env = g_environ_setenv (env, "G_MESSAGES_DEBUG", "cockpit-ssh", TRUE);
   setup_mock_sshd (tc, data);
 
   if (tc->ssh_port && strchr (hostname, ':') != NULL)  /* bracket IPv6 addresses */
@@ -355,7 +394,16 @@ setup (TestCase *tc,
       argv[1] = host;
     }
 
-  tc->transport = start_bridge (env, (gchar **) argv);
+  if (fixture->expect_log)
+    {
+      tc->transport = start_bridge (env, (gchar **) argv, &tc->bridge_pid, &err_fd);
+      tc->bridge_log = g_string_new ("");
+      tc->bridge_log_watch = g_unix_fd_add (err_fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_bridge_log, tc);
+    }
+  else
+    {
+      tc->transport = start_bridge (env, (gchar **) argv, &tc->bridge_pid, NULL);
+    }
   g_signal_connect (tc->transport, "closed", G_CALLBACK (on_closed_set_flag), &tc->closed);
   g_strfreev (env);
   g_free (host);
@@ -366,6 +414,8 @@ static void
 teardown (TestCase *tc,
           gconstpointer data)
 {
+  const TestFixture *fixture = data;
+
   if (tc->home_knownhosts_file)
     {
       unlink (tc->home_knownhosts_file);
@@ -391,6 +441,14 @@ teardown (TestCase *tc,
   /* If this asserts, outstanding references  */
   g_assert (tc->transport == NULL);
 
+  if (tc->bridge_log)
+    {
+      /* Everything is logged once the bridge has exited */
+      WAIT_UNTIL (tc->bridge_log_watch == 0);
+      g_assert (g_pattern_match_simple (fixture->expect_log, tc->bridge_log->str));
+      g_string_free (tc->bridge_log, TRUE);
+    }
+
   if (tc->mock_sshd)
     {
       kill (tc->mock_sshd, SIGTERM);
@@ -621,6 +679,254 @@ test_echo_queue (TestCase *tc,
   json_object_unref (init);
 }
 
+static gchar *
+write_config_dir (const gchar *ssh_login)
+{
+  gchar *dir = g_dir_make_tmp ("config.XXXXXX", NULL);
+  gchar *sub = g_build_filename (dir, "cockpit", NULL);
+  gchar *path = g_build_filename (sub, "cockpit.conf", NULL);
+  gchar *contents = g_strdup_printf ("[Ssh-Login]\nhost = 127.0.0.2\n%s", ssh_login);
+
+  g_assert_cmpint (mkdir (sub, 0700), ==, 0);
+  g_assert (g_file_set_contents (path, contents, -1, NULL));
+
+  g_free (contents);
+  g_free (path);
+  g_free (sub);
+  return dir;
+}
+
+static void
+remove_config_dir (gchar *dir)
+{
+  gchar *sub = g_build_filename (dir, "cockpit", NULL);
+  gchar *path = g_build_filename (sub, "cockpit.conf", NULL);
+
+  g_assert_cmpint (unlink (path), ==, 0);
+  g_assert_cmpint (rmdir (sub), ==, 0);
+  g_assert_cmpint (rmdir (dir), ==, 0);
+
+  g_free (path);
+  g_free (sub);
+  g_free (dir);
+}
+
+static void
+echo_blocks (TestCase *tc,
+             gsize block_size,
+             guint count)
+{
+  GBytes *received = NULL;
+  GBytes *sent;
+  guint i;
+  gulong sig;
+
+  sig = g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_get_payload), &received);
+
+  sent = g_bytes_new_take (g_strnfill (block_size, '{'), block_size);
+  for (i = 0; i < count; i++)
+    {
+      cockpit_transport_send (tc->transport, "546", sent);
+      while (received == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      g_assert (g_bytes_equal (received, sent));
+      g_bytes_unref (received);
+      received = NULL;
+    }
+
+  g_bytes_unref (sent);
+  g_signal_handler_disconnect (tc->transport, sig);
+}
+
+typedef struct {
+  const gchar *ssh_login;
+  const gchar *mock_sshd_arg;
+  const gchar *mock_sshd_arg_value;
+  const gchar *problem;
+  const gchar *expect_log;
+} TransportFixture;
+
+static void
+test_transport_options (gconstpointer data)
+{
+  const TransportFixture *tf = data;
+  TestCase tc = { NULL, };
+  TestFixture fixture = {
+    .ssh_command = fixture_cat.ssh_command,
+    .mock_sshd_arg = tf->mock_sshd_arg,
+    .mock_sshd_arg_value = tf->mock_sshd_arg_value,
+    .expect_log = tf->expect_log,
+  };
+  JsonObject *init;
+  gchar *config;
+
+  config = write_config_dir (tf->ssh_login);
+  fixture.config = config;
+
+  setup (&tc, &fixture);
+  do_fixture_auth (tc.transport, &fixture);
+  init = wait_until_transport_init (tc.transport, tf->problem);
+
+  if (!tf->problem)
+    {
+      echo_blocks (&tc, 1000 * 1000, 2);
+      cockpit_transport_close (tc.transport, NULL);
+    }
+
+  json_object_unref (init);
+  teardown (&tc, &fixture);
+
+  remove_config_dir (config);
+}
+
+/* libssh doesn't compress by default, so this only connects when configured */
+static const TransportFixture transport_options = {
+  .ssh_login = "compression = yes\ncompressionLevel = 9\nciphers = aes256-ctr,aes128-ctr\nmacs = hmac-sha2-256\n",
+  .mock_sshd_arg = "--compression",
+  .mock_sshd_arg_value = "zlib@openssh.com",
+};
+
+/* Both of these are in the libssh defaults, and must not be offered here */
+static const TransportFixture transport_options_ciphers = {
+  .ssh_login = "ciphers = aes256-ctr\n",
+  .mock_sshd_arg = "--ciphers",
+  .mock_sshd_arg_value = "aes128-ctr",
+  .problem = "no-host",
+};
+
+static const TransportFixture transport_options_macs = {
+  .ssh_login = "macs = hmac-sha2-256\n",
+  .mock_sshd_arg = "--macs",
+  .mock_sshd_arg_value = "hmac-sha2-512",
+  .problem = "no-host",
+};
+
+static const TransportFixture transport_options_invalid = {
+  .ssh_login = "ciphers = invalid-cipher\n",
+  .expect_log = "*invalid ciphers option: invalid-cipher*",
+};
+
+static const TransportFixture transport_preconnect = {
+  .ssh_login = "preconnect = yes\n",
+  .expect_log = "*using early connection to 127.0.0.1:*",
+};
+
+static gdouble
+read_cpu_seconds (GPid pid)
+{
+  gchar *path = g_strdup_printf ("/proc/%d/stat", (int)pid);
+  gchar *contents = NULL;
+  gchar **fields;
+  gdouble seconds;
+
+  g_assert (g_file_get_contents (path, &contents, NULL, NULL));
+
+  /* utime and stime are fields 14 and 15, counted after the command name */
+  fields = g_strsplit (strrchr (contents, ')') + 2, " ", -1);
+  seconds = (g_ascii_strtoull (fields[11], NULL, 10) +
+             g_ascii_strtoull (fields[12], NULL, 10)) / (gdouble)sysconf (_SC_CLK_TCK);
+
+  g_strfreev (fields);
+  g_free (contents);
+  g_free (path);
+  return seconds;
+}
+
+static void
+test_transport_benchmark (void)
+{
+  const gchar *settings[] = {
+    "",
+    "ciphers = chacha20-poly1305@openssh.com\n",
+    "ciphers = aes128-gcm@openssh.com\n",
+    "ciphers = aes256-gcm@openssh.com\n",
+    "ciphers = aes128-ctr\nmacs = hmac-sha2-256-etm@openssh.com\n",
+    "ciphers = aes128-gcm@openssh.com\ncompression = yes\ncompressionLevel = 1\n",
+    "ciphers = aes128-gcm@openssh.com\ncompression = yes\ncompressionLevel = 6\n",
+  };
+
+  const gsize block_size = 1000 * 1000;
+  const guint count = 100;
+  TestCase tc;
+  TestFixture fixture = { .ssh_command = fixture_cat.ssh_command };
+  JsonObject *init;
+  gchar *config;
+  gdouble elapsed;
+  gdouble cpu;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (settings); i++)
+    {
+      memset (&tc, 0, sizeof (tc));
+      config = write_config_dir (settings[i]);
+      fixture.config = config;
+
+      setup (&tc, &fixture);
+      do_fixture_auth (tc.transport, &fixture);
+      init = wait_until_transport_init (tc.transport, NULL);
+
+      cpu = read_cpu_seconds (tc.bridge_pid);
+      g_test_timer_start ();
+      echo_blocks (&tc, block_size, count);
+      elapsed = g_test_timer_elapsed ();
+      cpu = read_cpu_seconds (tc.bridge_pid) - cpu;
+
+      g_test_message ("%s: %.1f MB/s each way, cockpit-ssh used %.2f s cpu",
+                      settings[i][0] ? settings[i] : "defaults\n",
+                      (block_size * count) / elapsed / 1000000, cpu);
+
+      cockpit_transport_close (tc.transport, NULL);
+      json_object_unref (init);
+      teardown (&tc, &fixture);
+      remove_config_dir (config);
+    }
+}
+
+static guint64
+read_context_switches (GPid pid)
+{
+  gchar *path = g_strdup_printf ("/proc/%d/status", (int)pid);
+  gchar *contents = NULL;
+  gchar **lines;
+  guint64 total = 0;
+  gint i;
+
+  g_assert (g_file_get_contents (path, &contents, NULL, NULL));
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], "voluntary_ctxt_switches:") ||
+          g_str_has_prefix (lines[i], "nonvoluntary_ctxt_switches:"))
+        total += g_ascii_strtoull (strchr (lines[i], ':') + 1, NULL, 10);
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+  g_free (path);
+  return total;
+}
+
+static void
+test_idle_wakeups (TestCase *tc,
+                   gconstpointer data)
+{
+  JsonObject *init = NULL;
+  guint64 before, after;
+
+  do_fixture_auth (tc->transport, data);
+  init = wait_until_transport_init (tc->transport, NULL);
+
+  /* An idle session should leave cockpit-ssh sleeping in poll() */
+  before = read_context_switches (tc->bridge_pid);
+  g_usleep (G_USEC_PER_SEC);
+  after = read_context_switches (tc->bridge_pid);
+
+  g_assert_cmpuint (after - before, <, 50);
+
+  do_echo_and_close (tc);
+  json_object_unref (init);
+}
+
 static void
 test_echo_large (TestCase *tc,
                  gconstpointer data)
@@ -1106,7 +1412,7 @@ test_cannot_connect (void)
 
   JsonObject *init = NULL;
   gchar **env = setup_env (NULL);
-  CockpitTransport *transport = start_bridge (env, (gchar **) argv);
+  CockpitTransport *transport = start_bridge (env, (gchar **) argv, NULL, NULL);
   do_basic_auth (transport, "*", "user", "unused");
   init = wait_until_transport_init (transport, "no-host");
 
@@ -1370,6 +1676,8 @@ int
 main (int argc,
       char *argv[])
 {
+  /* Keep the known hosts index out of the real cache directory */
+  g_setenv ("XDG_CACHE_HOME", BUILDDIR "/mock-cache", TRUE);
 
   cockpit_test_init (&argc, &argv);
 
@@ -1377,6 +1685,8 @@ main (int argc,
               setup, test_echo_and_close, teardown);
   g_test_add ("/ssh-bridge/echo-queue", TestCase, &fixture_mock_echo,
               setup, test_echo_queue, teardown);
+  g_test_add ("/ssh-bridge/idle-wakeups", TestCase, &fixture_mock_echo,
+              setup, test_idle_wakeups, teardown);
   g_test_add ("/ssh-bridge/echo-large", TestCase, &fixture_cat,
               setup, test_echo_large, teardown);
 
@@ -1395,6 +1705,18 @@ main (int argc,
   g_test_add ("/ssh-bridge/command-just-fails", TestCase, &fixture_command_fails,
               setup, test_problem, teardown);
   g_test_add_func ("/ssh-bridge/cannot-connect", test_cannot_connect);
+  g_test_add_data_func ("/ssh-bridge/transport-options", &transport_options,
+                        test_transport_options);
+  g_test_add_data_func ("/ssh-bridge/transport-options-ciphers", &transport_options_ciphers,
+                        test_transport_options);
+  g_test_add_data_func ("/ssh-bridge/transport-options-macs", &transport_options_macs,
+                        test_transport_options);
+  g_test_add_data_func ("/ssh-bridge/transport-options-invalid", &transport_options_invalid,
+                        test_transport_options);
+  g_test_add_data_func ("/ssh-bridge/preconnect", &transport_preconnect,
+                        test_transport_options);
+  if (g_test_perf ())
+    g_test_add_func ("/ssh-bridge/transport-benchmark", test_transport_benchmark);
   g_test_add ("/ssh-bridge/ssh-config-home", TestCase, &fixture_home_ssh_config,
               setup, test_echo_and_close, teardown);
   g_test_add ("/ssh-bridge/ssh-config-valid-user", TestCase, &fixture_ssh_config_valid_user,
@@ -0,0 +1,154 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "testlib/cockpittest.h"
+
+#include "cockpitsshincoming.h"
+
+#include <string.h>
+
+static void
+test_coalesce (void)
+{
+  CockpitSshIncoming incoming = { NULL, 0 };
+  GBytes *bytes;
+
+  g_assert (cockpit_ssh_incoming_flush (&incoming) == NULL);
+
+  cockpit_ssh_incoming_append (&incoming, (const guint8 *)"one ", 4);
+  cockpit_ssh_incoming_append (&incoming, (const guint8 *)"two ", 4);
+  cockpit_ssh_incoming_append (&incoming, (const guint8 *)"three", 5);
+
+  /* Several blocks go on as one */
+  bytes = cockpit_ssh_incoming_flush (&incoming);
+  cockpit_assert_bytes_eq (bytes, "one two three", -1);
+  g_bytes_unref (bytes);
+
+  g_assert (cockpit_ssh_incoming_flush (&incoming) == NULL);
+  cockpit_ssh_incoming_clear (&incoming);
+}
+
+static void
+test_small_copied (void)
+{
+  CockpitSshIncoming incoming = { NULL, 0 };
+  const guint8 *slab;
+  GBytes *bytes;
+
+  cockpit_ssh_incoming_append (&incoming, (const guint8 *)"small", 5);
+  slab = incoming.slab;
+  g_assert (slab != NULL);
+
+  /* A small flush doesn't pin the slab, which gathers the next data */
+  bytes = cockpit_ssh_incoming_flush (&incoming);
+  g_assert (g_bytes_get_data (bytes, NULL) != (gconstpointer)slab);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 5);
+  g_assert (incoming.slab == slab);
+
+  cockpit_ssh_incoming_append (&incoming, (const guint8 *)"again", 5);
+  g_assert (incoming.slab == slab);
+
+  /* The copy stays valid while the slab is reused */
+  cockpit_assert_bytes_eq (bytes, "small", -1);
+  g_bytes_unref (bytes);
+
+  bytes = cockpit_ssh_incoming_flush (&incoming);
+  cockpit_assert_bytes_eq (bytes, "again", -1);
+  g_bytes_unref (bytes);
+
+  cockpit_ssh_incoming_clear (&incoming);
+}
+
+static void
+test_large_pooled (void)
+{
+  CockpitSshIncoming incoming = { NULL, 0 };
+  const guint8 *slab;
+  guint8 *data;
+  GBytes *bytes;
+  guint pooled;
+
+  data = g_malloc (64 * 1024);
+  memset (data, 'x', 64 * 1024);
+
+  cockpit_ssh_incoming_append (&incoming, data, 64 * 1024);
+  slab = incoming.slab;
+
+  /* A large flush hands over the slab itself */
+  bytes = cockpit_ssh_incoming_flush (&incoming);
+  g_assert (g_bytes_get_data (bytes, NULL) == (gconstpointer)slab);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 64 * 1024);
+  g_assert (incoming.slab == NULL);
+
+  /* Once written it goes back to the pool, and is used again */
+  pooled = cockpit_ssh_incoming_pooled ();
+  g_bytes_unref (bytes);
+  g_assert_cmpuint (cockpit_ssh_incoming_pooled (), ==, pooled + 1);
+
+  cockpit_ssh_incoming_append (&incoming, data, 10);
+  g_assert (incoming.slab == slab);
+  g_assert_cmpuint (cockpit_ssh_incoming_pooled (), ==, pooled);
+
+  cockpit_ssh_incoming_clear (&incoming);
+  g_assert_cmpuint (cockpit_ssh_incoming_pooled (), ==, pooled + 1);
+
+  g_free (data);
+}
+
+static void
+test_fits (void)
+{
+  CockpitSshIncoming incoming = { NULL, 0 };
+  guint8 *data;
+  GBytes *bytes;
+
+  data = g_malloc0 (COCKPIT_SSH_INCOMING_SLAB_SIZE);
+
+  g_assert (cockpit_ssh_incoming_fits (&incoming, COCKPIT_SSH_INCOMING_SLAB_SIZE));
+  g_assert (!cockpit_ssh_incoming_fits (&incoming, COCKPIT_SSH_INCOMING_SLAB_SIZE + 1));
+
+  cockpit_ssh_incoming_append (&incoming, data, COCKPIT_SSH_INCOMING_SLAB_SIZE - 10);
+  g_assert (cockpit_ssh_incoming_fits (&incoming, 10));
+  g_assert (!cockpit_ssh_incoming_fits (&incoming, 11));
+
+  bytes = cockpit_ssh_incoming_flush (&incoming);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, COCKPIT_SSH_INCOMING_SLAB_SIZE - 10);
+  g_bytes_unref (bytes);
+
+  g_assert (cockpit_ssh_incoming_fits (&incoming, COCKPIT_SSH_INCOMING_SLAB_SIZE));
+
+  cockpit_ssh_incoming_clear (&incoming);
+  g_free (data);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/ssh-incoming/coalesce", test_coalesce);
+  g_test_add_func ("/ssh-incoming/small-copied", test_small_copied);
+  g_test_add_func ("/ssh-incoming/large-pooled", test_large_pooled);
+  g_test_add_func ("/ssh-incoming/fits", test_fits);
+
+  return g_test_run ();
+}
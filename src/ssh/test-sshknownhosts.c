@@ -0,0 +1,162 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2024 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "testlib/cockpittest.h"
+
+#include "cockpitsshknownhosts.h"
+
+#include <unistd.h>
+
+#define MOCK_KNOWN_HOSTS BUILDDIR "/mock-known-hosts"
+#define MOCK_KEY "AAAAC3NzaC1lZDI1NTE5AAAAIOMqqnkVzrm0SdG6UOoqKLsabgH5C9okWi0dh2l9GKJl"
+
+static void
+write_known_hosts (const gchar *content)
+{
+  GError *error = NULL;
+
+  g_file_set_contents (MOCK_KNOWN_HOSTS, content, -1, &error);
+  g_assert_no_error (error);
+}
+
+static void
+teardown (void)
+{
+  unlink (MOCK_KNOWN_HOSTS);
+}
+
+static void
+test_plain (void)
+{
+  write_known_hosts ("# A comment\n"
+                     "\n"
+                     "example.com,10.0.0.1 ssh-ed25519 " MOCK_KEY "\n"
+                     "[other.example]:2222 ssh-ed25519 " MOCK_KEY "\n"
+                     "broken.example ssh-ed25519\n");
+
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "Example.COM", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "10.0.0.1", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 2222), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "other.example", 2222), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "other.example", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+
+  /* Lines without a key don't count */
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "broken.example", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+
+  teardown ();
+}
+
+static void
+test_hashed (void)
+{
+  /* Made with ssh-keygen -H for example.com and [example.com]:2222 */
+  write_known_hosts ("|1|fZPO6ZNAzv1tGUTV7eMKFvfnI0g=|p4Li7rVkThINyd/Ee1kH07PMRnk= ssh-ed25519 " MOCK_KEY "\n"
+                     "|1|u0NtZ+c/B3ST8xKKaoVckmmUUf4=|oD4gvK9TtXqCNf1WBtYRuEXQ3i0= ssh-ed25519 " MOCK_KEY "\n");
+
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 2222), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 2223), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.org", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+
+  teardown ();
+}
+
+static void
+test_undecided (void)
+{
+  write_known_hosts ("[localhost]:*,[127.0.0.1]:* ssh-ed25519 " MOCK_KEY "\n");
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "localhost", 2222), ==, COCKPIT_SSH_KNOWN_HOST_UNDECIDED);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNDECIDED);
+
+  write_known_hosts ("example.com ssh-ed25519 " MOCK_KEY "\n"
+                     "@revoked example.org ssh-ed25519 " MOCK_KEY "\n");
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNDECIDED);
+
+  teardown ();
+}
+
+static void
+test_missing (void)
+{
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (BUILDDIR "/non-existent", "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+}
+
+static void
+test_index (void)
+{
+  GError *error = NULL;
+  GKeyFile *index;
+  gchar *checksum;
+  gchar *path;
+  gchar **hosts;
+  gchar *value;
+
+  write_known_hosts ("example.com ssh-ed25519 " MOCK_KEY "\n");
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, MOCK_KNOWN_HOSTS, -1);
+  path = g_strdup_printf (BUILDDIR "/mock-cache/cockpit/ssh/%s.known-hosts", checksum);
+
+  index = g_key_file_new ();
+  g_key_file_load_from_file (index, path, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+  value = g_key_file_get_value (index, "known-hosts", "hosts", NULL);
+  g_assert_cmpstr (value, ==, "example.com;");
+  g_free (value);
+
+  /* As long as the file doesn't change, only the index is looked at */
+  hosts = (gchar *[]) { "changed.example", NULL };
+  g_key_file_set_string_list (index, "known-hosts", "hosts", (const gchar * const *)hosts, 1);
+  g_key_file_save_to_file (index, path, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "changed.example", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.com", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+
+  /* And a changed file is parsed again */
+  write_known_hosts ("example.com,example.org ssh-ed25519 " MOCK_KEY "\n");
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "changed.example", 22), ==, COCKPIT_SSH_KNOWN_HOST_UNKNOWN);
+  g_assert_cmpint (cockpit_ssh_known_hosts_lookup (MOCK_KNOWN_HOSTS, "example.org", 22), ==, COCKPIT_SSH_KNOWN_HOST_KNOWN);
+
+  g_key_file_free (index);
+  g_free (checksum);
+  g_free (path);
+  teardown ();
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  /* Keep the known hosts index out of the real cache directory */
+  g_setenv ("XDG_CACHE_HOME", BUILDDIR "/mock-cache", TRUE);
+
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/ssh-known-hosts/plain", test_plain);
+  g_test_add_func ("/ssh-known-hosts/hashed", test_hashed);
+  g_test_add_func ("/ssh-known-hosts/undecided", test_undecided);
+  g_test_add_func ("/ssh-known-hosts/missing", test_missing);
+  g_test_add_func ("/ssh-known-hosts/index", test_index);
+
+  return g_test_run ();
+}
@@ -31,6 +31,7 @@
 typedef struct {
   WebSocketConnection *client;
   WebSocketConnection *server;
+  GIOStream *sockets[2];
 } Test;
 
 static void
@@ -362,6 +363,49 @@ test_parse_headers_not_enough (void)
   g_assert_cmpint (ret, ==, 0);
 }
 
+static void
+test_parse_header_line (void)
+{
+  const gchar *input =
+      "Header1: value3\r\n"
+      "Header2:  field\r\n"
+      "\r\n"
+      "BODY  ";
+
+  GHashTable *headers = web_socket_util_new_headers ();
+  gboolean end = FALSE;
+  gsize offset = 0;
+  gssize ret;
+
+  /* Truncated lines are left alone */
+  ret = web_socket_util_parse_header_line (input, 10, headers, &end);
+  g_assert_cmpint (ret, ==, 0);
+  g_assert_cmpuint (g_hash_table_size (headers), ==, 0);
+
+  ret = web_socket_util_parse_header_line (input, strlen (input), headers, &end);
+  g_assert_cmpint (ret, ==, 17);
+  g_assert (!end);
+  offset += ret;
+
+  ret = web_socket_util_parse_header_line (input + offset, strlen (input) - offset, headers, &end);
+  g_assert_cmpint (ret, ==, 17);
+  g_assert (!end);
+  offset += ret;
+
+  ret = web_socket_util_parse_header_line (input + offset, strlen (input) - offset, headers, &end);
+  g_assert_cmpint (ret, ==, 2);
+  g_assert (end);
+
+  g_assert_cmpuint (g_hash_table_size (headers), ==, 2);
+  g_assert_cmpstr (g_hash_table_lookup (headers, "header1"), ==, "value3");
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Header2"), ==, "field");
+
+  ret = web_socket_util_parse_header_line ("Header1 value3\r\n", 16, headers, &end);
+  g_assert_cmpint (ret, <, 0);
+
+  g_hash_table_unref (headers);
+}
+
 static void
 test_parse_headers_bad (void)
 {
@@ -486,12 +530,38 @@ setup_pair (Test *test,
   g_object_unref (ios);
 }
 
+/* Not a GSocketConnection, so frames are written like on TLS streams */
+static void
+setup_stream_pair (Test *test,
+                   gconstpointer data)
+{
+  GIOStream *ioc;
+  GIOStream *ios;
+
+  cockpit_socket_streampair (&test->sockets[0], &test->sockets[1]);
+
+  ioc = g_simple_io_stream_new (g_io_stream_get_input_stream (test->sockets[0]),
+                                g_io_stream_get_output_stream (test->sockets[0]));
+  ios = g_simple_io_stream_new (g_io_stream_get_input_stream (test->sockets[1]),
+                                g_io_stream_get_output_stream (test->sockets[1]));
+
+  test->server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, ios, NULL, NULL);
+  test->client =  web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, ioc);
+
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_not_reached), NULL);
+
+  g_object_unref (ioc);
+  g_object_unref (ios);
+}
+
 static void
 teardown (Test *test,
           gconstpointer data)
 {
   g_clear_object (&test->client);
   g_clear_object (&test->server);
+  g_clear_object (&test->sockets[0]);
+  g_clear_object (&test->sockets[1]);
 }
 
 static gboolean
@@ -796,6 +866,110 @@ test_send_prefixed (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+test_send_prefixed_big (Test *test,
+                        gconstpointer data)
+{
+  GBytes *prefix = NULL;
+  GBytes *payload = NULL;
+  GBytes *received = NULL;
+  GBytes *expected = NULL;
+  gchar *contents;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_text_message), &received);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  prefix = g_bytes_new_static ("channel\n", 8);
+  payload = g_bytes_new_take (g_strnfill (100 * 1000, '?'), 100 * 1000);
+  contents = g_strnfill (8 + 100 * 1000, '?');
+  memcpy (contents, "channel\n", 8);
+  expected = g_bytes_new_take (contents, 8 + 100 * 1000);
+
+  /* Unmasked, the frame refers to the prefix and payload directly */
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, prefix, payload);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (expected, received));
+  g_clear_pointer (&received, g_bytes_unref);
+
+  /* Masking must not touch the caller's data */
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, prefix, payload);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (expected, received));
+  g_assert_cmpstr (g_bytes_get_data (prefix, NULL), ==, "channel\n");
+  g_assert (((const gchar *)g_bytes_get_data (payload, NULL))[0] == '?');
+  g_clear_pointer (&received, g_bytes_unref);
+
+  g_bytes_unref (expected);
+  g_bytes_unref (payload);
+  g_bytes_unref (prefix);
+}
+
+static void
+on_message_count (WebSocketConnection *ws,
+                  WebSocketDataType type,
+                  GBytes *message,
+                  gpointer user_data)
+{
+  guint *count = user_data;
+  (*count)++;
+}
+
+static void
+on_notify_count (GObject *object,
+                 GParamSpec *pspec,
+                 gpointer user_data)
+{
+  guint *count = user_data;
+  (*count)++;
+}
+
+static void
+test_send_many (Test *test,
+                gconstpointer data)
+{
+  guint messages = GPOINTER_TO_UINT (data);
+  guint received = 0;
+  guint notified = 0;
+  gchar buffer[16];
+  GBytes *payload;
+  gdouble elapsed;
+  guint i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_count), &received);
+  g_signal_connect (test->server, "notify::buffered-amount", G_CALLBACK (on_notify_count), &notified);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  g_test_timer_start ();
+
+  /* Many small messages, as chatty channels send them */
+  for (i = 0; i < messages; i++)
+    {
+      g_snprintf (buffer, sizeof (buffer), "%08x", i);
+      payload = g_bytes_new (buffer, 8);
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload);
+      g_bytes_unref (payload);
+    }
+
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, messages * 8);
+
+  WAIT_UNTIL (received == messages);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+
+  /* Notifications are coalesced rather than sent per message */
+  g_assert_cmpuint (notified, >, 0);
+  g_assert_cmpuint (notified, <, messages);
+
+  g_test_minimized_result (elapsed, "sent %u messages in %.3f seconds, %.0f messages/s",
+                           messages, elapsed, messages / elapsed);
+}
+
 static void
 test_send_bad_data (Test *test,
                     gconstpointer unused)
@@ -1272,6 +1446,7 @@ main (int argc,
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_prefixed_big, "send-prefixed-big" },
       { test_send_bad_data, "send-bad-data" },
       { test_pressure_queue, "pressure-queue" },
       { test_pressure_throttle, "pressure-throttle" },
@@ -1310,6 +1485,7 @@ main (int argc,
   g_test_add_func ("/web-socket/parse-duplicate-headers", test_parse_duplicate_headers);
   g_test_add_func ("/web-socket/parse-headers-no-out", test_parse_headers_no_out);
   g_test_add_func ("/web-socket/parse-headers-bad", test_parse_headers_bad);
+  g_test_add_func ("/web-socket/parse-header-line", test_parse_header_line);
   g_test_add_func ("/web-socket/parse-headers-not-enough", test_parse_headers_not_enough);
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
@@ -1328,7 +1504,21 @@ main (int argc,
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
 
+  g_test_add ("/web-socket/stream/send-prefixed", Test, NULL,
+              setup_stream_pair, test_send_prefixed, teardown);
+  g_test_add ("/web-socket/stream/send-prefixed-big", Test, NULL,
+              setup_stream_pair, test_send_prefixed_big, teardown);
+  g_test_add ("/web-socket/stream/send-big-packets", Test, NULL,
+              setup_stream_pair, test_send_big_packets, teardown);
+  g_test_add ("/web-socket/stream/send-many", Test, GUINT_TO_POINTER (10000),
+              setup_stream_pair, test_send_many, teardown);
+
   g_test_add ("/web-socket/message-after-closing", Test, NULL, setup_pair, test_message_after_closing, teardown);
+  g_test_add ("/web-socket/send-many", Test, GUINT_TO_POINTER (10000),
+              setup_pair, test_send_many, teardown);
+  if (g_test_perf ())
+    g_test_add ("/web-socket/send-many-benchmark", Test, GUINT_TO_POINTER (1000000),
+                setup_pair, test_send_many, teardown);
 
   return g_test_run ();
 }
@@ -319,62 +319,26 @@ web_socket_util_parse_headers (const gchar *data,
                                GHashTable **headers)
 {
   GHashTable *parsed_headers;
-  const gchar *line;
-  const gchar *colon;
   gsize consumed = 0;
   gboolean end = FALSE;
-  gsize line_len;
+  gssize ret;
 
   parsed_headers = web_socket_util_new_headers ();
 
   while (!end)
     {
-      line = memchr (data, '\n', length);
+      ret = web_socket_util_parse_header_line (data, length, parsed_headers, &end);
 
-      /* No line ending: need more data */
-      if (line == NULL)
+      /* Need more data, or invalid */
+      if (ret <= 0)
         {
-          consumed = 0;
+          consumed = ret;
           break;
         }
 
-      line++;
-      line_len = (line - data);
-
-      /* An empty line, all done */
-      if ((data[0] == '\r' && data[1] == '\n') || data[0] == '\n')
-        {
-          end = TRUE;
-        }
-
-      /* A header line */
-      else
-        {
-          colon = memchr (data, ':', length);
-          if (!colon || colon >= line)
-            {
-              g_debug ("received invalid header line: %.*s", (gint)line_len, data);
-              consumed = -1;
-              break;
-            }
-
-          g_autofree gchar *name = g_strndup (data, colon - data);
-          g_strstrip (name);
-          g_autofree gchar *value = g_strndup (colon + 1, line - (colon + 1));
-          g_strstrip (value);
-
-          if (!is_valid_line (name, -1) || !g_utf8_validate (value, -1, NULL))
-            {
-              g_debug ("received invalid header");
-              consumed = -1;
-              break;
-            }
-          g_hash_table_insert (parsed_headers, g_steal_pointer (&name), g_steal_pointer (&value));
-        }
-
-      consumed += line_len;
-      data += line_len;
-      length -= line_len;
+      consumed += ret;
+      data += ret;
+      length -= ret;
     }
 
   if (consumed > 0)
@@ -388,6 +352,73 @@ web_socket_util_parse_headers (const gchar *data,
   return consumed;
 }
 
+/**
+ * web_socket_util_parse_header_line:
+ * @data: (array length=length): the input data
+ * @length: length of data
+ * @headers: table to add the parsed header to
+ * @end: (out): set to %TRUE when the empty line after the headers was parsed
+ *
+ * Parse a single HTTP header line, or the empty line that ends the
+ * headers. This allows parsing headers incrementally as they arrive,
+ * keeping the position and @headers between calls.
+ *
+ * Return value: zero if truncated, negative if fails, or number of
+ *               characters parsed including the new line
+ */
+gssize
+web_socket_util_parse_header_line (const gchar *data,
+                                   gsize length,
+                                   GHashTable *headers,
+                                   gboolean *end)
+{
+  const gchar *line;
+  const gchar *colon;
+  gsize line_len;
+
+  g_return_val_if_fail (data != NULL || length == 0, -1);
+  g_return_val_if_fail (headers != NULL, -1);
+
+  line = memchr (data, '\n', length);
+
+  /* No line ending: need more data */
+  if (line == NULL)
+    return 0;
+
+  line++;
+  line_len = (line - data);
+
+  /* An empty line, all done */
+  if ((data[0] == '\r' && data[1] == '\n') || data[0] == '\n')
+    {
+      if (end)
+        *end = TRUE;
+      return line_len;
+    }
+
+  /* A header line */
+  colon = memchr (data, ':', line_len);
+  if (!colon)
+    {
+      g_debug ("received invalid header line: %.*s", (gint)line_len, data);
+      return -1;
+    }
+
+  g_autofree gchar *name = g_strndup (data, colon - data);
+  g_strstrip (name);
+  g_autofree gchar *value = g_strndup (colon + 1, line - (colon + 1));
+  g_strstrip (value);
+
+  if (!is_valid_line (name, -1) || !g_utf8_validate (value, -1, NULL))
+    {
+      g_debug ("received invalid header");
+      return -1;
+    }
+
+  g_hash_table_insert (headers, g_steal_pointer (&name), g_steal_pointer (&value));
+  return line_len;
+}
+
 gboolean
 _web_socket_util_header_equals (GHashTable *headers,
                                 const gchar *name,
@@ -34,6 +34,11 @@ gssize          web_socket_util_parse_headers  (const gchar *data,
                                                 gsize length,
                                                 GHashTable **headers);
 
+gssize       web_socket_util_parse_header_line (const gchar *data,
+                                                gsize length,
+                                                GHashTable *headers,
+                                                gboolean *end);
+
 gssize          web_socket_util_parse_req_line (const gchar *data,
                                                 gsize length,
                                                 gchar **method,
@@ -24,6 +24,8 @@
 
 #include "common/cockpitflow.h"
 
+#include <sys/socket.h>
+#include <errno.h>
 #include <string.h>
 
 /*
@@ -98,8 +100,17 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+static GParamSpec *buffered_amount_pspec = NULL;
+
 typedef struct {
-  GBytes *data;
+  /* The frame header is at most 14 bytes, and built in place */
+  guint8 header[14];
+  gsize header_len;
+
+  /* Referenced data sent after the header, either may be NULL */
+  GBytes *segments[2];
+
+  gsize len;
   gboolean last;
   gsize sent;
   gsize amount;
@@ -138,10 +149,16 @@ typedef struct
   GByteArray *incoming;
 
   GPollableOutputStream *output;
+  GSocket *socket;
   GSource *output_source;
   gsize output_queued;
+  gsize pressure_limit;
   GQueue outgoing;
 
+  /* Caller data not yet sent, and a pending notify about it */
+  gsize buffered_amount;
+  GSource *notify_source;
+
   /* Current message being assembled */
   guint8 message_opcode;
   GByteArray *message_data;
@@ -153,9 +170,12 @@ typedef struct
 
 #define MAX_PAYLOAD   128 * 1024
 
-/* The queue size above which we consider applying back pressure */
+/* The default queue size above which we consider applying back pressure */
 #define QUEUE_PRESSURE       1UL * 1024UL * 1024UL /* 1 megabyte */
 
+/* The start of a frame is copied together up to this size, one TLS record */
+#define WRITE_COALESCE_SIZE  16 * 1024
+
 static void    web_socket_connection_flow_iface_init        (CockpitFlowInterface *iface);
 
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (WebSocketConnection, web_socket_connection, G_TYPE_OBJECT,
@@ -170,7 +190,10 @@ frame_free (gpointer data)
   Frame *frame = data;
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      if (frame->segments[0])
+        g_bytes_unref (frame->segments[0]);
+      if (frame->segments[1])
+        g_bytes_unref (frame->segments[1]);
       g_slice_free (Frame, frame);
     }
 }
@@ -181,6 +204,7 @@ web_socket_connection_init (WebSocketConnection *self)
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
 
   g_queue_init (&pv->outgoing);
+  pv->pressure_limit = QUEUE_PRESSURE;
   pv->main_context = g_main_context_ref_thread_default ();
 }
 
@@ -357,29 +381,34 @@ xor_with_mask_rfc6455 (const guint8 *mask,
     data[n] ^= mask[n & 3];
 }
 
+static void queue_frame (WebSocketConnection *self,
+                         WebSocketQueueFlags flags,
+                         Frame *frame);
+
 static void
 send_prefixed_message_rfc6455 (WebSocketConnection *self,
                                WebSocketQueueFlags flags,
                                guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+                               GBytes *prefix,
+                               GBytes *payload)
 {
-  gsize amount;
-  GByteArray *bytes;
-  gsize frame_len;
+  Frame *frame;
   guint8 *outer;
   guint8 *mask = 0;
-  guint8 *at;
+  gsize prefix_len = 0;
+  gsize payload_len;
   gsize len;
   guint64 size;
 
+  if (prefix)
+    prefix_len = g_bytes_get_size (prefix);
+  payload_len = g_bytes_get_size (payload);
+
   len = payload_len + prefix_len;
-  amount = len;
 
-  bytes = g_byte_array_sized_new (14 + len);
-  outer = bytes->data;
+  frame = g_slice_new0 (Frame);
+  frame->amount = len;
+  outer = frame->header;
   outer[0] = 0x80 | opcode;
 
   /* If control message, truncate payload */
@@ -395,21 +424,27 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
         }
 
       /* Buffered amount of bytes is zero for control messages */
-      amount = 0;
+      frame->amount = 0;
     }
 
+  /* These only copy when truncating */
+  if (prefix_len > 0)
+    frame->segments[0] = g_bytes_new_from_bytes (prefix, 0, prefix_len);
+  if (payload_len > 0)
+    frame->segments[1] = g_bytes_new_from_bytes (payload, 0, payload_len);
+
   size = len;
   if (size < 126)
     {
       outer[1] = (0xFF & size); /* mask | 7-bit-len */
-      bytes->len = 2;
+      frame->header_len = 2;
     }
   else if (size < 65536)
     {
       outer[1] = 126; /* mask | 16-bit-len */
       outer[2] = (size >> 8) & 0xFF;
       outer[3] = (size >> 0) & 0xFF;
-      bytes->len = 4;
+      frame->header_len = 4;
     }
   else
     {
@@ -422,34 +457,42 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
       outer[7] = (size >> 16) & 0xFF;
       outer[8] = (size >> 8) & 0xFF;
       outer[9] = (size >> 0) & 0xFF;
-      bytes->len = 10;
+      frame->header_len = 10;
     }
 
   /*
    * The server side doesn't need to mask, so we don't. There's
    * probably a client somewhere that's not expecting it.
+   *
+   * This means server frames just reference the prefix and payload,
+   * while the client has to copy them in order to mask them.
    */
   const gboolean is_client_side = !GET_PRIV(self)->server_side;
   if (is_client_side)
     {
       guint32 rand = g_random_int ();
+      GByteArray *masked;
+
       outer[1] |= 0x80;
-      mask = outer + bytes->len;
+      mask = outer + frame->header_len;
       memcpy (mask, &rand, sizeof (guint32));
-      bytes->len += 4;
+      frame->header_len += 4;
+
+      masked = g_byte_array_sized_new (len);
+      if (frame->segments[0])
+        g_byte_array_append (masked, g_bytes_get_data (frame->segments[0], NULL), prefix_len);
+      if (frame->segments[1])
+        g_byte_array_append (masked, g_bytes_get_data (frame->segments[1], NULL), payload_len);
+      xor_with_mask_rfc6455 (mask, masked->data, masked->len);
+
+      g_clear_pointer (&frame->segments[0], g_bytes_unref);
+      g_clear_pointer (&frame->segments[1], g_bytes_unref);
+      frame->segments[1] = g_byte_array_free_to_bytes (masked);
     }
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
-
-  if (is_client_side)
-    xor_with_mask_rfc6455 (mask, at, len);
-
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+  frame->len = frame->header_len + len;
+  queue_frame (self, flags, frame);
+  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame->len);
 }
 
 static void
@@ -459,7 +502,9 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  GBytes *bytes = g_bytes_new (payload, payload_len);
+  send_prefixed_message_rfc6455 (self, flags, opcode, NULL, bytes);
+  g_bytes_unref (bytes);
 }
 
 static void
@@ -1019,18 +1064,125 @@ start_input (WebSocketConnection *self)
   g_source_attach (pv->input_source, pv->main_context);
 }
 
+static guint
+frame_vectors (Frame *frame,
+               GOutputVector *vectors)
+{
+  const guint8 *pieces[3];
+  gsize lengths[3];
+  gsize skip;
+  guint n = 0;
+  guint i;
+
+  pieces[0] = frame->header;
+  lengths[0] = frame->header_len;
+  for (i = 0; i < 2; i++)
+    {
+      if (frame->segments[i])
+        {
+          pieces[i + 1] = g_bytes_get_data (frame->segments[i], &lengths[i + 1]);
+        }
+      else
+        {
+          pieces[i + 1] = NULL;
+          lengths[i + 1] = 0;
+        }
+    }
+
+  /* Only the part of the frame not yet sent */
+  skip = frame->sent;
+  for (i = 0; i < 3; i++)
+    {
+      if (skip >= lengths[i])
+        {
+          skip -= lengths[i];
+          continue;
+        }
+      vectors[n].buffer = pieces[i] + skip;
+      vectors[n].size = lengths[i] - skip;
+      skip = 0;
+      n++;
+    }
+
+  return n;
+}
+
+static gssize
+write_frame (WebSocketConnection *self,
+             Frame *frame,
+             GError **error)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  guint8 buffer[WRITE_COALESCE_SIZE];
+  GOutputVector vectors[3];
+  struct iovec iov[3];
+  struct msghdr msg = { 0, };
+  gsize length;
+  gsize chunk;
+  gssize res;
+  guint n;
+  guint i;
+  int errn;
+
+  n = frame_vectors (frame, vectors);
+  g_assert (n > 0);
+
+  /*
+   * Streams other than plain sockets (such as TLS) have no vectored
+   * non-blocking write before GLib 2.60. The header and prefix are
+   * small, so copy them together with the start of the payload. The
+   * rest of a large payload is then written straight from its bytes.
+   */
+  if (!pv->socket)
+    {
+      if (n == 1 || vectors[0].size >= WRITE_COALESCE_SIZE)
+        {
+          return g_pollable_output_stream_write_nonblocking (pv->output, vectors[0].buffer,
+                                                             vectors[0].size, NULL, error);
+        }
+
+      length = 0;
+      for (i = 0; i < n && length < sizeof (buffer); i++)
+        {
+          chunk = MIN (vectors[i].size, sizeof (buffer) - length);
+          memcpy (buffer + length, vectors[i].buffer, chunk);
+          length += chunk;
+        }
+
+      return g_pollable_output_stream_write_nonblocking (pv->output, buffer, length, NULL, error);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      iov[i].iov_base = (gpointer)vectors[i].buffer;
+      iov[i].iov_len = vectors[i].size;
+    }
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+
+  do
+    res = sendmsg (g_socket_get_fd (pv->socket), &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  while (res < 0 && errno == EINTR);
+
+  if (res < 0)
+    {
+      errn = errno;
+      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errn), g_strerror (errn));
+    }
+
+  return res;
+}
+
 static gboolean
 on_web_socket_output (GObject *pollable_stream,
                       gpointer user_data)
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
-  const guint8 *data;
   GError *error = NULL;
   gsize before;
   Frame *frame;
   gssize count;
-  gsize len;
 
   frame = g_queue_peek_head (&pv->outgoing);
 
@@ -1041,14 +1193,9 @@ on_web_socket_output (GObject *pollable_stream,
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
+  g_assert (frame->len > frame->sent);
 
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
+  count = write_frame (self, frame, &error);
 
   if (count < 0)
     {
@@ -1067,12 +1214,14 @@ on_web_socket_output (GObject *pollable_stream,
   before = pv->output_queued;
 
   frame->sent += count;
-  if (frame->sent >= len)
+  if (frame->sent >= frame->len)
     {
       g_debug ("sent frame");
       g_queue_pop_head (&pv->outgoing);
-      g_assert (len <= pv->output_queued);
-      pv->output_queued -= len;
+      g_assert (frame->len <= pv->output_queued);
+      pv->output_queued -= frame->len;
+      g_assert (frame->amount <= pv->buffered_amount);
+      pv->buffered_amount -= frame->amount;
 
       if (frame->last)
         {
@@ -1093,7 +1242,7 @@ on_web_socket_output (GObject *pollable_stream,
    * If we're controlling another flow, turn off back pressure when
    * our output buffer size becomes less than the low mark.
    */
-  if (before >= QUEUE_PRESSURE && GET_PRIV(self)->output_queued < QUEUE_PRESSURE)
+  if (before >= pv->pressure_limit && pv->output_queued < pv->pressure_limit)
     cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
 
   return TRUE;
@@ -1113,27 +1262,25 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             Frame *frame)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   gsize before;
-  Frame *frame;
+  gsize len;
   Frame *prev;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
-  g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
+  if (pv->close_sent)
+    {
+      frame_free (frame);
+      g_return_if_reached ();
+    }
 
-  frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
-  frame->amount = amount;
+  len = frame->len;
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
+  pv->buffered_amount += frame->amount;
 
   /* If urgent put at front of queue */
   if (flags & WEB_SOCKET_QUEUE_URGENT)
@@ -1168,12 +1315,34 @@ _web_socket_connection_queue (WebSocketConnection *self,
    * If we have two much data queued, and are controlling another flow
    * tell it to stop sending data, each time we cross over the high bound.
    */
-  if (before < QUEUE_PRESSURE && GET_PRIV(self)->output_queued >= QUEUE_PRESSURE)
+  if (before < pv->pressure_limit && pv->output_queued >= pv->pressure_limit)
     cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
 
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  Frame *frame;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (pv->close_sent == FALSE);
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  frame = g_slice_new0 (Frame);
+  frame->segments[0] = g_bytes_new_take (data, len);
+  frame->len = len;
+  frame->amount = amount;
+  queue_frame (self, flags, frame);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1243,6 +1412,10 @@ _web_socket_connection_take_io_stream (WebSocketConnection *self,
   if (G_IS_POLLABLE_OUTPUT_STREAM (os))
     pv->output = G_POLLABLE_OUTPUT_STREAM (os);
 
+  /* Plain sockets can write a frame's pieces in one call */
+  if (G_IS_SOCKET_CONNECTION (io_stream))
+    pv->socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (io_stream));
+
   pv->io_open = TRUE;
   g_object_notify (G_OBJECT (self), "io-stream");
 
@@ -1352,6 +1525,13 @@ web_socket_connection_dispose (GObject *object)
   cockpit_flow_throttle (COCKPIT_FLOW (self), NULL);
   g_assert (GET_PRIV(self)->pressure == NULL);
 
+  if (GET_PRIV(self)->notify_source)
+    {
+      g_source_destroy (GET_PRIV(self)->notify_source);
+      g_source_unref (GET_PRIV(self)->notify_source);
+      GET_PRIV(self)->notify_source = NULL;
+    }
+
   G_OBJECT_CLASS (web_socket_connection_parent_class)->dispose (object);
 }
 
@@ -1372,6 +1552,7 @@ web_socket_connection_finalize (GObject *object)
   while (!g_queue_is_empty (&pv->outgoing))
     frame_free (g_queue_pop_head (&pv->outgoing));
   pv->output_queued = 0;
+  pv->buffered_amount = 0;
 
   g_clear_object (&pv->io_stream);
   g_assert (!pv->input_source);
@@ -1440,11 +1621,14 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
    * This represents caller provided data passed into the
    * web_socket_connection_send() function, which has been queued but not
    * yet been sent.
+   *
+   * Change notifications are coalesced, and emitted at most once per
+   * main loop iteration, no matter how many messages were sent.
    */
-  g_object_class_install_property (gobject_class, PROP_BUFFERED_AMOUNT,
-                                   g_param_spec_ulong ("buffered-amount", "Buffered amount", "Outstanding amount of data buffered",
-                                                       0, G_MAXULONG, 0,
-                                                       G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  buffered_amount_pspec = g_param_spec_ulong ("buffered-amount", "Buffered amount", "Outstanding amount of data buffered",
+                                              0, G_MAXULONG, 0,
+                                              G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (gobject_class, PROP_BUFFERED_AMOUNT, buffered_amount_pspec);
 
   /**
    * WebSocketConnection:io-stream:
@@ -1621,19 +1805,26 @@ web_socket_connection_get_ready_state (WebSocketConnection *self)
 gsize
 web_socket_connection_get_buffered_amount (WebSocketConnection *self)
 {
-  gsize amount = 0;
-  Frame *frame;
-  GList *l;
-
   g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
+  return GET_PRIV(self)->buffered_amount;
+}
 
-  for (l = GET_PRIV(self)->outgoing.head; l != NULL; l = g_list_next (l))
-    {
-      frame = l->data;
-      amount += frame->amount;
-    }
-
-  return amount;
+/**
+ * web_socket_connection_set_pressure_limit:
+ * @self: the WebSocket
+ * @limit: queued output in bytes
+ *
+ * Set the amount of queued output above which the connection
+ * emits back pressure. Back pressure is relieved again once the
+ * queue drains below this limit.
+ */
+void
+web_socket_connection_set_pressure_limit (WebSocketConnection *self,
+                                          gsize limit)
+{
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (limit > 0);
+  GET_PRIV(self)->pressure_limit = limit;
 }
 
 /**
@@ -1690,6 +1881,34 @@ web_socket_connection_get_close_data (WebSocketConnection *self)
   return GET_PRIV(self)->peer_close_data;
 }
 
+static gboolean
+on_buffered_amount_notify (gpointer user_data)
+{
+  WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  g_source_unref (pv->notify_source);
+  pv->notify_source = NULL;
+
+  g_object_notify_by_pspec (G_OBJECT (self), buffered_amount_pspec);
+  return FALSE;
+}
+
+static void
+queue_buffered_amount_notify (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  /* Senders queue many messages at once, tell listeners once about all of them */
+  if (pv->notify_source)
+    return;
+
+  pv->notify_source = g_idle_source_new ();
+  g_source_set_priority (pv->notify_source, G_PRIORITY_HIGH);
+  g_source_set_callback (pv->notify_source, on_buffered_amount_notify, self, NULL);
+  g_source_attach (pv->notify_source, pv->main_context);
+}
+
 /**
  * web_socket_connection_send:
  * @self: the WebSocket
@@ -1752,10 +1971,9 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
-  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                 pref, prefix_len, payload, payload_len);
+  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode, prefix, message);
 
-  g_object_notify (G_OBJECT (self), "buffered-amount");
+  queue_buffered_amount_notify (self);
 }
 
 /**
@@ -64,6 +64,9 @@ WebSocketState  web_socket_connection_get_ready_state     (WebSocketConnection *
 
 gsize           web_socket_connection_get_buffered_amount (WebSocketConnection *self);
 
+void            web_socket_connection_set_pressure_limit  (WebSocketConnection *self,
+                                                           gsize limit);
+
 gushort         web_socket_connection_get_close_code      (WebSocketConnection *self);
 
 const gchar *   web_socket_connection_get_close_data      (WebSocketConnection *self);
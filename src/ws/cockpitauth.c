@@ -38,6 +38,7 @@
 #include "common/cockpitwebserver.h"
 
 #include <sys/socket.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -93,6 +94,8 @@ get_process_idle (void)
   return seconds;
 }
 
+static void warm_process_free (gpointer data);
+
 G_DEFINE_TYPE (CockpitAuth, cockpit_auth, G_TYPE_OBJECT)
 
 typedef struct {
@@ -127,6 +130,9 @@ typedef struct {
 
   /* The conversation in progress */
   gchar *conversation;
+
+  /* Sent along with the login reply to a warm process */
+  gchar **warm_options;
 } CockpitSession;
 
 static void
@@ -227,13 +233,14 @@ cockpit_session_unref (gpointer data)
       if (session->destroy_sig)
         g_signal_handler_disconnect (object, session->destroy_sig);
       g_object_weak_unref (object, on_web_service_gone, session);
-      g_object_run_dispose (object);
+      cockpit_web_service_disconnect (COCKPIT_WEB_SERVICE (object));
       g_object_unref (object);
     }
 
   if (session->timeout_tag)
     g_source_remove (session->timeout_tag);
 
+  g_strfreev (session->warm_options);
   g_free (session);
 }
 
@@ -256,6 +263,7 @@ cockpit_auth_finalize (GObject *object)
   g_hash_table_remove_all (self->conversations);
   g_hash_table_destroy (self->sessions);
   g_hash_table_destroy (self->conversations);
+  g_hash_table_destroy (self->warm);
   G_OBJECT_CLASS (cockpit_auth_parent_class)->finalize (object);
 }
 
@@ -292,6 +300,9 @@ cockpit_auth_init (CockpitAuth *self)
   self->conversations = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                NULL, cockpit_session_unref);
 
+  self->warm = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      NULL, warm_process_free);
+
   self->timeout_tag = g_timeout_add_seconds (get_process_idle (),
                                              on_process_timeout, self);
 
@@ -462,18 +473,19 @@ session_child_setup (gpointer data)
   closefrom (3);
 }
 
-static CockpitPipe *
-session_start_process (const gchar **argv,
+static gboolean
+session_spawn_process (const gchar **argv,
                        const gchar **env,
-                       gboolean capture_stderr)
+                       GPid *pid,
+                       int *io,
+                       int *stderr_fd)
 {
   GError *error = NULL;
   ChildData child;
   gboolean ret;
-  GPid pid = 0;
   int fds[2];
 
-  g_return_val_if_fail (argv[0] != NULL, NULL);
+  g_return_val_if_fail (argv[0] != NULL, FALSE);
 
   g_debug ("spawning %s", argv[0]);
 
@@ -481,15 +493,14 @@ session_start_process (const gchar **argv,
   if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
     {
       g_warning ("couldn't create loopback socket: %s", g_strerror (errno));
-      return NULL;
+      return FALSE;
     }
 
-  int stderr_fd = -1;
   child.io = fds[0];
   ret = g_spawn_async_with_pipes (NULL, (gchar **)argv, (gchar **)env,
                                   G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
                                   session_child_setup, &child,
-                                  &pid, NULL, NULL, capture_stderr ? &stderr_fd : NULL, &error);
+                                  pid, NULL, NULL, stderr_fd, &error);
 
   close (fds[0]);
 
@@ -498,39 +509,218 @@ session_start_process (const gchar **argv,
       g_message ("couldn't launch cockpit session: %s: %s", argv[0], error->message);
       g_error_free (error);
       close (fds[1]);
-      return NULL;
+      return FALSE;
     }
 
+  *io = fds[1];
+  return TRUE;
+}
+
+static CockpitPipe *
+session_start_process (const gchar **argv,
+                       const gchar **env,
+                       gboolean capture_stderr)
+{
+  int stderr_fd = -1;
+  GPid pid = 0;
+  int io;
+
+  if (!session_spawn_process (argv, env, &pid, &io, capture_stderr ? &stderr_fd : NULL))
+    return NULL;
+
   return g_object_new (COCKPIT_TYPE_PIPE,
-                       "in-fd", fds[1],
-                       "out-fd", fds[1],
+                       "in-fd", io,
+                       "out-fd", io,
                        "err-fd", stderr_fd,
                        "pid", pid,
                        "name", argv[0],
                        NULL);
 }
 
+/*
+ * A warm process is a cockpit-ssh started ahead of time for one of the
+ * hosts in [Ssh-Login] warmHosts. It waits for the answer to its login
+ * challenge, and with the preconnect option already has its connection
+ * open. It's replaced when it's used, or when it gets too old.
+ */
+
+typedef struct {
+  CockpitAuth *auth;
+  gchar *host;
+  gchar *name;
+  GPid pid;
+  int io;
+  guint watch_tag;
+  guint timeout_tag;
+} WarmProcess;
+
+static void warm_process_start (CockpitAuth *self, const gchar *host);
+
+static const gchar * const *
+warm_process_hosts (void)
+{
+  /* Only for cockpit-ssh processes that we start ourselves */
+  if (!cockpit_conf_bool ("WebService", "LoginTo", TRUE) ||
+      cockpit_conf_string (COCKPIT_CONF_SSH_SECTION, "UnixPath"))
+    return NULL;
+
+  return cockpit_conf_strv (COCKPIT_CONF_SSH_SECTION, "warmHosts", ' ');
+}
+
 static void
-send_authorize_reply (CockpitTransport *transport,
-                      const gchar *cookie,
-                      const gchar *authorization)
+on_warm_process_reaped (GPid pid,
+                        gint status,
+                        gpointer user_data)
 {
-  const gchar *fields[] = {
-    "command", "authorize",
-    "cookie", cookie,
-    "response", authorization,
-    NULL
-  };
+  g_spawn_close_pid (pid);
+}
 
-  GBytes *payload;
+static void
+warm_process_free (gpointer data)
+{
+  WarmProcess *warm = data;
+
+  if (warm->watch_tag)
+    {
+      /* Still running, don't leave it waiting for a login */
+      g_source_remove (warm->watch_tag);
+      kill (warm->pid, SIGTERM);
+      g_child_watch_add (warm->pid, on_warm_process_reaped, NULL);
+    }
+  if (warm->timeout_tag)
+    g_source_remove (warm->timeout_tag);
+  if (warm->io >= 0)
+    close (warm->io);
+  g_free (warm->host);
+  g_free (warm->name);
+  g_free (warm);
+}
+
+static void
+on_warm_process_exit (GPid pid,
+                      gint status,
+                      gpointer user_data)
+{
+  WarmProcess *warm = user_data;
+
+  g_debug ("%s: warm process exited", warm->host);
+  warm->watch_tag = 0;
+  g_spawn_close_pid (pid);
+
+  /* Not started again until the next login, so a broken host can't make us spin */
+  g_hash_table_remove (warm->auth->warm, warm->host);
+}
+
+static gboolean
+on_warm_process_timeout (gpointer user_data)
+{
+  WarmProcess *warm = user_data;
+  CockpitAuth *self = warm->auth;
+  gchar *host;
+
+  /* The server gives up on an idle connection at some point, so start afresh */
+  warm->timeout_tag = 0;
+  host = g_strdup (warm->host);
+  g_hash_table_remove (self->warm, host);
+  warm_process_start (self, host);
+  g_free (host);
+
+  return FALSE;
+}
+
+static void
+warm_process_start (CockpitAuth *self,
+                    const gchar *host)
+{
+  const gchar *command;
+  g_auto(GStrv) argv = NULL;
+  g_auto(GStrv) env = NULL;
+  GError *error = NULL;
+  WarmProcess *warm;
+  gint argc;
+
+  command = cockpit_conf_string (COCKPIT_CONF_SSH_SECTION, "Command");
+  if (command == NULL)
+    command = cockpit_ws_ssh_program;
+
+  if (!g_shell_parse_argv (command, &argc, &argv, &error))
+    {
+      g_message ("couldn't parse ssh command: %s", error->message);
+      g_error_free (error);
+      return;
+    }
+
+  /* append the host */
+  argv = g_renew (char *, argv, argc + 1 + 1);
+  argv[argc++] = g_strdup (host);
+  argv[argc] = NULL;
+
+  warm = g_new0 (WarmProcess, 1);
+  warm->auth = self;
+  warm->host = g_strdup (host);
+  warm->name = g_strdup (argv[0]);
+  warm->io = -1;
+
+  /* The remote peer and such are sent along with the login reply */
+  env = g_get_environ ();
+  if (!session_spawn_process ((const gchar **)argv, (const gchar **)env, &warm->pid, &warm->io, NULL))
+    {
+      warm_process_free (warm);
+      return;
+    }
+
+  g_debug ("%s: started warm process", host);
+  warm->watch_tag = g_child_watch_add (warm->pid, on_warm_process_exit, warm);
+  warm->timeout_tag = g_timeout_add_seconds (cockpit_conf_uint (COCKPIT_CONF_SSH_SECTION, "warmTimeout",
+                                                                60, 3600, 5),
+                                             on_warm_process_timeout, warm);
+  g_hash_table_replace (self->warm, warm->host, warm);
+}
+
+static CockpitPipe *
+warm_process_take (CockpitAuth *self,
+                   const gchar *host)
+{
+  const gchar * const *hosts = warm_process_hosts ();
+  CockpitPipe *pipe = NULL;
+  WarmProcess *warm;
+
+  if (!hosts || !g_strv_contains (hosts, host))
+    return NULL;
+
+  warm = g_hash_table_lookup (self->warm, host);
+  if (warm)
+    {
+      /* The pipe watches the process from here on */
+      g_source_remove (warm->watch_tag);
+      warm->watch_tag = 0;
+
+      g_debug ("%s: using warm process", host);
+      pipe = g_object_new (COCKPIT_TYPE_PIPE,
+                           "in-fd", warm->io,
+                           "out-fd", warm->io,
+                           "pid", warm->pid,
+                           "name", warm->name,
+                           NULL);
+      warm->io = -1;
+      g_hash_table_remove (self->warm, host);
+    }
+
+  /* Have another one ready for the next login */
+  warm_process_start (self, host);
+  return pipe;
+}
+
+static void
+append_authorize_fields (GByteArray *buffer,
+                         const gchar * const *fields)
+{
   const gchar *delim;
-  GByteArray *buffer;
   JsonNode *node;
   gchar *encoded;
   gsize length;
   guint i;
 
-  buffer = g_byte_array_new ();
   for (i = 0; fields[i] != NULL; i++)
     {
       if (i % 2 == 0)
@@ -546,6 +736,28 @@ send_authorize_reply (CockpitTransport *transport,
       json_node_free (node);
       g_free (encoded);
     }
+}
+
+static void
+send_authorize_reply (CockpitTransport *transport,
+                      const gchar *cookie,
+                      const gchar *authorization,
+                      const gchar * const *options)
+{
+  const gchar *fields[] = {
+    "command", "authorize",
+    "cookie", cookie,
+    "response", authorization,
+    NULL
+  };
+
+  GBytes *payload;
+  GByteArray *buffer;
+
+  buffer = g_byte_array_new ();
+  append_authorize_fields (buffer, fields);
+  if (options)
+    append_authorize_fields (buffer, options);
 
   g_byte_array_append (buffer, (guchar *)"}", 1);
   payload = g_bytes_new_with_free_func (buffer->data, buffer->len,
@@ -608,7 +820,8 @@ reply_authorize_challenge (CockpitSession *session)
   if (cockpit_authorize_type (session->authorization, &authorization_type) &&
       (g_str_equal (authorize_type, "*") || g_str_equal (authorize_type, authorization_type)))
     {
-      send_authorize_reply (session->transport, cookie, session->authorization);
+      send_authorize_reply (session->transport, cookie, session->authorization,
+                            (const gchar * const *)session->warm_options);
       cockpit_memory_clear (session->authorization, -1);
       g_free (session->authorization);
       session->authorization = NULL;
@@ -774,7 +987,7 @@ on_transport_control (CockpitTransport *transport,
 
           /* return a negative answer; we handle unknown hosts interactively, or want to fail on them */
           g_debug ("received x-host-key authorize challenge");
-          send_authorize_reply (session->transport, cookie, "");
+          send_authorize_reply (session->transport, cookie, "", NULL);
           return TRUE;
         }
 
@@ -1097,7 +1310,28 @@ cockpit_session_launch (CockpitAuth *self,
     }
 
   g_autoptr(CockpitPipe) pipe = NULL;
-  if (command != NULL)
+  g_auto(GStrv) warm_options = NULL;
+  if (command != NULL && host && g_str_equal (section, COCKPIT_CONF_SSH_SECTION) && !capture_stderr)
+    pipe = warm_process_take (self, host);
+
+  if (pipe != NULL)
+    {
+      /* What would otherwise be in its environment */
+      GPtrArray *options = g_ptr_array_new ();
+      if (cockpit_creds_get_rhost (creds))
+        {
+          g_ptr_array_add (options, g_strdup ("remote-peer"));
+          g_ptr_array_add (options, g_strdup (cockpit_creds_get_rhost (creds)));
+        }
+      if (g_strcmp0 (cockpit_web_request_lookup_header (request, "X-SSH-Connect-Unknown-Hosts"), "yes") == 0)
+        {
+          g_ptr_array_add (options, g_strdup ("connect-to-unknown-hosts"));
+          g_ptr_array_add (options, g_strdup ("1"));
+        }
+      g_ptr_array_add (options, NULL);
+      warm_options = (gchar **)g_ptr_array_free (options, FALSE);
+    }
+  else if (command != NULL)
     {
       g_auto(GStrv) env = g_get_environ ();
       if (cockpit_creds_get_rhost (creds))
@@ -1147,6 +1381,7 @@ cockpit_session_launch (CockpitAuth *self,
 
   g_autoptr(CockpitTransport) transport = cockpit_pipe_transport_new (pipe);
   CockpitSession *session = cockpit_session_create (self, cockpit_pipe_get_name (pipe), creds, transport);
+  session->warm_options = g_steal_pointer (&warm_options);
 
   /* How long to wait for the auth process to send some data */
   session->authorize_timeout = timeout_option ("timeout", section, cockpit_ws_auth_process_timeout);
@@ -1618,8 +1853,10 @@ cockpit_auth_new (gboolean login_loopback,
                   CockpitAuthFlags flags)
 {
   CockpitAuth *self = g_object_new (COCKPIT_TYPE_AUTH, NULL);
+  const gchar * const *warm_hosts;
   const gchar *max_startups_conf;
   gint count = 0;
+  guint i;
 
   self->flags = flags;
   self->login_loopback = login_loopback;
@@ -1659,6 +1896,10 @@ cockpit_auth_new (gboolean login_loopback,
         }
     }
 
+  warm_hosts = warm_process_hosts ();
+  for (i = 0; warm_hosts && warm_hosts[i] != NULL; i++)
+    warm_process_start (self, warm_hosts[i]);
+
   return self;
 }
 
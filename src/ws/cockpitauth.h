@@ -65,6 +65,7 @@ struct _CockpitAuth
   guint max_startups;
   guint max_startups_begin;
   guint max_startups_rate;
+  GHashTable *warm;
 };
 
 struct _CockpitAuthClass
@@ -44,7 +44,7 @@ cockpit_channel_inject_free (gpointer data)
   if (inject)
     {
       if (inject->service)
-        g_object_remove_weak_pointer (G_OBJECT (inject->service), (gpointer *)&inject->service);
+        cockpit_web_service_release (inject->service);
       g_free (inject->base_path);
       g_free (inject->host);
       g_free (inject);
@@ -57,8 +57,7 @@ cockpit_channel_inject_new (CockpitWebService *service,
                             const gchar *host)
 {
   CockpitChannelInject *inject = g_new (CockpitChannelInject, 1);
-  inject->service = service;
-  g_object_add_weak_pointer (G_OBJECT (inject->service), (gpointer *)&inject->service);
+  inject->service = g_object_ref (service);
   inject->base_path = g_strdup (path);
   inject->host = g_strdup (host);
   return inject;
@@ -576,12 +575,12 @@ parse_host_and_etag (CockpitWebService *service,
   return TRUE;
 }
 
-void
-cockpit_channel_response_serve (CockpitWebService *service,
-                                GHashTable *in_headers,
-                                CockpitWebResponse *response,
-                                const gchar *where,
-                                const gchar *path)
+static void
+serve_in_session (CockpitWebService *service,
+                  GHashTable *in_headers,
+                  CockpitWebResponse *response,
+                  const gchar *where,
+                  const gchar *path)
 {
   CockpitChannelResponse *self = NULL;
   CockpitTransport *transport = NULL;
@@ -602,11 +601,6 @@ cockpit_channel_response_serve (CockpitWebService *service,
   gpointer key;
   gpointer value;
 
-  g_return_if_fail (COCKPIT_IS_WEB_SERVICE (service));
-  g_return_if_fail (in_headers != NULL);
-  g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (response));
-  g_return_if_fail (path != NULL);
-
   /* Where might be NULL, but that's still valid */
   if (!parse_host_and_etag (service, in_headers, where, path, &host, &quoted_etag))
     {
@@ -629,7 +623,9 @@ cockpit_channel_response_serve (CockpitWebService *service,
         }
     }
 
-  cockpit_web_response_set_cache_type (response, cache_type);
+  /* The shell is served without a where, and the caller picks its cache type */
+  if (where)
+    cockpit_web_response_set_cache_type (response, cache_type);
   object = cockpit_transport_build_json ("command", "open",
                                          "payload", "http-stream1",
                                          "internal", "packages",
@@ -678,6 +674,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
           g_ascii_strcasecmp (key, "Content-MD5") == 0 ||
           g_ascii_strcasecmp (key, "Content-Range") == 0 ||
           g_ascii_strcasecmp (key, "Range") == 0 ||
+          g_ascii_strcasecmp (key, "If-Range") == 0 ||
           g_ascii_strcasecmp (key, "TE") == 0 ||
           g_ascii_strcasecmp (key, "Trailer") == 0 ||
           g_ascii_strcasecmp (key, "Upgrade") == 0 ||
@@ -710,6 +707,20 @@ cockpit_channel_response_serve (CockpitWebService *service,
       json_object_set_string_member (heads, "Accept-Encoding", "identity");
     }
 
+  /*
+   * The bridge can answer byte range requests, but only when the body
+   * is passed through unchanged, and the ETag (if any) matches If-Range.
+   * The bridge doesn't know our ETag, so If-Range is checked here and
+   * never forwarded, otherwise the bridge would ignore the Range.
+   */
+  if (!injecting_base_path && !cockpit_web_response_get_url_root (response))
+    {
+      const gchar *range = g_hash_table_lookup (in_headers, "Range");
+      const gchar *if_range = g_hash_table_lookup (in_headers, "If-Range");
+      if (range && (!if_range || g_strcmp0 (if_range, g_hash_table_lookup (out_headers, "ETag")) == 0))
+        json_object_set_string_member (heads, "Range", range);
+    }
+
   json_object_set_object_member (object, "headers", heads);
 
   self = cockpit_channel_response_new (service, response, transport,
@@ -733,10 +744,66 @@ out:
     cockpit_web_response_error (response, 404, NULL, NULL);
 }
 
+typedef struct {
+  CockpitWebService *service;
+  CockpitWebResponse *response;
+  GHashTable *headers;
+  GBytes *open;
+  gchar *where;
+  gchar *path;
+} ServeInvoke;
+
+static void
+serve_invoke_free (gpointer data)
+{
+  ServeInvoke *invoke = data;
+  cockpit_web_service_release (invoke->service);
+  g_object_unref (invoke->response);
+  if (invoke->headers)
+    g_hash_table_unref (invoke->headers);
+  if (invoke->open)
+    g_bytes_unref (invoke->open);
+  g_free (invoke->where);
+  g_free (invoke->path);
+  g_free (invoke);
+}
+
+static gboolean
+on_invoke_serve (gpointer data)
+{
+  ServeInvoke *invoke = data;
+  serve_in_session (invoke->service, invoke->headers, invoke->response,
+                    invoke->where, invoke->path);
+  return FALSE;
+}
+
 void
-cockpit_channel_response_open (CockpitWebService *service,
-                               CockpitWebRequest *request,
-                               JsonObject *open)
+cockpit_channel_response_serve (CockpitWebService *service,
+                                GHashTable *in_headers,
+                                CockpitWebResponse *response,
+                                const gchar *where,
+                                const gchar *path)
+{
+  ServeInvoke *invoke;
+
+  g_return_if_fail (COCKPIT_IS_WEB_SERVICE (service));
+  g_return_if_fail (in_headers != NULL);
+  g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (response));
+  g_return_if_fail (path != NULL);
+
+  invoke = g_new0 (ServeInvoke, 1);
+  invoke->service = g_object_ref (service);
+  invoke->response = g_object_ref (response);
+  invoke->headers = g_hash_table_ref (in_headers);
+  invoke->where = g_strdup (where);
+  invoke->path = g_strdup (path);
+  cockpit_web_service_invoke (service, on_invoke_serve, invoke, serve_invoke_free);
+}
+
+static void
+open_in_session (CockpitWebService *service,
+                 CockpitWebResponse *response,
+                 JsonObject *open)
 {
   CockpitChannelResponse *self;
   CockpitTransport *transport;
@@ -746,8 +813,6 @@ cockpit_channel_response_open (CockpitWebService *service,
   const gchar *content_encoding;
   const gchar *content_disposition;
 
-  g_autoptr(CockpitWebResponse) response = cockpit_web_request_respond (request);
-
   /* Parse the external */
   if (!cockpit_web_service_parse_external (open, &content_type, &content_encoding, &content_disposition, NULL))
     {
@@ -795,3 +860,33 @@ cockpit_channel_response_open (CockpitWebService *service,
   /* Unref when the channel closes */
   g_signal_connect_after (self, "closed", G_CALLBACK (g_object_unref), NULL);
 }
+
+static gboolean
+on_invoke_open (gpointer data)
+{
+  ServeInvoke *invoke = data;
+  JsonObject *open;
+
+  open = cockpit_json_parse_bytes (invoke->open, NULL);
+  g_return_val_if_fail (open != NULL, FALSE);
+
+  open_in_session (invoke->service, invoke->response, open);
+  json_object_unref (open);
+  return FALSE;
+}
+
+void
+cockpit_channel_response_open (CockpitWebService *service,
+                               CockpitWebRequest *request,
+                               JsonObject *open)
+{
+  ServeInvoke *invoke;
+
+  invoke = g_new0 (ServeInvoke, 1);
+  invoke->service = g_object_ref (service);
+  invoke->response = cockpit_web_request_respond (request);
+
+  /* JSON objects can't be shared between threads, not even their refs */
+  invoke->open = cockpit_json_write_bytes (open);
+  cockpit_web_service_invoke (service, on_invoke_open, invoke, serve_invoke_free);
+}
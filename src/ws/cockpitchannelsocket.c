@@ -181,43 +181,48 @@ cockpit_channel_socket_class_init (CockpitChannelSocketClass *klass)
   channel_class->close = cockpit_channel_socket_close;
 }
 
-void
-cockpit_channel_socket_open (CockpitWebService *service,
-                             JsonObject *open,
-                             CockpitWebRequest *request)
+typedef struct {
+  CockpitWebService *service;
+  CockpitSocketHandoff *handoff;
+  GBytes *open;
+  WebSocketDataType data_type;
+} SocketInvoke;
+
+static void
+socket_invoke_free (gpointer data)
+{
+  SocketInvoke *invoke = data;
+  cockpit_web_service_release (invoke->service);
+  cockpit_socket_handoff_free (invoke->handoff);
+  g_bytes_unref (invoke->open);
+  g_free (invoke);
+}
+
+static gboolean
+on_invoke_open (gpointer data)
 {
+  SocketInvoke *invoke = data;
   CockpitChannelSocket *self = NULL;
-  WebSocketDataType data_type;
   CockpitTransport *transport;
-  g_autofree const gchar **protocols = NULL;
   g_autofree gchar *id = NULL;
+  JsonObject *open;
 
-  if (!cockpit_web_service_parse_external (open, NULL, NULL, NULL, &protocols) ||
-      !cockpit_web_service_parse_binary (open, &data_type))
-    {
-      respond_with_error (request, 400, "Bad channel request");
-      return;
-    }
-
-  transport = cockpit_web_service_get_transport (service);
-  if (!transport)
-    {
-      respond_with_error (request, 502, "Failed to open channel transport");
-      return;
-    }
+  open = cockpit_json_parse_bytes (invoke->open, NULL);
+  g_return_val_if_fail (open != NULL, FALSE);
 
+  transport = cockpit_web_service_get_transport (invoke->service);
   json_object_set_boolean_member (open, "flow-control", TRUE);
 
-  id = cockpit_web_service_unique_channel (service);
+  id = cockpit_web_service_unique_channel (invoke->service);
   self = g_object_new (COCKPIT_TYPE_CHANNEL_SOCKET,
                        "transport", transport,
                        "options", open,
                        "id", id,
                        NULL);
 
-  self->data_type = data_type;
+  self->data_type = invoke->data_type;
 
-  self->socket = cockpit_web_service_create_socket (protocols, request);
+  self->socket = cockpit_socket_handoff_accept (invoke->handoff);
   self->socket_open = g_signal_connect (self->socket, "open", G_CALLBACK (on_socket_open), self);
   self->socket_message = g_signal_connect (self->socket, "message", G_CALLBACK (on_socket_message), self);
   self->socket_close = g_signal_connect (self->socket, "close", G_CALLBACK (on_socket_close), self);
@@ -230,4 +235,38 @@ cockpit_channel_socket_open (CockpitWebService *service,
 
   /* Tell the socket peer's output to throttle based on back pressure */
   cockpit_flow_throttle (COCKPIT_FLOW (self->socket), COCKPIT_FLOW (self));
+
+  json_object_unref (open);
+  return FALSE;
+}
+
+void
+cockpit_channel_socket_open (CockpitWebService *service,
+                             JsonObject *open,
+                             CockpitWebRequest *request)
+{
+  SocketInvoke *invoke;
+  WebSocketDataType data_type;
+  g_autofree const gchar **protocols = NULL;
+
+  if (!cockpit_web_service_parse_external (open, NULL, NULL, NULL, &protocols) ||
+      !cockpit_web_service_parse_binary (open, &data_type))
+    {
+      respond_with_error (request, 400, "Bad channel request");
+      return;
+    }
+
+  if (!cockpit_web_service_get_transport (service))
+    {
+      respond_with_error (request, 502, "Failed to open channel transport");
+      return;
+    }
+
+  /* The channel and its socket are created where the transport runs */
+  invoke = g_new0 (SocketInvoke, 1);
+  invoke->service = g_object_ref (service);
+  invoke->handoff = cockpit_socket_handoff_new (protocols, request);
+  invoke->open = cockpit_json_write_bytes (open);
+  invoke->data_type = data_type;
+  cockpit_web_service_invoke (service, on_invoke_open, invoke, socket_invoke_free);
 }
@@ -658,9 +658,9 @@ handle_shell (CockpitHandlerData *data,
   else if (service)
     {
       shell_path = cockpit_conf_string ("WebService", "Shell");
+      cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
       cockpit_channel_response_serve (service, headers, response, NULL,
                                       shell_path ? shell_path : cockpit_ws_shell_component);
-      cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
     }
   else
     {
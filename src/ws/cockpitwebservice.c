@@ -32,9 +32,11 @@
 
 #include "common/cockpitauthorize.h"
 #include "common/cockpitconf.h"
+#include "common/cockpitflow.h"
 #include "common/cockpithex.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitmemory.h"
+#include "common/cockpitpipetransport.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpitwebresponse.h"
 #include "common/cockpitwebserver.h"
@@ -45,28 +47,146 @@
 #include <stdlib.h>
 
 guint cockpit_ws_ping_interval = 5;
+gboolean cockpit_ws_session_threads = FALSE;
 
 /* ----------------------------------------------------------------------------
  * Web Socket Info
  */
 
+/*
+ * Messages from the bridge are sent straight to the web socket until the
+ * web socket has more than SOCKET_LOW_WATER queued. From then on they are
+ * queued per channel and the channels take turns (deficit round robin) as
+ * the web socket drains, only ever refilling it up to that mark. Interactive
+ * channels get a larger quantum than bulk transfers, so that a large download
+ * doesn't hold up terminal output or D-Bus replies.
+ *
+ * Channels are throttled individually: unless the browser asks for flow
+ * control itself, we turn it on for bulk channels and answer the bridge's
+ * pings once the data before them has gone to the web socket.
+ */
+
+/* Bytes a bulk channel may send per scheduling round */
+#define CHANNEL_QUANTUM         (16 * 1024)
+
+/* Interactive channels get this many times the bulk quantum */
+#define INTERACTIVE_WEIGHT      4
+
+/* Output queued in a web socket above which channels take turns */
+#define SOCKET_LOW_WATER        (4 * CHANNEL_QUANTUM)
+
+/*
+ * Queued bytes for a single channel above which we throttle the whole bridge.
+ * Flow controlled channels stay well below this, it only bounds memory for
+ * channels that keep sending without waiting for their pings to be answered.
+ */
+#define CHANNEL_QUEUE_MAX       (4 * 1024 * 1024)
+
+typedef struct {
+  GBytes *prefix;
+  GBytes *payload;
+  GBytes *reply;
+  WebSocketDataType data_type;
+} CockpitSocketFrame;
+
+typedef struct {
+  gchar *id;
+  GBytes *prefix;
+  WebSocketDataType data_type;
+  gsize quantum;
+  gsize deficit;
+  GQueue queue;
+  gsize queued;
+  gboolean scheduled;
+  gboolean visiting;
+  gboolean closed;
+  gboolean answer_pings;
+} CockpitSocketChannel;
+
 typedef struct {
   gchar *id;
   WebSocketConnection *connection;
   GHashTable *channels;
   JsonObject *init_received;
+  GQueue scheduled;
+  gboolean congested;
 } CockpitSocket;
 
 typedef struct {
   GHashTable *by_channel;
   GHashTable *by_connection;
   guint next_socket_id;
+  guint overfull;
 } CockpitSockets;
 
+static void
+cockpit_socket_frame_free (gpointer data)
+{
+  CockpitSocketFrame *frame = data;
+  if (frame->prefix)
+    g_bytes_unref (frame->prefix);
+  if (frame->payload)
+    g_bytes_unref (frame->payload);
+  if (frame->reply)
+    g_bytes_unref (frame->reply);
+  g_slice_free (CockpitSocketFrame, frame);
+}
+
+static CockpitSocketChannel *
+cockpit_socket_channel_new (const gchar *channel,
+                            WebSocketDataType data_type,
+                            gsize quantum)
+{
+  CockpitSocketChannel *chan;
+  gchar *prefix;
+
+  chan = g_slice_new0 (CockpitSocketChannel);
+  chan->id = g_strdup (channel);
+  prefix = g_strdup_printf ("%s\n", channel);
+  chan->prefix = g_bytes_new_take (prefix, strlen (prefix));
+  chan->data_type = data_type;
+  chan->quantum = quantum;
+  g_queue_init (&chan->queue);
+  return chan;
+}
+
+static void
+cockpit_socket_channel_free (gpointer data)
+{
+  CockpitSocketChannel *chan = data;
+  while (!g_queue_is_empty (&chan->queue))
+    cockpit_socket_frame_free (g_queue_pop_head (&chan->queue));
+  g_bytes_unref (chan->prefix);
+  g_free (chan->id);
+  g_slice_free (CockpitSocketChannel, chan);
+}
+
+static void
+cockpit_socket_channel_discard (CockpitSockets *sockets,
+                                CockpitSocketChannel *chan)
+{
+  if (chan->queued >= CHANNEL_QUEUE_MAX)
+    sockets->overfull--;
+  while (!g_queue_is_empty (&chan->queue))
+    cockpit_socket_frame_free (g_queue_pop_head (&chan->queue));
+  chan->queued = 0;
+}
+
 static void
 cockpit_socket_free (gpointer data)
 {
   CockpitSocket *socket = data;
+  GList *l;
+
+  /* Channels that were closed while still draining are only in the schedule */
+  for (l = socket->scheduled.head; l != NULL; l = g_list_next (l))
+    {
+      CockpitSocketChannel *chan = l->data;
+      if (chan->closed)
+        cockpit_socket_channel_free (chan);
+    }
+  g_queue_clear (&socket->scheduled);
+
   g_hash_table_unref (socket->channels);
   if (socket->init_received)
     json_object_unref (socket->init_received);
@@ -104,28 +224,188 @@ cockpit_socket_lookup_by_channel (CockpitSockets *sockets,
 static void
 cockpit_socket_remove_channel (CockpitSockets *sockets,
                                CockpitSocket *socket,
-                               const gchar *channel)
+                               const gchar *channel,
+                               gboolean discard)
 {
+  CockpitSocketChannel *chan;
+
   g_debug ("%s remove channel %s for socket", socket->id, channel);
+
+  chan = g_hash_table_lookup (socket->channels, channel);
+  if (!chan)
+    return;
+
   g_hash_table_remove (sockets->by_channel, channel);
-  g_hash_table_remove (socket->channels, channel);
+  g_hash_table_steal (socket->channels, channel);
+
+  if (discard)
+    cockpit_socket_channel_discard (sockets, chan);
+
+  /* Still has output queued, freed once that has drained */
+  if (chan->scheduled)
+    chan->closed = TRUE;
+  else
+    cockpit_socket_channel_free (chan);
 }
 
 static void
 cockpit_socket_add_channel (CockpitSockets *sockets,
                             CockpitSocket *socket,
                             const gchar *channel,
-                            WebSocketDataType data_type)
+                            WebSocketDataType data_type,
+                            gsize quantum,
+                            gboolean answer_pings)
 {
-  gchar *chan;
+  CockpitSocketChannel *chan;
 
-  chan = g_strdup (channel);
-  g_hash_table_insert (sockets->by_channel, chan, socket);
-  g_hash_table_replace (socket->channels, chan, GINT_TO_POINTER (data_type));
+  chan = cockpit_socket_channel_new (channel, data_type, quantum);
+  chan->answer_pings = answer_pings;
+  g_hash_table_insert (sockets->by_channel, chan->id, socket);
+  g_hash_table_replace (socket->channels, chan->id, chan);
 
   g_debug ("%s added channel %s to socket", socket->id, channel);
 }
 
+static void
+cockpit_socket_queue (CockpitSockets *sockets,
+                      CockpitSocket *socket,
+                      CockpitSocketChannel *chan,
+                      WebSocketDataType data_type,
+                      GBytes *prefix,
+                      GBytes *payload,
+                      GBytes *reply)
+{
+  CockpitSocketFrame *frame;
+  gsize before;
+
+  frame = g_slice_new0 (CockpitSocketFrame);
+  if (payload)
+    {
+      frame->prefix = g_bytes_ref (prefix);
+      frame->payload = g_bytes_ref (payload);
+      frame->data_type = data_type;
+    }
+  if (reply)
+    frame->reply = g_bytes_ref (reply);
+  g_queue_push_tail (&chan->queue, frame);
+
+  before = chan->queued;
+  if (payload)
+    chan->queued += g_bytes_get_size (payload);
+  if (before < CHANNEL_QUEUE_MAX && chan->queued >= CHANNEL_QUEUE_MAX)
+    sockets->overfull++;
+
+  if (!chan->scheduled)
+    {
+      chan->scheduled = TRUE;
+      g_queue_push_tail (&socket->scheduled, chan);
+    }
+}
+
+static void
+cockpit_socket_send (CockpitSockets *sockets,
+                     CockpitSocket *socket,
+                     CockpitSocketChannel *chan,
+                     WebSocketDataType data_type,
+                     GBytes *prefix,
+                     GBytes *payload)
+{
+  if (web_socket_connection_get_ready_state (socket->connection) != WEB_SOCKET_STATE_OPEN)
+    return;
+
+  /* Keep ordering within a channel, and wait our turn when congested */
+  if (chan && (chan->scheduled || socket->congested))
+    cockpit_socket_queue (sockets, socket, chan, data_type, prefix, payload, NULL);
+  else
+    web_socket_connection_send (socket->connection, data_type, prefix, payload);
+}
+
+/*
+ * Send a control message back to the bridge once everything the channel
+ * queued before this point has been handed to the web socket.
+ */
+static void
+cockpit_socket_reply (CockpitSockets *sockets,
+                      CockpitSocket *socket,
+                      CockpitSocketChannel *chan,
+                      CockpitTransport *transport,
+                      GBytes *reply)
+{
+  if (web_socket_connection_get_ready_state (socket->connection) != WEB_SOCKET_STATE_OPEN)
+    return;
+
+  if (chan->scheduled || socket->congested)
+    cockpit_socket_queue (sockets, socket, chan, 0, NULL, NULL, reply);
+  else if (transport)
+    cockpit_transport_send (transport, NULL, reply);
+}
+
+static void
+cockpit_socket_drain (CockpitSockets *sockets,
+                      CockpitSocket *socket,
+                      CockpitTransport *transport)
+{
+  CockpitSocketChannel *chan;
+  CockpitSocketFrame *frame;
+  gsize before;
+  gsize length;
+
+  while (!socket->congested)
+    {
+      chan = g_queue_peek_head (&socket->scheduled);
+      if (!chan)
+        break;
+
+      /* Each turn a channel gets its quantum on top of what it had left over */
+      if (!chan->visiting)
+        {
+          chan->deficit += chan->quantum;
+          chan->visiting = TRUE;
+        }
+
+      frame = g_queue_peek_head (&chan->queue);
+      if (frame)
+        {
+          length = frame->payload ? g_bytes_get_size (frame->payload) : 0;
+          if (length <= chan->deficit)
+            {
+              g_queue_pop_head (&chan->queue);
+              chan->deficit -= length;
+
+              before = chan->queued;
+              chan->queued -= length;
+              if (before >= CHANNEL_QUEUE_MAX && chan->queued < CHANNEL_QUEUE_MAX)
+                sockets->overfull--;
+
+              /* May apply back pressure and mark us as congested */
+              if (frame->payload &&
+                  web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+                web_socket_connection_send (socket->connection, frame->data_type, frame->prefix, frame->payload);
+              if (frame->reply && transport)
+                cockpit_transport_send (transport, NULL, frame->reply);
+              cockpit_socket_frame_free (frame);
+              continue;
+            }
+        }
+
+      /* End of this channel's turn */
+      chan->visiting = FALSE;
+      g_queue_pop_head (&socket->scheduled);
+
+      if (g_queue_is_empty (&chan->queue))
+        {
+          chan->deficit = 0;
+          chan->scheduled = FALSE;
+          if (chan->closed)
+            cockpit_socket_channel_free (chan);
+        }
+      else
+        {
+          g_queue_push_tail (&socket->scheduled, chan);
+        }
+    }
+}
+
 static CockpitSocket *
 cockpit_socket_track (CockpitSockets *sockets,
                       WebSocketConnection *connection)
@@ -135,7 +415,8 @@ cockpit_socket_track (CockpitSockets *sockets,
   socket = g_new0 (CockpitSocket, 1);
   socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
   socket->connection = g_object_ref (connection);
-  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cockpit_socket_channel_free);
+  g_queue_init (&socket->scheduled);
 
   g_debug ("%s new socket", socket->id);
 
@@ -149,11 +430,21 @@ static void
 cockpit_socket_destroy (CockpitSockets *sockets,
                         CockpitSocket *socket)
 {
+  CockpitSocketChannel *scheduled;
   GHashTableIter iter;
   const gchar *chan;
 
   g_debug ("%s destroy socket", socket->id);
 
+  /* Nothing more will be sent, so release any back pressure from here */
+  while ((scheduled = g_queue_pop_head (&socket->scheduled)))
+    {
+      cockpit_socket_channel_discard (sockets, scheduled);
+      scheduled->scheduled = FALSE;
+      if (scheduled->closed)
+        cockpit_socket_channel_free (scheduled);
+    }
+
   g_hash_table_iter_init (&iter, socket->channels);
   while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
     g_hash_table_remove (sockets->by_channel, chan);
@@ -192,6 +483,22 @@ cockpit_sockets_cleanup (CockpitSockets *sockets)
  * Web Socket Routing
  */
 
+/*
+ * With cockpit_ws_session_threads a web service moves its bridge transport,
+ * web sockets and channels to a thread of its own once the bridge has sent
+ * its "init" message. Authentication, the session table and the GObject
+ * life cycle of the service (its signals, weak references, dispose and
+ * finalize) stay in the main thread. Calls from the main thread into the
+ * session go through cockpit_web_service_invoke().
+ */
+typedef struct {
+  GMainContext *context;
+  CockpitPipe *pipe;
+  gulong close_sig;
+  gboolean pipe_closed;
+  gint finished;
+} CockpitSessionThread;
+
 struct _CockpitWebService {
   GObject parent;
 
@@ -200,8 +507,9 @@ struct _CockpitWebService {
   CockpitCreds *creds;
   CockpitSockets sockets;
   gboolean closing;
+  gboolean disposed;
   GBytes *control_prefix;
-  guint ping_timeout;
+  GSource *ping_timeout;
   gint callers;
   guint next_internal_id;
 
@@ -211,7 +519,14 @@ struct _CockpitWebService {
   gulong recv_sig;
   gulong closed_sig;
   gboolean sent_done;
-  guint credentials_timeout;
+  GSource *credentials_timeout;
+  gboolean pressure;
+
+  /* Where the transport and sockets run, and where this object lives */
+  GMainContext *context;
+  GMainContext *main_context;
+  GThread *main_thread;
+  CockpitSessionThread *thread;
 
   GHashTable *checksum_by_host;
   GHashTable *host_by_checksum;
@@ -224,13 +539,93 @@ typedef struct {
 static guint sig_idling = 0;
 static guint sig_destroy = 0;
 
-G_DEFINE_TYPE (CockpitWebService, cockpit_web_service, G_TYPE_OBJECT);
+static void  cockpit_web_service_flow_iface_init   (CockpitFlowInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitWebService, cockpit_web_service, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_web_service_flow_iface_init));
+
+static CockpitFlow *
+transport_flow (CockpitTransport *transport)
+{
+  if (COCKPIT_IS_PIPE_TRANSPORT (transport))
+    return COCKPIT_FLOW (cockpit_pipe_transport_get_pipe (COCKPIT_PIPE_TRANSPORT (transport)));
+  return NULL;
+}
 
 static void
-cockpit_web_service_dispose (GObject *object)
+update_pressure (CockpitWebService *self)
 {
-  CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
-  gboolean emit = FALSE;
+  gboolean pressure = self->sockets.overfull > 0;
+
+  /* Throttle the bridge while any channel has too much queued for its socket */
+  if (pressure != self->pressure)
+    {
+      g_debug ("%s back pressure on bridge", pressure ? "applying" : "relieving");
+      self->pressure = pressure;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), pressure);
+    }
+}
+
+static void
+destroy_source (GSource **source)
+{
+  if (*source)
+    {
+      g_source_destroy (*source);
+      g_source_unref (*source);
+      *source = NULL;
+    }
+}
+
+static GSource *
+attach_timeout (GSource *source,
+                GMainContext *context,
+                GSourceFunc func,
+                gpointer user_data)
+{
+  g_source_set_callback (source, func, user_data, NULL);
+  g_source_attach (source, context);
+  return source;
+}
+
+/*
+ * Unlike g_main_context_invoke() this never runs @func right away, not
+ * even when @context happens to be free, so it always runs in the
+ * thread that iterates @context.
+ */
+static void
+invoke_later (GMainContext *context,
+              GSourceFunc func,
+              gpointer data,
+              GDestroyNotify notify)
+{
+  GSource *source;
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_HIGH);
+  g_source_set_callback (source, func, data, notify);
+  g_source_attach (source, context);
+  g_source_unref (source);
+}
+
+static gboolean
+in_main_thread (CockpitWebService *self)
+{
+  return !self->thread || g_thread_self () == self->main_thread;
+}
+
+static gboolean
+on_invoke_dispose (gpointer user_data)
+{
+  g_object_run_dispose (user_data);
+  return FALSE;
+}
+
+static gboolean
+on_invoke_close (gpointer user_data)
+{
+  CockpitWebService *self = user_data;
+  CockpitFlow *flow;
 
   if (self->control_sig)
     g_signal_handler_disconnect (self->transport, self->control_sig);
@@ -244,9 +639,13 @@ cockpit_web_service_dispose (GObject *object)
     g_signal_handler_disconnect (self->transport, self->closed_sig);
   self->closed_sig = 0;
 
-  if (self->credentials_timeout)
-    g_source_remove (self->credentials_timeout);
-  self->credentials_timeout = 0;
+  /* Both timers run without a reference, stop them where they run */
+  destroy_source (&self->credentials_timeout);
+  destroy_source (&self->ping_timeout);
+
+  flow = transport_flow (self->transport);
+  if (flow)
+    cockpit_flow_throttle (flow, NULL);
 
   if (!self->sent_done)
     {
@@ -254,6 +653,16 @@ cockpit_web_service_dispose (GObject *object)
       cockpit_transport_close (self->transport, NULL);
     }
 
+  cockpit_sockets_close (&self->sockets, NULL);
+  return FALSE;
+}
+
+static void
+cockpit_web_service_dispose (GObject *object)
+{
+  CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
+  gboolean emit = FALSE;
+
   if (!self->closing)
     {
       g_debug ("web service closing");
@@ -261,7 +670,12 @@ cockpit_web_service_dispose (GObject *object)
     }
   self->closing = TRUE;
 
-  cockpit_sockets_close (&self->sockets, NULL);
+  if (!self->disposed)
+    {
+      self->disposed = TRUE;
+      cockpit_web_service_invoke (self, on_invoke_close, g_object_ref (self),
+                                  (GDestroyNotify)cockpit_web_service_release);
+    }
 
   if (emit)
     g_signal_emit (self, sig_destroy, 0);
@@ -269,22 +683,51 @@ cockpit_web_service_dispose (GObject *object)
   G_OBJECT_CLASS (cockpit_web_service_parent_class)->dispose (object);
 }
 
+typedef struct {
+  CockpitSockets sockets;
+  CockpitTransport *transport;
+  CockpitSessionThread *thread;
+} ServiceRemains;
+
+static gboolean
+on_invoke_cleanup (gpointer user_data)
+{
+  ServiceRemains *remains = user_data;
+
+  cockpit_sockets_cleanup (&remains->sockets);
+  if (remains->transport)
+    g_object_unref (remains->transport);
+
+  /* The session thread goes away once this is set */
+  if (remains->thread)
+    g_atomic_int_set (&remains->thread->finished, TRUE);
+
+  g_free (remains);
+  return FALSE;
+}
+
 static void
 cockpit_web_service_finalize (GObject *object)
 {
   CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
+  ServiceRemains *remains;
 
-  cockpit_sockets_cleanup (&self->sockets);
+  /* The sockets and the transport are released where they run */
+  remains = g_new0 (ServiceRemains, 1);
+  remains->sockets = self->sockets;
+  remains->transport = self->transport;
+  remains->thread = self->thread;
+  cockpit_web_service_invoke (self, on_invoke_cleanup, remains, NULL);
 
-  if (self->transport)
-    g_object_unref (self->transport);
   if (self->init_received)
     json_object_unref (self->init_received);
 
   g_bytes_unref (self->control_prefix);
   cockpit_creds_unref (self->creds);
-  if (self->ping_timeout)
-    g_source_remove (self->ping_timeout);
+  destroy_source (&self->ping_timeout);
+  destroy_source (&self->credentials_timeout);
+  g_main_context_unref (self->context);
+  g_main_context_unref (self->main_context);
 
   g_hash_table_destroy (self->host_by_checksum);
   g_hash_table_destroy (self->checksum_by_host);
@@ -303,17 +746,28 @@ static void
 caller_begin (CockpitWebService *self)
 {
   g_object_ref (self);
-  self->callers++;
+  g_atomic_int_inc (&self->callers);
+}
+
+static gboolean
+on_invoke_idling (gpointer user_data)
+{
+  g_signal_emit (user_data, sig_idling, 0);
+  return FALSE;
 }
 
 static void
 caller_end (CockpitWebService *self)
 {
-  g_return_if_fail (self->callers > 0);
-  self->callers--;
-  if (self->callers == 0)
-    g_signal_emit (self, sig_idling, 0);
-  g_object_unref (self);
+  g_return_if_fail (g_atomic_int_get (&self->callers) > 0);
+  if (g_atomic_int_dec_and_test (&self->callers))
+    {
+      if (in_main_thread (self))
+        g_signal_emit (self, sig_idling, 0);
+      else
+        invoke_later (self->main_context, on_invoke_idling, g_object_ref (self), g_object_unref);
+    }
+  cockpit_web_service_release (self);
 }
 
 static void
@@ -329,10 +783,14 @@ outbound_protocol_error (CockpitWebService *self,
 static gboolean
 process_close (CockpitWebService *self,
                CockpitSocket *socket,
-               const gchar *channel)
+               const gchar *channel,
+               gboolean discard)
 {
   if (socket)
-    cockpit_socket_remove_channel (&self->sockets, socket, channel);
+    {
+      cockpit_socket_remove_channel (&self->sockets, socket, channel, discard);
+      update_pressure (self);
+    }
 
   return TRUE;
 }
@@ -345,7 +803,8 @@ process_and_relay_close (CockpitWebService *self,
 {
   gboolean valid;
 
-  valid = process_close (self, socket, channel);
+  /* Output still queued for the channel is of no interest to the closing side */
+  valid = process_close (self, socket, channel, TRUE);
   if (valid && !self->sent_done)
     cockpit_transport_send (self->transport, NULL, payload);
 
@@ -591,10 +1050,89 @@ poison_creds (gpointer user_data)
 {
   CockpitWebService *self = user_data;
   cockpit_creds_poison (self->creds);
-  self->credentials_timeout = 0;
+  destroy_source (&self->credentials_timeout);
   return G_SOURCE_REMOVE;
 }
 
+static gboolean  on_ping_time    (gpointer user_data);
+
+static void
+on_session_pipe_close (CockpitPipe *pipe,
+                       const gchar *problem,
+                       gpointer user_data)
+{
+  CockpitSessionThread *thread = user_data;
+  thread->pipe_closed = TRUE;
+}
+
+static gpointer
+session_thread_run (gpointer data)
+{
+  CockpitSessionThread *thread = data;
+
+  g_main_context_push_thread_default (thread->context);
+
+  while (!thread->pipe_closed || !g_atomic_int_get (&thread->finished))
+    g_main_context_iteration (thread->context, TRUE);
+
+  g_signal_handler_disconnect (thread->pipe, thread->close_sig);
+  g_object_unref (thread->pipe);
+
+  /* Anything still dispatched here only releases what's left */
+  while (g_main_context_iteration (thread->context, FALSE));
+
+  g_main_context_pop_thread_default (thread->context);
+  g_main_context_unref (thread->context);
+  g_free (thread);
+  return NULL;
+}
+
+static gboolean
+on_session_thread_spawn (gpointer data)
+{
+  g_thread_unref (g_thread_new ("cockpit-session", session_thread_run, data));
+  return FALSE;
+}
+
+/*
+ * Called while the pipe is being dispatched in the main thread, so move
+ * everything over to the new context right now, but only let the thread
+ * loose on it once the main thread is done with the pipe.
+ */
+static void
+session_thread_start (CockpitWebService *self)
+{
+  CockpitSessionThread *thread;
+  CockpitPipe *pipe;
+
+  if (!cockpit_ws_session_threads || self->thread || self->closing ||
+      !COCKPIT_IS_PIPE_TRANSPORT (self->transport))
+    return;
+
+  pipe = cockpit_pipe_transport_get_pipe (COCKPIT_PIPE_TRANSPORT (self->transport));
+  if (cockpit_pipe_is_closed (pipe))
+    return;
+
+  g_debug ("%s: moving web service to its own thread", self->id ? self->id : "session");
+
+  thread = g_new0 (CockpitSessionThread, 1);
+  thread->context = g_main_context_new ();
+  thread->pipe = g_object_ref (pipe);
+  thread->close_sig = g_signal_connect (pipe, "close", G_CALLBACK (on_session_pipe_close), thread);
+
+  cockpit_pipe_set_context (pipe, thread->context);
+
+  g_main_context_unref (self->context);
+  self->context = g_main_context_ref (thread->context);
+  self->thread = thread;
+
+  destroy_source (&self->ping_timeout);
+  self->ping_timeout = attach_timeout (g_timeout_source_new_seconds (cockpit_ws_ping_interval),
+                                       self->context, on_ping_time, self);
+
+  invoke_later (self->main_context, on_session_thread_spawn, thread, NULL);
+}
+
 static const gchar *
 process_transport_init (CockpitWebService *self,
                         CockpitTransport *transport,
@@ -634,7 +1172,10 @@ process_transport_init (CockpitWebService *self,
          "init" message.
       */
 
-      self->credentials_timeout = g_timeout_add (2*60*1000, poison_creds, self);
+      session_thread_start (self);
+
+      self->credentials_timeout = attach_timeout (g_timeout_source_new (2*60*1000), self->context,
+                                                  poison_creds, self);
 
       /* Always send an init message down the new transport */
       object = cockpit_transport_build_json ("command", "init", NULL);
@@ -673,6 +1214,27 @@ process_transport_init (CockpitWebService *self,
   return NULL;
 }
 
+static void
+process_channel_ping (CockpitWebService *self,
+                      CockpitSocket *socket,
+                      CockpitSocketChannel *chan,
+                      JsonObject *options)
+{
+  GBytes *payload;
+
+  /*
+   * The bridge stops reading for this channel when too many of its pings
+   * are unanswered. So reply once the data sent before the ping has gone
+   * to the web socket, which throttles just this channel when it can't
+   * keep up.
+   */
+  json_object_set_string_member (options, "command", "pong");
+  payload = cockpit_json_write_bytes (options);
+  cockpit_socket_reply (&self->sockets, socket, chan,
+                        self->sent_done ? NULL : self->transport, payload);
+  g_bytes_unref (payload);
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const gchar *command,
@@ -683,6 +1245,7 @@ on_transport_control (CockpitTransport *transport,
 {
   const gchar *problem = "protocol-error";
   CockpitWebService *self = user_data;
+  CockpitSocketChannel *chan = NULL;
   CockpitSocket *socket = NULL;
   gboolean valid = FALSE;
   gboolean forward;
@@ -717,27 +1280,35 @@ on_transport_control (CockpitTransport *transport,
   else
     {
       socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
+      if (socket)
+        chan = g_hash_table_lookup (socket->channels, channel);
 
       /* Usually all control messages with a channel are forwarded */
       forward = TRUE;
 
-      if (g_strcmp0 (command, "close") == 0)
+      /* Pings for flow control we turned on are answered here */
+      if (chan && chan->answer_pings && g_strcmp0 (command, "ping") == 0)
         {
-          valid = process_close (self, socket, channel);
+          forward = FALSE;
+          process_channel_ping (self, socket, chan, options);
         }
-      else
+
+      if (forward && socket)
         {
-          valid = TRUE;
+          /* Forward this message to the right websocket, after the channel's queued data */
+          cockpit_socket_send (&self->sockets, socket, chan, WEB_SOCKET_DATA_TEXT,
+                               self->control_prefix, payload);
+          update_pressure (self);
         }
 
-      if (forward)
+      if (g_strcmp0 (command, "close") == 0)
         {
-          /* Forward this message to the right websocket */
-          if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
-            {
-              web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
-                                          self->control_prefix, payload);
-            }
+          /* Any queued output, including the close, is still delivered */
+          valid = process_close (self, socket, channel, FALSE);
+        }
+      else
+        {
+          valid = TRUE;
         }
     }
 
@@ -756,10 +1327,8 @@ on_transport_recv (CockpitTransport *transport,
                    gpointer user_data)
 {
   CockpitWebService *self = user_data;
-  WebSocketDataType data_type;
+  CockpitSocketChannel *chan;
   CockpitSocket *socket;
-  gchar *string;
-  GBytes *prefix;
 
   if (!channel)
     return FALSE;
@@ -768,11 +1337,10 @@ on_transport_recv (CockpitTransport *transport,
   socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
   if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
     {
-      string = g_strdup_printf ("%s\n", channel);
-      prefix = g_bytes_new_take (string, strlen (string));
-      data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
-      g_bytes_unref (prefix);
+      chan = g_hash_table_lookup (socket->channels, channel);
+      g_return_val_if_fail (chan != NULL, FALSE);
+      cockpit_socket_send (&self->sockets, socket, chan, chan->data_type, chan->prefix, payload);
+      update_pressure (self);
       return TRUE;
     }
 
@@ -790,7 +1358,7 @@ on_transport_closed (CockpitTransport *transport,
   cockpit_sockets_close (&self->sockets, problem);
 
   /* Dispose web service */
-  g_object_run_dispose (G_OBJECT (self));
+  cockpit_web_service_disconnect (self);
 }
 
 gboolean
@@ -894,6 +1462,48 @@ cockpit_web_service_parse_external (JsonObject *options,
   return TRUE;
 }
 
+static gsize
+channel_quantum (JsonObject *options)
+{
+  const gchar *payload;
+  gboolean pty;
+
+  /*
+   * Bulk transfers get the base quantum. Everything else, terminals,
+   * D-Bus, metrics and so on, is interactive and gets a larger share.
+   */
+  if (!cockpit_json_get_string (options, "payload", NULL, &payload) || !payload)
+    return CHANNEL_QUANTUM * INTERACTIVE_WEIGHT;
+  if (g_str_equal (payload, "fsread1") ||
+      g_str_equal (payload, "http-stream1") ||
+      g_str_equal (payload, "http-stream2"))
+    return CHANNEL_QUANTUM;
+  if (g_str_equal (payload, "stream") &&
+      cockpit_json_get_bool (options, "pty", FALSE, &pty) && !pty)
+    return CHANNEL_QUANTUM;
+  return CHANNEL_QUANTUM * INTERACTIVE_WEIGHT;
+}
+
+/*
+ * The bridge only delivers a "pong" to a channel once it is ready, so a
+ * channel that sends much before "ready" (such as fslist1) would wait
+ * forever for its pings. These payloads send "ready" before any data.
+ */
+static gboolean
+channel_flow_control (JsonObject *options)
+{
+  const gchar *payload;
+
+  if (!cockpit_json_get_string (options, "payload", NULL, &payload) || !payload)
+    return FALSE;
+  return g_str_equal (payload, "fsread1") ||
+         g_str_equal (payload, "http-stream1") ||
+         g_str_equal (payload, "http-stream2") ||
+         g_str_equal (payload, "stream") ||
+         g_str_equal (payload, "packet") ||
+         g_str_equal (payload, "websocket-stream1");
+}
+
 static gboolean
 process_and_relay_open (CockpitWebService *self,
                         CockpitSocket *socket,
@@ -901,6 +1511,7 @@ process_and_relay_open (CockpitWebService *self,
                         JsonObject *options)
 {
   WebSocketDataType data_type = WEB_SOCKET_DATA_TEXT;
+  gboolean answer_pings = FALSE;
   GBytes *payload;
 
   if (self->closing)
@@ -924,8 +1535,19 @@ process_and_relay_open (CockpitWebService *self,
   if (!cockpit_web_service_parse_binary (options, &data_type))
     return FALSE;
 
+  /* Flow control lets us hold back just this channel when its web socket is slow */
+  if (socket && !json_object_has_member (options, "flow-control") &&
+      channel_flow_control (options))
+    {
+      json_object_set_boolean_member (options, "flow-control", TRUE);
+      answer_pings = TRUE;
+    }
+
   if (socket)
-    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type);
+    {
+      cockpit_socket_add_channel (&self->sockets, socket, channel, data_type,
+                                  channel_quantum (options), answer_pings);
+    }
 
   if (!self->sent_done)
     {
@@ -946,7 +1568,7 @@ process_logout (CockpitWebService *self,
 
   /* Destroys our web service, disconnects everything */
   g_info ("Logging out session %s", self->id);
-  g_object_run_dispose (G_OBJECT (self));
+  cockpit_web_service_disconnect (self);
 }
 
 static const gchar *
@@ -1189,6 +1811,27 @@ on_web_socket_closing (WebSocketConnection *connection,
   return TRUE;
 }
 
+static void
+on_web_socket_pressure (WebSocketConnection *connection,
+                        gboolean pressure,
+                        CockpitWebService *self)
+{
+  CockpitSocket *socket;
+
+  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
+  g_return_if_fail (socket != NULL);
+
+  g_debug ("%s web socket is %s", socket->id, pressure ? "congested" : "draining");
+  socket->congested = pressure;
+
+  /* Give each channel with queued output its turn */
+  if (!pressure)
+    {
+      cockpit_socket_drain (&self->sockets, socket, self->sent_done ? NULL : self->transport);
+      update_pressure (self);
+    }
+}
+
 static void
 on_web_socket_close (WebSocketConnection *connection,
                      CockpitWebService *self)
@@ -1203,11 +1846,13 @@ on_web_socket_close (WebSocketConnection *connection,
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_open, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_closing, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_close, self);
+  g_signal_handlers_disconnect_by_func (connection, on_web_socket_pressure, self);
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
   cockpit_socket_destroy (&self->sockets, socket);
+  update_pressure (self);
 
   caller_end (self);
 }
@@ -1238,11 +1883,21 @@ cockpit_web_service_init (CockpitWebService *self)
 {
   self->control_prefix = g_bytes_new_static ("\n", 1);
   cockpit_sockets_init (&self->sockets);
-  self->ping_timeout = g_timeout_add_seconds (cockpit_ws_ping_interval, on_ping_time, self);
+  self->main_thread = g_thread_self ();
+  self->main_context = g_main_context_ref_thread_default ();
+  self->context = g_main_context_ref (self->main_context);
+  self->ping_timeout = attach_timeout (g_timeout_source_new_seconds (cockpit_ws_ping_interval),
+                                       self->context, on_ping_time, self);
   self->host_by_checksum = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   self->checksum_by_host = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 }
 
+static void
+cockpit_web_service_flow_iface_init (CockpitFlowInterface *iface)
+{
+  /* No implementation */
+}
+
 static void
 cockpit_web_service_class_init (CockpitWebServiceClass *klass)
 {
@@ -1275,6 +1930,7 @@ cockpit_web_service_new (CockpitCreds *creds,
                          CockpitTransport *transport)
 {
   CockpitWebService *self;
+  CockpitFlow *flow;
 
   g_return_val_if_fail (creds != NULL, NULL);
   g_return_val_if_fail (transport != NULL, NULL);
@@ -1287,51 +1943,162 @@ cockpit_web_service_new (CockpitCreds *creds,
   self->recv_sig = g_signal_connect_after (self->transport, "recv", G_CALLBACK (on_transport_recv), self);
   self->closed_sig = g_signal_connect_after (self->transport, "closed", G_CALLBACK (on_transport_closed), self);
 
+  /* Stop reading from the bridge when web sockets can't keep up */
+  flow = transport_flow (self->transport);
+  if (flow)
+    cockpit_flow_throttle (flow, COCKPIT_FLOW (self));
+
   return self;
 }
 
-WebSocketConnection *
-cockpit_web_service_create_socket (const gchar **protocols,
-                                   CockpitWebRequest *request)
+struct _CockpitSocketHandoff {
+  gchar *url;
+  gchar **origins;
+  gchar **protocols;
+  GIOStream *io;
+  GHashTable *headers;
+  GByteArray *buffer;
+};
+
+/**
+ * cockpit_socket_handoff_new:
+ * @protocols: optional web socket protocols
+ * @request: the request to upgrade to a web socket
+ *
+ * Take everything needed to accept a web socket for @request, so
+ * that the socket can be created after the request is gone, and
+ * in another thread.
+ *
+ * Returns: (transfer full): the handoff, free with cockpit_socket_handoff_free()
+ */
+CockpitSocketHandoff *
+cockpit_socket_handoff_new (const gchar **protocols,
+                            CockpitWebRequest *request)
 {
-  WebSocketConnection *connection;
+  CockpitSocketHandoff *handoff;
   const gchar * const *origins;
-  gchar *allocated = NULL;
-  gchar *origin = NULL;
-  gchar *defaults[2];
+  GHashTable *headers;
+  GByteArray *buffer;
   gboolean is_https;
-  gchar *url;
 
   const gchar *host = cockpit_web_request_get_host (request);
   const gchar *protocol = cockpit_web_request_get_protocol (request);
   g_debug("cockpit_web_service_create_socket: host %s, protocol %s", host, protocol);
   is_https = g_str_equal (protocol, "https") == 0;
 
-  url = g_strdup_printf ("%s://%s%s",
-                         is_https ? "wss" : "ws",
-                         host ? host : "localhost",
-                         cockpit_web_request_get_path (request));
+  handoff = g_new0 (CockpitSocketHandoff, 1);
+  handoff->url = g_strdup_printf ("%s://%s%s",
+                                  is_https ? "wss" : "ws",
+                                  host ? host : "localhost",
+                                  cockpit_web_request_get_path (request));
 
   origins = cockpit_conf_strv ("WebService", "Origins", ' ');
   if (origins == NULL)
     {
-      origin = g_strdup_printf ("%s://%s", protocol, host);
-      defaults[0] = origin;
-      defaults[1] = NULL;
-      origins = (const gchar **)defaults;
+      handoff->origins = g_new0 (gchar *, 2);
+      handoff->origins[0] = g_strdup_printf ("%s://%s", protocol, host);
+    }
+  else
+    {
+      handoff->origins = g_strdupv ((gchar **)origins);
     }
 
-  connection = web_socket_server_new_for_stream (url, origins, protocols,
-                                                 cockpit_web_request_get_io_stream (request),
-                                                 cockpit_web_request_get_headers (request),
-                                                 cockpit_web_request_get_buffer (request));
-  g_free (allocated);
-  g_free (url);
-  g_free (origin);
+  handoff->protocols = g_strdupv ((gchar **)protocols);
+  handoff->io = g_object_ref (cockpit_web_request_get_io_stream (request));
+
+  headers = cockpit_web_request_get_headers (request);
+  if (headers)
+    handoff->headers = g_hash_table_ref (headers);
+  buffer = cockpit_web_request_get_buffer (request);
+  if (buffer)
+    handoff->buffer = g_byte_array_ref (buffer);
+
+  return handoff;
+}
+
+/**
+ * cockpit_socket_handoff_accept:
+ * @handoff: the handoff
+ *
+ * Create the web socket, in the thread default main context of the
+ * caller.
+ *
+ * Returns: (transfer full): the new web socket
+ */
+WebSocketConnection *
+cockpit_socket_handoff_accept (CockpitSocketHandoff *handoff)
+{
+  return web_socket_server_new_for_stream (handoff->url,
+                                           (const gchar * const *)handoff->origins,
+                                           (const gchar * const *)handoff->protocols,
+                                           handoff->io, handoff->headers, handoff->buffer);
+}
+
+void
+cockpit_socket_handoff_free (CockpitSocketHandoff *handoff)
+{
+  g_free (handoff->url);
+  g_strfreev (handoff->origins);
+  g_strfreev (handoff->protocols);
+  g_object_unref (handoff->io);
+  if (handoff->headers)
+    g_hash_table_unref (handoff->headers);
+  if (handoff->buffer)
+    g_byte_array_unref (handoff->buffer);
+  g_free (handoff);
+}
+
+WebSocketConnection *
+cockpit_web_service_create_socket (const gchar **protocols,
+                                   CockpitWebRequest *request)
+{
+  CockpitSocketHandoff *handoff;
+  WebSocketConnection *connection;
+
+  handoff = cockpit_socket_handoff_new (protocols, request);
+  connection = cockpit_socket_handoff_accept (handoff);
+  cockpit_socket_handoff_free (handoff);
 
   return connection;
 }
 
+typedef struct {
+  CockpitWebService *service;
+  CockpitSocketHandoff *handoff;
+} SocketInvoke;
+
+static void
+socket_invoke_free (gpointer data)
+{
+  SocketInvoke *invoke = data;
+  cockpit_web_service_release (invoke->service);
+  cockpit_socket_handoff_free (invoke->handoff);
+  g_free (invoke);
+}
+
+static gboolean
+on_invoke_socket (gpointer data)
+{
+  SocketInvoke *invoke = data;
+  CockpitWebService *self = invoke->service;
+  WebSocketConnection *connection;
+
+  connection = cockpit_socket_handoff_accept (invoke->handoff);
+
+  /* Channels take turns well before the output queue gets long */
+  web_socket_connection_set_pressure_limit (connection, SOCKET_LOW_WATER);
+
+  g_signal_connect (connection, "open", G_CALLBACK (on_web_socket_open), self);
+  g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
+  g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
+  g_signal_connect (connection, "pressure", G_CALLBACK (on_web_socket_pressure), self);
+
+  cockpit_socket_track (&self->sockets, connection);
+  g_object_unref (connection);
+
+  return FALSE;
+}
+
 /**
  * cockpit_web_service_socket:
  * @io_stream: the stream to talk on
@@ -1350,18 +2117,50 @@ cockpit_web_service_socket (CockpitWebService *self,
                             CockpitWebRequest *request)
 {
   const gchar *protocols[] = { "cockpit1", NULL };
-  WebSocketConnection *connection;
+  SocketInvoke *invoke;
 
-  connection = cockpit_web_service_create_socket (protocols, request);
+  /* Counted right away, so the session doesn't look idle in the meantime */
+  caller_begin (self);
 
-  g_signal_connect (connection, "open", G_CALLBACK (on_web_socket_open), self);
-  g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
-  g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
+  invoke = g_new0 (SocketInvoke, 1);
+  invoke->service = g_object_ref (self);
+  invoke->handoff = cockpit_socket_handoff_new (protocols, request);
+  cockpit_web_service_invoke (self, on_invoke_socket, invoke, socket_invoke_free);
+}
 
-  cockpit_socket_track (&self->sockets, connection);
-  g_object_unref (connection);
+/**
+ * cockpit_web_service_invoke:
+ * @self: the service
+ * @func: function to call
+ * @data: data for @func
+ * @notify: optional function to free @data, after @func was called
+ *
+ * Call @func in the thread where the transport and the sockets of
+ * this service run. Unless the service runs in a session thread of
+ * its own, this calls @func right away.
+ *
+ * Anything that touches the transport, or creates channels on it,
+ * must be done this way when called from the main thread.
+ */
+void
+cockpit_web_service_invoke (CockpitWebService *self,
+                            GSourceFunc func,
+                            gpointer data,
+                            GDestroyNotify notify)
+{
+  g_return_if_fail (COCKPIT_IS_WEB_SERVICE (self));
+  g_return_if_fail (func != NULL);
 
-  caller_begin (self);
+  if (self->thread && g_thread_self () == self->main_thread)
+    {
+      invoke_later (self->context, func, data, notify);
+    }
+  else
+    {
+      (func) (data);
+      if (notify)
+        (notify) (data);
+    }
 }
 
 
@@ -1416,14 +2215,43 @@ cockpit_web_service_set_id (CockpitWebService *self,
 void
 cockpit_web_service_disconnect (CockpitWebService *self)
 {
-  g_object_run_dispose (G_OBJECT (self));
+  /* Always disposed in the main thread, see below */
+  if (in_main_thread (self))
+    g_object_run_dispose (G_OBJECT (self));
+  else
+    invoke_later (self->main_context, on_invoke_dispose, g_object_ref (self), g_object_unref);
+}
+
+static gboolean
+on_invoke_release (gpointer user_data)
+{
+  return FALSE;
+}
+
+/**
+ * cockpit_web_service_release:
+ * @self: the service
+ *
+ * Drop a reference to the service. Unlike g_object_unref() this may
+ * be called from a session thread: the service is only ever disposed
+ * and finalized in the main thread, where its signals are handled.
+ */
+void
+cockpit_web_service_release (CockpitWebService *self)
+{
+  g_return_if_fail (COCKPIT_IS_WEB_SERVICE (self));
+
+  if (in_main_thread (self))
+    g_object_unref (self);
+  else
+    invoke_later (self->main_context, on_invoke_release, self, g_object_unref);
 }
 
 gboolean
 cockpit_web_service_get_idling (CockpitWebService *self)
 {
   g_return_val_if_fail (COCKPIT_IS_WEB_SERVICE (self), TRUE);
-  return (self->callers == 0);
+  return (g_atomic_int_get (&self->callers) == 0);
 }
 
 CockpitTransport *
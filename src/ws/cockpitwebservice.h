@@ -37,6 +37,8 @@ G_BEGIN_DECLS
 
 typedef struct _CockpitWebService   CockpitWebService;
 
+typedef struct _CockpitSocketHandoff   CockpitSocketHandoff;
+
 GType                cockpit_web_service_get_type    (void);
 
 CockpitWebService *  cockpit_web_service_new         (CockpitCreds *creds,
@@ -44,9 +46,16 @@ CockpitWebService *  cockpit_web_service_new         (CockpitCreds *creds,
 
 void                 cockpit_web_service_disconnect  (CockpitWebService *self);
 
+void                 cockpit_web_service_release     (CockpitWebService *self);
+
 void                 cockpit_web_service_socket      (CockpitWebService *self,
                                                       CockpitWebRequest *request);
 
+void                 cockpit_web_service_invoke      (CockpitWebService *self,
+                                                      GSourceFunc func,
+                                                      gpointer data,
+                                                      GDestroyNotify notify);
+
 CockpitCreds *       cockpit_web_service_get_creds   (CockpitWebService *self);
 const gchar *        cockpit_web_service_get_id      (CockpitWebService *self);
 void                 cockpit_web_service_set_id      (CockpitWebService *self,
@@ -57,6 +66,13 @@ gboolean             cockpit_web_service_get_idling  (CockpitWebService *self);
 WebSocketConnection *   cockpit_web_service_create_socket    (const gchar **protocols,
                                                               CockpitWebRequest *request);
 
+CockpitSocketHandoff *  cockpit_socket_handoff_new           (const gchar **protocols,
+                                                              CockpitWebRequest *request);
+
+WebSocketConnection *   cockpit_socket_handoff_accept        (CockpitSocketHandoff *handoff);
+
+void                    cockpit_socket_handoff_free          (CockpitSocketHandoff *handoff);
+
 gchar *                 cockpit_web_service_unique_channel   (CockpitWebService *self);
 
 CockpitTransport *      cockpit_web_service_get_transport    (CockpitWebService *self);
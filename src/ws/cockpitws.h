@@ -36,6 +36,9 @@ extern gint cockpit_ws_session_timeout;
 extern guint cockpit_ws_auth_process_timeout;
 extern guint cockpit_ws_auth_response_timeout;
 
+/* From cockpitwebservice.c */
+extern gboolean cockpit_ws_session_threads;
+
 /* From cockpitauth.c */
 extern guint cockpit_ws_service_idle;
 extern const gchar *cockpit_ws_max_startups;
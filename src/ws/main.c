@@ -157,6 +157,8 @@ main (int argc,
   if (opt_for_tls_proxy || cockpit_conf_bool ("WebService", "X-For-CockpitClient", FALSE))
     opt_no_tls = TRUE;
 
+  cockpit_ws_session_threads = cockpit_conf_bool ("WebService", "SessionThreads", FALSE);
+
   cockpit_hacks_redirect_gdebug_to_stderr ();
 
   if (opt_local_session || opt_no_tls)
@@ -72,6 +72,14 @@ setup_alt_config (Test *test,
   test->auth = cockpit_auth_new (FALSE, COCKPIT_AUTH_NONE);
 }
 
+static void
+setup_warm_config (Test *test,
+                   gconstpointer data)
+{
+  cockpit_config_file = SRCDIR "/src/ws/mock-config/cockpit/cockpit-warm.conf";
+  test->auth = cockpit_auth_new (FALSE, COCKPIT_AUTH_NONE);
+}
+
 static void
 teardown_normal (Test *test,
                  gconstpointer data)
@@ -650,6 +658,17 @@ static const SuccessFixture fixture_ssh_remote_basic = {
   .expect_stored_password = TRUE
 };
 
+static void
+test_warm_success (Test *test,
+                   gconstpointer data)
+{
+  /* Started up front, and replaced once used */
+  g_assert_cmpuint (g_hash_table_size (test->auth->warm), ==, 2);
+  test_custom_success (test, data);
+  g_assert_cmpuint (g_hash_table_size (test->auth->warm), ==, 2);
+  g_assert (g_hash_table_contains (test->auth->warm, "machine"));
+}
+
 static const SuccessFixture fixture_ssh_no_data = {
   .warning = NULL,
   .data = NULL,
@@ -1259,6 +1278,8 @@ main (int argc,
               setup_normal, test_custom_success, teardown_normal);
   g_test_add ("/auth/custom-ssh-remote-basic-success", Test, &fixture_ssh_remote_basic,
               setup_normal, test_custom_success, teardown_normal);
+  g_test_add ("/auth/custom-ssh-remote-warm", Test, &fixture_ssh_remote_basic,
+              setup_warm_config, test_warm_success, teardown_normal);
   g_test_add ("/auth/custom-ssh-remote-switched", Test, &fixture_ssh_remote_switched,
               setup_normal, test_custom_success, teardown_normal);
   g_test_add ("/auth/custom-ssh-with-conf-default", Test, &fixture_ssh_alt_default,
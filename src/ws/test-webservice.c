@@ -0,0 +1,399 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2013-2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebservice.h"
+
+#include "common/cockpitflow.h"
+#include "common/cockpitjson.h"
+#include "common/cockpitwebserver.h"
+
+#include "websocket/websocket.h"
+
+#include "testlib/cockpittest.h"
+#include "testlib/mock-transport.h"
+
+#include <string.h>
+
+/* Size of the blocks a bulk channel sends */
+#define BLOCK_SIZE   (32 * 1024)
+
+typedef struct {
+  MockTransport *transport;
+  CockpitWebService *service;
+  CockpitWebServer *server;
+  WebSocketConnection *client;
+
+  /* Control messages received by the client */
+  GQueue controls;
+
+  /* Bulk data received by the client, and how much before the interactive message */
+  gsize bulk_received;
+  gssize interactive_at;
+} TestCase;
+
+static gboolean
+on_handle_stream (CockpitWebServer *server,
+                  CockpitWebRequest *request,
+                  gpointer user_data)
+{
+  TestCase *tc = user_data;
+  cockpit_web_service_socket (tc->service, request);
+  return TRUE;
+}
+
+static void
+on_client_message (WebSocketConnection *connection,
+                   WebSocketDataType type,
+                   GBytes *message,
+                   gpointer user_data)
+{
+  TestCase *tc = user_data;
+  g_autofree gchar *channel = NULL;
+  GBytes *payload;
+  JsonObject *object;
+  GError *error = NULL;
+
+  payload = cockpit_transport_parse_frame (message, &channel);
+  g_assert (payload != NULL);
+
+  if (!channel)
+    {
+      object = cockpit_json_parse_bytes (payload, &error);
+      g_assert_no_error (error);
+      g_queue_push_tail (&tc->controls, object);
+    }
+  else if (g_str_equal (channel, "bulk"))
+    {
+      tc->bulk_received += g_bytes_get_size (payload);
+    }
+  else if (g_str_equal (channel, "interactive"))
+    {
+      g_assert_cmpint (tc->interactive_at, ==, -1);
+      tc->interactive_at = tc->bulk_received;
+    }
+
+  g_bytes_unref (payload);
+}
+
+static void
+client_send (TestCase *tc,
+             const gchar *control)
+{
+  g_autofree gchar *frame = g_strdup_printf ("\n%s", control);
+  GBytes *message = g_bytes_new (frame, strlen (frame));
+  web_socket_connection_send (tc->client, WEB_SOCKET_DATA_TEXT, NULL, message);
+  g_bytes_unref (message);
+}
+
+static JsonObject *
+wait_transport_control (TestCase *tc)
+{
+  JsonObject *object;
+
+  while ((object = mock_transport_pop_control (tc->transport)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  return object;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const gchar *protocols[] = { "cockpit1", NULL };
+  GSocketClient *socket_client;
+  GSocketConnection *conn;
+  CockpitCreds *creds;
+  GError *error = NULL;
+  gchar *origin;
+  gchar *url;
+  gint port;
+
+  g_queue_init (&tc->controls);
+  tc->interactive_at = -1;
+
+  tc->transport = mock_transport_new ();
+  creds = cockpit_creds_new ("cockpit",
+                             COCKPIT_CRED_USER, "scruffy",
+                             COCKPIT_CRED_CSRF_TOKEN, "token",
+                             NULL);
+  tc->service = cockpit_web_service_new (creds, COCKPIT_TRANSPORT (tc->transport));
+  cockpit_creds_unref (creds);
+
+  tc->server = cockpit_web_server_new (NULL, COCKPIT_WEB_SERVER_NONE);
+  g_signal_connect (tc->server, "handle-stream", G_CALLBACK (on_handle_stream), tc);
+  port = cockpit_web_server_add_inet_listener (tc->server, "127.0.0.1", 0, &error);
+  g_assert_no_error (error);
+  cockpit_web_server_start (tc->server);
+
+  socket_client = g_socket_client_new ();
+  conn = g_socket_client_connect_to_host (socket_client, "127.0.0.1", port, NULL, &error);
+  g_assert_no_error (error);
+  g_object_unref (socket_client);
+
+  url = g_strdup_printf ("ws://127.0.0.1:%d/cockpit/socket", port);
+  origin = g_strdup_printf ("http://127.0.0.1:%d", port);
+  tc->client = web_socket_client_new_for_stream (url, origin, protocols, G_IO_STREAM (conn));
+  g_signal_connect (tc->client, "message", G_CALLBACK (on_client_message), tc);
+  g_object_unref (conn);
+  g_free (origin);
+  g_free (url);
+
+  /* The web service says hello first */
+  while (g_queue_is_empty (&tc->controls))
+    g_main_context_iteration (NULL, TRUE);
+  json_object_unref (g_queue_pop_head (&tc->controls));
+
+  client_send (tc, "{ \"command\": \"init\", \"version\": 1 }");
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  JsonObject *object;
+
+  web_socket_connection_close (tc->client, WEB_SOCKET_CLOSE_NORMAL, NULL);
+  while (web_socket_connection_get_ready_state (tc->client) != WEB_SOCKET_STATE_CLOSED)
+    g_main_context_iteration (NULL, TRUE);
+  g_object_unref (tc->client);
+
+  cockpit_web_service_disconnect (tc->service);
+  g_object_unref (tc->service);
+  g_object_unref (tc->server);
+  g_object_unref (tc->transport);
+
+  while ((object = g_queue_pop_head (&tc->controls)))
+    json_object_unref (object);
+
+  cockpit_assert_expected ();
+}
+
+static JsonObject *
+open_channel (TestCase *tc,
+              const gchar *control)
+{
+  client_send (tc, control);
+  return wait_transport_control (tc);
+}
+
+static void
+bridge_send (TestCase *tc,
+             const gchar *channel,
+             gsize length)
+{
+  GBytes *payload;
+  gchar *data;
+
+  data = g_malloc (length);
+  memset (data, 'x', length);
+  payload = g_bytes_new_take (data, length);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), channel, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+bridge_control (TestCase *tc,
+                const gchar *control)
+{
+  GBytes *payload = g_bytes_new (control, strlen (control));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), NULL, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+test_interactive_overtakes (TestCase *tc,
+                            gconstpointer data)
+{
+  JsonObject *open;
+  GBytes *payload;
+  gsize total;
+  gint i;
+
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"bulk\", \"payload\": \"fsread1\", \"path\": \"/big\" }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"bulk\", \"payload\": \"fsread1\","
+                                "  \"path\": \"/big\", \"flow-control\": true }");
+  open_channel (tc, "{ \"command\": \"open\", \"channel\": \"interactive\", \"payload\": \"stream\", \"pty\": true }");
+
+  /* The bridge saturates the web socket with bulk data, then sends a short message */
+  total = 0;
+  for (i = 0; i < 64; i++)
+    {
+      bridge_send (tc, "bulk", BLOCK_SIZE);
+      total += BLOCK_SIZE;
+    }
+  payload = g_bytes_new_static ("ls\r\n", 4);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "interactive", payload);
+  g_bytes_unref (payload);
+
+  while (tc->bulk_received < total || tc->interactive_at < 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Without fair scheduling it would arrive after megabytes of bulk data */
+  g_assert_cmpint (tc->interactive_at, <, 4 * BLOCK_SIZE);
+}
+
+static void
+test_channel_pressure (TestCase *tc,
+                       gconstpointer data)
+{
+  JsonObject *pong;
+  JsonObject *object;
+  gsize total;
+  gint i;
+
+  open_channel (tc, "{ \"command\": \"open\", \"channel\": \"bulk\", \"payload\": \"fsread1\", \"path\": \"/big\" }");
+
+  total = 0;
+  for (i = 0; i < 32; i++)
+    {
+      bridge_send (tc, "bulk", BLOCK_SIZE);
+      total += BLOCK_SIZE;
+    }
+  bridge_control (tc, "{ \"command\": \"ping\", \"channel\": \"bulk\", \"sequence\": 1048576 }");
+
+  /* The channel is held back until its data has gone to the web socket */
+  g_assert (mock_transport_pop_control (tc->transport) == NULL);
+
+  pong = wait_transport_control (tc);
+  cockpit_assert_json_eq (pong, "{ \"command\": \"pong\", \"channel\": \"bulk\", \"sequence\": 1048576 }");
+
+  while (tc->bulk_received < total)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The browser never saw the ping we answered */
+  while ((object = g_queue_pop_head (&tc->controls)))
+    {
+      g_assert (!json_object_has_member (object, "channel"));
+      json_object_unref (object);
+    }
+}
+
+static void
+test_channel_pressure_browser (TestCase *tc,
+                               gconstpointer data)
+{
+  JsonObject *object;
+  JsonObject *open;
+
+  /* When the browser asks for flow control itself, it answers the pings */
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"bulk\", \"payload\": \"fsread1\","
+                           "  \"path\": \"/big\", \"flow-control\": true }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"bulk\", \"payload\": \"fsread1\","
+                                "  \"path\": \"/big\", \"flow-control\": true }");
+
+  bridge_send (tc, "bulk", BLOCK_SIZE);
+  bridge_control (tc, "{ \"command\": \"ping\", \"channel\": \"bulk\", \"sequence\": 32768 }");
+
+  while (g_queue_is_empty (&tc->controls))
+    g_main_context_iteration (NULL, TRUE);
+
+  object = g_queue_pop_head (&tc->controls);
+  cockpit_assert_json_eq (object, "{ \"command\": \"ping\", \"channel\": \"bulk\", \"sequence\": 32768 }");
+  json_object_unref (object);
+  g_assert_cmpuint (tc->bulk_received, ==, BLOCK_SIZE);
+  g_assert (mock_transport_pop_control (tc->transport) == NULL);
+}
+
+static void
+on_service_pressure (CockpitFlow *flow,
+                     gboolean pressure,
+                     gpointer user_data)
+{
+  GString *log = user_data;
+  g_string_append (log, pressure ? "+" : "-");
+}
+
+static void
+test_bridge_pressure (TestCase *tc,
+                      gconstpointer data)
+{
+  GString *log;
+  gsize total;
+  gint i;
+
+  log = g_string_new ("");
+  g_signal_connect (tc->service, "pressure", G_CALLBACK (on_service_pressure), log);
+
+  /* The browser answers flow control itself, but hasn't yet */
+  open_channel (tc, "{ \"command\": \"open\", \"channel\": \"bulk\", \"payload\": \"fsread1\","
+                    "  \"path\": \"/big\", \"flow-control\": true }");
+
+  /* A channel ignoring its pings makes the bridge as a whole wait */
+  total = 0;
+  for (i = 0; i < 160; i++)
+    {
+      bridge_send (tc, "bulk", BLOCK_SIZE);
+      total += BLOCK_SIZE;
+    }
+  g_assert_cmpstr (log->str, ==, "+");
+
+  while (tc->bulk_received < total)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (log->str, ==, "+-");
+
+  g_signal_handlers_disconnect_by_func (tc->service, on_service_pressure, log);
+  g_string_free (log, TRUE);
+}
+
+static void
+test_flow_control_payloads (TestCase *tc,
+                            gconstpointer data)
+{
+  JsonObject *open;
+
+  /* Sends "ready" only after the listing, would never get its pongs */
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"list\", \"payload\": \"fslist1\", \"path\": \"/\" }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"list\", \"payload\": \"fslist1\", \"path\": \"/\" }");
+
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"dbus\", \"payload\": \"dbus-json3\", \"bus\": \"system\" }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"dbus\", \"payload\": \"dbus-json3\", \"bus\": \"system\" }");
+
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"none\" }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"none\" }");
+
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"http\", \"payload\": \"http-stream2\", \"unix\": \"/sock\" }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"http\", \"payload\": \"http-stream2\","
+                                "  \"unix\": \"/sock\", \"flow-control\": true }");
+
+  open = open_channel (tc, "{ \"command\": \"open\", \"channel\": \"stream\", \"payload\": \"stream\", \"spawn\": [\"cat\"] }");
+  cockpit_assert_json_eq (open, "{ \"command\": \"open\", \"channel\": \"stream\", \"payload\": \"stream\","
+                                "  \"spawn\": [\"cat\"], \"flow-control\": true }");
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/web-service/schedule/interactive-overtakes", TestCase, NULL,
+              setup, test_interactive_overtakes, teardown);
+  g_test_add ("/web-service/schedule/channel-pressure", TestCase, NULL,
+              setup, test_channel_pressure, teardown);
+  g_test_add ("/web-service/schedule/channel-pressure-browser", TestCase, NULL,
+              setup, test_channel_pressure_browser, teardown);
+  g_test_add ("/web-service/schedule/bridge-pressure", TestCase, NULL,
+              setup, test_bridge_pressure, teardown);
+  g_test_add ("/web-service/schedule/flow-control-payloads", TestCase, NULL,
+              setup, test_flow_control_payloads, teardown);
+
+  return g_test_run ();
+}